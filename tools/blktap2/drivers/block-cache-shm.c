@@ -0,0 +1,456 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Read cache shared by all tapdisk processes on a host, so that clones
+ * of one parent image find the blocks another clone already read.  The
+ * cache is a fixed size, set associative table of 4K pages in a POSIX
+ * shared memory object, created by the first tapdisk to use it.
+ *
+ * Pages are keyed on the identity of the image file and the page number.
+ * Lookups take no lock: each slot carries a sequence count, odd while
+ * the slot is rewritten, and a reader that sees it change under it
+ * treats the lookup as a miss.  A writer claims a slot by making its
+ * count odd, and gives up if another got there first.  Inserts evict the
+ * least recently used page of the set.  A tapdisk dying halfway through
+ * an insert leaves that one slot unusable until the cache is recreated.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tapdisk.h"
+#include "block-cache-shm.h"
+
+#define BLOCK_CACHE_SHM_FILE        "/blktap-block-cache"
+#define BLOCK_CACHE_SHM_MAGIC       0x62637368 /* "bcsh" */
+#define BLOCK_CACHE_SHM_VERSION     1
+#define BLOCK_CACHE_SHM_WAYS        8
+#define BLOCK_CACHE_SHM_INIT_WAIT   1000 /* ms for the creator to set up */
+
+typedef struct block_cache_shm_header   block_cache_shm_header_t;
+typedef struct block_cache_shm_slot     block_cache_shm_slot_t;
+
+struct block_cache_shm_header {
+	uint32_t                    magic;
+	uint32_t                    version;
+	uint64_t                    size;
+	uint32_t                    nr_sets;
+	uint32_t                    ways;
+	uint64_t                    slots;     /* offset of the slot table */
+	uint64_t                    data;      /* offset of the pages */
+
+	uint32_t                    clock;     /* advanced by every insert */
+	uint32_t                    pad;
+	uint64_t                    inserts;
+	uint64_t                    evictions;
+};
+
+struct block_cache_shm_slot {
+	uint32_t                    seq;       /* odd while rewritten */
+	uint32_t                    atime;     /* clock when last used */
+	block_cache_key_t           key;       /* all zero if empty */
+	uint64_t                    page;
+};
+
+struct block_cache_shm {
+	int                         fd;
+	size_t                      size;
+	block_cache_shm_header_t   *hdr;
+	block_cache_shm_slot_t     *slots;
+	char                       *data;
+};
+
+static inline uint64_t
+block_cache_shm_mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static inline block_cache_shm_slot_t *
+block_cache_shm_set(block_cache_shm_t *shm,
+		    const block_cache_key_t *key, uint64_t page)
+{
+	uint64_t h;
+
+	h = block_cache_shm_mix(page);
+	h = block_cache_shm_mix(h ^ key->gen);
+	h = block_cache_shm_mix(h ^ key->ino);
+	h = block_cache_shm_mix(h ^ key->dev);
+
+	return shm->slots + (h % shm->hdr->nr_sets) * shm->hdr->ways;
+}
+
+static inline char *
+block_cache_shm_page(block_cache_shm_t *shm, block_cache_shm_slot_t *slot)
+{
+	return shm->data +
+		((size_t)(slot - shm->slots) << BLOCK_CACHE_SHM_PAGE_SHIFT);
+}
+
+static inline int
+block_cache_key_equal(const block_cache_key_t *a, const block_cache_key_t *b)
+{
+	return (a->dev == b->dev && a->ino == b->ino && a->gen == b->gen);
+}
+
+static inline int
+block_cache_key_empty(const block_cache_key_t *key)
+{
+	return (!key->dev && !key->ino && !key->gen);
+}
+
+int
+block_cache_shm_key(block_cache_key_t *key, const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st))
+		return -errno;
+
+	/*
+	 * the change time tells a rewritten or recreated image, or device
+	 * node, from the one whose pages are cached.
+	 */
+	key->dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	key->ino = st.st_ino;
+	key->gen = (uint64_t)st.st_ctim.tv_sec * 1000000000ULL +
+		st.st_ctim.tv_nsec;
+
+	return 0;
+}
+
+static void
+block_cache_shm_layout(block_cache_shm_header_t *hdr, size_t size)
+{
+	uint64_t nr_slots, slots_end;
+
+	nr_slots = (size - BLOCK_CACHE_SHM_PAGE_SIZE) /
+		(BLOCK_CACHE_SHM_PAGE_SIZE + sizeof(block_cache_shm_slot_t));
+
+	hdr->size    = size;
+	hdr->ways    = BLOCK_CACHE_SHM_WAYS;
+	hdr->nr_sets = nr_slots / BLOCK_CACHE_SHM_WAYS;
+	hdr->slots   = BLOCK_CACHE_SHM_PAGE_SIZE;
+
+	slots_end    = hdr->slots + (uint64_t)hdr->nr_sets * hdr->ways *
+		sizeof(block_cache_shm_slot_t);
+	hdr->data    = ((slots_end + BLOCK_CACHE_SHM_PAGE_SIZE - 1) &
+			~(uint64_t)(BLOCK_CACHE_SHM_PAGE_SIZE - 1));
+}
+
+static int
+block_cache_shm_valid(block_cache_shm_t *shm)
+{
+	block_cache_shm_header_t *hdr = shm->hdr;
+	uint64_t nr_slots;
+
+	if (hdr->version != BLOCK_CACHE_SHM_VERSION || !hdr->nr_sets ||
+	    hdr->ways != BLOCK_CACHE_SHM_WAYS || hdr->size != shm->size)
+		return 0;
+
+	nr_slots = (uint64_t)hdr->nr_sets * hdr->ways;
+
+	return (hdr->slots + nr_slots * sizeof(block_cache_shm_slot_t) <=
+		hdr->data &&
+		hdr->data + (nr_slots << BLOCK_CACHE_SHM_PAGE_SHIFT) <=
+		shm->size);
+}
+
+static int
+block_cache_shm_map(block_cache_shm_t *shm)
+{
+	shm->hdr = mmap(NULL, shm->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, shm->fd, 0);
+	if (shm->hdr == MAP_FAILED) {
+		shm->hdr = NULL;
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int
+block_cache_shm_create(block_cache_shm_t *shm, size_t size)
+{
+	int err;
+	block_cache_shm_header_t *hdr;
+
+	shm->fd = shm_open(BLOCK_CACHE_SHM_FILE,
+			   O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (shm->fd == -1)
+		return -errno;
+
+	shm->size = size;
+	if (ftruncate(shm->fd, size)) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = block_cache_shm_map(shm);
+	if (err)
+		goto fail;
+
+	/* the pages of a new object read as zero: every slot is empty */
+	hdr          = shm->hdr;
+	hdr->version = BLOCK_CACHE_SHM_VERSION;
+	block_cache_shm_layout(hdr, size);
+
+	if (!hdr->nr_sets) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	__atomic_store_n(&hdr->magic, BLOCK_CACHE_SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+
+fail:
+	shm_unlink(BLOCK_CACHE_SHM_FILE);
+	return err;
+}
+
+static int
+block_cache_shm_attach(block_cache_shm_t *shm)
+{
+	int i, err;
+	struct stat st;
+
+	shm->fd = shm_open(BLOCK_CACHE_SHM_FILE, O_RDWR, 0);
+	if (shm->fd == -1)
+		return -errno;
+
+	/* wait for the creator to size the object and fill in its header */
+	for (i = 0; i < BLOCK_CACHE_SHM_INIT_WAIT; i++) {
+		if (fstat(shm->fd, &st))
+			return -errno;
+
+		if (st.st_size >= BLOCK_CACHE_SHM_PAGE_SIZE) {
+			if (!shm->hdr) {
+				shm->size = st.st_size;
+				err = block_cache_shm_map(shm);
+				if (err)
+					return err;
+			}
+
+			if (__atomic_load_n(&shm->hdr->magic, __ATOMIC_ACQUIRE) ==
+			    BLOCK_CACHE_SHM_MAGIC)
+				return block_cache_shm_valid(shm) ? 0 : -EINVAL;
+		}
+
+		usleep(1000);
+	}
+
+	return -ETIMEDOUT;
+}
+
+static void
+block_cache_shm_unmap(block_cache_shm_t *shm)
+{
+	if (shm->hdr)
+		munmap(shm->hdr, shm->size);
+	if (shm->fd != -1)
+		close(shm->fd);
+
+	shm->hdr = NULL;
+	shm->fd  = -1;
+}
+
+/*
+ * The first tapdisk sizes the cache; later ones use it as it is,
+ * whatever size they ask for.
+ */
+int
+block_cache_shm_open(block_cache_shm_t **_shm, size_t size)
+{
+	int err, retry;
+	block_cache_shm_t *shm;
+
+	*_shm = NULL;
+
+	shm = calloc(1, sizeof(block_cache_shm_t));
+	if (!shm)
+		return -ENOMEM;
+
+	shm->fd = -1;
+
+	for (retry = 0; retry < 2; retry++) {
+		err = block_cache_shm_create(shm, size);
+		if (err == -EEXIST)
+			err = block_cache_shm_attach(shm);
+		if (!err)
+			break;
+
+		block_cache_shm_unmap(shm);
+
+		/* left behind by a creator that died, or of another layout */
+		if (err != -ETIMEDOUT && err != -EINVAL)
+			break;
+		EPRINTF("recreating stale block cache %s: %d\n",
+			BLOCK_CACHE_SHM_FILE, err);
+		shm_unlink(BLOCK_CACHE_SHM_FILE);
+	}
+
+	if (err) {
+		free(shm);
+		return err;
+	}
+
+	shm->slots = (block_cache_shm_slot_t *)
+		((char *)shm->hdr + shm->hdr->slots);
+	shm->data  = (char *)shm->hdr + shm->hdr->data;
+
+	*_shm = shm;
+	return 0;
+}
+
+void
+block_cache_shm_close(block_cache_shm_t *shm)
+{
+	if (!shm)
+		return;
+
+	block_cache_shm_unmap(shm);
+	free(shm);
+}
+
+int
+block_cache_shm_read(block_cache_shm_t *shm, const block_cache_key_t *key,
+		     uint64_t page, size_t off, size_t len, char *buf)
+{
+	int i;
+	uint32_t seq, now;
+	block_cache_shm_slot_t *slot;
+
+	slot = block_cache_shm_set(shm, key, page);
+
+	for (i = 0; i < shm->hdr->ways; i++, slot++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		if (slot->page != page || !block_cache_key_equal(&slot->key, key))
+			continue;
+
+		memcpy(buf, block_cache_shm_page(shm, slot) + off, len);
+
+		/* rewritten while we copied? */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			return -EAGAIN;
+
+		now = __atomic_load_n(&shm->hdr->clock, __ATOMIC_RELAXED);
+		if (slot->atime != now)
+			slot->atime = now;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+void
+block_cache_shm_insert(block_cache_shm_t *shm, const block_cache_key_t *key,
+		       uint64_t page, const char *buf)
+{
+	int i, evict;
+	uint32_t seq, vseq, now;
+	block_cache_shm_slot_t *slot, *victim;
+
+	slot   = block_cache_shm_set(shm, key, page);
+	victim = NULL;
+	vseq   = 0;
+	evict  = 1;
+
+	for (i = 0; i < shm->hdr->ways; i++, slot++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		/* another tapdisk read it meanwhile */
+		if (slot->page == page && block_cache_key_equal(&slot->key, key))
+			return;
+
+		if (block_cache_key_empty(&slot->key)) {
+			victim = slot;
+			vseq   = seq;
+			evict  = 0;
+			break;
+		}
+
+		if (!victim || (int32_t)(slot->atime - victim->atime) < 0) {
+			victim = slot;
+			vseq   = seq;
+		}
+	}
+
+	if (!victim)
+		return;
+
+	if (!__atomic_compare_exchange_n(&victim->seq, &vseq, vseq + 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* odd count must be visible before any of the new contents (smp_wmb) */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	now = __atomic_add_fetch(&shm->hdr->clock, 1, __ATOMIC_RELAXED);
+
+	victim->key   = *key;
+	victim->page  = page;
+	victim->atime = now;
+	memcpy(block_cache_shm_page(shm, victim), buf,
+	       BLOCK_CACHE_SHM_PAGE_SIZE);
+
+	__atomic_store_n(&victim->seq, vseq + 2, __ATOMIC_RELEASE);
+
+	__atomic_fetch_add(&shm->hdr->inserts, 1, __ATOMIC_RELAXED);
+	if (evict)
+		__atomic_fetch_add(&shm->hdr->evictions, 1, __ATOMIC_RELAXED);
+}
+
+void
+block_cache_shm_debug(block_cache_shm_t *shm)
+{
+	block_cache_shm_header_t *hdr = shm->hdr;
+
+	tlog_write(TLOG_WARN, "shared cache %s: size: %"PRIu64", pages: %"PRIu64
+		   ", inserts: %"PRIu64", evictions: %"PRIu64"\n",
+		   BLOCK_CACHE_SHM_FILE, hdr->size,
+		   (uint64_t)hdr->nr_sets * hdr->ways,
+		   hdr->inserts, hdr->evictions);
+}
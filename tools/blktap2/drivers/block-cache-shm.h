@@ -0,0 +1,58 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _BLOCK_CACHE_SHM_H_
+#define _BLOCK_CACHE_SHM_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#define BLOCK_CACHE_SHM_PAGE_SHIFT  12
+#define BLOCK_CACHE_SHM_PAGE_SIZE   (1 << BLOCK_CACHE_SHM_PAGE_SHIFT)
+
+typedef struct block_cache_shm      block_cache_shm_t;
+typedef struct block_cache_key      block_cache_key_t;
+
+/* identifies an image across tapdisk processes */
+struct block_cache_key {
+	uint64_t                    dev;
+	uint64_t                    ino;
+	uint64_t                    gen;
+};
+
+int block_cache_shm_open(block_cache_shm_t **, size_t size);
+void block_cache_shm_close(block_cache_shm_t *);
+void block_cache_shm_debug(block_cache_shm_t *);
+
+int block_cache_shm_key(block_cache_key_t *, const char *path);
+
+int block_cache_shm_read(block_cache_shm_t *, const block_cache_key_t *,
+			 uint64_t page, size_t off, size_t len, char *buf);
+void block_cache_shm_insert(block_cache_shm_t *, const block_cache_key_t *,
+			    uint64_t page, const char *buf);
+
+#endif
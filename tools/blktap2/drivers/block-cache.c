@@ -36,6 +36,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "block-cache-shm.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -57,6 +58,7 @@
 #define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
+#define BLOCK_CACHE_SHM_MAX_MB          (1 << 20)
 
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
@@ -105,7 +107,9 @@ struct radix_tree {
 struct block_cache_request {
 	int                             err;
 	char                           *buf;
-	uint64_t                        secs;
+	uint64_t                        sec;       /* first sector in buf */
+	uint64_t                        nr_secs;
+	uint64_t                        secs;      /* still outstanding */
 	td_request_t                    treq;
 	block_cache_t                  *cache;
 };
@@ -131,6 +135,9 @@ struct block_cache {
 
 	radix_tree_t                    tree;
 
+	block_cache_shm_t              *shm;       /* host wide, if set */
+	block_cache_key_t               key;
+
 	block_cache_stats_t             stats;
 };
 
@@ -516,6 +523,54 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+/*
+ * TAPDISK2_BLOCK_CACHE_SHM=<MB> makes the cache shared by all tapdisks
+ * on the host instead of private to this one.
+ */
+static size_t
+block_cache_shm_size(void)
+{
+	char *env, *end;
+	unsigned long size;
+
+	env = getenv("TAPDISK2_BLOCK_CACHE_SHM");
+	if (!env)
+		return 0;
+
+	size = strtoul(env, &end, 0);
+	if (*env == '\0' || *end != '\0' || size > BLOCK_CACHE_SHM_MAX_MB) {
+		EPRINTF("invalid TAPDISK2_BLOCK_CACHE_SHM %s\n", env);
+		return 0;
+	}
+
+	return (size_t)size << 20;
+}
+
+static void
+block_cache_open_shm(block_cache_t *cache)
+{
+	int err;
+	size_t size;
+
+	size = block_cache_shm_size();
+	if (!size)
+		return;
+
+	err = block_cache_shm_key(&cache->key, cache->name);
+	if (err)
+		goto fail;
+
+	err = block_cache_shm_open(&cache->shm, size);
+	if (err)
+		goto fail;
+
+	return;
+
+fail:
+	EPRINTF("no shared cache for %s, using a private one: %d\n",
+		cache->name, err);
+}
+
 static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
@@ -537,15 +592,22 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	cache->sectors = driver->info.size;
 
 	tree = &cache->tree;
-	err  = radix_tree_initialize(tree, cache->sectors);
-	if (err)
-		goto fail;
-
 	tree->cache = cache;
 	cache->requests_free = BLOCK_CACHE_REQUESTS;
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
+	block_cache_open_shm(cache);
+	if (cache->shm) {
+		DPRINTF("opening shared cache for %s, sectors: %"PRIu64"\n",
+			cache->name, cache->sectors);
+		goto out;
+	}
+
+	err  = radix_tree_initialize(tree, cache->sectors);
+	if (err)
+		goto fail;
+
 	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
 							  -1, /* dummy fd */
 							  BLOCK_CACHE_PAGE_IDLETIME << 1,
@@ -558,6 +620,7 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		"tree: %p, height: %d\n",
 		cache->name, cache->sectors, tree, tree->height);
 
+out:
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
 
@@ -580,8 +643,12 @@ block_cache_close(td_driver_t *driver)
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
-	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+	if (cache->shm)
+		block_cache_shm_close(cache->shm);
+	else {
+		tapdisk_server_unregister_event(cache->timeout_id);
+		radix_tree_free(tree);
+	}
 	free(cache->name);
 
 	return 0;
@@ -624,6 +691,29 @@ block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
 	td_complete_request(treq, 0);
 }
 
+/*
+ * the read was widened to whole pages: return what was asked for, and
+ * share every page read in full.
+ */
+static void
+block_cache_populate_shm(block_cache_t *cache, block_cache_request_t *breq)
+{
+	uint64_t sec, end;
+
+	memcpy(breq->treq.buf,
+	       breq->buf + ((breq->treq.sec - breq->sec) << RADIX_TREE_NODE_SHIFT),
+	       breq->treq.secs << RADIX_TREE_NODE_SHIFT);
+
+	end = breq->sec + breq->nr_secs;
+
+	for (sec = breq->sec; sec + BLOCK_CACHE_NODES_PER_PAGE <= end;
+	     sec += BLOCK_CACHE_NODES_PER_PAGE)
+		block_cache_shm_insert(cache->shm, &cache->key,
+				       sec / BLOCK_CACHE_NODES_PER_PAGE,
+				       breq->buf + ((sec - breq->sec) <<
+						    RADIX_TREE_NODE_SHIFT));
+}
+
 static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
@@ -646,6 +736,12 @@ block_cache_populate_cache(td_request_t clone, int err)
 		goto out;
 	}
 
+	if (cache->shm) {
+		block_cache_populate_shm(cache, breq);
+		free(breq->buf);
+		goto out;
+	}
+
 	for (i = 0; i < breq->treq.secs; i++) {
 		off_t off = i << RADIX_TREE_NODE_SHIFT;
 		DBG("%s: populating sec 0x%08llx\n",
@@ -676,13 +772,22 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 
 	clone = treq;
 	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
 
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
+	if (cache->shm) {
+		clone.sec  = treq.sec & ~(uint64_t)(BLOCK_CACHE_NODES_PER_PAGE - 1);
+		clone.secs = ((treq.sec + treq.secs - clone.sec +
+			       BLOCK_CACHE_NODES_PER_PAGE - 1) &
+			      ~(BLOCK_CACHE_NODES_PER_PAGE - 1));
+		if (clone.sec + clone.secs > cache->sectors)
+			clone.secs = cache->sectors - clone.sec;
+	} else if (radix_tree_size(tree) +
+		   (treq.secs << RADIX_TREE_NODE_SHIFT) >= BLOCK_CACHE_MAX_SIZE)
 		goto out;
 
+	size  = clone.secs << RADIX_TREE_NODE_SHIFT;
+
 	breq = block_cache_get_request(cache);
 	if (!breq)
 		goto out;
@@ -693,7 +798,9 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	}
 
 	breq->treq    = treq;
-	breq->secs    = treq.secs;
+	breq->sec     = clone.sec;
+	breq->nr_secs = clone.secs;
+	breq->secs    = clone.secs;
 	breq->err     = 0;
 	breq->buf     = buf;
 	breq->cache   = cache;
@@ -701,9 +808,46 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	clone.buf     = buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
+	td_forward_request(clone);
+	return;
 
 out:
-	td_forward_request(clone);
+	td_forward_request(treq);
+}
+
+/*
+ * copies straight into the request, a page at a time; on a miss the
+ * part already copied is simply read again.
+ */
+static int
+block_cache_find_shm(block_cache_t *cache, td_request_t treq)
+{
+	int err;
+	char *buf;
+	size_t off, len;
+	uint64_t sec, end, n;
+
+	buf = treq.buf;
+	end = treq.sec + treq.secs;
+
+	for (sec = treq.sec; sec < end; sec += n) {
+		off = sec & (BLOCK_CACHE_NODES_PER_PAGE - 1);
+		n   = BLOCK_CACHE_NODES_PER_PAGE - off;
+		if (n > end - sec)
+			n = end - sec;
+		len = n << RADIX_TREE_NODE_SHIFT;
+
+		err = block_cache_shm_read(cache->shm, &cache->key,
+					   sec / BLOCK_CACHE_NODES_PER_PAGE,
+					   off << RADIX_TREE_NODE_SHIFT,
+					   len, buf);
+		if (err)
+			return err;
+
+		buf += len;
+	}
+
+	return 0;
 }
 
 static void
@@ -722,6 +866,14 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
+	if (cache->shm) {
+		if (block_cache_find_shm(cache, treq))
+			return block_cache_miss(cache, treq);
+
+		cache->stats.hits += treq.secs;
+		return td_complete_request(treq, 0);
+	}
+
 	for (i = 0; i < treq.secs; i++) {
 		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
 		if (!iov[i])
@@ -771,6 +923,8 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	if (cache->shm)
+		block_cache_shm_debug(cache->shm);
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -37,9 +37,6 @@
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
-#include "hashtable.h"
-#include "hashtable_itr.h"
-#include "hashtable_utility.h"
 
 #include <errno.h>
 #include <inttypes.h>
@@ -60,7 +57,6 @@
 
 /* timeout for reads and writes in ms */
 #define HEARTBEAT_MS 1000
-#define RAMDISK_HASHSIZE 128
 
 /* connect retry timeout (seconds) */
 #define REMUS_CONNRETRY_TIMEOUT 10
@@ -99,18 +95,41 @@ td_vbd_t *device_vbd = NULL;
 td_image_t *remus_image = NULL;
 struct tap_disk tapdisk_remus;
 
+/* a run of consecutive sectors held by the ramdisk, in one buffer */
+struct ramdisk_extent {
+	uint64_t sector;
+	size_t secs;
+	/* sectors buf has room for */
+	size_t room;
+	char* buf;
+	/* treap searched by sector */
+	struct ramdisk_extent* left;
+	struct ramdisk_extent* right;
+	long prio;
+	/* all extents of the map, in sector order */
+	struct list_head next;
+};
+
+/* Extents never overlap. Those of a write set do not touch either: writes
+ * are merged into them as they arrive, so that the set is flushed as a few
+ * large writes without any sorting. */
+struct ramdisk_map {
+	struct ramdisk_extent* root;
+	struct list_head extents;
+};
+
 struct ramdisk {
 	size_t sector_size;
-	struct hashtable* h;
-	/* when a ramdisk is flushed, h is given a new empty hash for writes
+	struct ramdisk_map* h;
+	/* when a ramdisk is flushed, h is given a new empty map for writes
 	 * while the old ramdisk (prev) is drained asynchronously.
 	 */
-	struct hashtable* prev;
+	struct ramdisk_map* prev;
 	/* count of outstanding requests to the base driver */
 	size_t inflight;
-	/* prev holds the requests to be flushed, while inprogress holds
-	 * requests being flushed. When requests complete, they are removed
-	 * from inprogress.
+	/* prev holds the extents to be flushed, while inprogress holds
+	 * the writes being flushed, one extent each. When requests complete,
+	 * they are removed from inprogress.
 	 * Whenever a new flush is merged with ongoing flush (i.e, prev),
 	 * we have to make sure that none of the new requests overlap with
 	 * ones in "inprogress". If it does, keep it back in prev and dont issue
@@ -120,7 +139,7 @@ struct ramdisk {
 	 * IOW, make sure we dont create a write-after-write time ordering constraint.
 	 * 
 	 */
-	struct hashtable* inprogress;
+	struct ramdisk_map* inprogress;
 };
 
 /* the ramdisk intercepts the original callback for reads and writes.
@@ -231,6 +250,8 @@ static inline int ring_isfull(struct req_ring* ring)
 }
 /* Prototype declarations */
 static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s);
+static void ramdisk_map_complete(struct ramdisk_map* map, uint64_t sector,
+				 char* buf);
 
 /* functions to create and sumbit treq's */
 
@@ -239,8 +260,6 @@ replicated_write_callback(td_request_t treq, int err)
 {
 	struct tdremus_state *s = (struct tdremus_state *) treq.cb_data;
 	td_vbd_request_t *vreq;
-	int i;
-	uint64_t start;
 	vreq = (td_vbd_request_t *) treq.private;
 
 	/* the write failed for now, lets panic. this is very bad */
@@ -255,11 +274,7 @@ replicated_write_callback(td_request_t treq, int err)
 	free(vreq);
 
 	s->ramdisk.inflight--;
-	start = treq.sec;
-	for (i = 0; i < treq.secs; i++) {
-		hashtable_remove(s->ramdisk.inprogress, &start);
-		start++;
-	}
+	ramdisk_map_complete(s->ramdisk.inprogress, treq.sec, treq.buf);
 	free(treq.buf);
 
 	if (!s->ramdisk.inflight && !s->ramdisk.prev) {
@@ -303,199 +318,290 @@ create_write_request(struct tdremus_state *state, td_sector_t sec, int secs, cha
 }
 
 
-/* http://www.concentric.net/~Ttwang/tech/inthash.htm */
-static unsigned int uint64_hash(void* k)
+static struct ramdisk_map* ramdisk_map_create(void)
 {
-	uint64_t key = *(uint64_t*)k;
+	struct ramdisk_map* map;
 
-	key = (~key) + (key << 18);
-	key = key ^ (key >> 31);
-	key = key * 21;
-	key = key ^ (key >> 11);
-	key = key + (key << 6);
-	key = key ^ (key >> 22);
+	if (!(map = calloc(1, sizeof(*map))))
+		return NULL;
 
-	return (unsigned int)key;
+	INIT_LIST_HEAD(&map->extents);
+
+	return map;
+}
+
+static inline int ramdisk_map_empty(struct ramdisk_map* map)
+{
+	return list_empty(&map->extents);
 }
 
-static int rd_hash_equal(void* k1, void* k2)
+/* buffers of extents that were handed to a write request belong to it */
+static void ramdisk_map_destroy(struct ramdisk_map* map, int free_bufs)
 {
-	uint64_t key1, key2;
+	struct ramdisk_extent *ext, *tmp;
 
-	key1 = *(uint64_t*)k1;
-	key2 = *(uint64_t*)k2;
+	if (!map)
+		return;
+
+	list_for_each_entry_safe(ext, tmp, &map->extents, next) {
+		if (free_bufs)
+			free(ext->buf);
+		free(ext);
+	}
 
-	return key1 == key2;
+	free(map);
 }
 
-static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
-			int nb_sectors, char* buf)
+static struct ramdisk_extent* ramdisk_tree_insert(struct ramdisk_extent* t,
+						  struct ramdisk_extent* ext)
 {
-	int i;
-	char* v;
-	uint64_t key;
-
-	for (i = 0; i < nb_sectors; i++) {
-		key = sector + i;
-		/* check whether it is queued in a previous flush request */
-		if (!(ramdisk->prev && (v = hashtable_search(ramdisk->prev, &key)))) {
-			/* check whether it is an ongoing flush */
-			if (!(ramdisk->inprogress && (v = hashtable_search(ramdisk->inprogress, &key))))
-				return -1;
+	struct ramdisk_extent* c;
+
+	if (!t)
+		return ext;
+
+	if (ext->sector < t->sector) {
+		t->left = ramdisk_tree_insert(t->left, ext);
+		if (t->left->prio > t->prio) {
+			c = t->left;
+			t->left = c->right;
+			c->right = t;
+			return c;
+		}
+	} else {
+		t->right = ramdisk_tree_insert(t->right, ext);
+		if (t->right->prio > t->prio) {
+			c = t->right;
+			t->right = c->left;
+			c->left = t;
+			return c;
 		}
-		memcpy(buf + i * ramdisk->sector_size, v, ramdisk->sector_size);
 	}
 
-	return 0;
+	return t;
 }
 
-static int ramdisk_write_hash(struct hashtable* h, uint64_t sector, char* buf,
-			      size_t len)
+static struct ramdisk_extent* ramdisk_tree_join(struct ramdisk_extent* l,
+						struct ramdisk_extent* r)
 {
-	char* v;
-	uint64_t* key;
+	if (!l)
+		return r;
+	if (!r)
+		return l;
 
-	if ((v = hashtable_search(h, &sector))) {
-		memcpy(v, buf, len);
-		return 0;
+	if (l->prio > r->prio) {
+		l->right = ramdisk_tree_join(l->right, r);
+		return l;
 	}
 
-	if (!(v = malloc(len))) {
-		DPRINTF("ramdisk_write_hash: malloc failed\n");
-		return -1;
-	}
-	memcpy(v, buf, len);
-	if (!(key = malloc(sizeof(*key)))) {
-		DPRINTF("ramdisk_write_hash: error allocating key\n");
-		free(v);
-		return -1;
-	}
-	*key = sector;
-	if (!hashtable_insert(h, key, v)) {
-		DPRINTF("ramdisk_write_hash failed on sector %" PRIu64 "\n", sector);
-		free(key);
-		free(v);
-		return -1;
-	}
+	r->left = ramdisk_tree_join(l, r->left);
+	return r;
+}
 
-	return 0;
+static struct ramdisk_extent* ramdisk_tree_erase(struct ramdisk_extent* t,
+						 struct ramdisk_extent* ext)
+{
+	if (t == ext)
+		return ramdisk_tree_join(t->left, t->right);
+
+	if (ext->sector < t->sector)
+		t->left = ramdisk_tree_erase(t->left, ext);
+	else
+		t->right = ramdisk_tree_erase(t->right, ext);
+
+	return t;
 }
 
-static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
-				int nb_sectors, char* buf)
+/* the first extent ending after sector, or NULL */
+static struct ramdisk_extent* ramdisk_map_lower(struct ramdisk_map* map,
+						uint64_t sector)
 {
-	int i, rc;
+	struct ramdisk_extent *t, *ext = NULL;
 
-	for (i = 0; i < nb_sectors; i++) {
-		rc = ramdisk_write_hash(ramdisk->h, sector + i,
-					buf + i * ramdisk->sector_size,
-					ramdisk->sector_size);
-		if (rc)
-			return rc;
-	}
+	for (t = map->root; t; )
+		if (t->sector + t->secs > sector) {
+			ext = t;
+			t = t->left;
+		} else
+			t = t->right;
 
-	return 0;
+	return ext;
 }
 
-static int uint64_compare(const void* k1, const void* k2)
+static inline struct ramdisk_extent* ramdisk_map_next(struct ramdisk_map* map,
+						      struct ramdisk_extent* ext)
 {
-	uint64_t u1 = *(uint64_t*)k1;
-	uint64_t u2 = *(uint64_t*)k2;
+	if (ext->next.next == &map->extents)
+		return NULL;
 
-	/* u1 - u2 is unsigned */
-	return u1 < u2 ? -1 : u1 > u2 ? 1 : 0;
+	return list_entry(ext->next.next, struct ramdisk_extent, next);
 }
 
-/* set psectors to an array of the sector numbers in the hash, returning
- * the number of entries (or -1 on error) */
-static int ramdisk_get_sectors(struct hashtable* h, uint64_t** psectors)
+/* link ext in before 'before', the extent following it (NULL: last) */
+static void ramdisk_map_insert(struct ramdisk_map* map,
+			       struct ramdisk_extent* ext,
+			       struct ramdisk_extent* before)
 {
-	struct hashtable_itr* itr;
-	uint64_t* sectors;
-	int count;
+	ext->left = ext->right = NULL;
+	ext->prio = random();
+	map->root = ramdisk_tree_insert(map->root, ext);
+	list_add_tail(&ext->next, before ? &before->next : &map->extents);
+}
 
-	if (!(count = hashtable_count(h)))
-		return 0;
+static void ramdisk_map_remove(struct ramdisk_map* map,
+			       struct ramdisk_extent* ext)
+{
+	map->root = ramdisk_tree_erase(map->root, ext);
+	list_del(&ext->next);
+}
 
-	if (!(*psectors = malloc(count * sizeof(uint64_t)))) {
-		DPRINTF("ramdisk_get_sectors: error allocating sector map\n");
-		return -1;
-	}
-	sectors = *psectors;
+/* the extent holding sector, if any */
+static struct ramdisk_extent* ramdisk_map_find(struct ramdisk_map* map,
+					       uint64_t sector)
+{
+	struct ramdisk_extent* ext;
 
-	itr = hashtable_iterator(h);
-	count = 0;
-	do {
-		sectors[count++] = *(uint64_t*)hashtable_iterator_key(itr);
-	} while (hashtable_iterator_advance(itr));
-	free(itr);
+	if (!map || !(ext = ramdisk_map_lower(map, sector)))
+		return NULL;
 
-	return count;
+	return ext->sector <= sector ? ext : NULL;
 }
 
-/*
-  return -1 for OOM
-  return -2 for merge lookup failure
-  return -3 for WAW race
-  return 0 on success.
-*/
-static int merge_requests(struct ramdisk* ramdisk, uint64_t start,
-			size_t count, char **mergedbuf)
+static int ramdisk_map_overlaps(struct ramdisk_map* map, uint64_t sector,
+				size_t secs)
 {
-	char* buf;
-	char* sector;
-	int i;
-	uint64_t *key;
-	int rc = 0;
+	struct ramdisk_extent* ext;
 
-	if (!(buf = valloc(count * ramdisk->sector_size))) {
-		DPRINTF("merge_request: allocation failed\n");
-		return -1;
-	}
+	ext = ramdisk_map_lower(map, sector);
 
-	for (i = 0; i < count; i++) {
-		if (!(sector = hashtable_search(ramdisk->prev, &start))) {
-			DPRINTF("merge_request: lookup failed on %"PRIu64"\n", start);
-			free(buf);
-			rc = -2;
-			goto fail;
+	return ext && ext->sector < sector + secs;
+}
+
+/* copy sectors into the map, merging them with every extent they overlap
+ * or touch */
+static int ramdisk_map_write(struct ramdisk_map* map, size_t sector_size,
+			     uint64_t sector, size_t secs, char* buf)
+{
+	struct ramdisk_extent *first, *ext, *tmp;
+	uint64_t start, end;
+	size_t room;
+	char* data;
+
+	end = sector + secs;
+	first = ramdisk_map_lower(map, sector ? sector - 1 : 0);
+
+	if (!first || first->sector > end) {
+		if (!(ext = calloc(1, sizeof(*ext))) ||
+		    !(ext->buf = valloc(secs * sector_size))) {
+			DPRINTF("ramdisk_map_write: allocation failed\n");
+			free(ext);
+			return -1;
 		}
+		memcpy(ext->buf, buf, secs * sector_size);
+		ext->sector = sector;
+		ext->secs = ext->room = secs;
 
-		/* Check inprogress requests to avoid waw non-determinism */
-		if (hashtable_search(ramdisk->inprogress, &start)) {
-			DPRINTF("merge_request: WAR RACE on %"PRIu64"\n", start);
-			free(buf);
-			rc = -3;
-			goto fail;
+		ramdisk_map_insert(map, ext, first);
+		return 0;
+	}
+
+	start = MIN(sector, first->sector);
+	end = MAX(end, first->sector + first->secs);
+	for (ext = ramdisk_map_next(map, first);
+	     ext && ext->sector <= end; ext = ramdisk_map_next(map, ext))
+		end = MAX(end, ext->sector + ext->secs);
+
+	/* appends double the room, so that streaming writes copy little */
+	if (start < first->sector || end - start > first->room) {
+		room = end - start;
+		if (start == first->sector)
+			room = MAX(room, first->room * 2);
+
+		if (!(data = valloc(room * sector_size))) {
+			DPRINTF("ramdisk_map_write: allocation failed\n");
+			return -1;
 		}
-		/* Insert req into inprogress (brief period of duplication of hash entries until
-		 * they are removed from prev. Read tracking would not be reading wrong entries)
-		 */
-		if (!(key = malloc(sizeof(*key)))) {
-			DPRINTF("%s: error allocating key\n", __FUNCTION__);
-			free(buf);			
-			rc = -1;
-			goto fail;
+		memcpy(data + (first->sector - start) * sector_size,
+		       first->buf, first->secs * sector_size);
+		free(first->buf);
+		first->buf = data;
+		first->room = room;
+	}
+
+	/* still sorted: start is past the end of the extent before */
+	first->sector = start;
+
+	for (ext = ramdisk_map_next(map, first);
+	     ext && ext->sector < end; ext = tmp) {
+		tmp = ramdisk_map_next(map, ext);
+		memcpy(first->buf + (ext->sector - start) * sector_size,
+		       ext->buf, ext->secs * sector_size);
+		ramdisk_map_remove(map, ext);
+		free(ext->buf);
+		free(ext);
+	}
+
+	memcpy(first->buf + (sector - start) * sector_size, buf,
+	       secs * sector_size);
+	first->secs = end - start;
+
+	return 0;
+}
+
+/* a flushed extent was written: it is no longer in progress */
+static void ramdisk_map_complete(struct ramdisk_map* map, uint64_t sector,
+				 char* buf)
+{
+	struct ramdisk_extent* ext;
+
+	for (ext = ramdisk_map_lower(map, sector);
+	     ext && ext->sector <= sector; ext = ramdisk_map_next(map, ext))
+		if (ext->buf == buf) {
+			ramdisk_map_remove(map, ext);
+			free(ext);
+			return;
 		}
-		*key = start;
-		if (!hashtable_insert(ramdisk->inprogress, key, NULL)) {
-			DPRINTF("%s failed to insert sector %" PRIu64 " into inprogress hash\n", 
-				__FUNCTION__, start);
-			free(key);
-			free(buf);
-			rc = -1;
-			goto fail;
+}
+
+static int ramdisk_read(struct ramdisk* ramdisk, uint64_t sector,
+			int nb_sectors, char* buf)
+{
+	struct ramdisk_extent *ext, *newer;
+	size_t off, n;
+
+	while (nb_sectors) {
+		n = nb_sectors;
+
+		/* check whether it is queued in a previous flush request */
+		if (!(ext = ramdisk_map_find(ramdisk->prev, sector))) {
+			/* check whether it is an ongoing flush */
+			if (!(ext = ramdisk_map_find(ramdisk->inprogress, sector)))
+				return -1;
+
+			/* up to where prev has newer data */
+			if (ramdisk->prev &&
+			    (newer = ramdisk_map_lower(ramdisk->prev, sector)))
+				n = MIN(n, newer->sector - sector);
 		}
-		memcpy(buf + i * ramdisk->sector_size, sector, ramdisk->sector_size);
-		start++;
+
+		off = sector - ext->sector;
+		n = MIN(n, ext->secs - off);
+
+		memcpy(buf, ext->buf + off * ramdisk->sector_size,
+		       n * ramdisk->sector_size);
+		buf += n * ramdisk->sector_size;
+		sector += n;
+		nb_sectors -= n;
 	}
 
-	*mergedbuf = buf;
 	return 0;
-fail:
-	for (start--; i >0; i--, start--)
-		hashtable_remove(ramdisk->inprogress, &start);
-	return rc;
+}
+
+static inline int ramdisk_write(struct ramdisk* ramdisk, uint64_t sector,
+				int nb_sectors, char* buf)
+{
+	return ramdisk_map_write(ramdisk->h, ramdisk->sector_size,
+				 sector, nb_sectors, buf);
 }
 
 /* The underlying driver may not handle having the whole ramdisk queued at
@@ -504,69 +610,59 @@ fail:
  * the underlying driver */
 static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 {
-	uint64_t* sectors;
-	char* buf = NULL;
-	uint64_t base, batchlen;
-	int i, j, count = 0;
+	struct ramdisk_map* prev = s->ramdisk.prev;
+	struct ramdisk_extent *ext, *tmp;
+	uint64_t sector;
+	size_t secs;
+	char* buf;
 
 	// RPRINTF("ramdisk flush\n");
 
-	if ((count = ramdisk_get_sectors(s->ramdisk.prev, &sectors)) <= 0)
-		return count;
+	if (!prev || ramdisk_map_empty(prev))
+		return 0;
 
-	/* Create the inprogress table if empty */
-	if (!s->ramdisk.inprogress)
-		s->ramdisk.inprogress = create_hashtable(RAMDISK_HASHSIZE,
-							uint64_hash,
-							rd_hash_equal);
-	
-	/*
-	  RPRINTF("ramdisk: flushing %d sectors\n", count);
-	*/
+	/* Create the inprogress map if empty */
+	if (!s->ramdisk.inprogress &&
+	    !(s->ramdisk.inprogress = ramdisk_map_create()))
+		return -1;
 
-	/* sort and merge sectors to improve disk performance */
-	qsort(sectors, count, sizeof(*sectors), uint64_compare);
-
-	for (i = 0; i < count;) {
-		base = sectors[i++];
-		while (i < count && sectors[i] == sectors[i-1] + 1)
-			i++;
-		batchlen = sectors[i-1] - base + 1;
-
-		j = merge_requests(&s->ramdisk, base, batchlen, &buf);
-			
-		if (j) {
-			RPRINTF("ramdisk_flush: merge_requests failed:%s\n",
-				j == -1? "OOM": (j==-2? "missing sector" : "WAW race"));
-			if (j == -3) continue;
-			free(sectors);
-			return -1;
-		}
+	/* the extents are already sorted and merged */
+	list_for_each_entry_safe(ext, tmp, &prev->extents, next) {
+		/* Check inprogress requests to avoid waw non-determinism */
+		if (ramdisk_map_overlaps(s->ramdisk.inprogress,
+					 ext->sector, ext->secs))
+			continue;
+
+		ramdisk_map_remove(prev, ext);
+		ramdisk_map_insert(s->ramdisk.inprogress, ext,
+				   ramdisk_map_lower(s->ramdisk.inprogress,
+						     ext->sector));
+
+		/* the write may complete, and ext go, before we return */
+		sector = ext->sector;
+		secs = ext->secs;
+		buf = ext->buf;
 
 		/* NOTE: create_write_request() creates a treq AND forwards it down
 		 * the driver chain */
-		// RPRINTF("forwarding write request at %" PRIu64 ", length: %" PRIu64 "\n", base, batchlen);
-		create_write_request(s, base, batchlen, buf);
-		//RPRINTF("write request at %" PRIu64 ", length: %" PRIu64 " forwarded\n", base, batchlen);
+		if (create_write_request(s, sector, secs, buf)) {
+			RPRINTF("ramdisk_flush: OOM\n");
+			/* nothing was forwarded: hand ext back to prev */
+			ramdisk_map_remove(s->ramdisk.inprogress, ext);
+			ramdisk_map_insert(prev, ext,
+					   ramdisk_map_lower(prev, ext->sector));
+			return -1;
+		}
 
 		s->ramdisk.inflight++;
-
-		for (j = 0; j < batchlen; j++) {
-			buf = hashtable_search(s->ramdisk.prev, &base);
-			free(buf);
-			hashtable_remove(s->ramdisk.prev, &base);
-			base++;
-		}
 	}
 
-	if (!hashtable_count(s->ramdisk.prev)) {
+	if (ramdisk_map_empty(prev)) {
 		/* everything is in flight */
-		hashtable_destroy(s->ramdisk.prev, 0);
+		ramdisk_map_destroy(prev, 0);
 		s->ramdisk.prev = NULL;
 	}
 
-	free(sectors);
-
 	// RPRINTF("ramdisk flush done\n");
 	return 0;
 }
@@ -575,46 +671,44 @@ static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 static int ramdisk_start_flush(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-	uint64_t* key;
-	char* buf;
-	int rc = 0;
-	int i, j, count, batchlen;
-	uint64_t* sectors;
+	struct ramdisk_map* h;
+	struct ramdisk_extent* ext;
 
-	if (!hashtable_count(s->ramdisk.h)) {
+	if (ramdisk_map_empty(s->ramdisk.h)) {
 		/*
 		  RPRINTF("Nothing to flush\n");
 		*/
 		return 0;
 	}
 
+	/* We create a new map so that new writes can be performed before
+	 * the old one is completely drained. */
+	if (!(h = ramdisk_map_create())) {
+		RPRINTF("ramdisk_start_flush: OOM\n");
+		return -1;
+	}
+
 	if (s->ramdisk.prev) {
 		/* a flush request issued while a previous flush is still in progress
 		 * will merge with the previous request. If you want the previous
 		 * request to be consistent, wait for it to complete. */
-		if ((count = ramdisk_get_sectors(s->ramdisk.h, &sectors)) < 0)
-			return count;
-
-		for (i = 0; i < count; i++) {
-			buf = hashtable_search(s->ramdisk.h, sectors + i);
-			ramdisk_write_hash(s->ramdisk.prev, sectors[i], buf,
-					   s->ramdisk.sector_size);
-		}
-		free(sectors);
+		list_for_each_entry(ext, &s->ramdisk.h->extents, next)
+			if (ramdisk_map_write(s->ramdisk.prev,
+					      s->ramdisk.sector_size,
+					      ext->sector, ext->secs, ext->buf)) {
+				ramdisk_map_destroy(h, 0);
+				return -1;
+			}
 
-		hashtable_destroy (s->ramdisk.h, 0);
+		ramdisk_map_destroy(s->ramdisk.h, 1);
 	} else
 		s->ramdisk.prev = s->ramdisk.h;
 
-	/* We create a new hashtable so that new writes can be performed before
-	 * the old hashtable is completely drained. */
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
+	s->ramdisk.h = h;
 
 	return ramdisk_flush(driver, s);
 }
 
-
 static int ramdisk_start(td_driver_t *driver)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
@@ -625,8 +719,8 @@ static int ramdisk_start(td_driver_t *driver)
 	}
 
 	s->ramdisk.sector_size = driver->info.sector_size;
-	s->ramdisk.h = create_hashtable(RAMDISK_HASHSIZE, uint64_hash,
-					rd_hash_equal);
+	if (!(s->ramdisk.h = ramdisk_map_create()))
+		return -1;
 
 	DPRINTF("Ramdisk started, %zu bytes/sector\n", s->ramdisk.sector_size);
 
@@ -1689,8 +1783,8 @@ static int tdremus_close(td_driver_t *driver)
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
 
 	RPRINTF("closing\n");
-	if (s->ramdisk.inprogress)
-		hashtable_destroy(s->ramdisk.inprogress, 0);
+	ramdisk_map_destroy(s->ramdisk.inprogress, 0);
+	s->ramdisk.inprogress = NULL;
 	
 	if (s->driver_data) {
 		free(s->driver_data);
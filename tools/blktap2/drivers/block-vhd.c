@@ -41,6 +41,9 @@
  *     writes and the zero-bitmap write complete, the BAT and bitmap writes
  *     are started in parallel.  The transaction is completed only after both
  *     the BAT and bitmap writes successfully return.
+ * Several blocks may be allocated at once.  A BAT write covers one sector
+ * of the table, and carries every allocation in that sector whose bitmap
+ * has been zeroed by the time it is issued.
  */
 
 #include <errno.h>
@@ -72,10 +75,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%lu, BBLK: 0x%04x\n",				\
+		    "%lu, BALLOCS: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.nr_allocs);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -109,11 +112,14 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               256   /* default, see TAPDISK2_VHD_BITMAP_CACHE */
+#define VHD_CACHE_SIZE_MIN           16
+#define VHD_CACHE_SIZE_MAX           65536
+
+#define VHD_BAT_ENTRIES_PER_SEC      (VHD_SECTOR_SIZE / sizeof(u32))
+#define VHD_BAT_MAX_ALLOCS           64    /* blocks allocated concurrently */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
-#define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
@@ -136,13 +142,16 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
 
-#define VHD_FLAG_BAT_LOCKED          1
-#define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_BAT_WRITE_STARTED   1
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_ALLOCATING       16
+#define VHD_FLAG_BM_BAT_READY        32
+#define VHD_FLAG_BM_BAT_WRITING      64
+#define VHD_FLAG_BM_BAT_FAILED       128
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -151,6 +160,7 @@ unsigned int SPB;
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_BAT_WAIT         4
 
 typedef uint8_t vhd_flag_t;
 
@@ -186,17 +196,27 @@ struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	int                       nr_allocs;   /* blocks being allocated */
+	int                       max_allocs;
+	struct list_head          allocs;      /* their bitmaps, until the bat
+						* write covering them starts */
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
+
+	uint64_t                  writes;      /* bat writes issued */
+	uint64_t                  blocks;      /* blocks they allocated */
 };
 
 struct vhd_bitmap {
 	u32                       blk;
-	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	struct vhd_bitmap        *hash_next;   /* cache bucket chain */
+	struct list_head          lru;         /* lru or free list */
+
+	uint64_t                  pbw_offset;  /* file offset of the block,
+						* while allocating */
+	struct list_head          alloc;       /* on bat.allocs */
+	struct vhd_request        zero_req;    /* for initializing bitmap */
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -227,13 +247,17 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	int                       bm_cache_size;
+	u32                       bm_hash_mask;
+	struct vhd_bitmap       **bitmap;      /* hashed on blk */
+	struct list_head          bm_lru;      /* cached, oldest first */
+	struct list_head          bm_free;
+	struct vhd_bitmap        *bitmap_list;
 
-	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_evictions;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -443,6 +467,12 @@ vhd_initialize_bat(struct vhd_state *s)
 		goto fail;
 	}
 
+	s->bat.status    = 0;
+	s->bat.nr_allocs = 0;
+	s->bat.writes    = 0;
+	s->bat.blocks    = 0;
+	INIT_LIST_HEAD(&s->bat.allocs);
+
 	return 0;
 
 fail:
@@ -456,29 +486,68 @@ vhd_free_bitmap_cache(struct vhd_state *s)
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
+	if (s->bitmap_list) {
+		for (i = 0; i < s->bm_cache_size; i++) {
+			bm = s->bitmap_list + i;
+			free(bm->map);
+			free(bm->shadow);
+		}
+	}
+
+	free(s->bitmap_list);
+	free(s->bitmap);
+	s->bitmap_list   = NULL;
+	s->bitmap        = NULL;
+	s->bm_cache_size = 0;
+}
+
+static int
+vhd_bitmap_cache_size(void)
+{
+	char *env, *end;
+	unsigned long size;
+
+	env = getenv("TAPDISK2_VHD_BITMAP_CACHE");
+	if (!env)
+		return VHD_CACHE_SIZE;
+
+	size = strtoul(env, &end, 0);
+	if (*env == '\0' || *end != '\0') {
+		EPRINTF("invalid TAPDISK2_VHD_BITMAP_CACHE %s\n", env);
+		return VHD_CACHE_SIZE;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	return MAX(VHD_CACHE_SIZE_MIN, MIN(size, VHD_CACHE_SIZE_MAX));
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
-	int i, err, map_size;
+	int i, err, map_size, buckets;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
-
-	s->bm_lru        = 0;
+	s->bm_cache_size = vhd_bitmap_cache_size();
+	s->bm_hits       = 0;
+	s->bm_misses     = 0;
+	s->bm_evictions  = 0;
 	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	/* keep the hash chains short: at least one bucket per bitmap */
+	for (buckets = 1; buckets < s->bm_cache_size; buckets <<= 1)
+		;
+	s->bm_hash_mask = buckets - 1;
+
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_free);
+
+	s->bitmap      = calloc(buckets, sizeof(struct vhd_bitmap *));
+	s->bitmap_list = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap));
+	if (!s->bitmap || !s->bitmap_list) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < s->bm_cache_size; i++) {
 		bm = s->bitmap_list + i;
 
 		err = posix_memalign((void **)&bm->map, 512, map_size);
@@ -495,9 +564,13 @@ vhd_initialize_bitmap_cache(struct vhd_state *s)
 
 		memset(bm->map, 0, map_size);
 		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+		INIT_LIST_HEAD(&bm->alloc);
+		list_add_tail(&bm->lru, &s->bm_free);
 	}
 
+	/* leave bitmaps for reads and writes to allocated blocks */
+	s->bat.max_allocs = MIN(VHD_BAT_MAX_ALLOCS, s->bm_cache_size / 2);
+
 	return 0;
 
 fail:
@@ -664,6 +737,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	td_register_file(s->vhd.fd);
+
         return 0;
 
  fail:
@@ -760,6 +835,7 @@ _vhd_close(td_driver_t *driver)
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
+	td_unregister_file(s->vhd.fd);
 	vhd_close(&s->vhd);
 	vhd_free(s);
 
@@ -925,60 +1001,48 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
-{
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
-}
-
-static inline void
-lock_bat(struct vhd_state *s)
-{
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
-}
-
-static inline void
-unlock_bat(struct vhd_state *s)
+static inline int
+bat_full(struct vhd_state *s)
 {
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return (s->bat.nr_allocs >= s->bat.max_allocs);
 }
 
 static inline int
-bat_locked(struct vhd_state *s)
+bitmap_allocating(struct vhd_bitmap *bm)
 {
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return (bm && test_vhd_flag(bm->status, VHD_FLAG_BM_ALLOCATING));
 }
 
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->blk    = 0;
-	bm->seqno  = 0;
-	bm->status = 0;
+	bm->blk        = 0;
+	bm->status     = 0;
+	bm->hash_next  = NULL;
+	bm->pbw_offset = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
 	memset(bm->map, 0, vhd_sectors_to_bytes(s->bm_secs));
 	memset(bm->shadow, 0, vhd_sectors_to_bytes(s->bm_secs));
 	init_vhd_request(s, &bm->req);
+	init_vhd_request(s, &bm->zero_req);
+}
+
+static inline struct vhd_bitmap **
+bitmap_bucket(struct vhd_state *s, uint32_t block)
+{
+	return &s->bitmap[block & s->bm_hash_mask];
 }
 
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = *bitmap_bucket(s, block); bm; bm = bm->hash_next)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
@@ -1030,28 +1094,39 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+static inline void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pbm;
+
+	for (pbm = bitmap_bucket(s, bm->blk); *pbm; pbm = &(*pbm)->hash_next)
+		if (*pbm == bm) {
+			*pbm = bm->hash_next;
+			bm->hash_next = NULL;
+			return;
+		}
+
+	ASSERT(0);
+}
+
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	/* locked bitmaps stay put; the first unlocked one is the lru */
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (bitmap_locked(bm))
+			continue;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		ASSERT(!bitmap_in_use(bm));
+		unhash_bitmap(s, bm);
+		list_del(&bm->lru);
+		s->bm_evictions++;
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1061,8 +1136,9 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	
 	*bitmap = NULL;
 
-	if (s->bm_free_count > 0) {
-		bm = s->bitmap_free[--s->bm_free_count];
+	if (!list_empty(&s->bm_free)) {
+		bm = list_entry(s->bm_free.next, struct vhd_bitmap, lru);
+		list_del(&bm->lru);
 	} else {
 		bm = remove_lru_bitmap(s);
 		if (!bm)
@@ -1076,63 +1152,35 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_del(&bm->lru);
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **bucket = bitmap_bucket(s, bm->blk);
 
-	ASSERT(0);
+	ASSERT(!get_bitmap(s, bm->blk));
+
+	bm->hash_next = *bucket;
+	*bucket       = bm;
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(!bitmap_allocating(bm));
 
-	s->bitmap[i] = NULL;
-	s->bitmap_free[s->bm_free_count++] = bm;
+	unhash_bitmap(s, bm);
+	list_del(&bm->lru);
+	list_add_tail(&bm->lru, &s->bm_free);
 }
 
 static int
@@ -1155,8 +1203,8 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
-		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		if (op == VHD_OP_DATA_WRITE && bat_full(s) &&
+		    !bitmap_allocating(get_bitmap(s, blk)))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1168,10 +1216,13 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
-	/* bump lru count */
+	/* bump lru position */
+	s->bm_hits++;
 	touch_bitmap(s, bm);
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
@@ -1264,47 +1315,111 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
+/*
+ * Blocks are reserved at the end of the file as they are allocated, so
+ * several allocations can be in flight at once: each bitmap being
+ * allocated holds its own offset until the bat entry pointing to it is
+ * on disk.  Space reserved by an allocation that then fails is not
+ * reused.
+ */
 static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+reserve_new_block(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int gap = 0;
+	uint64_t lb_end = s->next_db;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(!bitmap_allocating(bm));
+	ASSERT(!bat_full(s));
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	bm->pbw_offset = s->next_db + gap;
+	s->next_db     = bm->pbw_offset + s->bm_secs + s->spb;
+
+	set_vhd_flag(bm->status, VHD_FLAG_BM_ALLOCATING);
+	list_add_tail(&bm->alloc, &s->bat.allocs);
+	s->bat.nr_allocs++;
 
-	return s->next_db;
+	return lb_end;
 }
 
-static int
+static inline void
+release_new_block(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	ASSERT(bitmap_allocating(bm));
+
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", bm->blk,
+	    !!test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_FAILED));
+
+	clear_vhd_flag(bm->status, (VHD_FLAG_BM_ALLOCATING |
+				    VHD_FLAG_BM_BAT_READY  |
+				    VHD_FLAG_BM_BAT_WRITING |
+				    VHD_FLAG_BM_BAT_FAILED));
+	list_del_init(&bm->alloc);
+	bm->pbw_offset = 0;
+	s->bat.nr_allocs--;
+}
+
+/*
+ * Writes the bat sector holding the first allocation that is ready,
+ * with every other ready allocation in the same sector folded into it.
+ * Allocations that become ready while the write is in flight are
+ * picked up when it completes.
+ */
+static void
 schedule_bat_write(struct vhd_state *s)
 {
-	int i;
-	u32 blk;
+	int i, n;
+	u32 first;
 	char *buf;
 	u64 offset;
 	struct vhd_request *req;
+	struct vhd_bitmap *bm, *tmp;
 
-	ASSERT(bat_locked(s));
+	if (test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED))
+		return;
+
+	first = 0;
+	n     = 0;
+
+	list_for_each_entry(bm, &s->bat.allocs, alloc)
+		if (test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY)) {
+			first = bm->blk - (bm->blk % VHD_BAT_ENTRIES_PER_SEC);
+			n     = 1;
+			break;
+		}
+
+	if (!n)
+		return;
 
 	req = &s->bat.req;
 	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	n   = 0;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, first), VHD_SECTOR_SIZE);
+
+	list_for_each_entry_safe(bm, tmp, &s->bat.allocs, alloc) {
+		if (!test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY) ||
+		    bm->blk - first >= VHD_BAT_ENTRIES_PER_SEC)
+			continue;
+
+		((u32 *)buf)[bm->blk - first] = bm->pbw_offset;
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
+		set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITING);
+		n++;
 
-	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
+		DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
+		    bm->blk, bm->pbw_offset);
+	}
 
-	for (i = 0; i < 128; i++)
+	for (i = 0; i < VHD_BAT_ENTRIES_PER_SEC; i++)
 		BE32_OUT(&((u32 *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
+	offset         = s->vhd.header.table_offset + first * sizeof(u32);
+	req->treq.sec  = first;
 	req->treq.secs = 1;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
@@ -1313,10 +1428,11 @@ schedule_bat_write(struct vhd_state *s)
 	aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	s->bat.writes++;
+	s->bat.blocks += n;
 
-	return 0;
+	DBG(TLOG_DBG, "first: 0x%04x, blocks: %d, "
+	    "table_offset: 0x%08"PRIx64"\n", first, n, offset);
 }
 
 static void
@@ -1324,19 +1440,19 @@ schedule_zero_bm_write(struct vhd_state *s,
 		       struct vhd_bitmap *bm, uint64_t lb_end)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &bm->zero_req;
 
 	init_vhd_request(s, req);
 
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = bm->blk * s->spb;
+	req->treq.secs = (bm->pbw_offset - lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    bm->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1351,15 +1467,13 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
 	bm = get_bitmap(s, blk);
+	if (bitmap_allocating(bm))
+		return 0;
+
 	if (!bm) {
 		/* install empty bitmap in cache */
 		err = alloc_vhd_bitmap(s, &bm, blk);
@@ -1369,8 +1483,7 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
+	lb_end = reserve_new_block(s, bm);
 	schedule_zero_bm_write(s, bm, lb_end);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
@@ -1380,66 +1493,60 @@ update_bat(struct vhd_state *s, uint32_t blk)
 static int
 allocate_block(struct vhd_state *s, uint32_t blk)
 {
-	char *zeros;
-	int err, gap;
-	uint64_t offset, size;
+	int err;
+	uint64_t lb_end, offset, size;
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
+	/* empty bitmap could already be in
+	 * cache if earlier bat update failed */
+	bm = get_bitmap(s, blk);
+	if (bitmap_allocating(bm))
 		return 0;
-	}
 
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
+	if (!bm) {
+		/* install empty bitmap in cache */
+		err = alloc_vhd_bitmap(s, &bm, blk);
+		if (err) 
+			return err;
 
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
+		install_bitmap(s, bm);
 	}
 
-	s->bat.pbw_offset = s->next_db;
+	lb_end = reserve_new_block(s, bm);
+	offset = vhd_sectors_to_bytes(lb_end);
+	size   = vhd_sectors_to_bytes(s->next_db - lb_end);
 
 	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	    blk, bm->pbw_offset);
 
 	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(errno, "lseek failed\n");
-		return -errno;
+		err = -errno;
+		ERR(err, "lseek failed\n");
+		goto fail;
 	}
 
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
 	err  = write(s->vhd.fd, vhd_zeros(size), size);
 	if (err != size) {
 		err = (err == -1 ? -errno : -EIO);
 		ERR(err, "write failed");
-		return err;
-	}
-
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
-	if (!bm) {
-		/* install empty bitmap in cache */
-		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
-			return err;
-
-		install_bitmap(s, bm);
+		goto fail;
 	}
 
-	lock_bat(s);
+	/* zeroed synchronously: ready for the next bat write */
 	lock_bitmap(bm);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
 	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
 
 	return 0;
+
+fail:
+	/* nothing else was reserved in the meantime */
+	release_new_block(s, bm);
+	s->next_db = lb_end;
+	return err;
 }
 
 static int 
@@ -1513,7 +1620,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = get_bitmap(s, blk)->pbw_offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1608,8 +1715,8 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(bitmap_allocating(bm));
+		offset = bm->pbw_offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1709,8 +1816,11 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_NOT_CACHED:
 			err = schedule_bitmap_read(s, clone.sec / s->spb);
-			if (err)
+			if (err) {
+				/* bitmap cache full: retry once one is free */
+				clone.blocked = (err == -EBUSY);
 				goto fail;
+			}
 
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
 			err = __vhd_queue_request(s, VHD_OP_DATA_READ, clone);
@@ -1775,8 +1885,10 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 				      VHD_FLAG_REQ_UPDATE_BITMAP);
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
 			err        = schedule_data_write(s, clone, flags);
-			if (err)
+			if (err) {
+				clone.blocked = (err == -EBUSY);
 				goto fail;
+			}
 			break;
 
 		case VHD_BM_BIT_CLEAR:
@@ -1797,8 +1909,11 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 		case VHD_BM_NOT_CACHED:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
 			err = schedule_bitmap_read(s, clone.sec / s->spb);
-			if (err)
+			if (err) {
+				/* bitmap cache full: retry once one is free */
+				clone.blocked = (err == -EBUSY);
 				goto fail;
+			}
 
 			err = __vhd_queue_request(s, VHD_OP_DATA_WRITE, clone);
 			if (err)
@@ -1904,13 +2019,13 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx = &bm->tx;
 
-	if (!bat_locked(s))
+	if (!bitmap_allocating(bm))
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT))
 		return;
 
-	if (!s->bat.req.error)
+	if (!test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_FAILED))
 		goto release;
 
 	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
@@ -1920,9 +2035,7 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 	return;
 
  release:
-	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	release_new_block(s, bm);
 }
 
 static void
@@ -1936,15 +2049,11 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		ASSERT(bitmap_allocating(bm));
+		set_vhd_flag(tx->status, VHD_FLAG_TX_BAT_WAIT);
+		return;
 	}
 
 	if (tx->error) {
@@ -1986,42 +2095,62 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_write(struct vhd_request *req)
 {
-	struct vhd_bitmap *bm;
+	LIST_HEAD(done);
+	struct vhd_bitmap *bm, *tmp;
 	struct vhd_transaction *tx;
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	DBG(TLOG_DBG, "first: 0x%04"PRIx64", err %d\n",
+	    req->treq.sec, req->error);
+	ASSERT(test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	/*
+	 * update the in-memory bat for the whole batch before anything
+	 * completes, so that a bat write started from a completion
+	 * callback sees every entry just written.
+	 */
+	list_for_each_entry_safe(bm, tmp, &s->bat.allocs, alloc) {
+		if (!test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITING))
+			continue;
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITING);
+		list_del(&bm->alloc);
+		list_add_tail(&bm->alloc, &done);
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+		if (!req->error)
+			bat_entry(s, bm->blk) = bm->pbw_offset;
+		else {
+			set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_FAILED);
+			bm->tx.error = (bm->tx.error ? : req->error);
+		}
+	}
+
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+
+	list_for_each_entry_safe(bm, tmp, &done, alloc) {
+		list_del_init(&bm->alloc);
+
+		tx = &bm->tx;
+		ASSERT(bitmap_valid(bm) && bitmap_locked(bm));
+		ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT));
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
+		if (test_vhd_flag(tx->status, VHD_FLAG_TX_BAT_WAIT)) {
+			clear_vhd_flag(tx->status, VHD_FLAG_TX_BAT_WAIT);
 			finish_bitmap_transaction(s, bm, req->error);
+		}
+
+		finish_bat_transaction(s, bm);
+
+		/* a preallocated block may have no writes left */
+		if (!bitmap_in_use(bm))
+			unlock_bitmap(bm);
 	}
 
-	finish_bat_transaction(s, bm);
+	schedule_bat_write(s);
 }
 
 static void
@@ -2039,23 +2168,26 @@ finish_zero_bm_write(struct vhd_request *req)
 	bm  = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
+	ASSERT(bitmap_allocating(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
 		tx->error = req->error;
+		set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_FAILED);
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
+		list_del_init(&bm->alloc);
+	} else {
+		set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
 		schedule_bat_write(s);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
+
+	finish_bat_transaction(s, bm);
 }
 
 static void
@@ -2240,6 +2372,8 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	uint64_t lookups;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2261,16 +2395,21 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	/* fixed disks and queries have neither cache nor bat */
+	if (!s->bitmap_list)
+		return;
+
+	lookups = s->bm_hits + s->bm_misses;
+	DBG(TLOG_WARN, "BITMAP CACHE: size: %d, hits: %"PRIu64", "
+	    "misses: %"PRIu64", hit rate: %.1f%%, evictions: %"PRIu64"\n",
+	    s->bm_cache_size, s->bm_hits, s->bm_misses,
+	    (lookups ? s->bm_hits * 100.0 / lookups : 0.0), s->bm_evictions);
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2293,14 +2432,19 @@ vhd_debug(td_driver_t *driver)
 		DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%08x, q: %p, qnum: %d, w: %p, "
 		    "wnum: %d, locked: %d, in use: %d, tx: %p, tx_error: %d, "
 		    "started: %d, finished: %d, status: %u, reqs: %p, nreqs: %d\n",
-		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
+		    i++, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, allocating: %d/%d, "
+	    "writes: %"PRIu64", blocks: %"PRIu64", blocks/write: %.2f\n",
+	    s->bat.status, s->bat.nr_allocs, s->bat.max_allocs,
+	    s->bat.writes, s->bat.blocks,
+	    (s->bat.writes ? (double)s->bat.blocks / s->bat.writes : 0.0));
+	list_for_each_entry(bm, &s->bat.allocs, alloc)
+		DBG(TLOG_WARN, "blk: 0x%04x, pbw_off: 0x%08"PRIx64", "
+		    "status: 0x%02x\n", bm->blk, bm->pbw_offset, bm->status);
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -34,6 +34,10 @@
 #include "scheduler.h"
 #include "tapdisk-log.h"
 
+#ifdef SCHEDULER_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #define DBG(_f, _a...)               tlog_write(TLOG_DBG, _f, ##_a)
 
 #define SCHEDULER_MAX_TIMEOUT        600
@@ -49,23 +53,474 @@
 
 typedef struct event {
 	char                         mode;
+	char                         dead;
 	event_id_t                   id;
 
 	int                          fd;
 	int                          timeout;
 	int                          deadline;
+	int                          timer;        /* in s->timers, or -1 */
 
 	event_cb_t                   cb;
 	void                        *private;
 
 	struct list_head             next;
+	struct event                *hash_next;
+#ifdef SCHEDULER_EPOLL
+	struct list_head             fd_next;      /* on its scheduler_fd */
+	struct list_head             dead_next;    /* on s->dead */
+	struct list_head             due_next;
+#endif
 } event_t;
 
+/*
+ * Timers: the events with a timeout, in a heap on their deadline, so
+ * that the next one to expire is always s->timers[0].
+ */
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_timer_set(scheduler_t *s, int i, event_t *event)
+{
+	s->timers[i] = event;
+	event->timer = i;
+}
+
+static void
+scheduler_timer_sift_up(scheduler_t *s, int i)
+{
+	event_t *event = s->timers[i];
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (s->timers[parent]->deadline <= event->deadline)
+			break;
+
+		scheduler_timer_set(s, i, s->timers[parent]);
+		i = parent;
+	}
+
+	scheduler_timer_set(s, i, event);
+}
+
+static void
+scheduler_timer_sift_down(scheduler_t *s, int i)
 {
+	event_t *event = s->timers[i];
+
+	for (;;) {
+		int child = 2 * i + 1;
+
+		if (child >= s->nr_timers)
+			break;
+
+		if (child + 1 < s->nr_timers &&
+		    s->timers[child + 1]->deadline < s->timers[child]->deadline)
+			child++;
+
+		if (event->deadline <= s->timers[child]->deadline)
+			break;
+
+		scheduler_timer_set(s, i, s->timers[child]);
+		i = child;
+	}
+
+	scheduler_timer_set(s, i, event);
+}
+
+static void
+scheduler_timer_update(scheduler_t *s, event_t *event)
+{
+	scheduler_timer_sift_up(s, event->timer);
+	scheduler_timer_sift_down(s, event->timer);
+}
+
+static int
+scheduler_timer_add(scheduler_t *s, event_t *event)
+{
+	if (s->nr_timers == s->max_timers) {
+		int max = s->max_timers ? 2 * s->max_timers : 16;
+		event_t **timers;
+
+		timers = realloc(s->timers, max * sizeof(*timers));
+		if (!timers)
+			return -ENOMEM;
+
+		s->timers     = timers;
+		s->max_timers = max;
+	}
+
+	scheduler_timer_set(s, s->nr_timers++, event);
+	scheduler_timer_sift_up(s, event->timer);
+
+	return 0;
+}
+
+static void
+scheduler_timer_del(scheduler_t *s, event_t *event)
+{
+	int i = event->timer;
+	event_t *last;
+
+	if (i < 0)
+		return;
+
+	event->timer = -1;
+
+	last = s->timers[--s->nr_timers];
+	if (last != event) {
+		scheduler_timer_set(s, i, last);
+		scheduler_timer_update(s, last);
+	}
+}
+
+/* Seconds until the next timer expires, capped at the max timeout */
+static void
+scheduler_prepare_timeout(scheduler_t *s)
+{
+	struct timeval now;
 	int diff;
+
+	s->timeout = SCHEDULER_MAX_TIMEOUT;
+
+	if (s->nr_timers) {
+		gettimeofday(&now, NULL);
+
+		diff = s->timers[0]->deadline - now.tv_sec;
+		if (diff > 0)
+			s->timeout = MIN(s->timeout, diff);
+		else
+			s->timeout = 0;
+	}
+
+	s->timeout = MIN(s->timeout, s->max_timeout);
+}
+
+static void
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
+{
+	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		event->deadline = now.tv_sec + event->timeout;
+		if (event->timer >= 0)
+			scheduler_timer_update(s, event);
+	}
+
+	event->cb(event->id, mode, event->private);
+}
+
+static void
+scheduler_hash_add(scheduler_t *s, event_t *event)
+{
+	event_t **head = &s->hash[event->id % SCHEDULER_HASH_SIZE];
+
+	event->hash_next = *head;
+	*head = event;
+}
+
+static event_t *
+scheduler_hash_del(scheduler_t *s, event_id_t id)
+{
+	event_t **pe, *event;
+
+	for (pe = &s->hash[id % SCHEDULER_HASH_SIZE];
+	     (event = *pe); pe = &event->hash_next)
+		if (event->id == id) {
+			*pe = event->hash_next;
+			return event;
+		}
+
+	return NULL;
+}
+
+#ifdef SCHEDULER_EPOLL
+
+/*
+ * epoll takes each fd only once, so the events on an fd are gathered on
+ * a scheduler_fd, and the fd is watched for what any of them wants.
+ *
+ * Callbacks may unregister any event, including ones which are ready but
+ * haven't been run yet: unregistered events are only marked dead, and
+ * freed (along with fds left without events) once the run is over.
+ */
+struct scheduler_fd {
+	int                          fd;
+	uint32_t                     mask;         /* watched for, 0 if not */
+	struct list_head             events;
+};
+
+static uint32_t
+scheduler_epoll_mask(char mode)
+{
+	uint32_t mask = 0;
+
+	if (mode & SCHEDULER_POLL_READ_FD)
+		mask |= EPOLLIN;
+	if (mode & SCHEDULER_POLL_WRITE_FD)
+		mask |= EPOLLOUT;
+	if (mode & SCHEDULER_POLL_EXCEPT_FD)
+		mask |= EPOLLPRI;
+
+	return mask;
+}
+
+/* As select(2) would report the fd, for those modes */
+static char
+scheduler_ready_mode(uint32_t events)
+{
+	char mode = 0;
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		mode |= SCHEDULER_POLL_READ_FD;
+	if (events & (EPOLLOUT | EPOLLERR))
+		mode |= SCHEDULER_POLL_WRITE_FD;
+	if (events & EPOLLPRI)
+		mode |= SCHEDULER_POLL_EXCEPT_FD;
+
+	return mode;
+}
+
+/*
+ * Watch sfd for what its live events want.  With force, tell epoll even
+ * if that hasn't changed: a new event may be for a new file on the same
+ * fd number, which epoll doesn't know about.
+ */
+static int
+scheduler_fd_update(scheduler_t *s, struct scheduler_fd *sfd, int force)
+{
+	struct epoll_event ev;
+	event_t *event;
+	uint32_t mask = 0;
+	int err, op;
+
+	list_for_each_entry(event, &sfd->events, fd_next)
+		if (!event->dead)
+			mask |= scheduler_epoll_mask(event->mode);
+
+	if (mask == sfd->mask && (!force || !mask))
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = mask;
+	ev.data.ptr = sfd;
+
+	if (!mask)
+		op = EPOLL_CTL_DEL;
+	else if (!sfd->mask)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+
+	/* The fd may have been closed (and reopened) behind our back */
+	if (err && op == EPOLL_CTL_MOD && errno == ENOENT)
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, sfd->fd, &ev);
+	else if (err && op == EPOLL_CTL_ADD && errno == EEXIST)
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, sfd->fd, &ev);
+	else if (err && op == EPOLL_CTL_DEL && (errno == ENOENT ||
+						errno == EBADF))
+		err = 0;
+
+	if (err)
+		return -errno;
+
+	sfd->mask = mask;
+	return 0;
+}
+
+static int
+scheduler_fd_add(scheduler_t *s, event_t *event)
+{
+	struct scheduler_fd *sfd;
+	int err;
+
+	if (event->fd < 0)
+		return -EINVAL;
+
+	if (event->fd >= s->nr_fds) {
+		int nr = MAX(event->fd + 1, 2 * s->nr_fds);
+		struct scheduler_fd **fds;
+
+		fds = realloc(s->fds, nr * sizeof(*fds));
+		if (!fds)
+			return -ENOMEM;
+
+		memset(fds + s->nr_fds, 0, (nr - s->nr_fds) * sizeof(*fds));
+		s->fds    = fds;
+		s->nr_fds = nr;
+	}
+
+	sfd = s->fds[event->fd];
+	if (!sfd) {
+		sfd = calloc(1, sizeof(*sfd));
+		if (!sfd)
+			return -ENOMEM;
+
+		sfd->fd = event->fd;
+		INIT_LIST_HEAD(&sfd->events);
+		s->fds[event->fd] = sfd;
+	}
+
+	list_add_tail(&event->fd_next, &sfd->events);
+
+	err = scheduler_fd_update(s, sfd, 1);
+	if (err) {
+		list_del_init(&event->fd_next);
+		if (list_empty(&sfd->events)) {
+			s->fds[event->fd] = NULL;
+			free(sfd);
+		}
+		return err;
+	}
+
+	return 0;
+}
+
+/* Free the dead events, and the fds they leave without any. */
+static void
+scheduler_gc_events(scheduler_t *s)
+{
+	event_t *event, *tmp;
+
+	list_for_each_entry_safe(event, tmp, &s->dead, dead_next) {
+		list_del(&event->dead_next);
+		list_del(&event->next);
+
+		if (!list_empty(&event->fd_next)) {
+			struct scheduler_fd *sfd = s->fds[event->fd];
+
+			list_del(&event->fd_next);
+			if (list_empty(&sfd->events)) {
+				if (sfd->mask)
+					epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL,
+						  sfd->fd, NULL);
+				s->fds[event->fd] = NULL;
+				free(sfd);
+			}
+		}
+
+		free(event);
+	}
+}
+
+static void
+scheduler_run_fd(scheduler_t *s, struct scheduler_fd *sfd, char ready)
+{
+	event_t *event;
+
+	/*
+	 * Each mode goes to the first event which wants it, as with
+	 * select.  Events added by the callbacks go at the tail, and
+	 * dead ones stay on the list until the gc.
+	 */
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		char mode;
+
+		if (event->dead)
+			continue;
+
+		mode = event->mode & ready;
+		if (mode & SCHEDULER_POLL_READ_FD)
+			mode = SCHEDULER_POLL_READ_FD;
+		else if (mode & SCHEDULER_POLL_WRITE_FD)
+			mode = SCHEDULER_POLL_WRITE_FD;
+		else if (mode & SCHEDULER_POLL_EXCEPT_FD)
+			mode = SCHEDULER_POLL_EXCEPT_FD;
+		else
+			continue;
+
+		ready &= ~mode;
+		scheduler_event_callback(s, event, mode);
+
+		if (!ready)
+			break;
+	}
+}
+
+static void
+scheduler_run_events(scheduler_t *s, int nr_ready)
+{
+	struct list_head due;
 	struct timeval now;
+	event_t *event;
+	int i;
+
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < nr_ready; i++) {
+		struct scheduler_fd *sfd = s->ready[i].data.ptr;
+		char ready = scheduler_ready_mode(s->ready[i].events);
+
+		scheduler_run_fd(s, sfd, ready);
+	}
+
+	/*
+	 * Take the expired timers out of the heap before running any, so
+	 * that each runs once, even with a timeout of 0.
+	 */
+	INIT_LIST_HEAD(&due);
+	while (s->nr_timers && s->timers[0]->deadline <= now.tv_sec) {
+		event = s->timers[0];
+		scheduler_timer_del(s, event);
+		list_add_tail(&event->due_next, &due);
+	}
+
+	list_for_each_entry(event, &due, due_next) {
+		if (event->dead)
+			continue;
+
+		scheduler_event_callback(s, event, SCHEDULER_POLL_TIMEOUT);
+
+		/* Can't fail, there was room for it a moment ago */
+		if (!event->dead)
+			scheduler_timer_add(s, event);
+	}
+
+	scheduler_gc_events(s);
+}
+
+int
+scheduler_wait_for_events(scheduler_t *s)
+{
+	int ret;
+
+	scheduler_gc_events(s);
+	scheduler_prepare_timeout(s);
+
+	DBG("timeout: %d, max_timeout: %d\n",
+	    s->timeout, s->max_timeout);
+
+	if (s->nr_ready < s->nr_fds) {
+		struct epoll_event *ready;
+
+		ready = realloc(s->ready, s->nr_fds * sizeof(*ready));
+		if (ready) {
+			s->ready    = ready;
+			s->nr_ready = s->nr_fds;
+		}
+	}
+
+	ret = epoll_wait(s->epoll_fd, s->ready, MAX(s->nr_ready, 1),
+			 s->timeout * 1000);
+
+	s->timeout     = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
+
+	if (ret < 0)
+		return -errno;
+
+	scheduler_run_events(s, ret);
+
+	return ret;
+}
+
+#else /* !SCHEDULER_EPOLL */
+
+static void
+scheduler_prepare_events(scheduler_t *s)
+{
 	event_t *event, *tmp;
 
 	FD_ZERO(&s->read_fds);
@@ -73,9 +528,6 @@ scheduler_prepare_events(scheduler_t *s)
 	FD_ZERO(&s->except_fds);
 
 	s->max_fd  = 0;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
-
-	gettimeofday(&now, NULL);
 
 	scheduler_for_each_event(s, event, tmp) {
 		if (event->mode & SCHEDULER_POLL_READ_FD) {
@@ -92,29 +544,9 @@ scheduler_prepare_events(scheduler_t *s)
 			FD_SET(event->fd, &s->except_fds);
 			s->max_fd = MAX(event->fd, s->max_fd);
 		}
-
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
 	}
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
-}
-
-static void
-scheduler_event_callback(event_t *event, char mode)
-{
-	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		event->deadline = now.tv_sec + event->timeout;
-	}
-
-	event->cb(event->id, mode, event->private);
+	scheduler_prepare_timeout(s);
 }
 
 static void
@@ -132,27 +564,31 @@ scheduler_run_events(scheduler_t *s)
 		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
 		    FD_ISSET(event->fd, &s->read_fds)) {
 			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_READ_FD);
 			goto next;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
 		    FD_ISSET(event->fd, &s->write_fds)) {
 			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_WRITE_FD);
 			goto next;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
 		    FD_ISSET(event->fd, &s->except_fds)) {
 			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_EXCEPT_FD);
 			goto next;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
 		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+		    scheduler_event_callback(s, event,
+					     SCHEDULER_POLL_TIMEOUT);
 
 	next:
 		if (s->restart)
@@ -160,12 +596,44 @@ scheduler_run_events(scheduler_t *s)
 	}
 }
 
+int
+scheduler_wait_for_events(scheduler_t *s)
+{
+	int ret;
+	struct timeval tv;
+
+	scheduler_prepare_events(s);
+
+	tv.tv_sec  = s->timeout;
+	tv.tv_usec = 0;
+
+	DBG("timeout: %d, max_timeout: %d\n",
+	    s->timeout, s->max_timeout);
+
+	ret = select(s->max_fd + 1, &s->read_fds,
+		     &s->write_fds, &s->except_fds, &tv);
+
+	s->restart     = 0;
+	s->timeout     = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
+
+	if (ret < 0)
+		return ret;
+
+	scheduler_run_events(s);
+
+	return ret;
+}
+
+#endif /* SCHEDULER_EPOLL */
+
 int
 scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
 	event_t *event;
 	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -185,33 +653,68 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	event->fd       = fd;
 	event->timeout  = timeout;
 	event->deadline = now.tv_sec + timeout;
+	event->timer    = -1;
 	event->cb       = cb;
 	event->private  = private;
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		err = scheduler_timer_add(s, event);
+		if (err)
+			goto fail;
+	}
+
+#ifdef SCHEDULER_EPOLL
+	INIT_LIST_HEAD(&event->fd_next);
+
+	if (mode & SCHEDULER_POLL_FD) {
+		err = scheduler_fd_add(s, event);
+		if (err) {
+			scheduler_timer_del(s, event);
+			goto fail;
+		}
+	}
+#endif
+
 	event->id       = s->uuid++;
 
 	if (!s->uuid)
 		s->uuid++;
 
 	list_add_tail(&event->next, &s->events);
+	scheduler_hash_add(s, event);
 
 	return event->id;
+
+fail:
+	free(event);
+	return err;
 }
 
 void
 scheduler_unregister_event(scheduler_t *s, event_id_t id)
 {
-	event_t *event, *tmp;
+	event_t *event;
 
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event, tmp)
-		if (event->id == id) {
-			list_del(&event->next);
-			free(event);
-			s->restart = 1;
-			break;
-		}
+	event = scheduler_hash_del(s, id);
+	if (!event)
+		return;
+
+	scheduler_timer_del(s, event);
+
+#ifdef SCHEDULER_EPOLL
+	event->dead = 1;
+	list_add_tail(&event->dead_next, &s->dead);
+
+	if (!list_empty(&event->fd_next))
+		scheduler_fd_update(s, s->fds[event->fd], 0);
+#else
+	list_del(&event->next);
+	free(event);
+	s->restart = 1;
+#endif
 }
 
 void
@@ -222,44 +725,26 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 }
 
 int
-scheduler_wait_for_events(scheduler_t *s)
+scheduler_initialize(scheduler_t *s)
 {
-	int ret;
-	struct timeval tv;
-
-	scheduler_prepare_events(s);
-
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
-
-	DBG("timeout: %d, max_timeout: %d\n",
-	    s->timeout, s->max_timeout);
-
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	memset(s, 0, sizeof(scheduler_t));
 
-	s->restart     = 0;
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
+	s->uuid        = 1;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
-	if (ret < 0)
-		return ret;
-
-	scheduler_run_events(s);
-
-	return ret;
-}
-
-void
-scheduler_initialize(scheduler_t *s)
-{
-	memset(s, 0, sizeof(scheduler_t));
+	INIT_LIST_HEAD(&s->events);
 
-	s->uuid = 1;
+#ifdef SCHEDULER_EPOLL
+	INIT_LIST_HEAD(&s->dead);
 
+	s->epoll_fd = epoll_create(1);
+	if (s->epoll_fd < 0)
+		return -errno;
+#else
 	FD_ZERO(&s->read_fds);
 	FD_ZERO(&s->write_fds);
 	FD_ZERO(&s->except_fds);
+#endif
 
-	INIT_LIST_HEAD(&s->events);
+	return 0;
 }
@@ -32,29 +32,54 @@
 
 #include "list.h"
 
+/* Wait with epoll(7) on Linux, and with select(2) elsewhere. */
+#ifdef __linux__
+#define SCHEDULER_EPOLL
+#endif
+
 #define SCHEDULER_POLL_READ_FD       0x1
 #define SCHEDULER_POLL_WRITE_FD      0x2
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+#define SCHEDULER_HASH_SIZE          256
+
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct event;
+struct scheduler_fd;
+struct epoll_event;
+
 typedef struct scheduler {
+#ifdef SCHEDULER_EPOLL
+	int                          epoll_fd;
+	struct scheduler_fd        **fds;          /* by fd */
+	int                          nr_fds;
+	struct epoll_event          *ready;
+	int                          nr_ready;
+	struct list_head             dead;         /* to free after a run */
+#else
 	fd_set                       read_fds;
 	fd_set                       write_fds;
 	fd_set                       except_fds;
+	int                          max_fd;
+	int                          restart;
+#endif
 
 	struct list_head             events;
+	struct event                *hash[SCHEDULER_HASH_SIZE]; /* by id */
+
+	struct event               **timers;       /* heap, on deadline */
+	int                          nr_timers;
+	int                          max_timers;
 
 	int                          uuid;
-	int                          max_fd;
 	int                          timeout;
-	int                          restart;
 	int                          max_timeout;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
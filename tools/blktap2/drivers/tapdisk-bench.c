@@ -0,0 +1,544 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * fio-style benchmark of the tapdisk data path: an in-process frontend
+ * keeps a number of requests in flight on a blkif ring served by a VBD,
+ * and reports throughput and completion latency.
+ *
+ * The frontend polls the ring rather than waiting for notifications, so
+ * what is measured is the ring, the request path and the image.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "list.h"
+#include "scheduler.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-utils.h"
+
+#define POLL_READ                        0
+#define POLL_WRITE                       1
+
+#define NR_LAT_BUCKETS                   32
+
+struct tapdisk_bench_stats {
+	uint64_t                         ios;
+	uint64_t                         bytes;
+	uint64_t                         errors;
+};
+
+struct tapdisk_bench {
+	td_vbd_t                        *vbd;
+	unsigned int                     id;
+
+	blkif_sring_t                   *sring;
+	blkif_front_ring_t               front;
+	char                            *data;
+
+	int                              bs;
+	int                              depth;
+	int                              write_pct;
+	int                              sequential;
+	int                              seconds;
+
+	uint64_t                         secs;
+	uint64_t                         cur;
+
+	int                              pipe[2];
+	event_id_t                       event_id;
+
+	int                              done;
+	int                              inflight;
+	int                              free_ids[MAX_REQUESTS];
+	int                              nr_free;
+	uint64_t                         issued_ns[MAX_REQUESTS];
+
+	uint64_t                         start_ns;
+	uint64_t                         end_ns;
+	struct tapdisk_bench_stats       read, write;
+	uint64_t                         lat_total_ns;
+	uint64_t                         lat_max_ns;
+	uint64_t                         lat_buckets[NR_LAT_BUCKETS];
+};
+
+static void
+usage(const char *app, int err)
+{
+	printf("usage: %s <-n type:/path/to/image> [-b block size] "
+	       "[-q queue depth] [-w write percentage] [-s] "
+	       "[-t seconds]\n", app);
+	printf("       -s: sequential, rather than random, offsets\n");
+	exit(err);
+}
+
+static uint64_t
+tapdisk_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+tapdisk_bench_poll(struct tapdisk_bench *b)
+{
+	int dummy = 0;
+
+	write_exact(b->pipe[POLL_WRITE], &dummy, sizeof(dummy));
+}
+
+static void
+tapdisk_bench_poll_clear(struct tapdisk_bench *b)
+{
+	int dummy;
+
+	read_exact(b->pipe[POLL_READ], &dummy, sizeof(dummy));
+}
+
+static inline char *
+tapdisk_bench_page(struct tapdisk_bench *b, int id, int seg)
+{
+	int psize = getpagesize();
+
+	return b->data +
+		(id * BLKIF_MAX_SEGMENTS_PER_REQUEST + seg) * psize;
+}
+
+static uint64_t
+tapdisk_bench_next_sector(struct tapdisk_bench *b)
+{
+	uint64_t blocks, sec;
+	int bsecs;
+
+	bsecs  = b->bs >> SECTOR_SHIFT;
+	blocks = b->secs / bsecs;
+
+	if (b->sequential) {
+		sec     = b->cur;
+		b->cur += bsecs;
+		if (b->cur + bsecs > b->secs)
+			b->cur = 0;
+		return sec;
+	}
+
+	return ((((uint64_t)random() << 31) | random()) % blocks) * bsecs;
+}
+
+static void
+tapdisk_bench_queue(struct tapdisk_bench *b)
+{
+	blkif_request_t *req;
+	int i, id, psize, secs, left;
+
+	psize = getpagesize();
+
+	while (b->nr_free) {
+		id  = b->free_ids[--b->nr_free];
+		req = RING_GET_REQUEST(&b->front, b->front.req_prod_pvt);
+		b->front.req_prod_pvt++;
+
+		req->id            = id;
+		req->sector_number = tapdisk_bench_next_sector(b);
+		req->operation     = (random() % 100 < b->write_pct ?
+				      BLKIF_OP_WRITE : BLKIF_OP_READ);
+		req->nr_segments   = 0;
+
+		for (left = b->bs >> SECTOR_SHIFT, i = 0; left; i++) {
+			struct blkif_request_segment *seg = req->seg + i;
+
+			secs = left;
+			if (secs > psize >> SECTOR_SHIFT)
+				secs = psize >> SECTOR_SHIFT;
+
+			seg->gref       = 0;
+			seg->first_sect = 0;
+			seg->last_sect  = secs - 1;
+			req->nr_segments++;
+			left -= secs;
+		}
+
+		b->issued_ns[id] = tapdisk_bench_now();
+		b->inflight++;
+	}
+
+	RING_PUSH_REQUESTS(&b->front);
+}
+
+static void
+tapdisk_bench_complete(struct tapdisk_bench *b, blkif_response_t *rsp)
+{
+	struct tapdisk_bench_stats *st;
+	uint64_t lat;
+	int bucket;
+
+	st  = rsp->operation == BLKIF_OP_WRITE ? &b->write : &b->read;
+	lat = tapdisk_bench_now() - b->issued_ns[rsp->id];
+
+	if (rsp->status == BLKIF_RSP_OKAY) {
+		st->ios++;
+		st->bytes += b->bs;
+	} else
+		st->errors++;
+
+	b->lat_total_ns += lat;
+	if (lat > b->lat_max_ns)
+		b->lat_max_ns = lat;
+
+	/* bucket n holds latencies under 2^n us */
+	for (bucket = 0, lat /= 1000; lat && bucket < NR_LAT_BUCKETS - 1;
+	     lat >>= 1)
+		bucket++;
+	b->lat_buckets[bucket]++;
+
+	b->free_ids[b->nr_free++] = rsp->id;
+	b->inflight--;
+}
+
+static void
+tapdisk_bench_reap(struct tapdisk_bench *b)
+{
+	RING_IDX rc, rp;
+
+	rp = b->front.sring->rsp_prod;
+	xen_rmb();
+
+	for (rc = b->front.rsp_cons; rc != rp; rc++)
+		tapdisk_bench_complete(b, RING_GET_RESPONSE(&b->front, rc));
+
+	b->front.rsp_cons = rc;
+}
+
+static uint64_t
+tapdisk_bench_percentile(struct tapdisk_bench *b, int pct)
+{
+	uint64_t n, seen;
+	int i;
+
+	n = b->read.ios + b->read.errors + b->write.ios + b->write.errors;
+
+	for (seen = 0, i = 0; i < NR_LAT_BUCKETS; i++) {
+		seen += b->lat_buckets[i];
+		if (seen * 100 >= n * pct)
+			break;
+	}
+
+	return 1ULL << i;
+}
+
+static void
+tapdisk_bench_print_stats(const char *name, struct tapdisk_bench_stats *st,
+			  double seconds)
+{
+	if (!st->ios && !st->errors)
+		return;
+
+	printf("  %-5s: ios=%"PRIu64", errors=%"PRIu64", iops=%.0f, "
+	       "bw=%.1fMiB/s\n", name, st->ios, st->errors,
+	       st->ios / seconds, st->bytes / seconds / (1 << 20));
+}
+
+static void
+tapdisk_bench_report(struct tapdisk_bench *b, const char *params)
+{
+	double seconds;
+	uint64_t n;
+
+	seconds = (b->end_ns - b->start_ns) / 1e9;
+	n       = (b->read.ios + b->read.errors +
+		   b->write.ios + b->write.errors);
+
+	printf("%s: bs=%d, depth=%d, %s, writes=%d%%, %.2fs\n",
+	       params, b->bs, b->depth,
+	       b->sequential ? "sequential" : "random", b->write_pct,
+	       seconds);
+
+	tapdisk_bench_print_stats("read", &b->read, seconds);
+	tapdisk_bench_print_stats("write", &b->write, seconds);
+
+	if (n)
+		printf("  lat (usec): avg=%.1f, max=%.1f, "
+		       "p50<%"PRIu64", p99<%"PRIu64"\n",
+		       b->lat_total_ns / 1000.0 / n, b->lat_max_ns / 1000.0,
+		       tapdisk_bench_percentile(b, 50),
+		       tapdisk_bench_percentile(b, 99));
+}
+
+static void
+tapdisk_bench_event(event_id_t id, char mode, void *arg)
+{
+	struct tapdisk_bench *b = (struct tapdisk_bench *)arg;
+
+	tapdisk_bench_poll_clear(b);
+	tapdisk_bench_reap(b);
+
+	if (!b->done && tapdisk_bench_now() - b->start_ns >=
+	    b->seconds * 1000000000ULL)
+		b->done = 1;
+
+	if (b->done) {
+		if (!b->inflight) {
+			b->end_ns = tapdisk_bench_now();
+			return;
+		}
+	} else
+		tapdisk_bench_queue(b);
+
+	tapdisk_vbd_poll_ring(b->vbd);
+	tapdisk_bench_poll(b);
+}
+
+static int
+tapdisk_bench_open_image(struct tapdisk_bench *b, const char *params,
+			 const char *path, int type)
+{
+	image_t image;
+	int err;
+
+	err = tapdisk_server_initialize();
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_initialize(b->id);
+	if (err)
+		goto out;
+
+	b->vbd = tapdisk_server_get_vbd(b->id);
+	if (!b->vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	err = tapdisk_vbd_parse_stack(b->vbd, params);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_open_vdi(b->vbd, path, type,
+				   TAPDISK_STORAGE_TYPE_DEFAULT,
+				   b->write_pct ? 0 : TD_OPEN_RDONLY);
+	if (err)
+		goto out;
+
+	b->vbd->reopened = 1;
+
+	err = tapdisk_vbd_get_image_info(b->vbd, &image);
+	if (err)
+		goto out;
+
+	b->secs = image.size;
+	if (b->secs < b->bs >> SECTOR_SHIFT) {
+		err = -EINVAL;
+		goto out;
+	}
+
+out:
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", path, err);
+	return err;
+}
+
+/*
+ * Set up the ring as the blktap device would, and the frontend's side of
+ * it.  The frontend's pages are the area the VBD expects the device to
+ * have mapped them in.
+ */
+static int
+tapdisk_bench_open_ring(struct tapdisk_bench *b)
+{
+	td_ring_t *ring;
+	int err, psize, nr_pages;
+
+	ring     = &b->vbd->ring;
+	psize    = getpagesize();
+	nr_pages = MAX_REQUESTS * BLKIF_MAX_SEGMENTS_PER_REQUEST;
+
+	err = posix_memalign((void **)&b->sring, psize, psize);
+	if (err)
+		return -err;
+
+	SHARED_RING_INIT(b->sring);
+	FRONT_RING_INIT(&b->front, b->sring, psize);
+
+	ring->sring = b->sring;
+	BACK_RING_INIT(&ring->fe_ring, b->sring, psize);
+
+	err = posix_memalign((void **)&b->data, psize, nr_pages * psize);
+	if (err)
+		return -err;
+
+	ring->vstart = (unsigned long)b->data;
+	tapdisk_server_register_buffer(b->data, nr_pages * psize);
+	return 0;
+}
+
+static int
+tapdisk_bench_open(struct tapdisk_bench *b, const char *params,
+		   const char *path, int type)
+{
+	int i, err;
+
+	err = tapdisk_bench_open_image(b, params, path, type);
+	if (err)
+		return err;
+
+	err = tapdisk_bench_open_ring(b);
+	if (err)
+		return err;
+
+	for (i = 0; i < b->depth; i++)
+		b->free_ids[b->nr_free++] = i;
+
+	if (pipe(b->pipe)) {
+		b->pipe[POLL_READ] = b->pipe[POLL_WRITE] = -1;
+		return -errno;
+	}
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    b->pipe[POLL_READ], 0,
+					    tapdisk_bench_event, b);
+	if (err < 0)
+		return err;
+
+	b->event_id = err;
+	return 0;
+}
+
+static void
+tapdisk_bench_close(struct tapdisk_bench *b)
+{
+	if (b->event_id)
+		tapdisk_server_unregister_event(b->event_id);
+	if (b->pipe[POLL_READ] != -1)
+		close(b->pipe[POLL_READ]);
+	if (b->pipe[POLL_WRITE] != -1)
+		close(b->pipe[POLL_WRITE]);
+
+	if (b->vbd) {
+		tapdisk_vbd_close_vdi(b->vbd);
+		if (!list_empty(&b->vbd->next))
+			tapdisk_server_remove_vbd(b->vbd);
+		free(b->vbd->name);
+		free(b->vbd);
+	}
+
+	if (b->data) {
+		tapdisk_server_unregister_buffer(b->data);
+		free(b->data);
+	}
+
+	free(b->sring);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, err, type, psize;
+	const char *params, *path;
+	struct tapdisk_bench bench;
+	struct tapdisk_bench *b = &bench;
+
+	memset(b, 0, sizeof(*b));
+	b->pipe[POLL_READ] = b->pipe[POLL_WRITE] = -1;
+	b->bs      = 4096;
+	b->depth   = MAX_REQUESTS;
+	b->seconds = 10;
+
+	err    = 0;
+	params = NULL;
+	psize  = getpagesize();
+
+	while ((c = getopt(argc, argv, "n:b:q:w:st:h")) != -1) {
+		switch (c) {
+		case 'n':
+			params = optarg;
+			break;
+		case 'b':
+			b->bs = atoi(optarg);
+			break;
+		case 'q':
+			b->depth = atoi(optarg);
+			break;
+		case 'w':
+			b->write_pct = atoi(optarg);
+			break;
+		case 's':
+			b->sequential = 1;
+			break;
+		case 't':
+			b->seconds = atoi(optarg);
+			break;
+		default:
+			err = EINVAL;
+		case 'h':
+			usage(argv[0], err);
+		}
+	}
+
+	if (!params ||
+	    b->bs <= 0 || b->bs % (1 << SECTOR_SHIFT) ||
+	    b->bs > BLKIF_MAX_SEGMENTS_PER_REQUEST * psize ||
+	    b->depth <= 0 || b->depth > MAX_REQUESTS ||
+	    b->write_pct < 0 || b->write_pct > 100 || b->seconds <= 0)
+		usage(argv[0], EINVAL);
+
+	type = tapdisk_disktype_parse_params(params, &path);
+	if (type < 0) {
+		err = type;
+		fprintf(stderr, "invalid argument %s: %d\n", params, err);
+		return -err;
+	}
+
+	tapdisk_start_logging("tapdisk-bench");
+	srandom(time(NULL));
+
+	err = tapdisk_bench_open(b, params, path, type);
+	if (err)
+		goto out;
+
+	b->start_ns = tapdisk_bench_now();
+	tapdisk_bench_poll(b);
+
+	while (!b->end_ns)
+		tapdisk_server_iterate();
+
+	tapdisk_bench_report(b, params);
+
+out:
+	tapdisk_bench_close(b);
+	tapdisk_stop_logging();
+	return -err;
+}
@@ -33,6 +33,12 @@
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef TAPDISK_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -262,9 +268,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -547,6 +553,602 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef TAPDISK_IO_URING
+/*
+ * io_uring
+ *
+ * Requests go to the kernel through the submission ring, one
+ * io_uring_enter(2) per batch, and complete on the completion ring.
+ * The ring fd polls readable while there are completions, so it's all
+ * the scheduler needs to watch; and completions are also taken after
+ * each submission, which under load saves most of the wakeups.
+ *
+ * Files and buffers registered with tapdisk_queue_register_file() and
+ * tapdisk_queue_register_buffer() are registered with the kernel too,
+ * saving it the fd lookup and the page pinning on each request.  If
+ * the kernel won't have them, requests go without.
+ */
+
+#define TAPDISK_URING_FILES     64
+#define TAPDISK_URING_BUFS      64
+
+struct uring {
+	int                   ring_fd;
+	int                   event_id;
+	int                   reaping;
+
+	unsigned             *sq_head;
+	unsigned             *sq_tail;
+	unsigned             *sq_mask;
+	struct io_uring_sqe  *sqes;
+
+	unsigned             *cq_head;
+	unsigned             *cq_tail;
+	unsigned             *cq_mask;
+	struct io_uring_cqe  *cqes;
+
+	void                 *sq_ring;
+	size_t                sq_ring_size;
+	void                 *cq_ring;
+	size_t                cq_ring_size;
+	size_t                sqes_size;
+
+	struct io_event      *aio_events;
+
+	/* fd registered in each slot, or -1; and the slot of each fd */
+	int                   files[TAPDISK_URING_FILES];
+	int                  *file_slots;
+	int                   nr_file_slots;
+
+	struct iovec          bufs[TAPDISK_URING_BUFS];
+	int                   nr_bufs;
+
+	int                   flags;
+};
+
+#define URING_FLAG_FILES        (1<<0)
+#define URING_FLAG_BUFS         (1<<1)
+
+static inline int
+__uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+__uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	if (uring->sq_ring)
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	uring->sqes    = NULL;
+	uring->cq_ring = NULL;
+	uring->sq_ring = NULL;
+
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+
+	free(uring->file_slots);
+	uring->file_slots    = NULL;
+	uring->nr_file_slots = 0;
+}
+
+static void *
+tapdisk_uring_map(struct uring *uring, size_t size, off_t off)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, uring->ring_fd, off);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static int
+tapdisk_uring_setup_ring(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	unsigned i, *sq_array;
+
+	memset(&p, 0, sizeof(p));
+
+	uring->ring_fd = __uring_setup(qlen, &p);
+	if (uring->ring_fd < 0)
+		return -errno;
+
+	uring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	uring->sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_size > uring->sq_ring_size)
+			uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = uring->sq_ring_size;
+	}
+
+	uring->sq_ring = tapdisk_uring_map(uring, uring->sq_ring_size,
+					   IORING_OFF_SQ_RING);
+	if (!uring->sq_ring)
+		return -errno;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_ring = uring->sq_ring;
+	else {
+		uring->cq_ring = tapdisk_uring_map(uring, uring->cq_ring_size,
+						   IORING_OFF_CQ_RING);
+		if (!uring->cq_ring)
+			return -errno;
+	}
+
+	uring->sqes = tapdisk_uring_map(uring, uring->sqes_size,
+					IORING_OFF_SQES);
+	if (!uring->sqes)
+		return -errno;
+
+	uring->sq_head = uring->sq_ring + p.sq_off.head;
+	uring->sq_tail = uring->sq_ring + p.sq_off.tail;
+	uring->sq_mask = uring->sq_ring + p.sq_off.ring_mask;
+	uring->cq_head = uring->cq_ring + p.cq_off.head;
+	uring->cq_tail = uring->cq_ring + p.cq_off.tail;
+	uring->cq_mask = uring->cq_ring + p.cq_off.ring_mask;
+	uring->cqes    = uring->cq_ring + p.cq_off.cqes;
+
+	/* sqes[i] always goes in slot i */
+	sq_array = uring->sq_ring + p.sq_off.array;
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	return 0;
+}
+
+/* Make sure the kernel has the plain and fixed read and write ops. */
+static int
+tapdisk_uring_probe(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	static const int ops[] = { IORING_OP_READ, IORING_OP_WRITE,
+				   IORING_OP_READ_FIXED,
+				   IORING_OP_WRITE_FIXED };
+	struct io_uring_probe *probe;
+	size_t size;
+	int i, err;
+
+	size  = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (!probe)
+		return -errno;
+
+	err = __uring_register(uring->ring_fd, IORING_REGISTER_PROBE,
+			       probe, 256);
+	if (err < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			err = -ENOSYS;
+			goto out;
+		}
+
+out:
+	free(probe);
+	return err;
+}
+
+static void
+tapdisk_uring_setup_files(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, err;
+
+	for (i = 0; i < TAPDISK_URING_FILES; i++)
+		uring->files[i] = -1;
+
+	/* A table of empty slots, for tapdisk_uring_register_file() */
+	err = __uring_register(uring->ring_fd, IORING_REGISTER_FILES,
+			       uring->files, TAPDISK_URING_FILES);
+	if (err < 0) {
+		DPRINTF("io_uring: no registered files: %d\n", -errno);
+		return;
+	}
+
+	uring->flags |= URING_FLAG_FILES;
+}
+
+static int
+tapdisk_uring_reap(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	unsigned head, tail;
+	int i, n, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	/* Completions may submit, which may reap */
+	if (uring->reaping)
+		return 0;
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (n = 0; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe;
+
+		cqe     = &uring->cqes[head & *uring->cq_mask];
+		ep      = uring->aio_events + n;
+		ep->obj = (struct iocb *)(uintptr_t)cqe->user_data;
+		ep->res = cqe->res;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+	if (!n)
+		return 0;
+
+	split = io_split(&queue->opioctx, uring->aio_events, n);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", n, split);
+
+	queue->iocbs_pending  -= n;
+	queue->tiocbs_pending -= split;
+
+	uring->reaping = 1;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	uring->reaping = 0;
+
+	queue_deferred_tiocbs(queue);
+
+	return split;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	tapdisk_uring_reap(private);
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_id = -1;
+
+	err = tapdisk_uring_setup_ring(queue, qlen);
+	if (err)
+		goto fail;
+
+	err = tapdisk_uring_probe(queue);
+	if (err)
+		goto fail;
+
+	tapdisk_uring_setup_files(queue);
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->ring_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_buf_index(struct uring *uring, const char *buf, size_t size)
+{
+	int i;
+
+	if (!(uring->flags & URING_FLAG_BUFS))
+		return -1;
+
+	for (i = 0; i < uring->nr_bufs; i++) {
+		const char *base = uring->bufs[i].iov_base;
+
+		if (buf >= base && buf + size <= base + uring->bufs[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+tapdisk_uring_prep_sqe(struct uring *uring, struct io_uring_sqe *sqe,
+		       struct iocb *iocb)
+{
+	int write = (iocb->aio_lio_opcode == IO_CMD_PWRITE);
+	int fd    = iocb->aio_fildes;
+	int buf;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd        = fd;
+	sqe->addr      = (unsigned long)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->user_data = (unsigned long)iocb;
+
+	if (fd < uring->nr_file_slots && uring->file_slots[fd] >= 0) {
+		sqe->fd     = uring->file_slots[fd];
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+
+	buf = tapdisk_uring_buf_index(uring, iocb->u.c.buf,
+				      iocb->u.c.nbytes);
+	if (buf >= 0) {
+		sqe->opcode    = write ?
+			IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = buf;
+	}
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned tail;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	/*
+	 * No more than queue->size iocbs are ever in flight, which the
+	 * rings have room for.
+	 */
+	tail = *uring->sq_tail;
+	for (i = 0; i < merged; i++, tail++)
+		tapdisk_uring_prep_sqe(uring,
+				       &uring->sqes[tail & *uring->sq_mask],
+				       queue->iocbs[i]);
+	__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = __uring_enter(uring->ring_fd, merged, 0, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/* Take back what the kernel didn't, to fail it below */
+	if (submitted < merged)
+		__atomic_store_n(uring->sq_tail, tail - (merged - submitted),
+				 __ATOMIC_RELEASE);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	tapdisk_uring_reap(queue);
+
+	return submitted;
+}
+
+static void
+tapdisk_uring_register_file(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_files_update up;
+	int slot, err;
+
+	if (!(uring->flags & URING_FLAG_FILES) || fd < 0)
+		return;
+
+	if (fd >= uring->nr_file_slots) {
+		int i, nr = fd + 1;
+		int *slots;
+
+		slots = realloc(uring->file_slots, nr * sizeof(*slots));
+		if (!slots)
+			return;
+
+		for (i = uring->nr_file_slots; i < nr; i++)
+			slots[i] = -1;
+
+		uring->file_slots    = slots;
+		uring->nr_file_slots = nr;
+	}
+
+	if (uring->file_slots[fd] >= 0)
+		return;
+
+	for (slot = 0; slot < TAPDISK_URING_FILES; slot++)
+		if (uring->files[slot] < 0)
+			break;
+	if (slot == TAPDISK_URING_FILES)
+		return;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds    = (unsigned long)&fd;
+
+	err = __uring_register(uring->ring_fd, IORING_REGISTER_FILES_UPDATE,
+			       &up, 1);
+	if (err < 0) {
+		DPRINTF("io_uring: failed to register fd %d: %d\n", fd, -errno);
+		return;
+	}
+
+	uring->files[slot]     = fd;
+	uring->file_slots[fd]  = slot;
+}
+
+static void
+tapdisk_uring_unregister_file(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_files_update up;
+	int slot, none = -1;
+
+	if (fd < 0 || fd >= uring->nr_file_slots)
+		return;
+
+	slot = uring->file_slots[fd];
+	if (slot < 0)
+		return;
+
+	/* The kernel lets go of the file once requests on it are done */
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds    = (unsigned long)&none;
+
+	if (__uring_register(uring->ring_fd, IORING_REGISTER_FILES_UPDATE,
+			     &up, 1) < 0)
+		DPRINTF("io_uring: failed to unregister fd %d: %d\n",
+			fd, -errno);
+
+	uring->files[slot]    = -1;
+	uring->file_slots[fd] = -1;
+}
+
+/*
+ * Buffers can only be registered all at once, so the whole table goes
+ * again each time it changes.  That waits for requests in flight, which
+ * is why buffers are only registered when their pool is set up or torn
+ * down.
+ */
+static void
+tapdisk_uring_update_bufs(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int err;
+
+	if (uring->flags & URING_FLAG_BUFS) {
+		__uring_register(uring->ring_fd, IORING_UNREGISTER_BUFFERS,
+				 NULL, 0);
+		uring->flags &= ~URING_FLAG_BUFS;
+	}
+
+	if (!uring->nr_bufs)
+		return;
+
+	err = __uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS,
+			       uring->bufs, uring->nr_bufs);
+	if (err < 0) {
+		DPRINTF("io_uring: no registered buffers: %d\n", -errno);
+		return;
+	}
+
+	uring->flags |= URING_FLAG_BUFS;
+}
+
+static void
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (uring->nr_bufs == TAPDISK_URING_BUFS)
+		return;
+
+	uring->bufs[uring->nr_bufs].iov_base = buf;
+	uring->bufs[uring->nr_bufs].iov_len  = size;
+	uring->nr_bufs++;
+
+	tapdisk_uring_update_bufs(queue);
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *uring = queue->tio_data;
+	int i;
+
+	for (i = 0; i < uring->nr_bufs; i++)
+		if (uring->bufs[i].iov_base == buf)
+			break;
+	if (i == uring->nr_bufs)
+		return;
+
+	memmove(uring->bufs + i, uring->bufs + i + 1,
+		(uring->nr_bufs - i - 1) * sizeof(uring->bufs[0]));
+	uring->nr_bufs--;
+
+	tapdisk_uring_update_bufs(queue);
+}
+
+static const struct tio td_tio_uring = {
+	.name                   = "uring",
+	.data_size              = sizeof(struct uring),
+	.tio_setup              = tapdisk_uring_setup,
+	.tio_destroy            = tapdisk_uring_destroy,
+	.tio_submit             = tapdisk_uring_submit,
+	.tio_register_file      = tapdisk_uring_register_file,
+	.tio_unregister_file    = tapdisk_uring_unregister_file,
+	.tio_register_buffer    = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer  = tapdisk_uring_unregister_buffer,
+};
+#endif /* TAPDISK_IO_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1177,14 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+	case TIO_DRV_URING:
+#ifdef TAPDISK_IO_URING
+		tio = &td_tio_uring;
+		break;
+#else
+		DPRINTF("I/O queue driver uring not built in, using lio\n");
+		return tapdisk_queue_init_io(queue, TIO_DRV_LIO);
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -591,6 +1201,13 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 
 	if (tio->tio_setup) {
 		err = tio->tio_setup(queue, queue->size);
+		if (err && drv == TIO_DRV_URING) {
+			/* Older kernels, or io_uring disabled */
+			DPRINTF("I/O queue driver %s unavailable (%d), "
+				"using lio\n", tio->name, err);
+			tapdisk_queue_free_io(queue);
+			return tapdisk_queue_init_io(queue, TIO_DRV_LIO);
+		}
 		if (err)
 			goto fail;
 	}
@@ -604,6 +1221,19 @@ fail:
 	return err;
 }
 
+int
+tapdisk_queue_driver(const char *name)
+{
+	if (!strcmp(name, "lio"))
+		return TIO_DRV_LIO;
+	if (!strcmp(name, "rwio"))
+		return TIO_DRV_RWIO;
+	if (!strcmp(name, "uring"))
+		return TIO_DRV_URING;
+
+	return -EINVAL;
+}
+
 int
 tapdisk_init_queue(struct tqueue *queue, int size,
 		   int drv, struct tfilter *filter)
@@ -690,6 +1320,34 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->next = NULL;
 }
 
+void
+tapdisk_queue_register_file(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_register_file)
+		queue->tio->tio_register_file(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_file(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_file)
+		queue->tio->tio_unregister_file(queue, fd);
+}
+
+void
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (queue->tio && queue->tio->tio_register_buffer)
+		queue->tio->tio_register_buffer(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
@@ -91,11 +91,19 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional, see tapdisk_queue_register_file */
+	void (*tio_register_file)     (struct tqueue *queue, int fd);
+	void (*tio_unregister_file)   (struct tqueue *queue, int fd);
+	void (*tio_register_buffer)   (struct tqueue *queue,
+				       void *buf, size_t size);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *buf);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3, /* falls back to lio if unavailable */
 };
 
 /*
@@ -111,6 +119,7 @@ enum {
 #define tapdisk_queue_empty(q) ((q)->queued == 0)
 #define tapdisk_queue_full(q)  \
 	(((q)->tiocbs_pending + (q)->queued) >= (q)->size)
+int tapdisk_queue_driver(const char *name);
 int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
 void tapdisk_debug_queue(struct tqueue *);
@@ -122,4 +131,18 @@ int tapdisk_cancel_all_tiocbs(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
 
+/*
+ * Hints that I/O will go to fd, or to buffers in [buf, buf + size), for
+ * as long as they stay registered, which drivers may set up in advance
+ * (uring).  A file must be unregistered before it is closed, and a
+ * buffer before it is unmapped.  Buffers must be memory tapdisk owns and
+ * keeps mapped: not the blktap mmap area, whose pages the kernel swaps in
+ * and out per request.  (Un)registering a buffer may wait for the I/O in
+ * flight, so it belongs in setup and teardown, not on the I/O path.
+ */
+void tapdisk_queue_register_file(struct tqueue *, int fd);
+void tapdisk_queue_unregister_file(struct tqueue *, int fd);
+void tapdisk_queue_register_buffer(struct tqueue *, void *buf, size_t size);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *buf);
+
 #endif
@@ -101,6 +101,30 @@ tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
 }
 
+void
+tapdisk_server_register_file(int fd)
+{
+	tapdisk_queue_register_file(&server.aio_queue, fd);
+}
+
+void
+tapdisk_server_unregister_file(int fd)
+{
+	tapdisk_queue_unregister_file(&server.aio_queue, fd);
+}
+
+void
+tapdisk_server_register_buffer(void *buf, size_t size)
+{
+	tapdisk_queue_register_buffer(&server.aio_queue, buf, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&server.aio_queue, buf);
+}
+
 void
 tapdisk_server_debug(void)
 {
@@ -208,8 +232,21 @@ tapdisk_server_stop_vbds(void)
 static int
 tapdisk_server_init_aio(void)
 {
+	const char *name;
+	int drv = TIO_DRV_LIO;
+
+	/* lio, rwio or uring */
+	name = getenv("TAPDISK2_QUEUE_DRIVER");
+	if (name) {
+		drv = tapdisk_queue_driver(name);
+		if (drv < 0) {
+			EPRINTF("unknown I/O queue driver %s\n", name);
+			drv = TIO_DRV_LIO;
+		}
+	}
+
 	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+				  drv, NULL);
 }
 
 static void
@@ -283,9 +320,7 @@ tapdisk_server_init(void)
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
 
-	scheduler_initialize(&server.scheduler);
-
-	return 0;
+	return scheduler_initialize(&server.scheduler);
 }
 
 int
@@ -311,7 +346,9 @@ tapdisk_server_initialize(void)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		return err;
 
 	err = tapdisk_server_complete();
 	if (err)
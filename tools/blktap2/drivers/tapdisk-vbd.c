@@ -1702,6 +1702,17 @@ tapdisk_vbd_check_ring_message(td_vbd_t *vbd)
 	}
 }
 
+/*
+ * Take in and issue what the frontend put on the ring.  Besides the ring
+ * event, for in-process frontends that have no device to notify us.
+ */
+void
+tapdisk_vbd_poll_ring(td_vbd_t *vbd)
+{
+	tapdisk_vbd_pull_ring_requests(vbd);
+	tapdisk_vbd_issue_requests(vbd);
+}
+
 static void
 tapdisk_vbd_ring_event(event_id_t id, char mode, void *private)
 {
@@ -1709,8 +1720,7 @@ tapdisk_vbd_ring_event(event_id_t id, char mode, void *private)
 
 	vbd = (td_vbd_t *)private;
 
-	tapdisk_vbd_pull_ring_requests(vbd);
-	tapdisk_vbd_issue_requests(vbd);
+	tapdisk_vbd_poll_ring(vbd);
 
 	/* vbd may be destroyed after this call */
 	tapdisk_vbd_check_ring_message(vbd);
@@ -28,10 +28,81 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <libaio.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
 
+#define VHD_COALESCE_DEPTH        8
+#define VHD_COALESCE_MAX_DEPTH    64
+#define VHD_COALESCE_BAT_BATCH    512   /* new parent blocks per BAT write */
+
+/*
+ * Blocks are copied through a pipeline of up to 'depth' requests.  A
+ * request reads a whole child block, bitmap and data in one go; blocks
+ * with nothing in them stop there.  A fully populated block, or one new
+ * to the parent, is written in one go; otherwise the parent block is
+ * read, the child sectors merged in, and written back.  Parent blocks
+ * are allocated in memory, and the BAT entries written in batches once
+ * their data is on disk.  The trailing footer, which the new blocks
+ * overwrite, is rewritten at the end.
+ */
+
+enum {
+	VHD_COALESCE_READ_CHILD,
+	VHD_COALESCE_READ_PARENT,
+	VHD_COALESCE_WRITE_PARENT,
+};
+
+struct vhd_coalesce;
+
+struct vhd_coalesce_request {
+	struct iocb               iocb;
+	struct vhd_coalesce      *c;
+	int                       state;
+	uint32_t                  block;
+	char                     *buf;        /* child bitmap + data */
+	char                     *pbuf;       /* parent bitmap + data */
+	char                     *map;        /* child bitmap */
+	uint64_t                  pblk;       /* parent sector of block */
+	int                       new_block;
+	int                       full;       /* parent block becomes full */
+};
+
+struct vhd_coalesce {
+	vhd_context_t            *vhd;
+	vhd_context_t            *parent;     /* NULL if raw */
+	int                       parent_fd;
+
+	io_context_t              aio;
+	int                       depth;
+	int                       busy;
+	int                       err;
+	struct vhd_coalesce_request *reqs;
+	struct io_event          *events;
+
+	uint32_t                 *blocks;     /* allocated, in file order */
+	uint32_t                  nr_blocks;
+	uint32_t                  next;
+
+	uint64_t                  bm_bytes;
+	uint64_t                  blk_bytes;
+	uint64_t                  end;        /* next free parent sector */
+	uint32_t                  bat_lo, bat_hi;
+	int                       bat_dirty;
+	int                       batmap_dirty;
+
+	int                       progress;
+	struct timeval            start, last;
+	uint32_t                  done;
+	uint32_t                  skipped;
+	uint64_t                  bytes_read;
+	uint64_t                  bytes_written;
+	uint64_t                  bat_writes;
+};
+
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 {
@@ -123,35 +194,569 @@ done:
 	return err;
 }
 
+static double
+vhd_coalesce_elapsed(struct timeval *since)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since->tv_sec) +
+		(now.tv_usec - since->tv_usec) / 1000000.0;
+}
+
+static void
+vhd_coalesce_report(struct vhd_coalesce *c)
+{
+	if (!c->progress || vhd_coalesce_elapsed(&c->last) < 1.0)
+		return;
+
+	gettimeofday(&c->last, NULL);
+	printf("coalesced %u/%u blocks (%u%%), %.1f MB/s\n",
+	       c->done, c->nr_blocks,
+	       (unsigned int)(c->nr_blocks ?
+			      (uint64_t)c->done * 100 / c->nr_blocks : 100),
+	       c->bytes_written / 1048576.0 / vhd_coalesce_elapsed(&c->start));
+	fflush(stdout);
+}
+
+static void
+vhd_coalesce_summary(struct vhd_coalesce *c)
+{
+	double secs;
+
+	if (!c->progress)
+		return;
+
+	secs = vhd_coalesce_elapsed(&c->start);
+	printf("coalesced %u blocks (%u empty) in %.1fs: "
+	       "read %.1f MB, wrote %.1f MB, %.1f MB/s, %"PRIu64" BAT writes\n",
+	       c->done, c->skipped, secs,
+	       c->bytes_read / 1048576.0, c->bytes_written / 1048576.0,
+	       secs > 0 ? c->bytes_written / 1048576.0 / secs : 0.0,
+	       c->bat_writes);
+}
+
+static int
+vhd_coalesce_block_cmp(const void *a, const void *b, void *arg)
+{
+	vhd_context_t *vhd = arg;
+	uint32_t x = vhd->bat.bat[*(const uint32_t *)a];
+	uint32_t y = vhd->bat.bat[*(const uint32_t *)b];
+
+	return (x > y) - (x < y);
+}
+
+static int
+vhd_coalesce_submit(struct vhd_coalesce_request *req, int write,
+		    int fd, char *buf, uint64_t sec, size_t size)
+{
+	struct iocb *iocb = &req->iocb;
+	int err;
+
+	if (write)
+		io_prep_pwrite(iocb, fd, buf, size, vhd_sectors_to_bytes(sec));
+	else
+		io_prep_pread(iocb, fd, buf, size, vhd_sectors_to_bytes(sec));
+	iocb->data = req;
+
+	err = io_submit(req->c->aio, 1, &iocb);
+	if (err != 1)
+		return (err < 0 ? err : -EIO);
+
+	req->c->busy++;
+	return 0;
+}
+
+/*
+ * Reserve room for a new parent block, with the data page aligned
+ * as libvhd does.  The BAT entry is only set once the block is written.
+ */
+static int
+vhd_coalesce_allocate(struct vhd_coalesce *c, uint64_t *blk)
+{
+	vhd_context_t *parent = c->parent;
+	int err, gap, spp;
+	char *zero;
+
+	spp = getpagesize() >> VHD_SECTOR_SHIFT;
+	gap = 0;
+
+	if ((c->end + parent->bm_secs) % spp)
+		gap = spp - ((c->end + parent->bm_secs) % spp);
+
+	if (gap) {
+		err = posix_memalign((void **)&zero, VHD_SECTOR_SIZE,
+				     vhd_sectors_to_bytes(gap));
+		if (err)
+			return -err;
+
+		memset(zero, 0, vhd_sectors_to_bytes(gap));
+		err = pwrite(parent->fd, zero, vhd_sectors_to_bytes(gap),
+			     vhd_sectors_to_bytes(c->end));
+		free(zero);
+		if (err != vhd_sectors_to_bytes(gap))
+			return (err == -1 ? -errno : -EIO);
+
+		c->end += gap;
+	}
+
+	*blk    = c->end;
+	c->end += parent->bm_secs + parent->spb;
+
+	return 0;
+}
+
+/*
+ * Writes the sectors of the parent BAT that new blocks went into.
+ */
+static int
+vhd_coalesce_write_bat(struct vhd_coalesce *c)
+{
+	vhd_context_t *parent = c->parent;
+	uint32_t i, first, count, per_sec;
+	uint32_t *bat;
+	size_t size;
+	int err;
+
+	if (!c->bat_dirty)
+		return 0;
+
+	per_sec = VHD_SECTOR_SIZE / sizeof(uint32_t);
+	first   = c->bat_lo / per_sec * per_sec;
+	count   = c->bat_hi - first;
+	size    = vhd_bytes_padded(count * sizeof(uint32_t));
+
+	err = posix_memalign((void **)&bat, VHD_SECTOR_SIZE, size);
+	if (err)
+		return -err;
+
+	memset(bat, 0, size);
+	memcpy(bat, parent->bat.bat + first,
+	       MIN(size, (parent->bat.entries - first) * sizeof(uint32_t)));
+	for (i = 0; i < size / sizeof(uint32_t); i++)
+		BE32_OUT(&bat[i]);
+
+	err = pwrite(parent->fd, bat, size, parent->header.table_offset +
+		     (uint64_t)first * sizeof(uint32_t));
+	free(bat);
+	if (err != size)
+		return (err == -1 ? -errno : -EIO);
+
+	c->bat_writes++;
+	c->bat_dirty = 0;
+	c->bat_lo    = parent->bat.entries;
+	c->bat_hi    = 0;
+
+	return 0;
+}
+
+static int
+vhd_coalesce_start(struct vhd_coalesce_request *req, uint32_t block)
+{
+	struct vhd_coalesce *c = req->c;
+
+	req->block     = block;
+	req->state     = VHD_COALESCE_READ_CHILD;
+	req->new_block = 0;
+	req->full      = 0;
+
+	return vhd_coalesce_submit(req, 0, c->vhd->fd, req->buf,
+				   c->vhd->bat.bat[block],
+				   c->bm_bytes + c->blk_bytes);
+}
+
+static int
+vhd_coalesce_next(struct vhd_coalesce_request *req)
+{
+	struct vhd_coalesce *c = req->c;
+
+	if (c->err || c->next >= c->nr_blocks)
+		return 0;
+
+	return vhd_coalesce_start(req, c->blocks[c->next++]);
+}
+
+/*
+ * Copy the child sectors of the block over the parent's data, and mark
+ * them in the parent bitmap.
+ */
+static void
+vhd_coalesce_merge(struct vhd_coalesce_request *req)
+{
+	struct vhd_coalesce *c = req->c;
+	vhd_context_t *vhd = c->vhd;
+	uint64_t pbm_bytes;
+	uint32_t i;
+
+	pbm_bytes = c->parent ? c->bm_bytes : 0;
+	req->full = 1;
+
+	for (i = 0; i < vhd->spb; i++) {
+		if (vhd_bitmap_test(vhd, req->map, i)) {
+			memcpy(req->pbuf + pbm_bytes + vhd_sectors_to_bytes(i),
+			       req->buf + c->bm_bytes + vhd_sectors_to_bytes(i),
+			       VHD_SECTOR_SIZE);
+			if (c->parent)
+				vhd_bitmap_set(c->parent, req->pbuf, i);
+		}
+
+		if (c->parent && !vhd_bitmap_test(c->parent, req->pbuf, i))
+			req->full = 0;
+	}
+}
+
+static int
+vhd_coalesce_child_read(struct vhd_coalesce_request *req)
+{
+	struct vhd_coalesce *c = req->c;
+	vhd_context_t *vhd = c->vhd;
+	uint32_t i, set;
+	uint64_t secs;
+	char *data;
+	int err;
+
+	c->bytes_read += c->bm_bytes + c->blk_bytes;
+
+	memcpy(req->map, req->buf, c->bm_bytes);
+	if (vhd_has_batmap(vhd) &&
+	    vhd_batmap_test(vhd, &vhd->batmap, req->block))
+		set = vhd->spb;
+	else
+		for (i = 0, set = 0; i < vhd->spb; i++)
+			if (vhd_bitmap_test(vhd, req->map, i))
+				set++;
+
+	if (!set) {
+		c->skipped++;
+		c->done++;
+		return vhd_coalesce_next(req);
+	}
+
+	if (set == vhd->spb)
+		for (i = 0; i < vhd->spb; i++)
+			vhd_bitmap_set(vhd, req->map, i);
+
+	data = req->buf + c->bm_bytes;
+
+	if (!c->parent) {
+		secs = vhd->footer.curr_size >> VHD_SECTOR_SHIFT;
+		req->pblk = (uint64_t)req->block * vhd->spb;
+		secs = MIN(secs - req->pblk, vhd->spb);
+
+		if (set == vhd->spb) {
+			req->state = VHD_COALESCE_WRITE_PARENT;
+			return vhd_coalesce_submit(req, 1, c->parent_fd, data,
+						   req->pblk,
+						   vhd_sectors_to_bytes(secs));
+		}
+
+		req->state = VHD_COALESCE_READ_PARENT;
+		return vhd_coalesce_submit(req, 0, c->parent_fd, req->pbuf,
+					   req->pblk,
+					   vhd_sectors_to_bytes(secs));
+	}
+
+	req->pblk = c->parent->bat.bat[req->block];
+
+	if (req->pblk == DD_BLK_UNUSED || set == vhd->spb) {
+		/* the child's sectors are all the parent block will hold */
+		if (req->pblk == DD_BLK_UNUSED) {
+			err = vhd_coalesce_allocate(c, &req->pblk);
+			if (err)
+				return err;
+			req->new_block = 1;
+		}
+
+		memset(req->buf, 0, c->bm_bytes);
+		for (i = 0; i < vhd->spb; i++) {
+			if (vhd_bitmap_test(vhd, req->map, i))
+				vhd_bitmap_set(c->parent, req->buf, i);
+			else
+				memset(data + vhd_sectors_to_bytes(i), 0,
+				       VHD_SECTOR_SIZE);
+		}
+
+		req->full  = (set == vhd->spb);
+		req->state = VHD_COALESCE_WRITE_PARENT;
+		return vhd_coalesce_submit(req, 1, c->parent->fd, req->buf,
+					   req->pblk,
+					   c->bm_bytes + c->blk_bytes);
+	}
+
+	req->state = VHD_COALESCE_READ_PARENT;
+	return vhd_coalesce_submit(req, 0, c->parent->fd, req->pbuf,
+				   req->pblk, c->bm_bytes + c->blk_bytes);
+}
+
+static int
+vhd_coalesce_parent_read(struct vhd_coalesce_request *req)
+{
+	struct vhd_coalesce *c = req->c;
+	int fd;
+
+	c->bytes_read += req->iocb.u.c.nbytes;
+
+	vhd_coalesce_merge(req);
+
+	fd = (c->parent ? c->parent->fd : c->parent_fd);
+	req->state = VHD_COALESCE_WRITE_PARENT;
+	return vhd_coalesce_submit(req, 1, fd, req->pbuf, req->pblk,
+				   req->iocb.u.c.nbytes);
+}
+
+static int
+vhd_coalesce_parent_written(struct vhd_coalesce_request *req)
+{
+	struct vhd_coalesce *c = req->c;
+	vhd_context_t *parent = c->parent;
+	int err;
+
+	c->bytes_written += req->iocb.u.c.nbytes;
+	c->done++;
+
+	if (req->new_block) {
+		parent->bat.bat[req->block] = req->pblk;
+		c->bat_lo = MIN(c->bat_lo, req->block);
+		c->bat_hi = MAX(c->bat_hi, req->block + 1);
+		c->bat_dirty++;
+	}
+
+	if (parent && req->full && vhd_has_batmap(parent) &&
+	    !vhd_batmap_test(parent, &parent->batmap, req->block)) {
+		vhd_batmap_set(parent, &parent->batmap, req->block);
+		c->batmap_dirty = 1;
+	}
+
+	if (c->bat_dirty >= VHD_COALESCE_BAT_BATCH) {
+		err = vhd_coalesce_write_bat(c);
+		if (err)
+			return err;
+	}
+
+	vhd_coalesce_report(c);
+
+	return vhd_coalesce_next(req);
+}
+
+static int
+vhd_coalesce_complete(struct vhd_coalesce_request *req, long res)
+{
+	if (res < 0)
+		return res;
+	if (res != req->iocb.u.c.nbytes)
+		return -EIO;
+
+	switch (req->state) {
+	case VHD_COALESCE_READ_CHILD:
+		return vhd_coalesce_child_read(req);
+	case VHD_COALESCE_READ_PARENT:
+		return vhd_coalesce_parent_read(req);
+	case VHD_COALESCE_WRITE_PARENT:
+		return vhd_coalesce_parent_written(req);
+	}
+
+	return -EINVAL;
+}
+
+static void
+vhd_coalesce_free(struct vhd_coalesce *c)
+{
+	int i;
+
+	if (c->reqs)
+		for (i = 0; i < c->depth; i++) {
+			free(c->reqs[i].buf);
+			free(c->reqs[i].pbuf);
+			free(c->reqs[i].map);
+		}
+
+	if (c->aio)
+		io_destroy(c->aio);
+
+	free(c->reqs);
+	free(c->events);
+	free(c->blocks);
+}
+
+static int
+vhd_coalesce_init(struct vhd_coalesce *c, vhd_context_t *vhd,
+		  vhd_context_t *parent, int parent_fd, int depth, int progress)
+{
+	struct vhd_coalesce_request *req;
+	uint32_t i;
+	off_t end;
+	int err;
+
+	memset(c, 0, sizeof(*c));
+	c->vhd       = vhd;
+	c->parent    = parent;
+	c->parent_fd = parent_fd;
+	c->depth     = depth;
+	c->progress  = progress;
+	c->bm_bytes  = vhd_sectors_to_bytes(vhd->bm_secs);
+	c->blk_bytes = vhd_sectors_to_bytes(vhd->spb);
+
+	if (parent) {
+		err = vhd_end_of_data(parent, &end);
+		if (err)
+			return err;
+
+		c->end    = end >> VHD_SECTOR_SHIFT;
+		c->bat_lo = parent->bat.entries;
+	}
+
+	c->blocks = calloc(vhd->bat.entries, sizeof(uint32_t));
+	if (!c->blocks)
+		return -ENOMEM;
+
+	for (i = 0; i < vhd->bat.entries; i++)
+		if (vhd->bat.bat[i] != DD_BLK_UNUSED)
+			c->blocks[c->nr_blocks++] = i;
+
+	/* read the child front to back */
+	qsort_r(c->blocks, c->nr_blocks, sizeof(uint32_t),
+		vhd_coalesce_block_cmp, vhd);
+
+	c->reqs   = calloc(depth, sizeof(struct vhd_coalesce_request));
+	c->events = calloc(depth, sizeof(struct io_event));
+	if (!c->reqs || !c->events)
+		return -ENOMEM;
+
+	for (i = 0; i < depth; i++) {
+		req    = c->reqs + i;
+		req->c = c;
+
+		if (posix_memalign((void **)&req->buf, 4096,
+				   c->bm_bytes + c->blk_bytes) ||
+		    posix_memalign((void **)&req->pbuf, 4096,
+				   c->bm_bytes + c->blk_bytes) ||
+		    !(req->map = malloc(c->bm_bytes)))
+			return -ENOMEM;
+	}
+
+	err = io_setup(depth, &c->aio);
+	if (err) {
+		c->aio = NULL;
+		return err;
+	}
+
+	gettimeofday(&c->start, NULL);
+	c->last = c->start;
+
+	return 0;
+}
+
+static int
+vhd_coalesce_run(struct vhd_coalesce *c)
+{
+	struct vhd_coalesce_request *req;
+	int i, n, err;
+
+	for (i = 0; i < c->depth && !c->err; i++) {
+		err = vhd_coalesce_next(c->reqs + i);
+		if (err)
+			c->err = err;
+	}
+
+	while (c->busy) {
+		n = io_getevents(c->aio, 1, c->depth, c->events, NULL);
+		if (n < 0) {
+			if (n == -EINTR)
+				continue;
+			return n;
+		}
+
+		for (i = 0; i < n; i++) {
+			req = c->events[i].data;
+			c->busy--;
+
+			err = vhd_coalesce_complete(req, (long)c->events[i].res);
+			if (err && !c->err) {
+				printf("error coalescing block 0x%x: %d\n",
+				       req->block, err);
+				c->err = err;
+			}
+		}
+	}
+
+	if (c->parent) {
+		err = vhd_coalesce_write_bat(c);
+		if (err && !c->err)
+			c->err = err;
+
+		if (c->batmap_dirty) {
+			err = vhd_write_batmap(c->parent, &c->parent->batmap);
+			if (err && !c->err)
+				c->err = err;
+		}
+
+		if (c->bat_writes) {
+			err = vhd_write_footer(c->parent, &c->parent->footer);
+			if (err && !c->err)
+				c->err = err;
+		}
+	}
+
+	if (!c->err)
+		vhd_coalesce_summary(c);
+
+	return c->err;
+}
+
+/*
+ * Only a dynamic parent with the child's block size lines up block for
+ * block; anything else goes through vhd_io_write a block at a time.
+ */
+static int
+vhd_coalesce_aligned(vhd_context_t *vhd, vhd_context_t *parent)
+{
+	if (!parent->file)
+		return 1;
+
+	return (vhd_type_dynamic(parent) &&
+		parent->spb == vhd->spb &&
+		parent->bm_secs == vhd->bm_secs);
+}
+
 int
 vhd_util_coalesce(int argc, char **argv)
 {
-	int err, c;
+	int err, c, depth, progress;
 	uint64_t i;
 	char *name, *pname;
 	vhd_context_t vhd, parent;
+	struct vhd_coalesce co;
 	int parent_fd = -1;
 
-	name  = NULL;
-	pname = NULL;
+	name     = NULL;
+	pname    = NULL;
+	depth    = VHD_COALESCE_DEPTH;
+	progress = 0;
 	parent.file = NULL;
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:q:ph")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
 			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'p':
+			progress = 1;
+			break;
 		case 'h':
 		default:
 			goto usage;
 		}
 	}
 
-	if (!name || optind != argc)
+	if (!name || optind != argc ||
+	    depth < 1 || depth > VHD_COALESCE_MAX_DEPTH)
 		goto usage;
 
 	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
@@ -195,6 +800,28 @@ vhd_util_coalesce(int argc, char **argv)
 			goto done;
 	}
 
+	if (parent.file) {
+		err = vhd_get_bat(&parent);
+		if (err)
+			goto done;
+
+		if (vhd_has_batmap(&parent)) {
+			err = vhd_get_batmap(&parent);
+			if (err)
+				goto done;
+		}
+	}
+
+	if (vhd_coalesce_aligned(&vhd, &parent)) {
+		err = vhd_coalesce_init(&co, &vhd,
+					parent.file ? &parent : NULL,
+					parent_fd, depth, progress);
+		if (!err)
+			err = vhd_coalesce_run(&co);
+		vhd_coalesce_free(&co);
+		goto done;
+	}
+
 	for (i = 0; i < vhd.bat.entries; i++) {
 		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
 		if (err)
@@ -213,6 +840,7 @@ vhd_util_coalesce(int argc, char **argv)
 	return err;
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-q queue depth] [-p progress] "
+	       "[-h help]\n");
 	return -EINVAL;
 }
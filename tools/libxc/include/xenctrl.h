@@ -1533,6 +1533,18 @@ int xc_tbuf_set_cpu_mask(xc_interface *xch, xc_cpumap_t mask);
 
 int xc_tbuf_set_evt_mask(xc_interface *xch, uint32_t mask);
 
+/**
+ * This function times the writing of trace records by Xen: it writes
+ * records TRC_TRACE_BENCH records into the trace buffer of whichever cpu
+ * handles the call.  Tracing must be enabled.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm records the number of records to write
+ * @parm cycles will contain the cycles it took
+ * @return 0 on success, -1 on failure.
+ */
+int xc_tbuf_bench(xc_interface *xch, uint32_t records, uint64_t *cycles);
+
 int xc_domctl(xc_interface *xch, struct xen_domctl *domctl);
 int xc_sysctl(xc_interface *xch, struct xen_sysctl *sysctl);
 
@@ -29,6 +29,9 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+#define XCFLAGS_STREAM_COMPRESS        (1 << 5)
+#define XCFLAGS_AUTO_CONVERGE          (1 << 6)
+#define XCFLAGS_POSTCOPY               (1 << 7)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -90,6 +93,12 @@ typedef enum {
     XC_MIG_STREAM_COLO,
 } xc_migration_stream_t;
 
+/* Upper bound of the nr_workers parameter of xc_domain_save. */
+#define XC_SAVE_MAX_WORKERS 16
+
+/* Downtime aimed for by a live xc_domain_save if none is given. */
+#define XC_SAVE_DEFAULT_DOWNTIME_MS 300
+
 /**
  * This function will save a running domain.
  *
@@ -98,12 +107,24 @@ typedef enum {
  * @parm dom the id of the domain
  * @param stream_type XC_MIG_STREAM_NONE if the far end of the stream
  *        doesn't use checkpointing
+ * @param nr_workers number of threads mapping and preparing memory for the
+ *        stream in parallel, with another one writing it; 0 to send memory
+ *        from the calling thread only
+ * @param max_downtime_ms downtime of the guest targeted by a live save: the
+ *        live phase ends once the remaining dirty memory is estimated to be
+ *        sent within it; 0 for XC_SAVE_DEFAULT_DOWNTIME_MS.  With
+ *        XCFLAGS_AUTO_CONVERGE, a guest dirtying memory too quickly to get
+ *        there has its vCPUs throttled until it does.  With XCFLAGS_POSTCOPY
+ *        (HVM only), memory which can't be sent within it at the end of the
+ *        live phase is sent after the guest has been resumed on the far end,
+ *        serving the page requests it writes to recv_fd first.
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags /* XCFLAGS_xxx */,
                    struct save_callbacks* callbacks, int hvm,
-                   xc_migration_stream_t stream_type, int recv_fd);
+                   xc_migration_stream_t stream_type, int recv_fd,
+                   unsigned int nr_workers, unsigned int max_downtime_ms);
 
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
@@ -111,7 +132,8 @@ struct restore_callbacks {
      */
     int (*suspend)(void* data);
 
-    /* Called after the secondary vm is ready to resume.
+    /* Called after the secondary vm is ready to resume, or, with a post-copy
+     * stream, once the guest can run while the rest of its memory arrives.
      * Callback function resumes the guest & the device model,
      * returns to xc_domain_restore.
      */
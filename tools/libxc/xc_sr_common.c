@@ -36,6 +36,11 @@ static const char *mandatory_rec_types[] =
     [REC_TYPE_VERIFY]                       = "Verify",
     [REC_TYPE_CHECKPOINT]                   = "Checkpoint",
     [REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST]    = "Checkpoint dirty pfn list",
+    [REC_TYPE_ZERO_PAGES]                   = "Zero pages",
+    [REC_TYPE_COMPRESSED_PAGE_DATA]         = "Compressed page data",
+    [REC_TYPE_POSTCOPY_PFNS]                = "Post-copy pfns",
+    [REC_TYPE_POSTCOPY_TRANSITION]          = "Post-copy transition",
+    [REC_TYPE_POSTCOPY_PAGE_REQUEST]        = "Post-copy page request",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -3,6 +3,9 @@
 
 #include <stdbool.h>
 
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
+
 #include "xg_private.h"
 #include "xg_save_restore.h"
 #include "xc_dom.h"
@@ -10,6 +13,9 @@
 
 #include "xc_sr_stream_format.h"
 
+/* LZ4 for COMPRESSED_PAGE_DATA records, see xc_sr_compress_lz4.c. */
+#include "../../xen/include/xen/lz4.h"
+
 /* String representation of Domain Header types. */
 const char *dhdr_type_to_str(uint32_t type);
 
@@ -18,6 +24,8 @@ const char *rec_type_to_str(uint32_t type);
 
 struct xc_sr_context;
 struct xc_sr_record;
+struct xc_sr_save_batch;
+struct xc_sr_save_pipeline;
 
 /**
  * Save operations.  To be implemented for each type of guest, for use by the
@@ -201,11 +209,42 @@ struct xc_sr_context
             /* Parameters for tweaking live migration. */
             unsigned max_iterations;
             unsigned dirty_threshold;
+            unsigned max_downtime_ms;
+            bool auto_converge;
+
+            /*
+             * Downtime estimated in the live phase, in ms, and how far the
+             * guest is throttled to get there: the percentage of its CPU time
+             * taken away, and its scheduling parameters from beforehand.
+             */
+            unsigned long downtime_ms;
+            unsigned throttle;
+            struct xen_domctl_sched_credit sched;
+
+            /*
+             * Post-copy: if the pages left at the end of the live phase
+             * can't be sent within the downtime, at send_rate pages per
+             * second, they are sent after the guest has resumed on the
+             * receiving side, as it asks for them.
+             */
+            bool postcopy;
+            uint64_t send_rate;
+            unsigned long nr_postcopy_pfns;
 
             unsigned long p2m_size;
 
+            /* Batch being filled, and its pfns. */
+            struct xc_sr_save_batch *batch;
             xen_pfn_t *batch_pfns;
             unsigned nr_batch_pfns;
+
+            /* Send memory as COMPRESSED_PAGE_DATA records. */
+            bool compress;
+
+            /* Threads preparing batches in parallel, 0 for a serial save. */
+            unsigned nr_workers;
+            struct xc_sr_save_pipeline *pipeline;
+
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
@@ -222,6 +261,7 @@ struct xc_sr_context
 
             /* From Image Header. */
             uint32_t format_version;
+            bool compressed;
 
             /* From Domain Header. */
             uint32_t guest_type;
@@ -254,12 +294,56 @@ struct xc_sr_context
             unsigned int xenstore_evtchn, console_evtchn;
             domid_t      xenstore_domid,  console_domid;
 
+            /*
+             * Pages of consecutive page data records, gathered so that they
+             * get populated and mapped in larger batches.  pages point into
+             * the record data (or decompressed copies of it) in bufs, or are
+             * NULL for zero pages.
+             */
+            struct
+            {
+                xen_pfn_t *pfns;
+                uint32_t *types;
+                void **pages;
+                unsigned nr_pfns;
+                void **bufs;
+                unsigned nr_bufs;
+            } batch;
+
+            /* Reading ahead of the stream, NULL when reading it directly. */
+            struct xc_sr_restore_reader *reader;
+
             /* Bitmap of currently populated PFNs during restore. */
             unsigned long *populated_pfns;
             xen_pfn_t max_populated_pfn;
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Post-copy, see handle_postcopy_transition(). */
+            struct xc_sr_postcopy
+            {
+                /* The guest runs, with the outstanding pages paged out. */
+                bool active;
+
+                /* Paging ring, and its event channel. */
+                void *ring_page;
+                vm_event_back_ring_t back_ring;
+                xenevtchn_handle *xce;
+                evtchn_port_t port;
+
+                /* Pfns still to come from the sender. */
+                unsigned long *outstanding;
+                xen_pfn_t max_pfn;
+                unsigned long nr_outstanding;
+
+                /* Paging requests waiting for their page. */
+                vm_event_request_t *waiting;
+                unsigned nr_waiting, max_waiting;
+
+                /* Page aligned buffer to load pages from. */
+                void *buffer;
+            } postcopy;
         } restore;
     };
 
@@ -391,6 +475,28 @@ static inline int write_record(struct xc_sr_context *ctx,
  */
 int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec);
 
+/*
+ * Whether a page of memory only contains zeroes.  Checks a cache line at a
+ * time, so non-zero pages are usually rejected after the first one.
+ */
+static inline bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned i, j;
+    uint64_t acc;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 8 )
+    {
+        for ( j = 0, acc = 0; j < 8; ++j )
+            acc |= p[i + j];
+
+        if ( acc )
+            return false;
+    }
+
+    return true;
+}
+
 /*
  * This would ideally be private in restore.c, but is needed by
  * x86_pv_localise_page() if we receive pagetables frames ahead of the
@@ -0,0 +1,144 @@
+#include <string.h>
+
+#include "xc_sr_common.h"
+
+/*
+ * LZ4 block compressor for COMPRESSED_PAGE_DATA records.
+ *
+ * Produces the plain LZ4 block format, as understood by the decompressor
+ * from xen/common/lz4 (see xc_dom_decompress_lz4.c).  This is the simple
+ * greedy single hash table variant, with skipping over incompressible
+ * data, trading some compression ratio for speed.
+ */
+
+#define MINMATCH     4
+#define LASTLITERALS 5                   /* Last bytes are always literals. */
+#define MFLIMIT      12                  /* No match may start after this. */
+#define MAX_DISTANCE 65535
+#define ML_BITS      4
+#define ML_MASK      ((1U << ML_BITS) - 1)
+#define RUN_MASK     ((1U << (8 - ML_BITS)) - 1)
+#define SKIPSTRENGTH 6
+
+/* The hash table of the work memory: LZ4_MEM_COMPRESS is 4096 pointers. */
+#define HASH_LOG     12
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len)
+{
+    for ( ; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = len;
+
+    return op;
+}
+
+/* Emit the literals [anchor, ip) followed by a match, or none if len is 0. */
+static unsigned char *put_sequence(unsigned char *op,
+                                   const unsigned char *anchor,
+                                   const unsigned char *ip,
+                                   size_t offset, size_t len)
+{
+    size_t lit = ip - anchor;
+    unsigned char *token = op++;
+
+    *token = (lit >= RUN_MASK ? RUN_MASK : lit) << ML_BITS;
+    if ( lit >= RUN_MASK )
+        op = put_length(op, lit - RUN_MASK);
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if ( len == 0 )
+        return op;
+
+    *op++ = offset;
+    *op++ = offset >> 8;
+
+    len -= MINMATCH;
+    *token |= len >= ML_MASK ? ML_MASK : len;
+    if ( len >= ML_MASK )
+        op = put_length(op, len - ML_MASK);
+
+    return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+                 unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+    const unsigned char **table = wrkmem;
+    const unsigned char *ip = src, *anchor = src, *ref;
+    const unsigned char *const iend = src + src_len;
+    const unsigned char *const mflimit = iend - MFLIMIT;
+    const unsigned char *const matchlimit = iend - LASTLITERALS;
+    unsigned char *op = dst;
+    unsigned int h, misses = 0;
+    size_t len;
+
+    memset(table, 0, sizeof(*table) << HASH_LOG);
+
+    if ( src_len < MFLIMIT + 1 )
+        goto last_literals;
+
+    while ( ip < mflimit )
+    {
+        h = hash32(read32(ip));
+        ref = table[h];
+        table[h] = ip;
+
+        if ( !ref || ip - ref > MAX_DISTANCE || read32(ref) != read32(ip) )
+        {
+            /* Step faster the longer nothing matches. */
+            ip += 1 + (misses++ >> SKIPSTRENGTH);
+            continue;
+        }
+        misses = 0;
+
+        /* Extend the match backwards into the pending literals... */
+        while ( ip > anchor && ref > src && ip[-1] == ref[-1] )
+        {
+            ip--;
+            ref--;
+        }
+
+        /* ... and forwards. */
+        for ( len = MINMATCH; ip + len < matchlimit && ip[len] == ref[len];
+              ++len )
+            ;
+
+        op = put_sequence(op, anchor, ip, ip - ref, len);
+        ip += len;
+        anchor = ip;
+
+        if ( ip < mflimit )
+            table[hash32(read32(ip - 2))] = ip - 2;
+    }
+
+ last_literals:
+    op = put_sequence(op, anchor, iend, 0, 0);
+    *dst_len = op - dst;
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
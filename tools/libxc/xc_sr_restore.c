@@ -1,9 +1,17 @@
 #include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include <assert.h>
 
 #include "xc_sr_common.h"
 
+/* Pages populated and mapped at a time, see queue_page_data(). */
+#define RESTORE_BATCH_SIZE (4 * MAX_BATCH_SIZE)
+
+/* Records read ahead of their processing, see reader_thread(). */
+#define RESTORE_READAHEAD 8
+
 /*
  * Read and validate the Image and Domain headers.
  */
@@ -46,6 +54,7 @@ static int read_headers(struct xc_sr_context *ctx)
     }
 
     ctx->restore.format_version = ihdr.version;
+    ctx->restore.compressed = ihdr.options & IHDR_OPT_COMPRESSED;
 
     if ( read_exact(ctx->fd, &dhdr, sizeof(dhdr)) )
     {
@@ -195,22 +204,136 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
 }
 
 /*
- * Given a list of pfns, their types, and a block of page data from the
+ * Post-copy: answer a paging request of the guest, letting its vcpu resume.
+ */
+static void postcopy_respond(struct xc_sr_context *ctx,
+                             const vm_event_request_t *req)
+{
+    vm_event_back_ring_t *ring = &ctx->restore.postcopy.back_ring;
+    vm_event_response_t *rsp = RING_GET_RESPONSE(ring, ring->rsp_prod_pvt);
+
+    memset(rsp, 0, sizeof(*rsp));
+    rsp->version = VM_EVENT_INTERFACE_VERSION;
+    rsp->vcpu_id = req->vcpu_id;
+    rsp->flags = req->flags;
+    rsp->reason = req->reason;
+    rsp->u.mem_paging.gfn = req->u.mem_paging.gfn;
+
+    ring->rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(ring);
+}
+
+/*
+ * Post-copy: pfn has been loaded, answer the requests waiting for it.
+ * Returns the number of requests answered.
+ */
+static unsigned postcopy_wake_waiting(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    struct xc_sr_postcopy *pc = &ctx->restore.postcopy;
+    unsigned i = 0, woken = 0;
+
+    while ( i < pc->nr_waiting )
+    {
+        if ( pc->waiting[i].u.mem_paging.gfn != pfn )
+        {
+            ++i;
+            continue;
+        }
+
+        postcopy_respond(ctx, &pc->waiting[i]);
+        pc->waiting[i] = pc->waiting[--pc->nr_waiting];
+        ++woken;
+    }
+
+    return woken;
+}
+
+/*
+ * Post-copy: the pages of a batch are all paged out in the running guest.
+ * Load them through the paging interface, and wake up the vcpus waiting for
+ * them.  Pages with a NULL data pointer are all zero.
+ */
+static int postcopy_load_pages(struct xc_sr_context *ctx, unsigned count,
+                               xen_pfn_t *pfns, const uint32_t *types,
+                               void **pages)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = &ctx->restore.postcopy;
+    unsigned i, woken = 0;
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( pfns[i] > pc->max_pfn ||
+             !test_and_clear_bit(pfns[i], pc->outstanding) )
+        {
+            ERROR("pfn %#"PRIpfn" isn't outstanding in post-copy", pfns[i]);
+            return -1;
+        }
+
+        --pc->nr_outstanding;
+
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_XTAB:
+        case XEN_DOMCTL_PFINFO_BROKEN:
+        case XEN_DOMCTL_PFINFO_XALLOC:
+            /* Freed meanwhile on the sending side. */
+            if ( xc_domain_decrease_reservation_exact(xch, ctx->domid, 1, 0,
+                                                      &pfns[i]) )
+                PERROR("Failed to remove pfn %#"PRIpfn, pfns[i]);
+            break;
+
+        default:
+            if ( pages[i] )
+                memcpy(pc->buffer, pages[i], PAGE_SIZE);
+            else
+                memset(pc->buffer, 0, PAGE_SIZE);
+
+            /* ENOENT: the guest has dropped the page meanwhile. */
+            if ( xc_mem_paging_load(xch, ctx->domid, pfns[i], pc->buffer) &&
+                 errno != ENOENT )
+            {
+                PERROR("Failed to load pfn %#"PRIpfn, pfns[i]);
+                return -1;
+            }
+            break;
+        }
+
+        woken += postcopy_wake_waiting(ctx, pfns[i]);
+    }
+
+    if ( woken && xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify the paging ring");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Given a list of pfns, their types, and the data of each page from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  Pages with a NULL data pointer are all zero (of
+ * type NOTAB), they get cleared instead.
  */
 static int process_page_data(struct xc_sr_context *ctx, unsigned count,
-                             xen_pfn_t *pfns, uint32_t *types, void *page_data)
+                             xen_pfn_t *pfns, uint32_t *types, void **pages)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = malloc(count * sizeof(*mfns));
-    int *map_errs = malloc(count * sizeof(*map_errs));
+    xen_pfn_t *mfns;
+    int *map_errs;
     int rc;
     void *mapping = NULL, *guest_page = NULL;
     unsigned i,    /* i indexes the pfns from the record. */
         j,         /* j indexes the subset of pfns we decide to map. */
         nr_pages = 0;
 
+    if ( ctx->restore.postcopy.active )
+        return postcopy_load_pages(ctx, count, pfns, types, pages);
+
+    mfns = malloc(count * sizeof(*mfns));
+    map_errs = malloc(count * sizeof(*map_errs));
     if ( !mfns || !map_errs )
     {
         rc = -1;
@@ -285,8 +408,26 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
             goto err;
         }
 
+        if ( !pages[i] )
+        {
+            /* Zero page.  Freshly populated frames aren't necessarily
+             * scrubbed, so clear it in any case. */
+            if ( ctx->restore.verify )
+            {
+                if ( !page_is_zero(guest_page) )
+                    ERROR("verify pfn %#"PRIpfn" failed (zero page)",
+                          pfns[i]);
+            }
+            else
+                memset(guest_page, 0, PAGE_SIZE);
+
+            ++j;
+            guest_page += PAGE_SIZE;
+            continue;
+        }
+
         /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        rc = ctx->restore.ops.localise_page(ctx, types[i], pages[i]);
         if ( rc )
         {
             ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
@@ -297,19 +438,18 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         if ( ctx->restore.verify )
         {
             /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
+            if ( memcmp(guest_page, pages[i], PAGE_SIZE) )
                 ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
                       pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
         }
         else
         {
             /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
+            memcpy(guest_page, pages[i], PAGE_SIZE);
         }
 
         ++j;
         guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
     }
 
  done:
@@ -326,34 +466,120 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Process the pages gathered by queue_page_data(), and free the buffers
+ * holding their data.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+static int flush_page_data(struct xc_sr_context *ctx)
+{
+    unsigned i;
+    int rc = 0;
+
+    if ( ctx->restore.batch.nr_pfns )
+        rc = process_page_data(ctx, ctx->restore.batch.nr_pfns,
+                               ctx->restore.batch.pfns,
+                               ctx->restore.batch.types,
+                               ctx->restore.batch.pages);
+
+    for ( i = 0; i < ctx->restore.batch.nr_bufs; ++i )
+        free(ctx->restore.batch.bufs[i]);
+
+    ctx->restore.batch.nr_bufs = 0;
+    ctx->restore.batch.nr_pfns = 0;
+
+    return rc;
+}
+
+/*
+ * Add the pages of a page data record to the batch, flushing it whenever it
+ * is full, so that pages get populated and mapped RESTORE_BATCH_SIZE at a
+ * time rather than one record at a time.  data holds the contents of the
+ * pages which have any one after the other, or is NULL if they are all zero.
+ * buf, which data points into, is taken over and freed once they have been
+ * processed.
+ */
+static int queue_page_data(struct xc_sr_context *ctx, unsigned count,
+                           const xen_pfn_t *pfns, const uint32_t *types,
+                           void *data, void *buf)
+{
+    unsigned i, n;
+    int rc;
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( ctx->restore.batch.nr_pfns == RESTORE_BATCH_SIZE )
+        {
+            rc = flush_page_data(ctx);
+            if ( rc )
+            {
+                free(buf);
+                return rc;
+            }
+        }
+
+        n = ctx->restore.batch.nr_pfns++;
+        ctx->restore.batch.pfns[n] = pfns[i];
+        ctx->restore.batch.types[n] = types[i];
+
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_XTAB:
+        case XEN_DOMCTL_PFINFO_BROKEN:
+        case XEN_DOMCTL_PFINFO_XALLOC:
+            /* No page data to deal with. */
+            ctx->restore.batch.pages[n] = NULL;
+            break;
+
+        default:
+            ctx->restore.batch.pages[n] = data;
+            if ( data )
+                data += PAGE_SIZE;
+            break;
+        }
+    }
+
+    if ( buf )
+        ctx->restore.batch.bufs[ctx->restore.batch.nr_bufs++] = buf;
+
+    /* Vcpus may be waiting for post-copy pages. */
+    if ( ctx->restore.postcopy.active )
+        return flush_page_data(ctx);
+
+    return 0;
+}
+
+/*
+ * Validate the header and the pfns of a PAGE_DATA or COMPRESSED_PAGE_DATA
+ * record, decoding the pfns and types into newly allocated arrays, and
+ * counting the pages with data.
+ */
+static int decode_page_data_pfns(struct xc_sr_context *ctx,
+                                 struct xc_sr_record *rec,
+                                 xen_pfn_t **ppfns, uint32_t **ptypes,
+                                 unsigned *ppages_of_data)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rec_page_data_header *pages = rec->data;
+    const char *name = rec_type_to_str(rec->type);
     unsigned i, pages_of_data = 0;
-    int rc = -1;
 
     xen_pfn_t *pfns = NULL, pfn;
     uint32_t *types = NULL, type;
 
     if ( rec->length < sizeof(*pages) )
     {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
+        ERROR("%s record truncated: length %u, min %zu",
+              name, rec->length, sizeof(*pages));
         goto err;
     }
     else if ( pages->count < 1 )
     {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        ERROR("Expected at least 1 pfn in %s record", name);
         goto err;
     }
     else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
+        ERROR("%s record (length %u) too short to contain %u"
+              " pfns worth of information", name, rec->length, pages->count);
         goto err;
     }
 
@@ -392,6 +618,36 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         types[i] = type;
     }
 
+    *ppfns = pfns;
+    *ptypes = types;
+    *ppages_of_data = pages_of_data;
+
+    return 0;
+
+ err:
+    free(types);
+    free(pfns);
+
+    return -1;
+}
+
+/*
+ * Validate a PAGE_DATA record from the stream, and queue the pages for
+ * process_page_data() to actually perform the legwork.
+ */
+static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned pages_of_data;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+    if ( decode_page_data_pfns(ctx, rec, &pfns, &types, &pages_of_data) )
+        return -1;
+
     if ( rec->length != (sizeof(*pages) +
                          (sizeof(uint64_t) * pages->count) +
                          (PAGE_SIZE * pages_of_data)) )
@@ -402,8 +658,9 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         goto err;
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+    rc = queue_page_data(ctx, pages->count, pfns, types,
+                         &pages->pfn[pages->count], rec->data);
+    rec->data = NULL;
  err:
     free(types);
     free(pfns);
@@ -412,145 +669,676 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 }
 
 /*
- * Send checkpoint dirty pfn list to primary.
+ * Validate a COMPRESSED_PAGE_DATA record from the stream, decompress the
+ * pages and queue them for process_page_data().
  */
-static int send_checkpoint_dirty_pfn_list(struct xc_sr_context *ctx)
+static int handle_compressed_page_data(struct xc_sr_context *ctx,
+                                       struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_compressed_page_data_header *pages = rec->data;
+    unsigned i, pages_of_data;
+    size_t hdr_len, data_len, page_len;
+    const uint32_t *lengths;
+    const unsigned char *data;
+    unsigned char *buf = NULL;
     int rc = -1;
-    unsigned count, written;
-    uint64_t i, *pfns = NULL;
-    struct iovec *iov = NULL;
-    xc_shadow_op_stats_t stats = { 0, ctx->restore.p2m_size };
-    struct xc_sr_record rec =
-    {
-        .type = REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST,
-    };
-    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
-                                    &ctx->restore.dirty_bitmap_hbuf);
 
-    if ( xc_shadow_control(
-             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
-             HYPERCALL_BUFFER(dirty_bitmap), ctx->restore.p2m_size,
-             NULL, 0, &stats) != ctx->restore.p2m_size )
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+    if ( !ctx->restore.compressed )
     {
-        PERROR("Failed to retrieve logdirty bitmap");
-        goto err;
+        ERROR("COMPRESSED_PAGE_DATA record in an uncompressed stream");
+        return -1;
     }
 
-    for ( i = 0, count = 0; i < ctx->restore.p2m_size; i++ )
+    if ( decode_page_data_pfns(ctx, rec, &pfns, &types, &pages_of_data) )
+        return -1;
+
+    hdr_len = sizeof(*pages) + pages->count * sizeof(uint64_t) +
+        pages_of_data * sizeof(*lengths);
+    if ( rec->length < hdr_len )
     {
-        if ( test_bit(i, dirty_bitmap) )
-            count++;
+        ERROR("COMPRESSED_PAGE_DATA record (length %u) too short to contain"
+              " %u page lengths", rec->length, pages_of_data);
+        goto err;
     }
 
+    lengths = (const uint32_t *)&pages->pfn[pages->count];
+    data = rec->data + hdr_len;
+    data_len = rec->length - hdr_len;
 
-    pfns = malloc(count * sizeof(*pfns));
-    if ( !pfns )
+    buf = malloc(pages_of_data * PAGE_SIZE);
+    if ( pages_of_data && !buf )
     {
-        ERROR("Unable to allocate %zu bytes of memory for dirty pfn list",
-              count * sizeof(*pfns));
+        ERROR("Unable to allocate %u pages for decompression", pages_of_data);
         goto err;
     }
 
-    for ( i = 0, written = 0; i < ctx->restore.p2m_size; ++i )
+    for ( i = 0; i < pages_of_data; ++i )
     {
-        if ( !test_bit(i, dirty_bitmap) )
-            continue;
-
-        if ( written > count )
+        if ( lengths[i] == 0 || lengths[i] > PAGE_SIZE ||
+             lengths[i] > data_len )
         {
-            ERROR("Dirty pfn list exceed");
+            ERROR("Bad length %u of page %u in COMPRESSED_PAGE_DATA record"
+                  " (%zu octets left)", lengths[i], i, data_len);
             goto err;
         }
 
-        pfns[written++] = i;
-    }
+        page_len = PAGE_SIZE;
+        if ( lengths[i] == PAGE_SIZE )
+            /* Stored uncompressed. */
+            memcpy(buf + i * PAGE_SIZE, data, PAGE_SIZE);
+        else if ( lz4_decompress_unknownoutputsize(data, lengths[i],
+                                                   buf + i * PAGE_SIZE,
+                                                   &page_len) ||
+                  page_len != PAGE_SIZE )
+        {
+            ERROR("Failed to decompress page %u of COMPRESSED_PAGE_DATA"
+                  " record", i);
+            goto err;
+        }
 
-    /* iovec[] for writev(). */
-    iov = malloc(3 * sizeof(*iov));
-    if ( !iov )
-    {
-        ERROR("Unable to allocate memory for sending dirty bitmap");
-        goto err;
+        data += lengths[i];
+        data_len -= lengths[i];
     }
 
-    rec.length = count * sizeof(*pfns);
-
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
-
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
-
-    iov[2].iov_base = pfns;
-    iov[2].iov_len = count * sizeof(*pfns);
-
-    if ( writev_exact(ctx->restore.send_back_fd, iov, 3) )
+    if ( data_len )
     {
-        PERROR("Failed to write dirty bitmap to stream");
+        ERROR("COMPRESSED_PAGE_DATA record has %zu trailing octets", data_len);
         goto err;
     }
 
-    rc = 0;
+    rc = queue_page_data(ctx, pages->count, pfns, types, buf, buf);
+    buf = NULL;
  err:
+    free(buf);
+    free(types);
     free(pfns);
-    free(iov);
+
     return rc;
 }
 
-static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec);
-static int handle_checkpoint(struct xc_sr_context *ctx)
+/*
+ * Validate a ZERO_PAGES record from the stream, and queue the pages for
+ * process_page_data() to clear.
+ */
+static int handle_zero_pages(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
-    int rc = 0, ret;
+    struct xc_sr_rec_zero_pages_header *pages = rec->data;
     unsigned i;
+    int rc = -1;
 
-    if ( !ctx->restore.checkpointed )
+    xen_pfn_t *pfns = NULL, pfn;
+    uint32_t *types = NULL;
+
+    if ( rec->length < sizeof(*pages) )
     {
-        ERROR("Found checkpoint in non-checkpointed stream");
-        rc = -1;
+        ERROR("ZERO_PAGES record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
         goto err;
     }
-
-    ret = ctx->restore.callbacks->checkpoint(ctx->restore.callbacks->data);
-    switch ( ret )
+    else if ( pages->count < 1 )
     {
-    case XGR_CHECKPOINT_SUCCESS:
-        break;
-
-    case XGR_CHECKPOINT_FAILOVER:
-        if ( ctx->restore.buffer_all_records )
-            rc = BROKEN_CHANNEL;
-        else
-            /* We don't have a consistent state */
-            rc = -1;
+        ERROR("Expected at least 1 pfn in ZERO_PAGES record");
+        goto err;
+    }
+    else if ( rec->length != sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    {
+        ERROR("ZERO_PAGES record wrong size: length %u, expected %zu + %zu",
+              rec->length, sizeof(*pages), pages->count * sizeof(uint64_t));
         goto err;
+    }
 
-    default: /* Other fatal error */
-        rc = -1;
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = calloc(pages->count, sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
         goto err;
     }
 
-    if ( ctx->restore.buffer_all_records )
+    for ( i = 0; i < pages->count; ++i )
     {
-        IPRINTF("All records buffered");
+        pfn = pages->pfn[i];
+        if ( pfn & ~PAGE_DATA_PFN_MASK )
+        {
+            ERROR("Reserved bits set in pfn[%u]: %#"PRIx64, i, pages->pfn[i]);
+            goto err;
+        }
 
-        for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
         {
-            rc = process_record(ctx, &ctx->restore.buffered_records[i]);
-            if ( rc )
-                goto err;
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            goto err;
         }
-        ctx->restore.buffered_rec_num = 0;
-        IPRINTF("All records processed");
+
+        /* types[i] is XEN_DOMCTL_PFINFO_NOTAB. */
+        pfns[i] = pfn;
     }
-    else
-        ctx->restore.buffer_all_records = true;
 
-    if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
-    {
-#define HANDLE_CALLBACK_RETURN_VALUE(ret)                   \
+    rc = queue_page_data(ctx, pages->count, pfns, types, NULL, NULL);
+ err:
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Post-copy: POSTCOPY_PFNS record, listing pages which are only sent after
+ * the guest has resumed.
+ */
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = &ctx->restore.postcopy;
+    const uint64_t *pfns = rec->data;
+    unsigned i, count = rec->length / sizeof(*pfns);
+    xen_pfn_t max_pfn = 0;
+    size_t old_sz, new_sz;
+    unsigned long *p;
+
+    if ( ctx->restore.checkpointed || pc->active )
+    {
+        ERROR("Unexpected %s record", rec_type_to_str(rec->type));
+        return -1;
+    }
+
+    if ( rec->length % sizeof(*pfns) )
+    {
+        ERROR("%s record length %u not a multiple of %zu",
+              rec_type_to_str(rec->type), rec->length, sizeof(*pfns));
+        return -1;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfns[i]) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum",
+                  (xen_pfn_t)pfns[i], i);
+            return -1;
+        }
+
+        max_pfn = max(max_pfn, (xen_pfn_t)pfns[i]);
+    }
+
+    if ( !pc->outstanding || max_pfn > pc->max_pfn )
+    {
+        old_sz = pc->outstanding ? bitmap_size(pc->max_pfn + 1) : 0;
+        new_sz = bitmap_size(max_pfn + 1);
+
+        p = realloc(pc->outstanding, new_sz);
+        if ( !p )
+        {
+            ERROR("Failed to realloc post-copy bitmap");
+            return -1;
+        }
+
+        memset((uint8_t *)p + old_sz, 0, new_sz - old_sz);
+        pc->outstanding = p;
+        pc->max_pfn = max_pfn;
+    }
+
+    for ( i = 0; i < count; ++i )
+        if ( !test_and_set_bit(pfns[i], pc->outstanding) )
+            ++pc->nr_outstanding;
+
+    return 0;
+}
+
+/*
+ * Post-copy: set up the paging ring, and page out the outstanding pages,
+ * populating those which never arrived first.
+ */
+static int postcopy_setup(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = &ctx->restore.postcopy;
+    xen_pfn_t pfns[MAX_BATCH_SIZE], p = 0;
+    unsigned i, nr;
+    uint32_t port;
+    int rc;
+
+    pc->ring_page = xc_vm_event_enable(xch, ctx->domid,
+                                       HVM_PARAM_PAGING_RING_PFN, &port);
+    if ( !pc->ring_page )
+    {
+        PERROR("Failed to enable paging");
+        return -1;
+    }
+
+    pc->xce = xenevtchn_open(NULL, 0);
+    if ( !pc->xce )
+    {
+        PERROR("Failed to open event channel");
+        return -1;
+    }
+
+    rc = xenevtchn_bind_interdomain(pc->xce, ctx->domid, port);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to bind event channel");
+        return -1;
+    }
+    pc->port = rc;
+
+    SHARED_RING_INIT((vm_event_sring_t *)pc->ring_page);
+    BACK_RING_INIT(&pc->back_ring, (vm_event_sring_t *)pc->ring_page,
+                   PAGE_SIZE);
+
+    errno = posix_memalign(&pc->buffer, PAGE_SIZE, PAGE_SIZE);
+    if ( errno )
+    {
+        pc->buffer = NULL;
+        PERROR("Failed to allocate page buffer");
+        return -1;
+    }
+
+    while ( p <= pc->max_pfn )
+    {
+        for ( nr = 0; nr < MAX_BATCH_SIZE && p <= pc->max_pfn; ++p )
+            if ( test_bit(p, pc->outstanding) )
+                pfns[nr++] = p;
+
+        if ( !nr )
+            continue;
+
+        rc = populate_pfns(ctx, nr, pfns, NULL);
+        if ( rc )
+            return rc;
+
+        for ( i = 0; i < nr; ++i )
+        {
+            if ( xc_mem_paging_nominate(xch, ctx->domid, pfns[i]) ||
+                 xc_mem_paging_evict(xch, ctx->domid, pfns[i]) )
+            {
+                PERROR("Failed to page out pfn %#"PRIpfn, pfns[i]);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void postcopy_teardown(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = &ctx->restore.postcopy;
+
+    if ( pc->ring_page )
+    {
+        if ( xc_mem_paging_disable(xch, ctx->domid) )
+            PERROR("Failed to disable paging");
+        xenforeignmemory_unmap(xch->fmem, pc->ring_page, 1);
+    }
+
+    if ( pc->xce )
+    {
+        if ( pc->port )
+            xenevtchn_unbind(pc->xce, pc->port);
+        xenevtchn_close(pc->xce);
+    }
+
+    free(pc->buffer);
+    free(pc->waiting);
+    free(pc->outstanding);
+    memset(pc, 0, sizeof(*pc));
+}
+
+/*
+ * Post-copy: all records but the pages listed in POSTCOPY_PFNS records have
+ * been received.  Page the latter out and resume the guest.  From then on,
+ * they get loaded as they arrive (see postcopy_load_pages()), and the guest
+ * touching one before that has the sender asked for it.
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = &ctx->restore.postcopy;
+    struct restore_callbacks *callbacks = ctx->restore.callbacks;
+    int rc;
+
+    if ( !pc->nr_outstanding || pc->active )
+    {
+        ERROR("Unexpected %s record",
+              rec_type_to_str(REC_TYPE_POSTCOPY_TRANSITION));
+        return -1;
+    }
+
+    if ( ctx->restore.send_back_fd < 0 || !callbacks || !callbacks->postcopy )
+    {
+        ERROR("Post-copy needs a back channel and a postcopy callback");
+        return -1;
+    }
+
+    IPRINTF("Post-copy of %lu pages", pc->nr_outstanding);
+
+    rc = postcopy_setup(ctx);
+    if ( rc )
+        return rc;
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+
+    if ( callbacks->restore_results )
+        callbacks->restore_results(ctx->restore.xenstore_gfn,
+                                   ctx->restore.console_gfn,
+                                   callbacks->data);
+
+    pc->active = true;
+
+    if ( callbacks->postcopy(callbacks->data) != 1 )
+    {
+        ERROR("Failed to resume the guest");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Post-copy: ask the sender for pages, in a POSTCOPY_PAGE_REQUEST record. */
+static int postcopy_request_pages(struct xc_sr_context *ctx,
+                                  uint64_t *pfns, unsigned count)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rhdr rhdr =
+        {
+            .type = REC_TYPE_POSTCOPY_PAGE_REQUEST,
+            .length = count * sizeof(*pfns),
+        };
+    struct iovec iov[2] =
+        {
+            { .iov_base = &rhdr, .iov_len = sizeof(rhdr) },
+            { .iov_base = pfns,  .iov_len = count * sizeof(*pfns) },
+        };
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, 2) )
+    {
+        PERROR("Failed to write page request to back channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Post-copy: handle the paging requests on the ring.  Those for outstanding
+ * pages wait for them, the first one for each page asking the sender for it.
+ */
+static int postcopy_handle_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = &ctx->restore.postcopy;
+    vm_event_back_ring_t *ring = &pc->back_ring;
+    vm_event_request_t req, *w;
+    uint64_t pfns[64];
+    unsigned i, nr = 0, answered = 0;
+    xen_pfn_t gfn;
+    int port, rc;
+
+    port = xenevtchn_pending(pc->xce);
+    if ( port < 0 || xenevtchn_unmask(pc->xce, port) )
+    {
+        PERROR("Failed to get paging event");
+        return -1;
+    }
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(ring, ring->req_cons), sizeof(req));
+        ring->req_cons++;
+        ring->sring->req_event = ring->req_cons + 1;
+
+        gfn = req.u.mem_paging.gfn;
+
+        if ( (req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE) ||
+             gfn > pc->max_pfn || !test_bit(gfn, pc->outstanding) )
+        {
+            /* Only paused vcpus need an answer. */
+            if ( req.flags & VM_EVENT_FLAG_VCPU_PAUSED )
+            {
+                postcopy_respond(ctx, &req);
+                ++answered;
+            }
+            continue;
+        }
+
+        for ( i = 0; i < pc->nr_waiting; ++i )
+            if ( pc->waiting[i].u.mem_paging.gfn == gfn )
+                break;
+
+        if ( i == pc->nr_waiting )
+        {
+            pfns[nr++] = gfn;
+            if ( nr == ARRAY_SIZE(pfns) )
+            {
+                rc = postcopy_request_pages(ctx, pfns, nr);
+                if ( rc )
+                    return rc;
+                nr = 0;
+            }
+        }
+
+        if ( pc->nr_waiting == pc->max_waiting )
+        {
+            w = realloc(pc->waiting, (pc->max_waiting + 64) * sizeof(*w));
+            if ( !w )
+            {
+                ERROR("Failed to realloc post-copy requests");
+                return -1;
+            }
+
+            pc->waiting = w;
+            pc->max_waiting += 64;
+        }
+        pc->waiting[pc->nr_waiting++] = req;
+    }
+
+    if ( nr )
+    {
+        rc = postcopy_request_pages(ctx, pfns, nr);
+        if ( rc )
+            return rc;
+    }
+
+    if ( answered && xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify the paging ring");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Post-copy: serve the paging requests of the guest until the next record
+ * arrives.
+ */
+static int postcopy_wait_for_record(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfds[2] =
+        {
+            { .fd = ctx->fd, .events = POLLIN },
+            { .fd = xenevtchn_fd(ctx->restore.postcopy.xce), .events = POLLIN },
+        };
+    int rc;
+
+    for ( ;; )
+    {
+        if ( poll(pfds, ARRAY_SIZE(pfds), -1) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll for post-copy events");
+            return -1;
+        }
+
+        if ( pfds[1].revents )
+        {
+            rc = postcopy_handle_requests(ctx);
+            if ( rc )
+                return rc;
+        }
+
+        if ( pfds[0].revents )
+            return 0;
+    }
+}
+
+/*
+ * Send checkpoint dirty pfn list to primary.
+ */
+static int send_checkpoint_dirty_pfn_list(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc = -1;
+    unsigned count, written;
+    uint64_t i, *pfns = NULL;
+    struct iovec *iov = NULL;
+    xc_shadow_op_stats_t stats = { 0, ctx->restore.p2m_size };
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST,
+    };
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->restore.dirty_bitmap_hbuf);
+
+    if ( xc_shadow_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->restore.p2m_size,
+             NULL, 0, &stats) != ctx->restore.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        goto err;
+    }
+
+    for ( i = 0, count = 0; i < ctx->restore.p2m_size; i++ )
+    {
+        if ( test_bit(i, dirty_bitmap) )
+            count++;
+    }
+
+
+    pfns = malloc(count * sizeof(*pfns));
+    if ( !pfns )
+    {
+        ERROR("Unable to allocate %zu bytes of memory for dirty pfn list",
+              count * sizeof(*pfns));
+        goto err;
+    }
+
+    for ( i = 0, written = 0; i < ctx->restore.p2m_size; ++i )
+    {
+        if ( !test_bit(i, dirty_bitmap) )
+            continue;
+
+        if ( written > count )
+        {
+            ERROR("Dirty pfn list exceed");
+            goto err;
+        }
+
+        pfns[written++] = i;
+    }
+
+    /* iovec[] for writev(). */
+    iov = malloc(3 * sizeof(*iov));
+    if ( !iov )
+    {
+        ERROR("Unable to allocate memory for sending dirty bitmap");
+        goto err;
+    }
+
+    rec.length = count * sizeof(*pfns);
+
+    iov[0].iov_base = &rec.type;
+    iov[0].iov_len = sizeof(rec.type);
+
+    iov[1].iov_base = &rec.length;
+    iov[1].iov_len = sizeof(rec.length);
+
+    iov[2].iov_base = pfns;
+    iov[2].iov_len = count * sizeof(*pfns);
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, 3) )
+    {
+        PERROR("Failed to write dirty bitmap to stream");
+        goto err;
+    }
+
+    rc = 0;
+ err:
+    free(pfns);
+    free(iov);
+    return rc;
+}
+
+static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec);
+static int handle_checkpoint(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc = 0, ret;
+    unsigned i;
+
+    if ( !ctx->restore.checkpointed )
+    {
+        ERROR("Found checkpoint in non-checkpointed stream");
+        rc = -1;
+        goto err;
+    }
+
+    ret = ctx->restore.callbacks->checkpoint(ctx->restore.callbacks->data);
+    switch ( ret )
+    {
+    case XGR_CHECKPOINT_SUCCESS:
+        break;
+
+    case XGR_CHECKPOINT_FAILOVER:
+        if ( ctx->restore.buffer_all_records )
+            rc = BROKEN_CHANNEL;
+        else
+            /* We don't have a consistent state */
+            rc = -1;
+        goto err;
+
+    default: /* Other fatal error */
+        rc = -1;
+        goto err;
+    }
+
+    if ( ctx->restore.buffer_all_records )
+    {
+        IPRINTF("All records buffered");
+
+        for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
+        {
+            rc = process_record(ctx, &ctx->restore.buffered_records[i]);
+            if ( rc )
+                goto err;
+        }
+        ctx->restore.buffered_rec_num = 0;
+
+        rc = flush_page_data(ctx);
+        if ( rc )
+            goto err;
+        IPRINTF("All records processed");
+    }
+    else
+        ctx->restore.buffer_all_records = true;
+
+    if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
+    {
+#define HANDLE_CALLBACK_RETURN_VALUE(ret)                   \
     do {                                                    \
         if ( ret == 1 )                                     \
             rc = 0; /* Success */                           \
@@ -631,6 +1419,15 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     xc_interface *xch = ctx->xch;
     int rc = 0;
 
+    /* Anything but more pages may depend on the pages so far. */
+    if ( rec->type != REC_TYPE_PAGE_DATA && rec->type != REC_TYPE_ZERO_PAGES &&
+         rec->type != REC_TYPE_COMPRESSED_PAGE_DATA )
+    {
+        rc = flush_page_data(ctx);
+        if ( rc )
+            goto out;
+    }
+
     switch ( rec->type )
     {
     case REC_TYPE_END:
@@ -640,6 +1437,14 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_ZERO_PAGES:
+        rc = handle_zero_pages(ctx, rec);
+        break;
+
+    case REC_TYPE_COMPRESSED_PAGE_DATA:
+        rc = handle_compressed_page_data(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -649,17 +1454,202 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_checkpoint(ctx);
         break;
 
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
     }
 
+ out:
     free(rec->data);
     rec->data = NULL;
 
     return rc;
 }
 
+/*
+ * Reading ahead of the stream, used for plain (not checkpointed) streams.
+ *
+ * A reader thread reads records into a ring of slots while the main thread
+ * processes the ones before them, so that reading the stream and loading
+ * the pages into the guest overlap.  The reader stops after the END or
+ * POSTCOPY_TRANSITION record, as the stream must not be consumed past
+ * these.  Record n lives in slot n % RESTORE_READAHEAD.  All state below is
+ * protected by lock.
+ */
+struct xc_sr_restore_reader
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    struct xc_sr_record slots[RESTORE_READAHEAD];
+
+    /* Next record to be read and processed respectively. */
+    unsigned long next_read, next_process;
+
+    /* The reader is done, after the last record or failing with errno. */
+    bool done, error;
+    int saved_errno;
+    /* The reader shall exit. */
+    bool quit;
+
+    pthread_t thread;
+    bool started;
+};
+
+static void *reader_thread(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    struct xc_sr_restore_reader *rd = ctx->restore.reader;
+    struct xc_sr_record rec;
+    int rc;
+
+    /* reader_destroy() cancels it while blocked reading the stream only. */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    pthread_mutex_lock(&rd->lock);
+    for ( ;; )
+    {
+        while ( !rd->quit &&
+                rd->next_read - rd->next_process == RESTORE_READAHEAD )
+            pthread_cond_wait(&rd->cond, &rd->lock);
+        if ( rd->quit )
+            break;
+        pthread_mutex_unlock(&rd->lock);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        rc = read_record(ctx, ctx->fd, &rec);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&rd->lock);
+        if ( rc )
+        {
+            rd->saved_errno = errno;
+            rd->error = rd->done = true;
+        }
+        else
+        {
+            rd->slots[rd->next_read++ % RESTORE_READAHEAD] = rec;
+            rd->done = rec.type == REC_TYPE_END ||
+                rec.type == REC_TYPE_POSTCOPY_TRANSITION;
+        }
+        pthread_cond_broadcast(&rd->cond);
+
+        if ( rd->done )
+            break;
+    }
+    pthread_mutex_unlock(&rd->lock);
+
+    return NULL;
+}
+
+static void reader_destroy(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_reader *rd = ctx->restore.reader;
+
+    if ( !rd )
+        return;
+
+    if ( rd->started )
+    {
+        pthread_mutex_lock(&rd->lock);
+        rd->quit = true;
+        pthread_cond_broadcast(&rd->cond);
+        /* Possibly blocked on a stream which isn't going anywhere. */
+        if ( !rd->done )
+            pthread_cancel(rd->thread);
+        pthread_mutex_unlock(&rd->lock);
+
+        pthread_join(rd->thread, NULL);
+    }
+
+    for ( ; rd->next_process != rd->next_read; rd->next_process++ )
+        free(rd->slots[rd->next_process % RESTORE_READAHEAD].data);
+
+    ctx->restore.reader = NULL;
+
+    pthread_cond_destroy(&rd->cond);
+    pthread_mutex_destroy(&rd->lock);
+    free(rd);
+}
+
+static int reader_create(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_reader *rd;
+    int rc;
+
+    rd = calloc(1, sizeof(*rd));
+    if ( !rd )
+    {
+        ERROR("Unable to allocate memory for the stream reader");
+        return -1;
+    }
+
+    pthread_mutex_init(&rd->lock, NULL);
+    pthread_cond_init(&rd->cond, NULL);
+    ctx->restore.reader = rd;
+
+    rc = pthread_create(&rd->thread, NULL, reader_thread, ctx);
+    if ( rc )
+    {
+        errno = rc;
+        PERROR("Unable to create stream reader thread");
+        return -1;
+    }
+    rd->started = true;
+
+    return 0;
+}
+
+/*
+ * Get the next record of the stream, from the reader if reading ahead.
+ */
+static int next_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    struct xc_sr_restore_reader *rd = ctx->restore.reader;
+    int rc = 0;
+
+    if ( !rd )
+        return read_record(ctx, ctx->fd, rec);
+
+    pthread_mutex_lock(&rd->lock);
+
+    while ( !rd->done && rd->next_process == rd->next_read )
+        pthread_cond_wait(&rd->cond, &rd->lock);
+
+    if ( rd->next_process != rd->next_read )
+    {
+        *rec = rd->slots[rd->next_process++ % RESTORE_READAHEAD];
+        pthread_cond_broadcast(&rd->cond);
+    }
+    else if ( rd->error )
+    {
+        errno = rd->saved_errno;
+        rc = -1;
+    }
+    else
+        /* The reader stopped at a post-copy transition, carry on directly. */
+        rc = 1;
+
+    pthread_mutex_unlock(&rd->lock);
+
+    if ( rc == 1 )
+    {
+        reader_destroy(ctx);
+        rc = read_record(ctx, ctx->fd, rec);
+    }
+
+    return rc;
+}
+
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -694,6 +1684,23 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    ctx->restore.batch.pfns = malloc(RESTORE_BATCH_SIZE *
+                                     sizeof(*ctx->restore.batch.pfns));
+    ctx->restore.batch.types = malloc(RESTORE_BATCH_SIZE *
+                                      sizeof(*ctx->restore.batch.types));
+    ctx->restore.batch.pages = malloc(RESTORE_BATCH_SIZE *
+                                      sizeof(*ctx->restore.batch.pages));
+    /* Each record queued has at least one page. */
+    ctx->restore.batch.bufs = malloc(RESTORE_BATCH_SIZE *
+                                     sizeof(*ctx->restore.batch.bufs));
+    if ( !ctx->restore.batch.pfns || !ctx->restore.batch.types ||
+         !ctx->restore.batch.pages || !ctx->restore.batch.bufs )
+    {
+        ERROR("Unable to allocate memory for page batches");
+        rc = -1;
+        goto err;
+    }
+
     ctx->restore.buffered_records = malloc(
         DEFAULT_BUF_RECORDS * sizeof(struct xc_sr_record));
     if ( !ctx->restore.buffered_records )
@@ -721,6 +1728,16 @@ static void cleanup(struct xc_sr_context *ctx)
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
         xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->restore.p2m_size)));
+    reader_destroy(ctx);
+    postcopy_teardown(ctx);
+
+    for ( i = 0; i < ctx->restore.batch.nr_bufs; ++i )
+        free(ctx->restore.batch.bufs[i]);
+    free(ctx->restore.batch.bufs);
+    free(ctx->restore.batch.pages);
+    free(ctx->restore.batch.types);
+    free(ctx->restore.batch.pfns);
+
     free(ctx->restore.buffered_records);
     free(ctx->restore.populated_pfns);
     if ( ctx->restore.ops.cleanup(ctx) )
@@ -742,9 +1759,23 @@ static int restore(struct xc_sr_context *ctx)
     if ( rc )
         goto err;
 
+    if ( ctx->restore.checkpointed == XC_MIG_STREAM_NONE )
+    {
+        rc = reader_create(ctx);
+        if ( rc )
+            goto err;
+    }
+
     do
     {
-        rc = read_record(ctx, ctx->fd, &rec);
+        if ( ctx->restore.postcopy.active )
+        {
+            rc = postcopy_wait_for_record(ctx);
+            if ( rc )
+                goto err;
+        }
+
+        rc = next_record(ctx, &rec);
         if ( rc )
         {
             if ( ctx->restore.buffer_all_records )
@@ -785,6 +1816,21 @@ static int restore(struct xc_sr_context *ctx)
 
     } while ( rec.type != REC_TYPE_END );
 
+    if ( ctx->restore.postcopy.active )
+    {
+        /* With post-copy, stream_complete was called before resuming. */
+        if ( ctx->restore.postcopy.nr_outstanding )
+        {
+            ERROR("%lu post-copy pages missing at the end of the stream",
+                  ctx->restore.postcopy.nr_outstanding);
+            rc = -1;
+            goto err;
+        }
+
+        IPRINTF("Restore successful");
+        goto done;
+    }
+
  remus_failover:
 
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
@@ -799,6 +1845,10 @@ static int restore(struct xc_sr_context *ctx)
      * With Remus, if we reach here, there must be some error on primary,
      * failover from the last checkpoint state.
      */
+    rc = flush_page_data(ctx);
+    if ( rc )
+        goto err;
+
     rc = ctx->restore.ops.stream_complete(ctx);
     if ( rc )
         goto err;
@@ -1,5 +1,8 @@
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
 
 #include "xc_sr_common.h"
 
@@ -15,7 +18,8 @@ static int write_headers(struct xc_sr_context *ctx, uint16_t guest_type)
             .marker  = IHDR_MARKER,
             .id      = htonl(IHDR_ID),
             .version = htonl(IHDR_VERSION),
-            .options = htons(IHDR_OPT_LITTLE_ENDIAN),
+            .options = htons(IHDR_OPT_LITTLE_ENDIAN |
+                             (ctx->save.compress ? IHDR_OPT_COMPRESSED : 0)),
         };
     struct xc_sr_dhdr dhdr =
         {
@@ -67,67 +71,293 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
- *
- * This function:
- * - gets the types for each pfn in the batch.
- * - for each pfn with real data:
- *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * A batch of pfns on its way into the stream.  The arrays are allocated once
+ * per batch, sized for MAX_BATCH_SIZE pfns.
  */
-static int write_batch(struct xc_sr_context *ctx)
+struct xc_sr_save_batch
 {
-    xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
-    int *errors = NULL, rc = -1;
-    unsigned i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned nr_pfns = ctx->save.nr_batch_pfns;
-    void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec =
-    {
-        .type = REC_TYPE_PAGE_DATA,
-    };
-
-    assert(nr_pfns != 0);
+    /* Pfns in the batch, filled by add_to_batch(). */
+    xen_pfn_t *pfns;
+    unsigned nr_pfns;
 
     /* Mfns of the batch pfns. */
-    mfns = malloc(nr_pfns * sizeof(*mfns));
+    xen_pfn_t *mfns;
     /* Types of the batch pfns. */
-    types = malloc(nr_pfns * sizeof(*types));
+    xen_pfn_t *types;
     /* Errors from attempting to map the gfns. */
-    errors = malloc(nr_pfns * sizeof(*errors));
+    int *errors;
     /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
+    void **guest_data;
     /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
+    void **local_pages;
+    /* Pfn list of the PAGE_DATA record. */
+    uint64_t *rec_pfns;
+    /* Pfn list of the ZERO_PAGES record. */
+    uint64_t *zero_pfns;
+    /* Page lengths, compressed pages and LZ4 state, if compressing. */
+    uint32_t *comp_lengths;
+    unsigned char *comp_data;
+    void *comp_wrkmem;
     /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    struct iovec *iov;
+    int iovcnt;
+
+    void *guest_mapping;
+    unsigned nr_pages, nr_pages_mapped;
+
+    struct xc_sr_rec_page_data_header hdr;
+    struct xc_sr_record rec;
+
+    struct xc_sr_rec_zero_pages_header zero_hdr;
+    struct xc_sr_record zero_rec;
+
+    /* Position in the pipeline (unused for a serial save). */
+    enum {
+        BATCH_FREE,    /* Available to add_to_batch(). */
+        BATCH_QUEUED,  /* Waiting for a worker to prepare it. */
+        BATCH_BUSY,    /* Being prepared by a worker. */
+        BATCH_READY,   /* Prepared, waiting to be written. */
+    } state;
+};
+
+/*
+ * Pipelined sending of memory, used when save.nr_workers is non-zero.
+ *
+ * Batches cycle through a fixed ring of slots.  The main thread fills a slot
+ * and queues it, worker threads prepare queued batches (type lookup, mapping
+ * and normalising of the pages) in parallel, and a writer thread writes the
+ * prepared batches into the stream in the order they were queued.  The
+ * stream is identical to the one of a serial save.
+ *
+ * Batch sequence numbers increase monotonically; batch n lives in slot
+ * n % nr_slots.  All state below is protected by lock.
+ */
+struct xc_sr_save_pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    struct xc_sr_save_batch *slots;
+    unsigned nr_slots;
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+    /* Next batch to be queued, prepared and written respectively. */
+    unsigned long next_fill, next_prepare, next_write;
+
+    /* A worker or the writer failed, errno as seen by it. */
+    bool error;
+    int saved_errno;
+    /* Threads shall exit. */
+    bool quit;
+
+    /* The writer and the worker threads. */
+    pthread_t *threads;
+    unsigned nr_threads;
+};
+
+static void free_batch(struct xc_sr_save_batch *batch)
+{
+    free(batch->comp_wrkmem);
+    free(batch->comp_data);
+    free(batch->comp_lengths);
+    free(batch->iov);
+    free(batch->zero_pfns);
+    free(batch->rec_pfns);
+    free(batch->local_pages);
+    free(batch->guest_data);
+    free(batch->errors);
+    free(batch->types);
+    free(batch->mfns);
+    free(batch->pfns);
+}
+
+static int alloc_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
+    memset(batch, 0, sizeof(*batch));
+
+    batch->pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->pfns));
+    batch->mfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->mfns));
+    batch->types = malloc(MAX_BATCH_SIZE * sizeof(*batch->types));
+    batch->errors = malloc(MAX_BATCH_SIZE * sizeof(*batch->errors));
+    batch->guest_data = malloc(MAX_BATCH_SIZE * sizeof(*batch->guest_data));
+    batch->local_pages = calloc(MAX_BATCH_SIZE, sizeof(*batch->local_pages));
+    batch->rec_pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->rec_pfns));
+    batch->zero_pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->zero_pfns));
+    /* The pages, and the headers, lengths and padding of both records. */
+    batch->iov = malloc((MAX_BATCH_SIZE + 10) * sizeof(*batch->iov));
+
+    if ( !batch->pfns || !batch->mfns || !batch->types || !batch->errors ||
+         !batch->guest_data || !batch->local_pages || !batch->rec_pfns ||
+         !batch->zero_pfns || !batch->iov )
+        goto nomem;
+
+    if ( ctx->save.compress )
     {
-        ERROR("Unable to allocate arrays for a batch of %u pages",
-              nr_pfns);
-        goto err;
+        /*
+         * Compressed pages are shorter than PAGE_SIZE, so this leaves room
+         * for the worst case output of compressing the last page.
+         */
+        batch->comp_lengths = malloc(MAX_BATCH_SIZE *
+                                     sizeof(*batch->comp_lengths));
+        batch->comp_data = malloc((MAX_BATCH_SIZE - 1) * PAGE_SIZE +
+                                  lz4_compressbound(PAGE_SIZE));
+        batch->comp_wrkmem = malloc(LZ4_MEM_COMPRESS);
+
+        if ( !batch->comp_lengths || !batch->comp_data ||
+             !batch->comp_wrkmem )
+            goto nomem;
+    }
+
+    return 0;
+
+ nomem:
+    free_batch(batch);
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * Defer sending a pfn to the final iteration.  May be called by the worker
+ * threads of a pipelined save.
+ */
+static void defer_page(struct xc_sr_context *ctx, xen_pfn_t pfn)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+
+    if ( pl )
+        pthread_mutex_lock(&pl->lock);
+
+    set_bit(pfn, ctx->save.deferred_pages);
+    ++ctx->save.nr_deferred_pages;
+
+    if ( pl )
+        pthread_mutex_unlock(&pl->lock);
+}
+
+/*
+ * Drop the guest mappings and local pages of a batch.
+ */
+static void release_batch(struct xc_sr_context *ctx,
+                          struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    batch->guest_mapping = NULL;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        free(batch->local_pages[i]);
+        batch->local_pages[i] = NULL;
+    }
+}
+
+/*
+ * Compress the pages of a prepared batch for its COMPRESSED_PAGE_DATA
+ * record, appending the page lengths, the page data and the padding of the
+ * record to the iovec[].  Pages which LZ4 can't shrink are sent unmodified.
+ */
+static int compress_batch(struct xc_sr_save_batch *batch, int iovcnt)
+{
+    static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+    struct iovec *iov = batch->iov, *run = NULL;
+    unsigned char *out = batch->comp_data;
+    int lengths_iov = iovcnt++;
+    unsigned i, n = 0;
+    size_t len;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        if ( !batch->guest_data[i] )
+            continue;
+
+        if ( lz4_compress(batch->guest_data[i], PAGE_SIZE, out, &len,
+                          batch->comp_wrkmem) == 0 && len < PAGE_SIZE )
+        {
+            /* Consecutive compressed pages are adjacent in comp_data. */
+            if ( !run )
+            {
+                run = &iov[iovcnt++];
+                run->iov_base = out;
+                run->iov_len = 0;
+            }
+            run->iov_len += len;
+            out += len;
+        }
+        else
+        {
+            len = PAGE_SIZE;
+            iov[iovcnt].iov_base = batch->guest_data[i];
+            iov[iovcnt].iov_len = PAGE_SIZE;
+            iovcnt++;
+            run = NULL;
+        }
+
+        batch->comp_lengths[n++] = len;
+        batch->rec.length += len;
+    }
+
+    assert(n == batch->nr_pages);
+
+    iov[lengths_iov].iov_base = batch->comp_lengths;
+    iov[lengths_iov].iov_len = n * sizeof(*batch->comp_lengths);
+    batch->rec.length += n * sizeof(*batch->comp_lengths);
+
+    len = ROUNDUP(batch->rec.length, REC_ALIGN_ORDER) - batch->rec.length;
+    if ( len )
+    {
+        iov[iovcnt].iov_base = (void *)zeroes;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
     }
 
+    return iovcnt;
+}
+
+/*
+ * Prepare a batch of memory for sending as PAGE_DATA and ZERO_PAGES records.
+ *
+ * This function:
+ * - gets the types for each pfn in the batch.
+ * - for each pfn with real data:
+ *   - maps and attempts to localise the pages.
+ *   - moves normal pages containing only zeroes to the ZERO_PAGES record.
+ * - constructs the iovec[] of the records, compressing the page data if
+ *   requested.
+ *
+ * It only reads shared state of the context (apart from deferring pages), so
+ * several batches may be prepared in parallel.
+ */
+static int prepare_batch(struct xc_sr_context *ctx,
+                         struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = batch->mfns, *types = batch->types;
+    void **guest_data = batch->guest_data;
+    void **local_pages = batch->local_pages;
+    int *errors = batch->errors, rc = -1;
+    unsigned i, p, nr_pages = 0, nr_rec_pfns = 0, nr_zero = 0;
+    unsigned nr_pfns = batch->nr_pfns;
+    void *page, *orig_page;
+    uint64_t *rec_pfns = batch->rec_pfns, *zero_pfns = batch->zero_pfns;
+    struct iovec *iov = batch->iov;
+    int iovcnt = 0;
+
+    assert(nr_pfns != 0);
+
+    memset(guest_data, 0, nr_pfns * sizeof(*guest_data));
+    batch->nr_pages_mapped = 0;
+
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, batch->pfns[i]);
 
         /* Likely a ballooned page. */
         if ( mfns[i] == INVALID_MFN )
-        {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
-        }
+            defer_page(ctx, batch->pfns[i]);
     }
 
     rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
@@ -153,14 +383,14 @@ static int write_batch(struct xc_sr_context *ctx)
 
     if ( nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(xch->fmem,
+        batch->guest_mapping = xenforeignmemory_map(xch->fmem,
             ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !batch->guest_mapping )
         {
             PERROR("Failed to map guest pages");
             goto err;
         }
-        nr_pages_mapped = nr_pages;
+        batch->nr_pages_mapped = nr_pages;
 
         for ( i = 0, p = 0; i < nr_pfns; ++i )
         {
@@ -175,11 +405,11 @@ static int write_batch(struct xc_sr_context *ctx)
             if ( errors[p] )
             {
                 ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
+                      batch->pfns[i], mfns[p], errors[p]);
                 goto err;
             }
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
+            orig_page = page = batch->guest_mapping + (p * PAGE_SIZE);
             rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
 
             if ( orig_page != page )
@@ -189,14 +419,20 @@ static int write_batch(struct xc_sr_context *ctx)
             {
                 if ( rc == -1 && errno == EAGAIN )
                 {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    defer_page(ctx, batch->pfns[i]);
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
                 else
                     goto err;
             }
+            else if ( types[i] == XEN_DOMCTL_PFINFO_NOTAB &&
+                      page_is_zero(page) )
+            {
+                /* Sent by pfn only, see below. */
+                zero_pfns[nr_zero++] = batch->pfns[i];
+                --nr_pages;
+            }
             else
                 guest_data[i] = page;
 
@@ -205,36 +441,79 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    /* Zero pages are left out of the PAGE_DATA record. */
+    for ( i = 0; i < nr_pfns; ++i )
     {
-        ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
-        goto err;
+        if ( types[i] == XEN_DOMCTL_PFINFO_NOTAB && !guest_data[i] )
+            continue;
+
+        rec_pfns[nr_rec_pfns++] = ((uint64_t)(types[i]) << 32) |
+            batch->pfns[i];
     }
 
-    hdr.count = nr_pfns;
+    if ( nr_zero )
+    {
+        batch->zero_rec.type = REC_TYPE_ZERO_PAGES;
+        batch->zero_hdr.count = nr_zero;
+        batch->zero_hdr._res1 = 0;
+        batch->zero_rec.length = sizeof(batch->zero_hdr) +
+            nr_zero * sizeof(*zero_pfns);
+
+        iov[iovcnt].iov_base = &batch->zero_rec.type;
+        iov[iovcnt].iov_len = sizeof(batch->zero_rec.type);
+        iovcnt++;
+
+        iov[iovcnt].iov_base = &batch->zero_rec.length;
+        iov[iovcnt].iov_len = sizeof(batch->zero_rec.length);
+        iovcnt++;
+
+        iov[iovcnt].iov_base = &batch->zero_hdr;
+        iov[iovcnt].iov_len = sizeof(batch->zero_hdr);
+        iovcnt++;
+
+        iov[iovcnt].iov_base = zero_pfns;
+        iov[iovcnt].iov_len = nr_zero * sizeof(*zero_pfns);
+        iovcnt++;
+    }
 
-    rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
+    batch->nr_pages = nr_pages;
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+    /* Nothing left for a PAGE_DATA record? */
+    if ( nr_rec_pfns == 0 )
+        goto done;
+
+    /* PAGE_DATA and COMPRESSED_PAGE_DATA share the header layout. */
+    batch->rec.type = ctx->save.compress ? REC_TYPE_COMPRESSED_PAGE_DATA
+                                         : REC_TYPE_PAGE_DATA;
+    batch->hdr.count = nr_rec_pfns;
+    batch->hdr._res1 = 0;
+
+    batch->rec.length = sizeof(batch->hdr);
+    batch->rec.length += nr_rec_pfns * sizeof(*rec_pfns);
+
+    iov[iovcnt].iov_base = &batch->rec.type;
+    iov[iovcnt].iov_len = sizeof(batch->rec.type);
+    iovcnt++;
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+    iov[iovcnt].iov_base = &batch->rec.length;
+    iov[iovcnt].iov_len = sizeof(batch->rec.length);
+    iovcnt++;
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+    iov[iovcnt].iov_base = &batch->hdr;
+    iov[iovcnt].iov_len = sizeof(batch->hdr);
+    iovcnt++;
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+    iov[iovcnt].iov_base = rec_pfns;
+    iov[iovcnt].iov_len = nr_rec_pfns * sizeof(*rec_pfns);
+    iovcnt++;
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    if ( ctx->save.compress )
+    {
+        iovcnt = compress_batch(batch, iovcnt);
+        goto done;
+    }
 
-    iovcnt = 4;
+    batch->rec.length += nr_pages * PAGE_SIZE;
 
     if ( nr_pages )
     {
@@ -250,34 +529,303 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    /* Sanity check we have collected all the pages we expected to. */
+    assert(nr_pages == 0);
+
+ done:
+    batch->iovcnt = iovcnt;
+    rc = 0;
+
+ err:
+    return rc;
+}
+
+/*
+ * Writes a prepared batch into the stream.
+ */
+static int send_batch(struct xc_sr_context *ctx,
+                      struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( writev_exact(ctx->fd, batch->iov, batch->iovcnt) )
     {
         PERROR("Failed to write page data to stream");
-        goto err;
+        return -1;
     }
 
-    /* Sanity check we have sent all the pages we expected to. */
-    assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
+    return 0;
+}
 
- err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
-    free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
+/*
+ * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
+ * is constructed in ctx->save.batch_pfns.
+ */
+static int write_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch *batch = ctx->save.batch;
+    int rc;
+
+    batch->nr_pfns = ctx->save.nr_batch_pfns;
+
+    rc = prepare_batch(ctx, batch);
+    if ( !rc )
+        rc = send_batch(ctx, batch);
+    release_batch(ctx, batch);
+
+    if ( !rc )
+        ctx->save.nr_batch_pfns = 0;
+
+    return rc;
+}
+
+/*
+ * Pipeline worker thread: prepares queued batches.
+ */
+static void *pipeline_worker(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+    for ( ;; )
+    {
+        while ( !pl->quit && !pl->error && pl->next_prepare == pl->next_fill )
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        if ( pl->quit || pl->error )
+            break;
+
+        batch = &pl->slots[pl->next_prepare++ % pl->nr_slots];
+        assert(batch->state == BATCH_QUEUED);
+        batch->state = BATCH_BUSY;
+        pthread_mutex_unlock(&pl->lock);
+
+        rc = prepare_batch(ctx, batch);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc )
+        {
+            if ( !pl->error )
+                pl->saved_errno = errno;
+            pl->error = true;
+        }
+        else
+            batch->state = BATCH_READY;
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/*
+ * Pipeline writer thread: writes prepared batches in order.
+ */
+static void *pipeline_writer(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+    for ( ;; )
+    {
+        batch = &pl->slots[pl->next_write % pl->nr_slots];
+        while ( !pl->quit && !pl->error && batch->state != BATCH_READY )
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        if ( pl->quit || pl->error )
+            break;
+        pthread_mutex_unlock(&pl->lock);
+
+        rc = send_batch(ctx, batch);
+        release_batch(ctx, batch);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc )
+        {
+            if ( !pl->error )
+                pl->saved_errno = errno;
+            pl->error = true;
+        }
+        else
+        {
+            batch->state = BATCH_FREE;
+            pl->next_write++;
+        }
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/*
+ * Report a failure of the pipeline to the caller.  Called with the lock held.
+ */
+static int pipeline_failed(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+
+    ERROR("Failed to send batch %lu", pl->next_write);
+    errno = pl->saved_errno;
+    return -1;
+}
+
+/*
+ * Hand the batch in ctx->save.batch_pfns over to the pipeline, and wait for
+ * the next slot to become available for filling.
+ */
+static int pipeline_queue_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch = ctx->save.batch;
+    int rc = 0;
+
+    pthread_mutex_lock(&pl->lock);
+
+    batch->nr_pfns = ctx->save.nr_batch_pfns;
+    batch->state = BATCH_QUEUED;
+    pl->next_fill++;
+    pthread_cond_broadcast(&pl->cond);
+
+    batch = &pl->slots[pl->next_fill % pl->nr_slots];
+    while ( !pl->error && batch->state != BATCH_FREE )
+        pthread_cond_wait(&pl->cond, &pl->lock);
+
+    if ( pl->error )
+        rc = pipeline_failed(ctx);
+    else
+    {
+        ctx->save.batch = batch;
+        ctx->save.batch_pfns = batch->pfns;
+        ctx->save.nr_batch_pfns = 0;
+    }
+
+    pthread_mutex_unlock(&pl->lock);
 
     return rc;
 }
 
 /*
- * Flush a batch of pfns into the stream.
+ * Wait until all queued batches have been written into the stream.
+ */
+static int pipeline_drain(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    int rc = 0;
+
+    pthread_mutex_lock(&pl->lock);
+
+    while ( !pl->error && pl->next_write != pl->next_fill )
+        pthread_cond_wait(&pl->cond, &pl->lock);
+
+    if ( pl->error )
+        rc = pipeline_failed(ctx);
+
+    pthread_mutex_unlock(&pl->lock);
+
+    return rc;
+}
+
+static void pipeline_destroy(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    unsigned i;
+
+    if ( !pl )
+        return;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->quit = true;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    for ( i = 0; i < pl->nr_threads; ++i )
+        pthread_join(pl->threads[i], NULL);
+
+    ctx->save.pipeline = NULL;
+
+    for ( i = 0; pl->slots && i < pl->nr_slots; ++i )
+    {
+        release_batch(ctx, &pl->slots[i]);
+        free_batch(&pl->slots[i]);
+    }
+
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->lock);
+    free(pl->threads);
+    free(pl->slots);
+    free(pl);
+}
+
+/*
+ * Set up the pipeline: nr_workers threads preparing batches, and one writing
+ * them.  Twice as many batches as workers may be in flight.
+ */
+static int pipeline_create(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pipeline *pl;
+    unsigned i, nr_workers = ctx->save.nr_workers;
+    int rc;
+
+    pl = calloc(1, sizeof(*pl));
+    if ( !pl )
+        goto nomem;
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+    ctx->save.pipeline = pl;
+
+    pl->nr_slots = 2 * nr_workers + 2;
+    pl->slots = calloc(pl->nr_slots, sizeof(*pl->slots));
+    pl->threads = calloc(nr_workers + 1, sizeof(*pl->threads));
+    if ( !pl->slots || !pl->threads )
+        goto nomem;
+
+    for ( i = 0; i < pl->nr_slots; ++i )
+    {
+        if ( alloc_batch(ctx, &pl->slots[i]) )
+        {
+            /* Only free the batches allocated so far. */
+            pl->nr_slots = i;
+            goto nomem;
+        }
+    }
+
+    ctx->save.batch = &pl->slots[0];
+    ctx->save.batch_pfns = pl->slots[0].pfns;
+
+    for ( i = 0; i <= nr_workers; ++i )
+    {
+        rc = pthread_create(&pl->threads[i], NULL,
+                            i ? pipeline_worker : pipeline_writer, ctx);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to create save thread");
+            return -1;
+        }
+        pl->nr_threads++;
+    }
+
+    DPRINTF("Sending memory with %u worker threads", nr_workers);
+
+    return 0;
+
+ nomem:
+    ERROR("Unable to allocate memory for the save pipeline");
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * Flush a batch of pfns into the stream.  When pipelined, the batch may still
+ * be in flight on return.
  */
 static int flush_batch(struct xc_sr_context *ctx)
 {
@@ -286,6 +834,9 @@ static int flush_batch(struct xc_sr_context *ctx)
     if ( ctx->save.nr_batch_pfns == 0 )
         return rc;
 
+    if ( ctx->save.pipeline )
+        return pipeline_queue_batch(ctx);
+
     rc = write_batch(ctx);
 
     if ( !rc )
@@ -298,6 +849,19 @@ static int flush_batch(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Flush the current batch and wait for all batches to be in the stream.
+ */
+static int flush_all_batches(struct xc_sr_context *ctx)
+{
+    int rc = flush_batch(ctx);
+
+    if ( !rc && ctx->save.pipeline )
+        rc = pipeline_drain(ctx);
+
+    return rc;
+}
+
 /*
  * Add a single pfn to the batch, flushing the batch if full.
  */
@@ -386,7 +950,7 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
         ++written;
     }
 
-    rc = flush_batch(ctx);
+    rc = flush_all_batches(ctx);
     if ( rc )
         return rc;
 
@@ -451,9 +1015,17 @@ static int update_progress_string(struct xc_sr_context *ctx,
 {
     xc_interface *xch = ctx->xch;
     char *new_str = NULL;
+    int rc;
+
+    if ( iter == 0 )
+        rc = asprintf(&new_str, "Frames iteration %u of %u",
+                      iter, ctx->save.max_iterations);
+    else
+        rc = asprintf(&new_str, "Frames iteration %u of %u, "
+                      "estimated downtime %lums", iter,
+                      ctx->save.max_iterations, ctx->save.downtime_ms);
 
-    if ( asprintf(&new_str, "Frames iteration %u of %u",
-                  iter, ctx->save.max_iterations) == -1 )
+    if ( rc == -1 )
     {
         PERROR("Unable to allocate new progress string");
         return -1;
@@ -466,29 +1038,119 @@ static int update_progress_string(struct xc_sr_context *ctx,
     return 0;
 }
 
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/* Pages per second, for a number of pages over a number of microseconds. */
+static uint64_t page_rate(unsigned long pages, uint64_t us)
+{
+    return pages * 1000000ULL / (us ?: 1);
+}
+
+/*
+ * Auto-converge: take a further THROTTLE_STEP percent of its CPU time away
+ * from the guest, by lowering its credit scheduler cap, to slow down the rate
+ * at which it dirties memory.
+ */
+#define THROTTLE_STEP 20
+#define THROTTLE_MAX  80
+
+static void throttle_guest(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xen_domctl_sched_credit sdom;
+    uint64_t full;
+
+    if ( ctx->save.throttle >= THROTTLE_MAX )
+        return;
+
+    if ( ctx->save.throttle == 0 &&
+         xc_sched_credit_domain_get(xch, ctx->domid, &ctx->save.sched) )
+    {
+        PERROR("Unable to get the scheduling parameters of domain %u, "
+               "not auto-converging", ctx->domid);
+        ctx->save.auto_converge = false;
+        return;
+    }
+
+    /* The cap is in percent of a pCPU, 0 being uncapped. */
+    full = ctx->save.sched.cap ?: (ctx->dominfo.max_vcpu_id + 1) * 100ULL;
+    full = full * (100 - ctx->save.throttle - THROTTLE_STEP) / 100;
+
+    sdom = ctx->save.sched;
+    sdom.cap = min_t(uint64_t, max_t(uint64_t, full, 1), UINT16_MAX);
+
+    if ( xc_sched_credit_domain_set(xch, ctx->domid, &sdom) )
+    {
+        PERROR("Unable to throttle domain %u", ctx->domid);
+        if ( ctx->save.throttle == 0 )
+            ctx->save.auto_converge = false;
+        return;
+    }
+
+    ctx->save.throttle += THROTTLE_STEP;
+    IPRINTF("Throttled domain %u to %u%% of its CPU time",
+            ctx->domid, 100 - ctx->save.throttle);
+}
+
+/* Restore the scheduling parameters of a throttled guest. */
+static void unthrottle_guest(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+
+    if ( ctx->save.throttle == 0 )
+        return;
+
+    if ( xc_sched_credit_domain_set(xch, ctx->domid, &ctx->save.sched) )
+        PERROR("Failed to restore the scheduling parameters of domain %u",
+               ctx->domid);
+
+    ctx->save.throttle = 0;
+}
+
 /*
  * Send memory while guest is running.
+ *
+ * Each iteration sends the pages dirtied during the previous one, which gives
+ * the rates at which the guest dirties memory and at which it is sent.  The
+ * live phase ends once the remaining dirty pages are estimated to be sent
+ * within the targeted downtime, or as soon as further iterations can't help
+ * because the guest dirties memory as fast as it is sent, or the set of dirty
+ * pages stopped shrinking.  With auto-converge the guest is throttled instead,
+ * while it dirties memory more than half as fast as it is sent.
  */
 static int send_memory_live(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
     xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
     char *progress_str = NULL;
+    unsigned long sent = ctx->save.p2m_size;
+    uint64_t start, clean, now, send_rate, dirty_rate;
     unsigned x;
     int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
 
     rc = update_progress_string(ctx, &progress_str, 0);
     if ( rc )
         goto out;
 
+    start = clean = now_us();
+
     rc = send_all_pages(ctx);
     if ( rc )
         goto out;
 
-    for ( x = 1;
-          ((x < ctx->save.max_iterations) &&
-           (stats.dirty_count > ctx->save.dirty_threshold)); ++x )
+    for ( x = 1; ; ++x )
     {
+        send_rate = ctx->save.send_rate = page_rate(sent, now_us() - start);
+
         if ( xc_shadow_control(
                  xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
                  &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
@@ -499,18 +1161,57 @@ static int send_memory_live(struct xc_sr_context *ctx)
             goto out;
         }
 
+        /* The pages were dirtied since the previous clean. */
+        now = now_us();
+        dirty_rate = page_rate(stats.dirty_count, now - clean);
+        clean = now;
+
         if ( stats.dirty_count == 0 )
             break;
 
+        ctx->save.downtime_ms = stats.dirty_count * 1000ULL /
+            (send_rate ?: 1);
+
+        DPRINTF("Iteration %u: sent %lu pages at %"PRIu64" pages/s, "
+                "%u dirtied at %"PRIu64" pages/s, estimated downtime %lums",
+                x - 1, sent, send_rate, stats.dirty_count, dirty_rate,
+                ctx->save.downtime_ms);
+
+        if ( stats.dirty_count <= ctx->save.dirty_threshold ||
+             ctx->save.downtime_ms <= ctx->save.max_downtime_ms ||
+             x >= ctx->save.max_iterations )
+            goto last;
+
+        if ( ctx->save.auto_converge )
+        {
+            if ( dirty_rate * 2 > send_rate )
+                throttle_guest(ctx);
+        }
+        else if ( dirty_rate >= send_rate || stats.dirty_count >= sent )
+        {
+            DPRINTF("Not converging, ending the live phase");
+            goto last;
+        }
+
         rc = update_progress_string(ctx, &progress_str, x);
         if ( rc )
             goto out;
 
+        start = now_us();
+        sent = stats.dirty_count;
+
         rc = send_dirty_pages(ctx, stats.dirty_count);
         if ( rc )
             goto out;
     }
 
+    goto out;
+
+ last:
+    /* Leave the pages just found dirty to suspend_and_send_dirty(). */
+    bitmap_or(ctx->save.deferred_pages, dirty_bitmap, ctx->save.p2m_size);
+    ctx->save.nr_deferred_pages += stats.dirty_count;
+
  out:
     xc_set_progress_prefix(xch, NULL);
     free(progress_str);
@@ -569,6 +1270,108 @@ static int colo_merge_secondary_dirty_bitmap(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Post-copy: send the dirty pages which the toolstack or the device model
+ * map on the receiving side before resuming the guest, i.e. while it can't
+ * serve page requests yet.
+ */
+static int send_postcopy_special_pages(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    static const unsigned int params[] = {
+        HVM_PARAM_STORE_PFN, HVM_PARAM_CONSOLE_PFN,
+        HVM_PARAM_IOREQ_PFN, HVM_PARAM_BUFIOREQ_PFN,
+        HVM_PARAM_PAGING_RING_PFN, HVM_PARAM_MONITOR_RING_PFN,
+        HVM_PARAM_SHARING_RING_PFN,
+    };
+    uint64_t pfn, nr_ioreq_server_pages = 0;
+    unsigned int i;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    for ( i = 0; i < ARRAY_SIZE(params); ++i )
+    {
+        if ( xc_hvm_param_get(xch, ctx->domid, params[i], &pfn) ||
+             pfn >= ctx->save.p2m_size ||
+             !test_and_clear_bit(pfn, dirty_bitmap) )
+            continue;
+
+        rc = add_to_batch(ctx, pfn);
+        if ( rc )
+            return rc;
+    }
+
+    if ( !xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_NR_IOREQ_SERVER_PAGES,
+                           &nr_ioreq_server_pages) && nr_ioreq_server_pages &&
+         !xc_hvm_param_get(xch, ctx->domid, HVM_PARAM_IOREQ_SERVER_PFN, &pfn) )
+    {
+        for ( ; nr_ioreq_server_pages--; ++pfn )
+        {
+            if ( pfn >= ctx->save.p2m_size ||
+                 !test_and_clear_bit(pfn, dirty_bitmap) )
+                continue;
+
+            rc = add_to_batch(ctx, pfn);
+            if ( rc )
+                return rc;
+        }
+    }
+
+    return flush_all_batches(ctx);
+}
+
+/*
+ * Post-copy: rather than sending the pages left dirty, announce them in
+ * POSTCOPY_PFNS records.  send_memory_postcopy() sends them later on, once
+ * the guest could be resumed on the receiving side.
+ */
+static int write_postcopy_pfns(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { REC_TYPE_POSTCOPY_PFNS, 0, NULL };
+    const unsigned max_pfns = REC_LENGTH_MAX / sizeof(uint64_t);
+    uint64_t *pfns;
+    unsigned nr = 0;
+    xen_pfn_t p;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = send_postcopy_special_pages(ctx);
+    if ( rc )
+        return rc;
+
+    pfns = malloc(max_pfns * sizeof(*pfns));
+    if ( !pfns )
+    {
+        ERROR("Unable to allocate %zu bytes for post-copy pfns",
+              max_pfns * sizeof(*pfns));
+        return -1;
+    }
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( test_bit(p, dirty_bitmap) )
+            pfns[nr++] = p;
+
+        if ( nr == max_pfns || (nr && p == ctx->save.p2m_size - 1) )
+        {
+            rc = write_split_record(ctx, &rec, pfns, nr * sizeof(*pfns));
+            if ( rc )
+                break;
+
+            ctx->save.nr_postcopy_pfns += nr;
+            nr = 0;
+        }
+    }
+
+    IPRINTF("Leaving %lu pages to post-copy", ctx->save.nr_postcopy_pfns);
+
+    free(pfns);
+    return rc;
+}
+
 /*
  * Suspend the domain and send dirty memory.
  * This is the last iteration of the live migration and the
@@ -620,7 +1423,14 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
         }
     }
 
-    rc = send_dirty_pages(ctx, stats.dirty_count + ctx->save.nr_deferred_pages);
+    /* Leave the pages to post-copy if they take too long to send now. */
+    if ( ctx->save.postcopy && ctx->save.live &&
+         (stats.dirty_count + ctx->save.nr_deferred_pages) * 1000ULL /
+         (ctx->save.send_rate ?: 1) > ctx->save.max_downtime_ms )
+        rc = write_postcopy_pfns(ctx);
+    else
+        rc = send_dirty_pages(ctx, stats.dirty_count +
+                              ctx->save.nr_deferred_pages);
     if ( rc )
         goto out;
 
@@ -633,6 +1443,107 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Post-copy: the guest is about to be resumed on the receiving side.  Send it
+ * the pages it asks for in POSTCOPY_PAGE_REQUEST records on the back channel
+ * first, and the remaining ones in order otherwise, until none are left.
+ */
+static int send_memory_postcopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { REC_TYPE_POSTCOPY_TRANSITION, 0, NULL };
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long left = ctx->save.nr_postcopy_pfns, requested = 0;
+    xen_pfn_t p = 0;
+    uint64_t *pfns;
+    unsigned i, n;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        return rc;
+
+    xc_set_progress_prefix(xch, "Post-copy");
+
+    while ( left )
+    {
+        while ( (rc = poll(&pfd, 1, 0)) > 0 )
+        {
+            rc = read_record(ctx, ctx->save.recv_fd, &rec);
+            if ( rc )
+                goto out;
+
+            if ( rec.type != REC_TYPE_POSTCOPY_PAGE_REQUEST ||
+                 rec.length % sizeof(*pfns) )
+            {
+                ERROR("Expected a %s record, got %s of length %u",
+                      rec_type_to_str(REC_TYPE_POSTCOPY_PAGE_REQUEST),
+                      rec_type_to_str(rec.type), rec.length);
+                free(rec.data);
+                rc = -1;
+                goto out;
+            }
+
+            /* Requests for pages already sent may cross them. */
+            pfns = rec.data;
+            for ( i = 0; i < rec.length / sizeof(*pfns); ++i )
+            {
+                if ( pfns[i] >= ctx->save.p2m_size ||
+                     !test_and_clear_bit(pfns[i], dirty_bitmap) )
+                    continue;
+
+                rc = add_to_batch(ctx, pfns[i]);
+                if ( rc )
+                    break;
+
+                --left;
+                ++requested;
+            }
+            free(rec.data);
+
+            if ( !rc )
+                rc = flush_all_batches(ctx);
+            if ( rc )
+                goto out;
+        }
+
+        if ( rc < 0 && errno != EINTR )
+        {
+            PERROR("Failed to poll for page requests");
+            goto out;
+        }
+
+        for ( n = 0; n < MAX_BATCH_SIZE && left; ++p )
+        {
+            if ( !test_and_clear_bit(p, dirty_bitmap) )
+                continue;
+
+            rc = add_to_batch(ctx, p);
+            if ( rc )
+                goto out;
+
+            --left;
+            ++n;
+        }
+
+        xc_report_progress_step(xch, ctx->save.nr_postcopy_pfns - left,
+                                ctx->save.nr_postcopy_pfns);
+    }
+
+    rc = flush_all_batches(ctx);
+    if ( rc )
+        goto out;
+
+    DPRINTF("Post-copy sent %lu pages on request, %lu in the background",
+            requested, ctx->save.nr_postcopy_pfns - requested);
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    return rc;
+}
+
 static int verify_frames(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -688,6 +1599,7 @@ static int send_domain_memory_live(struct xc_sr_context *ctx)
         goto out;
 
     rc = suspend_and_send_dirty(ctx);
+    unthrottle_guest(ctx);
     if ( rc )
         goto out;
 
@@ -746,19 +1658,38 @@ static int setup(struct xc_sr_context *ctx)
 
     dirty_bitmap = xc_hypercall_buffer_alloc_pages(
                    xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->save.p2m_size)));
-    ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
-                                  sizeof(*ctx->save.batch_pfns));
     ctx->save.deferred_pages = calloc(1, bitmap_size(ctx->save.p2m_size));
 
-    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages )
+    if ( !dirty_bitmap || !ctx->save.deferred_pages )
     {
-        ERROR("Unable to allocate memory for dirty bitmaps, batch pfns and"
+        ERROR("Unable to allocate memory for dirty bitmaps and"
               " deferred pages");
         rc = -1;
         errno = ENOMEM;
         goto err;
     }
 
+    if ( ctx->save.nr_workers )
+    {
+        rc = pipeline_create(ctx);
+        if ( rc )
+            goto err;
+    }
+    else
+    {
+        ctx->save.batch = malloc(sizeof(*ctx->save.batch));
+        if ( !ctx->save.batch || alloc_batch(ctx, ctx->save.batch) )
+        {
+            free(ctx->save.batch);
+            ctx->save.batch = NULL;
+            ERROR("Unable to allocate memory for batch pfns");
+            rc = -1;
+            errno = ENOMEM;
+            goto err;
+        }
+        ctx->save.batch_pfns = ctx->save.batch->pfns;
+    }
+
     rc = 0;
 
  err:
@@ -771,6 +1702,16 @@ static void cleanup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
+    unthrottle_guest(ctx);
+
+    if ( ctx->save.pipeline )
+        pipeline_destroy(ctx);
+    else if ( ctx->save.batch )
+    {
+        release_batch(ctx, ctx->save.batch);
+        free_batch(ctx->save.batch);
+        free(ctx->save.batch);
+    }
 
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0, NULL, 0, NULL);
@@ -781,7 +1722,6 @@ static void cleanup(struct xc_sr_context *ctx)
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
     free(ctx->save.deferred_pages);
-    free(ctx->save.batch_pfns);
 }
 
 /*
@@ -889,6 +1829,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         }
     } while ( ctx->save.checkpointed != XC_MIG_STREAM_NONE );
 
+    if ( ctx->save.nr_postcopy_pfns )
+    {
+        rc = send_memory_postcopy(ctx);
+        if ( rc )
+            goto err;
+    }
+
     xc_report_progress_single(xch, "End of stream");
 
     rc = write_end_record(ctx);
@@ -918,7 +1865,8 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t max_iters, uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
-                   xc_migration_stream_t stream_type, int recv_fd)
+                   xc_migration_stream_t stream_type, int recv_fd,
+                   unsigned int nr_workers, unsigned int max_downtime_ms)
 {
     struct xc_sr_context ctx =
         {
@@ -932,6 +1880,11 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
     ctx.save.checkpointed = stream_type;
     ctx.save.recv_fd = recv_fd;
+    ctx.save.compress = !!(flags & XCFLAGS_STREAM_COMPRESS);
+    ctx.save.nr_workers = min(nr_workers, (unsigned)XC_SAVE_MAX_WORKERS);
+    ctx.save.auto_converge = !!(flags & XCFLAGS_AUTO_CONVERGE);
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
+    ctx.save.max_downtime_ms = max_downtime_ms ?: XC_SAVE_DEFAULT_DOWNTIME_MS;
 
     /* If altering migration_stream update this assert too. */
     assert(stream_type == XC_MIG_STREAM_NONE ||
@@ -947,6 +1900,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.max_iterations = 5;
     ctx.save.dirty_threshold = 50;
 
+    /* Throttling the guest takes a few iterations to have an effect. */
+    if ( ctx.save.auto_converge )
+        ctx.save.max_iterations = 10;
+
     /* Sanity checks for callbacks. */
     if ( hvm )
         assert(callbacks->switch_qemu_logdirty);
@@ -955,8 +1912,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     if ( ctx.save.checkpointed == XC_MIG_STREAM_COLO )
         assert(callbacks->wait_checkpoint);
 
-    DPRINTF("fd %d, dom %u, max_iters %u, max_factor %u, flags %u, hvm %d",
-            io_fd, dom, max_iters, max_factor, flags, hvm);
+    DPRINTF("fd %d, dom %u, max_iters %u, max_factor %u, flags %u, hvm %d, "
+            "workers %u, max downtime %ums", io_fd, dom, max_iters, max_factor,
+            flags, hvm, ctx.save.nr_workers, ctx.save.max_downtime_ms);
 
     if ( xc_domain_getinfo(xch, dom, 1, &ctx.dominfo) != 1 )
     {
@@ -972,6 +1930,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
 
     ctx.domid = dom;
 
+    if ( ctx.save.postcopy &&
+         (!ctx.save.live || !ctx.dominfo.hvm ||
+          stream_type != XC_MIG_STREAM_NONE || recv_fd < 0) )
+    {
+        ERROR("Post-copy needs a live migration of an HVM guest, "
+              "with a back channel");
+        errno = EINVAL;
+        return -1;
+    }
+
     if ( ctx.dominfo.hvm )
     {
         ctx.save.ops = save_ops_x86_hvm;
@@ -29,6 +29,9 @@ struct xc_sr_ihdr
 #define IHDR_OPT_LITTLE_ENDIAN (0 << _IHDR_OPT_ENDIAN)
 #define IHDR_OPT_BIG_ENDIAN    (1 << _IHDR_OPT_ENDIAN)
 
+#define _IHDR_OPT_COMPRESSED 1
+#define IHDR_OPT_COMPRESSED    (1 << _IHDR_OPT_COMPRESSED)
+
 /*
  * Domain Header
  */
@@ -76,6 +79,11 @@ struct xc_sr_rhdr
 #define REC_TYPE_VERIFY                     0x0000000dU
 #define REC_TYPE_CHECKPOINT                 0x0000000eU
 #define REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST  0x0000000fU
+#define REC_TYPE_ZERO_PAGES                 0x00000010U
+#define REC_TYPE_COMPRESSED_PAGE_DATA       0x00000011U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000012U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000013U
+#define REC_TYPE_POSTCOPY_PAGE_REQUEST      0x00000014U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +98,25 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/*
+ * COMPRESSED_PAGE_DATA: as PAGE_DATA, followed by a uint32_t length of each
+ * page with data (PAGE_SIZE if stored uncompressed), then the LZ4 blocks.
+ */
+struct xc_sr_rec_compressed_page_data_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
+/* ZERO_PAGES */
+struct xc_sr_rec_zero_pages_header
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
@@ -170,3 +170,20 @@ int xc_tbuf_set_evt_mask(xc_interface *xch, uint32_t mask)
     return do_sysctl(xch, &sysctl);
 }
 
+
+int xc_tbuf_bench(xc_interface *xch, uint32_t records, uint64_t *cycles)
+{
+    DECLARE_SYSCTL;
+    int rc;
+
+    sysctl.cmd = XEN_SYSCTL_tbuf_op;
+    sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    sysctl.u.tbuf_op.cmd  = XEN_SYSCTL_TBUFOP_bench;
+    sysctl.u.tbuf_op.size = records;
+
+    rc = do_sysctl(xch, &sysctl);
+    if ( rc == 0 )
+        *cycles = sysctl.u.tbuf_op.cycles;
+
+    return rc;
+}
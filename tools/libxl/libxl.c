@@ -934,8 +934,10 @@ static void domain_suspend_cb(libxl__egc *egc,
 
 }
 
-int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
-                         const libxl_asyncop_how *ao_how)
+static int do_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
+                             int flags,
+                             const libxl_domain_suspend_params *params,
+                             const libxl_asyncop_how *ao_how)
 {
     AO_CREATE(ctx, domid, ao_how);
     int rc;
@@ -957,6 +959,24 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->compress = flags & LIBXL_SUSPEND_COMPRESS;
+    dss->auto_converge = flags & LIBXL_SUSPEND_AUTO_CONVERGE;
+    if (params) {
+        if (params->nr_workers < 0) {
+            LOG(ERROR, "invalid number of save workers %d",
+                params->nr_workers);
+            rc = ERROR_INVAL;
+            goto out_err;
+        }
+        if (params->max_downtime_ms < 0) {
+            LOG(ERROR, "invalid downtime target %dms",
+                params->max_downtime_ms);
+            rc = ERROR_INVAL;
+            goto out_err;
+        }
+        dss->nr_workers = params->nr_workers;
+        dss->max_downtime_ms = params->max_downtime_ms;
+    }
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
 
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
@@ -971,6 +991,20 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     return AO_CREATE_FAIL(rc);
 }
 
+int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+                         const libxl_asyncop_how *ao_how)
+{
+    return do_domain_suspend(ctx, domid, fd, flags, NULL, ao_how);
+}
+
+int libxl_domain_suspend_ext(libxl_ctx *ctx, uint32_t domid, int fd,
+                             int flags,
+                             const libxl_domain_suspend_params *params,
+                             const libxl_asyncop_how *ao_how)
+{
+    return do_domain_suspend(ctx, domid, fd, flags, params, ao_how);
+}
+
 int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid)
 {
     int ret;
@@ -958,6 +958,50 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, libxl_mac *src);
  */
 #define LIBXL_HAVE_BYTEARRAY_UUID 1
 
+/*
+ * LIBXL_HAVE_SUSPEND_COMPRESS
+ *
+ * If this is defined, libxl_domain_suspend accepts the
+ * LIBXL_SUSPEND_COMPRESS flag, which LZ4 compresses the guest memory in
+ * the stream.  Restoring such a stream requires a libxl which also
+ * defines LIBXL_HAVE_SUSPEND_COMPRESS.
+ */
+#define LIBXL_HAVE_SUSPEND_COMPRESS 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_AUTO_CONVERGE
+ *
+ * If this is defined, libxl_domain_suspend accepts the
+ * LIBXL_SUSPEND_AUTO_CONVERGE flag.  With it, a live suspend throttles
+ * the vCPUs of a guest which dirties memory too quickly for the expected
+ * downtime to drop below its target.  This only works for guests
+ * scheduled by the credit scheduler; their scheduling parameters are
+ * restored once the guest is suspended.
+ */
+#define LIBXL_HAVE_SUSPEND_AUTO_CONVERGE 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_WORKERS
+ *
+ * If this is defined, libxl_domain_suspend_ext and
+ * libxl_domain_suspend_params are available.  The nr_workers field of
+ * the params is the number of threads mapping and preparing the memory
+ * of the guest for the stream in parallel, with one more writing it.
+ * 0 (the default) sends the memory from a single thread.  Values above
+ * 16 are clamped.
+ */
+#define LIBXL_HAVE_SUSPEND_WORKERS 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_MAX_DOWNTIME
+ *
+ * If this is defined, libxl_domain_suspend_params has a max_downtime_ms
+ * field: the downtime of the guest a live suspend aims for.  The live
+ * phase ends once the remaining dirty memory is estimated to be sent
+ * within it.  0 (the default) means 300ms.
+ */
+#define LIBXL_HAVE_SUSPEND_MAX_DOWNTIME 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1306,6 +1350,15 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+#define LIBXL_SUSPEND_COMPRESS 4
+#define LIBXL_SUSPEND_AUTO_CONVERGE 8
+
+/* As libxl_domain_suspend, params may be NULL for the defaults. */
+int libxl_domain_suspend_ext(libxl_ctx *ctx, uint32_t domid, int fd,
+                             int flags, /* LIBXL_SUSPEND_* */
+                             const libxl_domain_suspend_params *params,
+                             const libxl_asyncop_how *ao_how)
+                             LIBXL_EXTERNAL_CALLERS_ONLY;
 
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
@@ -118,6 +118,7 @@ int libxl__device_generic_add(libxl__gc *gc, xs_transaction_t t,
     struct xs_permissions frontend_perms[2];
     struct xs_permissions ro_frontend_perms[2];
     struct xs_permissions backend_perms[2];
+    struct xs_batch *b;
     int create_transaction = t == XBT_NULL;
     int rc;
 
@@ -144,47 +145,53 @@ retry_transaction:
     rc = libxl__xs_rm_checked(gc, t, libxl_path);
     if (rc) goto out;
 
-    rc = libxl__xs_write_checked(gc, t, GCSPRINTF("%s/frontend",libxl_path),
-                                 frontend_path);
-    if (rc) goto out;
+    /* xxx much of this function lacks error checks! */
 
-    rc = libxl__xs_write_checked(gc, t, GCSPRINTF("%s/backend",libxl_path),
-                                 backend_path);
-    if (rc) goto out;
+    if (fents || ro_fents)
+        xs_rm(ctx->xsh, t, frontend_path);
+    if (bents)
+        xs_rm(ctx->xsh, t, backend_path);
 
-    /* xxx much of this function lacks error checks! */
+    /*
+     * The removals above may fail harmlessly when the parent directory
+     * doesn't exist yet, so they are done on their own.  Everything
+     * else goes to xenstore as one batch.
+     */
+    b = libxl__xs_batch_start(gc);
+
+    xs_batch_write(b, GCSPRINTF("%s/frontend", libxl_path),
+                   frontend_path, strlen(frontend_path));
+    xs_batch_write(b, GCSPRINTF("%s/backend", libxl_path),
+                   backend_path, strlen(backend_path));
 
     if (fents || ro_fents) {
-        xs_rm(ctx->xsh, t, frontend_path);
-        xs_mkdir(ctx->xsh, t, frontend_path);
+        xs_batch_mkdir(b, frontend_path);
         /* Console 0 is a special case. It doesn't use the regular PV
          * state machine but also the frontend directory has
          * historically contained other information, such as the
          * vnc-port, which we don't want the guest fiddling with.
          */
         if (device->kind == LIBXL__DEVICE_KIND_CONSOLE && device->devid == 0)
-            xs_set_permissions(ctx->xsh, t, frontend_path,
-                               ro_frontend_perms, ARRAY_SIZE(ro_frontend_perms));
+            xs_batch_set_permissions(b, frontend_path, ro_frontend_perms,
+                                     ARRAY_SIZE(ro_frontend_perms));
         else
-            xs_set_permissions(ctx->xsh, t, frontend_path,
-                               frontend_perms, ARRAY_SIZE(frontend_perms));
-        xs_write(ctx->xsh, t, GCSPRINTF("%s/backend", frontend_path),
-                 backend_path, strlen(backend_path));
-        if (fents)
-            libxl__xs_writev_perms(gc, t, frontend_path, fents,
-                                   frontend_perms, ARRAY_SIZE(frontend_perms));
-        if (ro_fents)
-            libxl__xs_writev_perms(gc, t, frontend_path, ro_fents,
-                                   ro_frontend_perms, ARRAY_SIZE(ro_frontend_perms));
+            xs_batch_set_permissions(b, frontend_path, frontend_perms,
+                                     ARRAY_SIZE(frontend_perms));
+        xs_batch_write(b, GCSPRINTF("%s/backend", frontend_path),
+                       backend_path, strlen(backend_path));
+        libxl__xs_batch_kvs(gc, b, frontend_path, fents,
+                            frontend_perms, ARRAY_SIZE(frontend_perms));
+        libxl__xs_batch_kvs(gc, b, frontend_path, ro_fents,
+                            ro_frontend_perms, ARRAY_SIZE(ro_frontend_perms));
     }
 
     if (bents) {
-        xs_rm(ctx->xsh, t, backend_path);
-        xs_mkdir(ctx->xsh, t, backend_path);
-        xs_set_permissions(ctx->xsh, t, backend_path, backend_perms, ARRAY_SIZE(backend_perms));
-        xs_write(ctx->xsh, t, GCSPRINTF("%s/frontend", backend_path),
-                 frontend_path, strlen(frontend_path));
-        libxl__xs_writev(gc, t, backend_path, bents);
+        xs_batch_mkdir(b, backend_path);
+        xs_batch_set_permissions(b, backend_path, backend_perms,
+                                 ARRAY_SIZE(backend_perms));
+        xs_batch_write(b, GCSPRINTF("%s/frontend", backend_path),
+                       frontend_path, strlen(frontend_path));
+        libxl__xs_batch_kvs(gc, b, backend_path, bents, NULL, 0);
 
         /*
          * We make a copy of everything for the backend in the libxl
@@ -206,9 +213,16 @@ retry_transaction:
          * This duplication is superfluous and messy but as discussed
          * the proper fix is more intrusive than we want to do now.
          */
-        rc = libxl__xs_writev(gc, t, libxl_path, bents);
-        if (rc) goto out;
+        libxl__xs_batch_kvs(gc, b, libxl_path, bents, NULL, 0);
+    }
+
+    if (!xs_batch_commit(ctx->xsh, t, b)) {
+        LOGE(ERROR, "unable to write device entries to xenstore");
+        xs_batch_free(b);
+        rc = ERROR_FAIL;
+        goto out;
     }
+    xs_batch_free(b);
 
     if (!create_transaction)
         return 0;
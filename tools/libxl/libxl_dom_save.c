@@ -375,7 +375,9 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
           | (debug ? XCFLAGS_DEBUG : 0)
-          | (dss->hvm ? XCFLAGS_HVM : 0);
+          | (dss->hvm ? XCFLAGS_HVM : 0)
+          | (dss->compress ? XCFLAGS_STREAM_COMPRESS : 0)
+          | (dss->auto_converge ? XCFLAGS_AUTO_CONVERGE : 0);
 
     /* Disallow saving a guest with vNUMA configured because migration
      * stream does not preserve node information.
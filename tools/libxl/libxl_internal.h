@@ -692,6 +692,16 @@ _hidden int libxl__xs_writev_atonce(libxl__gc *gc,
    /* Each fn returns 0 on success.
     * On error: returns -1, sets errno (no logging) */
 
+/* Batches send many modifications in one xenstore request, see
+ * xs_batch_commit.  _start never fails; the batch must be freed with
+ * xs_batch_free.  _kvs queues the writes (and permissions) done by
+ * libxl__xs_writev_perms; errors show up when the batch is committed. */
+_hidden struct xs_batch *libxl__xs_batch_start(libxl__gc *gc);
+_hidden void libxl__xs_batch_kvs(libxl__gc *gc, struct xs_batch *b,
+                                 const char *dir, char *kvs[],
+                                 struct xs_permissions *perms,
+                                 unsigned int num_perms);
+
 _hidden char *libxl__xs_get_dompath(libxl__gc *gc, uint32_t domid);
    /* On error: logs, returns NULL, sets errno. */
 
@@ -3283,6 +3293,10 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int compress;
+    int auto_converge;
+    int nr_workers;
+    int max_downtime_ms;
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
     /* private */
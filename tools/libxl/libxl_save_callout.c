@@ -90,7 +90,8 @@ void libxl__xc_domain_save(libxl__egc *egc, libxl__domain_save_state *dss,
 
     const unsigned long argnums[] = {
         dss->domid, 0, 0, dss->xcflags, dss->hvm,
-        cbflags, dss->checkpointed_stream,
+        cbflags, dss->checkpointed_stream, dss->nr_workers,
+        dss->max_downtime_ms,
     };
 
     shs->ao = ao;
@@ -41,28 +41,54 @@ char **libxl__xs_kvs_of_flexarray(libxl__gc *gc, flexarray_t *array, int length)
     return kvs;
 }
 
-int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
-                           const char *dir, char *kvs[],
-                           struct xs_permissions *perms,
-                           unsigned int num_perms)
+struct xs_batch *libxl__xs_batch_start(libxl__gc *gc)
+{
+    struct xs_batch *b = xs_batch_start();
+
+    if (!b) libxl__alloc_failed(CTX, __func__, 1, 0);
+    return b;
+}
+
+void libxl__xs_batch_kvs(libxl__gc *gc, struct xs_batch *b,
+                         const char *dir, char *kvs[],
+                         struct xs_permissions *perms,
+                         unsigned int num_perms)
 {
-    libxl_ctx *ctx = libxl__gc_owner(gc);
     char *path;
     int i;
 
     if (!kvs)
-        return 0;
+        return;
 
     for (i = 0; kvs[i] != NULL; i += 2) {
         path = GCSPRINTF("%s/%s", dir, kvs[i]);
         if (path && kvs[i + 1]) {
             int length = strlen(kvs[i + 1]);
-            xs_write(ctx->xsh, t, path, kvs[i + 1], length);
+            xs_batch_write(b, path, kvs[i + 1], length);
             if (perms)
-                xs_set_permissions(ctx->xsh, t, path, perms, num_perms);
+                xs_batch_set_permissions(b, path, perms, num_perms);
         }
     }
-    return 0;
+}
+
+int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
+                           const char *dir, char *kvs[],
+                           struct xs_permissions *perms,
+                           unsigned int num_perms)
+{
+    libxl_ctx *ctx = libxl__gc_owner(gc);
+    struct xs_batch *b;
+    int rc = 0;
+
+    if (!kvs)
+        return 0;
+
+    b = libxl__xs_batch_start(gc);
+    libxl__xs_batch_kvs(gc, b, dir, kvs, perms, num_perms);
+    if (!xs_batch_commit(ctx->xsh, t, b))
+        rc = -1;
+    xs_batch_free(b);
+    return rc;
 }
 
 int libxl__xs_writev(libxl__gc *gc, xs_transaction_t t,
@@ -4640,6 +4640,8 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
+                           int flags,
+                           const libxl_domain_suspend_params *params,
                            const char *override_config_file)
 {
     pid_t child = -1;
@@ -4648,7 +4650,7 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
     char *away_domname;
     char rc_buf;
     uint8_t *config_data;
-    int config_len, flags = LIBXL_SUSPEND_LIVE;
+    int config_len;
 
     save_domain_core_begin(domid, override_config_file,
                            &config_data, &config_len);
@@ -4666,9 +4668,10 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     xtl_stdiostream_adjust_flags(logger, XTL_STDIOSTREAM_HIDE_PROGRESS, 0);
 
+    flags |= LIBXL_SUSPEND_LIVE;
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    rc = libxl_domain_suspend_ext(ctx, domid, send_fd, flags, params, NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
                 " (rc=%d)\n", rc);
@@ -5086,13 +5089,20 @@ int main_migrate(int argc, char **argv)
     const char *ssh_command = "ssh";
     char *rune = NULL;
     char *host;
-    int opt, daemonize = 1, monitor = 1, debug = 0;
+    int opt, daemonize = 1, monitor = 1, debug = 0, flags = 0;
+    libxl_domain_suspend_params params;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"compress", 0, 0, 0x300},
+        {"auto-converge", 0, 0, 0x400},
+        {"workers", 1, 0, 0x500},
+        {"max-downtime", 1, 0, 0x600},
         COMMON_LONG_OPTS
     };
 
+    libxl_domain_suspend_params_init(&params);
+
     SWITCH_FOREACH_OPT(opt, "FC:s:e", opts, "migrate", 2) {
     case 'C':
         config_filename = optarg;
@@ -5113,6 +5123,18 @@ int main_migrate(int argc, char **argv)
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --compress */
+        flags |= LIBXL_SUSPEND_COMPRESS;
+        break;
+    case 0x400: /* --auto-converge */
+        flags |= LIBXL_SUSPEND_AUTO_CONVERGE;
+        break;
+    case 0x500: /* --workers */
+        params.nr_workers = parse_ulong(optarg);
+        break;
+    case 0x600: /* --max-downtime */
+        params.max_downtime_ms = parse_ulong(optarg);
+        break;
     }
 
     domid = find_domain(argv[optind]);
@@ -5142,7 +5164,8 @@ int main_migrate(int argc, char **argv)
                   debug ? " -d" : "");
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, flags, &params, config_filename);
+    libxl_domain_suspend_params_dispose(&params);
     return EXIT_SUCCESS;
 }
 #endif
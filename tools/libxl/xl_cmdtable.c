@@ -164,6 +164,13 @@ struct cmd_spec cmd_table[] = {
       "                migrate-receive [-d -e]\n"
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
+      "--compress      Compress the memory of the domain on the wire.\n"
+      "--auto-converge Throttle the domain if it dirties memory too fast for\n"
+      "                the migration to converge.\n"
+      "--workers N     Prepare the memory of the domain on N threads in\n"
+      "                parallel (at most 16, default 0: no extra threads).\n"
+      "--max-downtime MS\n"
+      "                Downtime of the domain to aim for (default 300ms).\n"
       "--debug         Print huge (!) amount of debug during the migration process."
     },
     { "restore",
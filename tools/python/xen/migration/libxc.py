@@ -25,7 +25,10 @@ IHDR_OPT_BIT_ENDIAN = 0
 IHDR_OPT_LE = (0 << IHDR_OPT_BIT_ENDIAN)
 IHDR_OPT_BE = (1 << IHDR_OPT_BIT_ENDIAN)
 
-IHDR_OPT_RESZ_MASK = 0xfffe
+IHDR_OPT_BIT_COMPRESSED = 1
+IHDR_OPT_COMPRESSED = (1 << IHDR_OPT_BIT_COMPRESSED)
+
+IHDR_OPT_RESZ_MASK = 0xfffc
 
 # Domain Header
 DHDR_FORMAT = "IHHII"
@@ -61,6 +64,11 @@ REC_TYPE_x86_pv_vcpu_msrs           = 0x0000000c
 REC_TYPE_verify                     = 0x0000000d
 REC_TYPE_checkpoint                 = 0x0000000e
 REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
+REC_TYPE_zero_pages                 = 0x00000010
+REC_TYPE_compressed_page_data       = 0x00000011
+REC_TYPE_postcopy_pfns              = 0x00000012
+REC_TYPE_postcopy_transition        = 0x00000013
+REC_TYPE_postcopy_page_request      = 0x00000014
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -78,7 +86,12 @@ rec_type_to_str = {
     REC_TYPE_x86_pv_vcpu_msrs           : "x86 PV vcpu msrs",
     REC_TYPE_verify                     : "Verify",
     REC_TYPE_checkpoint                 : "Checkpoint",
-    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list"
+    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list",
+    REC_TYPE_zero_pages                 : "Zero pages",
+    REC_TYPE_compressed_page_data       : "Compressed page data",
+    REC_TYPE_postcopy_pfns              : "Post-copy pfns",
+    REC_TYPE_postcopy_transition        : "Post-copy transition",
+    REC_TYPE_postcopy_page_request      : "Post-copy page request",
 }
 
 # page_data
@@ -101,6 +114,13 @@ PAGE_DATA_TYPE_BROKEN        = (0xdL << PAGE_DATA_TYPE_SHIFT) # Broken
 PAGE_DATA_TYPE_XALLOC        = (0xeL << PAGE_DATA_TYPE_SHIFT) # Allocate-only
 PAGE_DATA_TYPE_XTAB          = (0xfL << PAGE_DATA_TYPE_SHIFT) # Invalid
 
+# compressed_page_data
+COMPRESSED_PAGE_DATA_FORMAT  = "II"
+
+# zero_pages
+ZERO_PAGES_FORMAT            = "II"
+ZERO_PAGES_PFN_RES_MASK      = ~PAGE_DATA_PFN_MASK & ((1L << 64) - 1)
+
 # x86_pv_info
 X86_PV_INFO_FORMAT        = "BBHI"
 
@@ -123,6 +143,7 @@ class VerifyLibxc(VerifyBase):
         VerifyBase.__init__(self, info, read)
 
         self.squashed_pagedata_records = 0
+        self.compressed = False
 
 
     def verify(self):
@@ -166,7 +187,9 @@ class VerifyLibxc(VerifyBase):
                 "Stream is not native endianess - unable to validate")
 
         endian = ["little", "big"][options & IHDR_OPT_LE]
-        self.info("Libxc Image Header: %s endian" % (endian, ))
+        self.compressed = bool(options & IHDR_OPT_COMPRESSED)
+        self.info("Libxc Image Header: %s endian%s"
+                  % (endian, ["", ", compressed"][self.compressed]))
 
 
     def verify_dhdr(self):
@@ -205,7 +228,8 @@ class VerifyLibxc(VerifyBase):
         contentsz = (length + 7) & ~7
         content = self.rdexact(contentsz)
 
-        if rtype != REC_TYPE_page_data:
+        if rtype not in (REC_TYPE_page_data, REC_TYPE_zero_pages,
+                         REC_TYPE_compressed_page_data):
 
             if self.squashed_pagedata_records > 0:
                 self.info("Squashed %d Page Data records together"
@@ -281,6 +305,96 @@ class VerifyLibxc(VerifyBase):
                               % (minsz, pfnsz, pagesz, len(content)))
 
 
+    def verify_record_compressed_page_data(self, content):
+        """ Compressed Page Data record """
+        minsz = calcsize(COMPRESSED_PAGE_DATA_FORMAT)
+
+        if not self.compressed:
+            raise RecordError("COMPRESSED_PAGE_DATA record in a stream without"
+                              " the compressed option")
+
+        if len(content) <= minsz:
+            raise RecordError("COMPRESSED_PAGE_DATA record must be at least %d"
+                              " bytes long" % (minsz, ))
+
+        count, res1 = unpack(COMPRESSED_PAGE_DATA_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in COMPRESSED_PAGE_DATA record"
+                              " 0x%04x" % (res1, ))
+
+        pfnsz = count * 8
+        if (len(content) - minsz) < pfnsz:
+            raise RecordError("COMPRESSED_PAGE_DATA record must contain a pfn"
+                              " record for each count")
+
+        pfns = list(unpack("=%dQ" % (count,), content[minsz:minsz + pfnsz]))
+
+        nr_pages = 0
+        for idx, pfn in enumerate(pfns):
+
+            if pfn & PAGE_DATA_PFN_RESZ_MASK:
+                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x"
+                                  % (idx, pfn & PAGE_DATA_PFN_RESZ_MASK))
+
+            if pfn >> PAGE_DATA_TYPE_SHIFT in (5, 6, 7, 8):
+                raise RecordError("Invalid type value in pfn[%d]: 0x%016x"
+                                  % (idx, pfn & PAGE_DATA_TYPE_LTAB_MASK))
+
+            if PAGE_DATA_TYPE_NOTAB <= (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) \
+                    <= PAGE_DATA_TYPE_L4TAB:
+                nr_pages += 1
+
+        lensz = nr_pages * 4
+        hdrsz = minsz + pfnsz + lensz
+        if len(content) < hdrsz:
+            raise RecordError("COMPRESSED_PAGE_DATA record must contain a"
+                              " length for each page")
+
+        lengths = unpack("=%dI" % (nr_pages, ),
+                         content[minsz + pfnsz:hdrsz])
+
+        for idx, length in enumerate(lengths):
+            if not 0 < length <= 4096:
+                raise RecordError("Invalid length of page %d: %d"
+                                  % (idx, length))
+
+        datasz = sum(lengths)
+        if len(content) != hdrsz + datasz:
+            raise RecordError("Expected %u + %u, got %u"
+                              % (hdrsz, datasz, len(content)))
+
+
+    def verify_record_zero_pages(self, content):
+        """ Zero Pages record """
+        minsz = calcsize(ZERO_PAGES_FORMAT)
+
+        if len(content) <= minsz:
+            raise RecordError("ZERO_PAGES record must be at least %d bytes long"
+                              % (minsz, ))
+
+        count, res1 = unpack(ZERO_PAGES_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in ZERO_PAGES record 0x%04x"
+                              % (res1, ))
+
+        if count == 0:
+            raise RecordError("ZERO_PAGES record with no pfns")
+
+        pfnsz = count * 8
+        if len(content) != minsz + pfnsz:
+            raise RecordError("Expected %u + %u, got %u"
+                              % (minsz, pfnsz, len(content)))
+
+        pfns = unpack("=%dQ" % (count,), content[minsz:])
+
+        for idx, pfn in enumerate(pfns):
+            if pfn & ZERO_PAGES_PFN_RES_MASK:
+                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x"
+                                  % (idx, pfn & ZERO_PAGES_PFN_RES_MASK))
+
+
     def verify_record_x86_pv_info(self, content):
         """ x86 PV Info record """
 
@@ -409,6 +523,24 @@ class VerifyLibxc(VerifyBase):
         """ checkpoint dirty pfn list """
         raise RecordError("Found checkpoint dirty pfn list record in stream")
 
+    def verify_record_postcopy_pfns(self, content):
+        """ post-copy pfns record """
+
+        if len(content) == 0 or len(content) % 8 != 0:
+            raise RecordError("Length expected to be a non-zero multiple of 8,"
+                              " not %d" % (len(content), ))
+
+    def verify_record_postcopy_transition(self, content):
+        """ post-copy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Post-copy transition record with non-zero"
+                              " length")
+
+    def verify_record_postcopy_page_request(self, content):
+        """ post-copy page request """
+        raise RecordError("Found post-copy page request record in stream")
+
 
 record_verifiers = {
     REC_TYPE_end:
@@ -451,4 +583,14 @@ record_verifiers = {
         VerifyLibxc.verify_record_checkpoint,
     REC_TYPE_checkpoint_dirty_pfn_list:
         VerifyLibxc.verify_record_checkpoint_dirty_pfn_list,
+    REC_TYPE_zero_pages:
+        VerifyLibxc.verify_record_zero_pages,
+    REC_TYPE_compressed_page_data:
+        VerifyLibxc.verify_record_compressed_page_data,
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_page_request:
+        VerifyLibxc.verify_record_postcopy_page_request,
     }
@@ -0,0 +1,287 @@
+/*
+ * xenalyze-bench.c
+ *
+ * Benchmark for xenalyze: write a synthetic trace, in the format xentrace
+ * produces, then time a full summary pass of xenalyze over it.
+ *
+ * Each pcpu alternates between its idle vcpu and a vcpu of domain 1, with
+ * runstate change records for every switch, and a number of grant map
+ * records while domain 1 runs.  The records of each pcpu go in
+ * windows behind a cpu_change record, interleaved with the other pcpus
+ * the way xentrace writes out the per-cpu trace buffers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <xen/trace.h>
+
+#define IDLE_DOMAIN 32767
+
+/* Runstates, as in the runstate change records. */
+#define RUNSTATE_RUNNING  0
+#define RUNSTATE_RUNNABLE 1
+#define RUNSTATE_BLOCKED  2
+
+/* Cycles between two records on a pcpu. */
+#define RECORD_CYCLES 1000
+
+static unsigned int nr_cpus = 16, nr_windows = 256, nr_slices = 64,
+    nr_grants = 8;
+static uint64_t nr_records;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-c cpus] [-w windows] [-s slices] [-g grants] [-k]\n"
+            "          [-x xenalyze] tracefile\n"
+            "  -c cpus      pcpus in the trace (default 16)\n"
+            "  -w windows   trace windows per pcpu (default 256)\n"
+            "  -s slices    scheduling slices per window (default 64)\n"
+            "  -g grants    grant map records per slice (default 8)\n"
+            "  -k           keep an existing tracefile, don't write it\n"
+            "  -x xenalyze  xenalyze binary to time (default: xenalyze)\n",
+            prog);
+    exit(2);
+}
+
+/* Append a record with a tsc and nr_extra data words to buf. */
+static size_t put_record(uint32_t *buf, uint32_t event, uint64_t tsc,
+                         const uint32_t *extra, unsigned int nr_extra)
+{
+    struct t_rec *rec = (struct t_rec *)buf;
+
+    rec->event = event;
+    rec->extra_u32 = nr_extra;
+    rec->cycles_included = 1;
+    rec->u.cycles.cycles_lo = tsc;
+    rec->u.cycles.cycles_hi = tsc >> 32;
+    memcpy(rec->u.cycles.extra_u32, extra, nr_extra * sizeof(*extra));
+
+    nr_records++;
+
+    return 3 + nr_extra;
+}
+
+static size_t put_runstate(uint32_t *buf, uint64_t tsc, unsigned int dom,
+                           unsigned int vcpu, unsigned int old,
+                           unsigned int new)
+{
+    uint32_t extra = (dom << 16) | vcpu;
+
+    return put_record(buf, TRC_SCHED_RUNSTATE_CHANGE | (old << 8) | (new << 4),
+                      tsc, &extra, 1);
+}
+
+/* Fill in the records of one window of pcpu cpu.  Returns 32-bit words. */
+static size_t fill_window(uint32_t *buf, unsigned int cpu, uint64_t *tsc)
+{
+    uint32_t dom = 1;
+    size_t n = 0;
+    unsigned int s, g;
+
+    for ( s = 0; s < nr_slices; s++ )
+    {
+        n += put_runstate(buf + n, *tsc, IDLE_DOMAIN, cpu,
+                          RUNSTATE_RUNNING, RUNSTATE_RUNNABLE);
+        n += put_runstate(buf + n, *tsc, dom, cpu,
+                          RUNSTATE_RUNNABLE, RUNSTATE_RUNNING);
+        *tsc += RECORD_CYCLES;
+
+        for ( g = 0; g < nr_grants; g++ )
+        {
+            n += put_record(buf + n, TRC_MEM_PAGE_GRANT_MAP, *tsc, &dom, 1);
+            *tsc += RECORD_CYCLES;
+        }
+
+        n += put_runstate(buf + n, *tsc, dom, cpu,
+                          RUNSTATE_RUNNING, RUNSTATE_BLOCKED);
+        n += put_runstate(buf + n, *tsc, IDLE_DOMAIN, cpu,
+                          RUNSTATE_RUNNABLE, RUNSTATE_RUNNING);
+        *tsc += RECORD_CYCLES;
+
+        /* Blocked for a while; the vcpu wakes up on its own. */
+        *tsc += 4 * RECORD_CYCLES;
+        n += put_runstate(buf + n, *tsc, dom, cpu,
+                          RUNSTATE_BLOCKED, RUNSTATE_RUNNABLE);
+        *tsc += RECORD_CYCLES;
+    }
+
+    return n;
+}
+
+static int write_trace(const char *file)
+{
+    size_t max_words = nr_slices * (5 + nr_grants) * 4;
+    uint32_t *buf = malloc((max_words + 3) * sizeof(*buf));
+    uint64_t *tsc = calloc(nr_cpus, sizeof(*tsc));
+    unsigned int w, c;
+    FILE *f;
+
+    if ( !buf || !tsc )
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    f = fopen(file, "w");
+    if ( !f )
+    {
+        fprintf(stderr, "Could not create %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    for ( c = 0; c < nr_cpus; c++ )
+        tsc[c] = 1000000 + c;
+
+    for ( w = 0; w < nr_windows; w++ )
+    {
+        for ( c = 0; c < nr_cpus; c++ )
+        {
+            size_t n = fill_window(buf + 3, c, &tsc[c]);
+
+            /* cpu_change: cpu and the size of the window following it. */
+            buf[0] = TRC_TRACE_CPU_CHANGE | (2U << 28);
+            buf[1] = c;
+            buf[2] = n * sizeof(*buf);
+
+            if ( fwrite(buf, sizeof(*buf), n + 3, f) != n + 3 )
+            {
+                fprintf(stderr, "Write to %s failed: %s\n", file,
+                        strerror(errno));
+                fclose(f);
+                return -1;
+            }
+        }
+    }
+
+    free(tsc);
+    free(buf);
+
+    return fclose(f);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    const char *xenalyze = "xenalyze", *file;
+    bool keep = false;
+    struct stat st;
+    double start, elapsed;
+    pid_t pid;
+    int opt, status;
+
+    while ( (opt = getopt(argc, argv, "c:w:s:g:kx:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'c':
+            nr_cpus = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            nr_windows = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            nr_slices = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            nr_grants = strtoul(optarg, NULL, 0);
+            break;
+        case 'k':
+            keep = true;
+            break;
+        case 'x':
+            xenalyze = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( optind != argc - 1 || !nr_cpus || !nr_slices )
+        usage(argv[0]);
+    file = argv[optind];
+
+    if ( !keep || stat(file, &st) )
+    {
+        start = now();
+        if ( write_trace(file) )
+            return 1;
+        printf("Wrote %"PRIu64" records in %.2fs\n", nr_records,
+               now() - start);
+    }
+
+    if ( stat(file, &st) )
+    {
+        fprintf(stderr, "Could not stat %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+
+    start = now();
+
+    pid = fork();
+    if ( pid < 0 )
+    {
+        perror("fork");
+        return 1;
+    }
+    if ( pid == 0 )
+    {
+        int null = open("/dev/null", O_WRONLY);
+
+        if ( null >= 0 )
+        {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execlp(xenalyze, xenalyze, "--summary", file, NULL);
+        _exit(127);
+    }
+
+    if ( waitpid(pid, &status, 0) < 0 )
+    {
+        perror("waitpid");
+        return 1;
+    }
+    elapsed = now() - start;
+
+    if ( !WIFEXITED(status) || WEXITSTATUS(status) )
+    {
+        fprintf(stderr, "%s failed (status %#x)\n", xenalyze, status);
+        return 1;
+    }
+
+    printf("%s --summary: %lld bytes in %.2fs, %.1f MB/s\n", xenalyze,
+           (long long)st.st_size, elapsed, st.st_size / elapsed / 1e6);
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * xs-watch-bench.c
+ *
+ * Micro-benchmark for watch dispatch in xenstored: register a number of
+ * watches, then measure how many writes per second xenstored can handle.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <xenstore.h>
+
+#define BENCH_ROOT "/xs-watch-bench"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n watches] [-w writes] [-f] [-k]\n"
+            "  -n watches  number of watches to register (default 1000)\n"
+            "  -w writes   number of writes to time (default 10000)\n"
+            "  -f          write the watched nodes, so every write fires\n"
+            "              a watch (default: write unwatched siblings)\n"
+            "  -k          keep the " BENCH_ROOT " subtree afterwards\n",
+            prog);
+    exit(2);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Consume pending watch events, so they don't pile up in the library. */
+static void drain_events(struct xs_handle *xsh)
+{
+    char **vec;
+
+    while ( (vec = xs_check_watch(xsh)) != NULL )
+        free(vec);
+}
+
+int main(int argc, char *argv[])
+{
+    struct xs_handle *xsh;
+    unsigned int nr_watches = 1000, nr_writes = 10000, i;
+    bool fire = false, keep = false;
+    char path[64], token[16];
+    double start, elapsed;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "n:w:fkh")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n':
+            nr_watches = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            nr_writes = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            fire = true;
+            break;
+        case 'k':
+            keep = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( nr_watches == 0 || nr_writes == 0 )
+        usage(argv[0]);
+
+    xsh = xs_open(0);
+    if ( !xsh )
+    {
+        perror("xs_open");
+        return 1;
+    }
+
+    /* Lay out the tree like backends watching their frontends' state. */
+    start = now();
+    for ( i = 0; i < nr_watches; i++ )
+    {
+        snprintf(path, sizeof(path), BENCH_ROOT "/%u/state", i);
+        snprintf(token, sizeof(token), "%u", i);
+        if ( !xs_write(xsh, XBT_NULL, path, "1", 1) ||
+             !xs_watch(xsh, path, token) )
+        {
+            fprintf(stderr, "Failed to set up watch %u: %s\n",
+                    i, strerror(errno));
+            return 1;
+        }
+        drain_events(xsh);
+    }
+    elapsed = now() - start;
+    printf("registered %u watches in %.3fs\n", nr_watches, elapsed);
+
+    start = now();
+    for ( i = 0; i < nr_writes; i++ )
+    {
+        snprintf(path, sizeof(path), BENCH_ROOT "/%u/%s",
+                 i % nr_watches, fire ? "state" : "data");
+        if ( !xs_write(xsh, XBT_NULL, path, "2", 1) )
+        {
+            fprintf(stderr, "Write of %s failed: %s\n", path,
+                    strerror(errno));
+            return 1;
+        }
+        drain_events(xsh);
+    }
+    elapsed = now() - start;
+    printf("%u writes (%s) in %.3fs: %.0f writes/sec\n", nr_writes,
+           fire ? "watched" : "unwatched", elapsed, nr_writes / elapsed);
+
+    for ( i = 0; i < nr_watches; i++ )
+    {
+        snprintf(path, sizeof(path), BENCH_ROOT "/%u/state", i);
+        snprintf(token, sizeof(token), "%u", i);
+        xs_unwatch(xsh, path, token);
+    }
+
+    if ( !keep )
+        xs_rm(xsh, XBT_NULL, BENCH_ROOT);
+
+    xs_close(xsh);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
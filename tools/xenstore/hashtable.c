@@ -226,6 +226,53 @@ hashtable_remove(struct hashtable *h, void *k)
     return NULL;
 }
 
+/*****************************************************************************/
+void * /* returns old value associated with key */
+hashtable_replace(struct hashtable *h, void *k, void *v)
+{
+    struct entry *e;
+    unsigned int hashvalue, index;
+    void *old;
+    hashvalue = hash(h,k);
+    index = indexFor(h->tablelength,hashvalue);
+    e = h->table[index];
+    while (NULL != e)
+    {
+        /* Check hash value to short circuit heavier comparison */
+        if ((hashvalue == e->h) && (h->eqfn(k, e->k)))
+        {
+            old = e->v;
+            e->v = v;
+            return old;
+        }
+        e = e->next;
+    }
+    return NULL;
+}
+
+/*****************************************************************************/
+int
+hashtable_iterate(struct hashtable *h,
+                  int (*func)(void *k, void *v, void *arg), void *arg)
+{
+    int ret;
+    unsigned int i;
+    struct entry *e;
+    struct entry **table = h->table;
+
+    for (i = 0; i < h->tablelength; i++)
+    {
+        for (e = table[i]; e; e = e->next)
+        {
+            ret = func(e->k, e->v, arg);
+            if (ret)
+                return ret;
+        }
+    }
+
+    return 0;
+}
+
 /*****************************************************************************/
 /* destroy */
 void
@@ -145,6 +145,22 @@ valuetype * fnname (struct hashtable *h, keytype *k) \
     return (valuetype *) (hashtable_remove(h,k)); \
 }
 
+/*****************************************************************************
+ * hashtable_replace
+   
+ * @name        hashtable_replace
+ * @param   h   the hashtable
+ * @param   k   the key to search for  - does not claim ownership
+ * @param   v   the new value - does not claim ownership
+ * @return      the value previously associated with the key, or NULL if
+ *              none found (nothing is stored then)
+ *
+ * Unlike remove + insert this cannot fail for lack of memory.
+ */
+
+void * /* returns old value */
+hashtable_replace(struct hashtable *h, void *k, void *v);
+
 
 /*****************************************************************************
  * hashtable_count
@@ -157,6 +173,21 @@ unsigned int
 hashtable_count(struct hashtable *h);
 
 
+/*****************************************************************************
+ * hashtable_iterate
+
+ * @name        hashtable_iterate
+ * @param   h   the hashtable
+ * @param   func function to call for each entry; iteration stops if it
+ *               returns non-zero.  It must not modify the hashtable.
+ * @param   arg  opaque argument passed to func
+ * @return      0, or the first non-zero value returned by func
+ */
+int
+hashtable_iterate(struct hashtable *h,
+                  int (*func)(void *k, void *v, void *arg), void *arg);
+
+
 /*****************************************************************************
  * hashtable_destroy
    
@@ -48,6 +48,7 @@
 #define XS_UNWATCH_FILTER     1UL<<2
 
 struct xs_handle;
+struct xs_batch;
 typedef uint32_t xs_transaction_t;
 
 /* IMPORTANT: For details on xenstore protocol limits, see
@@ -229,6 +230,36 @@ xs_transaction_t xs_transaction_start(struct xs_handle *h);
 bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t,
 			bool abort);
 
+/* Batches collect write, mkdir, rm and set_permissions operations and
+ * send them to the daemon together, saving a round trip per operation.
+ * The xs_batch_* queueing functions return false on failure (too large
+ * an operation, or out of memory); the error is also reported when the
+ * batch is committed, so callers may check only the result of
+ * xs_batch_commit.
+ */
+struct xs_batch *xs_batch_start(void);
+bool xs_batch_write(struct xs_batch *b, const char *path,
+		    const void *data, unsigned int len);
+bool xs_batch_mkdir(struct xs_batch *b, const char *path);
+bool xs_batch_rm(struct xs_batch *b, const char *path);
+bool xs_batch_set_permissions(struct xs_batch *b, const char *path,
+			      struct xs_permissions *perms,
+			      unsigned int num_perms);
+
+/* Execute the operations of batch b in order, stopping at the first
+ * failure.  Without a transaction the batch is applied atomically (if it
+ * exceeds the size of a single request a transaction is used internally),
+ * inside transaction t a failed batch may be partially applied and the
+ * transaction should be abandoned.  Daemons not supporting batches get
+ * the operations one at a time, which is not atomic.
+ * Returns false on failure.
+ */
+bool xs_batch_commit(struct xs_handle *h, xs_transaction_t t,
+		     struct xs_batch *b);
+
+/* Free a batch, committed or not. */
+void xs_batch_free(struct xs_batch *b);
+
 /* Introduce a new domain.
  * This tells the store daemon about a shared memory page, event channel and
  * store path associated with a domain: the domain uses these to communicate.
@@ -50,7 +50,7 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
-#include "tdb.h"
+#include "xenstored_store.h"
 
 #include "hashtable.h"
 
@@ -72,7 +72,7 @@ static unsigned int nr_fds;
 
 #define ROUNDUP(_x, _w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
 
-static bool verbose = false;
+bool verbose = false;
 LIST_HEAD(connections);
 static int tracefd = -1;
 static bool recovery = true;
@@ -80,7 +80,7 @@ static bool remove_local = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
+static enum store_type store_type = STORE_MEMORY;
 
 static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
@@ -104,24 +104,6 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
-{
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
-}
-
 static char *sockmsg_string(enum xsd_sockmsg_type type)
 {
 	switch (type) {
@@ -146,6 +128,7 @@ static char *sockmsg_string(enum xsd_sockmsg_type type)
 	case XS_RESUME: return "RESUME";
 	case XS_SET_TARGET: return "SET_TARGET";
 	case XS_RESET_WATCHES: return "RESET_WATCHES";
+	case XS_BATCH: return "BATCH";
 	default:
 		return "**UNKNOWN**";
 	}
@@ -410,82 +393,63 @@ bool is_child(const char *child, const char *parent)
 /* If it fails, returns NULL and sets errno. */
 static struct node *read_node(struct connection *conn, const char *name)
 {
-	TDB_DATA key, data;
-	uint32_t *p;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
 
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
+	node = talloc(name, struct node);
+	if (!node) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	node->name = talloc_strdup(node, name);
+	node->parent = NULL;
 
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
+	if (store_fetch(transaction_prepend(conn, name), node)) {
+		if (errno == ENOENT) {
+			/* Remember non-existence in the transaction, too. */
+			node->generation = NO_GENERATION;
+			access_node(conn, node, NODE_ACCESS_READ, NULL);
 			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
+		} else if (errno != ENOMEM) {
+			log("Store error on reading %s", name);
 			errno = EIO;
 		}
+		talloc_free(node);
 		return NULL;
 	}
 
-	node = talloc(name, struct node);
-	node->name = talloc_strdup(node, name);
-	node->parent = NULL;
-	node->tdb = tdb_context(conn);
-	talloc_steal(node, data.dptr);
-
-	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
-
-	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
-	/* Data is binary blob (usually ascii, no nul). */
-	node->data = node->perms + node->num_perms;
-	/* Children is strings, nul separated. */
-	node->children = node->data + node->datalen;
+	if (access_node(conn, node, NODE_ACCESS_READ, NULL)) {
+		talloc_free(node);
+		return NULL;
+	}
 
 	return node;
 }
 
-static bool write_node(struct connection *conn, const struct node *node)
+static bool write_node(struct connection *conn, struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * access_node copes with this.
 	 */
 
-	TDB_DATA key, data;
-	void *p;
+	const char *key;
+	unsigned int size;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	data.dsize = 3*sizeof(uint32_t)
+	/* Quota is on the size of the packed (tdb) node record. */
+	size = sizeof(uint64_t) + 3*sizeof(uint32_t)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
-	if (domain_is_unprivileged(conn) && data.dsize >= quota_max_entry_size)
+	if (domain_is_unprivileged(conn) && size >= quota_max_entry_size)
 		goto error;
 
-	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
-
-	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
-	p += node->num_perms*sizeof(node->perms[0]);
-	memcpy(p, node->data, node->datalen);
-	p += node->datalen;
-	memcpy(p, node->children, node->childlen);
-
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key.dptr);
+	if (access_node(conn, node, NODE_ACCESS_WRITE, &key))
+		return false;
+
+	if (store_write(key, node)) {
+		if (errno == ENOMEM)
+			return false;
+		corrupt(conn, "Write of %s failed", key);
 		goto error;
 	}
 	return true;
@@ -676,6 +640,16 @@ void send_ack(struct connection *conn, enum xsd_sockmsg_type type)
 	send_reply(conn, type, "OK", sizeof("OK"));
 }
 
+/* Send an ack or, if error is non-zero, an error reply. */
+static void send_result(struct connection *conn, enum xsd_sockmsg_type type,
+			int error)
+{
+	if (error)
+		send_error(conn, error);
+	else
+		send_ack(conn, type);
+}
+
 void send_error(struct connection *conn, int error)
 {
 	unsigned int i;
@@ -801,12 +775,14 @@ static void do_read(struct connection *conn, const char *name)
 
 static void delete_node_single(struct connection *conn, struct node *node)
 {
-	TDB_DATA key;
+	const char *key;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	if (access_node(conn, node, NODE_ACCESS_DELETE, &key))
+		return;
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	/* In a transaction there might be no private copy of the node. */
+	if (store_delete(key) != 0 &&
+	    (!conn || !conn->transaction || errno != ENOENT)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -847,7 +823,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->generation = NO_GENERATION;
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -865,19 +841,15 @@ static struct node *construct_node(struct connection *conn, const char *name)
 	return node;
 }
 
-static int destroy_node(void *_node)
+static void destroy_node(struct connection *conn, struct node *node)
 {
-	struct node *node = _node;
-	TDB_DATA key;
+	const char *key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
-	return 0;
+	if (!access_node(conn, node, NODE_ACCESS_DELETE, &key))
+		store_delete(key);
 }
 
 static struct node *create_node(struct connection *conn, 
@@ -893,24 +865,25 @@ static struct node *create_node(struct connection *conn,
 	node->data = data;
 	node->datalen = datalen;
 
-	/* We write out the nodes down, setting destructor in case
-	 * something goes wrong. */
+	/* We write out the nodes down, removing the ones already written
+	 * in case something goes wrong. */
 	for (i = node; i; i = i->parent) {
 		if (!write_node(conn, i)) {
+			int saved_errno = errno;
+
 			domain_entry_dec(conn, i);
+			for (; node != i; node = node->parent)
+				destroy_node(conn, node);
+			errno = saved_errno;
 			return NULL;
 		}
-		talloc_set_destructor(i, destroy_node);
 	}
 
-	/* OK, now remove destructors so they stay around */
-	for (i = node; i; i = i->parent)
-		talloc_set_destructor(i, NULL);
 	return node;
 }
 
 /* path, data... */
-static void do_write(struct connection *conn, struct buffered_data *in)
+static int do_write(struct connection *conn, struct buffered_data *in)
 {
 	unsigned int offset, datalen;
 	struct node *node;
@@ -918,10 +891,8 @@ static void do_write(struct connection *conn, struct buffered_data *in)
 	char *name;
 
 	/* Extra "strings" can be created by binary data. */
-	if (get_strings(in, vec, ARRAY_SIZE(vec)) < ARRAY_SIZE(vec)) {
-		send_error(conn, EINVAL);
-		return;
-	}
+	if (get_strings(in, vec, ARRAY_SIZE(vec)) < ARRAY_SIZE(vec))
+		return EINVAL;
 
 	offset = strlen(vec[0]) + 1;
 	datalen = in->used - offset;
@@ -930,30 +901,24 @@ static void do_write(struct connection *conn, struct buffered_data *in)
 	node = get_node(conn, name, XS_PERM_WRITE);
 	if (!node) {
 		/* No permissions, invalid input? */
-		if (errno != ENOENT) {
-			send_error(conn, errno);
-			return;
-		}
+		if (errno != ENOENT)
+			return errno;
 		node = create_node(conn, name, in->buffer + offset, datalen);
-		if (!node) {
-			send_error(conn, errno);
-			return;
-		}
+		if (!node)
+			return errno;
 	} else {
 		node->data = in->buffer + offset;
 		node->datalen = datalen;
-		if (!write_node(conn, node)){
-			send_error(conn, errno);
-			return;
-		}
+		if (!write_node(conn, node))
+			return errno;
 	}
 
 	add_change_node(conn->transaction, name, false);
 	fire_watches(conn, name, false);
-	send_ack(conn, XS_WRITE);
+	return 0;
 }
 
-static void do_mkdir(struct connection *conn, const char *name)
+static int do_mkdir(struct connection *conn, const char *name)
 {
 	struct node *node;
 
@@ -963,19 +928,15 @@ static void do_mkdir(struct connection *conn, const char *name)
 	/* If it already exists, fine. */
 	if (!node) {
 		/* No permissions? */
-		if (errno != ENOENT) {
-			send_error(conn, errno);
-			return;
-		}
+		if (errno != ENOENT)
+			return errno;
 		node = create_node(conn, name, NULL, 0);
-		if (!node) {
-			send_error(conn, errno);
-			return;
-		}
+		if (!node)
+			return errno;
 		add_change_node(conn->transaction, name, false);
 		fire_watches(conn, name, false);
 	}
-	send_ack(conn, XS_MKDIR);
+	return 0;
 }
 
 static void delete_node(struct connection *conn, struct node *node)
@@ -1006,19 +967,23 @@ static void delete_node(struct connection *conn, struct node *node)
 }
 
 
-/* Delete memory using memmove. */
-static void memdel(void *mem, unsigned off, unsigned len, unsigned total)
-{
-	memmove(mem + off, mem + off + len, total - off - len);
-}
-
-
 static bool remove_child_entry(struct connection *conn, struct node *node,
 			       size_t offset)
 {
-	size_t childlen = strlen(node->children + offset);
-	memdel(node->children, offset, childlen + 1, node->childlen);
-	node->childlen -= childlen + 1;
+	size_t childlen = strlen(node->children + offset) + 1;
+	char *children;
+
+	/* The children may be shared with the store: don't modify in place. */
+	children = talloc_array(node, char, node->childlen - childlen);
+	if (!children) {
+		errno = ENOMEM;
+		return false;
+	}
+	memcpy(children, node->children, offset);
+	memcpy(children + offset, node->children + offset + childlen,
+	       node->childlen - offset - childlen);
+	node->children = children;
+	node->childlen -= childlen;
 	return write_node(conn, node);
 }
 
@@ -1044,18 +1009,14 @@ static int _rm(struct connection *conn, struct node *node, const char *name)
 	   happen is the child will continue to take up space, but will
 	   otherwise be unreachable. */
 	struct node *parent = read_node(conn, get_parent(name));
-	if (!parent) {
-		send_error(conn, EINVAL);
-		return 0;
-	}
+	if (!parent)
+		return EINVAL;
 
-	if (!delete_child(conn, parent, basename(name))) {
-		send_error(conn, EINVAL);
-		return 0;
-	}
+	if (!delete_child(conn, parent, basename(name)))
+		return EINVAL;
 
 	delete_node(conn, node);
-	return 1;
+	return 0;
 }
 
 
@@ -1070,9 +1031,10 @@ static void internal_rm(const char *name)
 }
 
 
-static void do_rm(struct connection *conn, const char *name)
+static int do_rm(struct connection *conn, const char *name)
 {
 	struct node *node;
+	int ret;
 
 	name = canonicalize(conn, name);
 	node = get_node(conn, name, XS_PERM_WRITE);
@@ -1080,27 +1042,24 @@ static void do_rm(struct connection *conn, const char *name)
 		/* Didn't exist already?  Fine, if parent exists. */
 		if (errno == ENOENT) {
 			node = read_node(conn, get_parent(name));
-			if (node) {
-				send_ack(conn, XS_RM);
-				return;
-			}
+			if (node)
+				return 0;
 			/* Restore errno, just in case. */
 			errno = ENOENT;
 		}
-		send_error(conn, errno);
-		return;
+		return errno;
 	}
 
-	if (streq(name, "/")) {
-		send_error(conn, EINVAL);
-		return;
-	}
+	if (streq(name, "/"))
+		return EINVAL;
 
-	if (_rm(conn, node, name)) {
-		add_change_node(conn->transaction, name, true);
-		fire_watches(conn, name, true);
-		send_ack(conn, XS_RM);
-	}
+	ret = _rm(conn, node, name);
+	if (ret)
+		return ret;
+
+	add_change_node(conn->transaction, name, true);
+	fire_watches(conn, name, true);
+	return 0;
 }
 
 
@@ -1124,7 +1083,7 @@ static void do_get_perms(struct connection *conn, const char *name)
 		send_reply(conn, XS_GET_PERMS, strings, len);
 }
 
-static void do_set_perms(struct connection *conn, struct buffered_data *in)
+static int do_set_perms(struct connection *conn, struct buffered_data *in)
 {
 	unsigned int num;
 	struct xs_permissions *perms;
@@ -1132,10 +1091,8 @@ static void do_set_perms(struct connection *conn, struct buffered_data *in)
 	struct node *node;
 
 	num = xs_count_strings(in->buffer, in->used);
-	if (num < 2) {
-		send_error(conn, EINVAL);
-		return;
-	}
+	if (num < 2)
+		return EINVAL;
 
 	/* First arg is node name. */
 	name = canonicalize(conn, in->buffer);
@@ -1144,37 +1101,113 @@ static void do_set_perms(struct connection *conn, struct buffered_data *in)
 
 	/* We must own node to do this (tools can do this too). */
 	node = get_node(conn, name, XS_PERM_WRITE|XS_PERM_OWNER);
-	if (!node) {
-		send_error(conn, errno);
-		return;
-	}
+	if (!node)
+		return errno;
 
 	perms = talloc_array(node, struct xs_permissions, num);
-	if (!xs_strings_to_perms(perms, num, permstr)) {
-		send_error(conn, errno);
-		return;
-	}
+	if (!xs_strings_to_perms(perms, num, permstr))
+		return errno;
 
 	/* Unprivileged domains may not change the owner. */
 	if (domain_is_unprivileged(conn) &&
-	    perms[0].id != node->perms[0].id) {
-		send_error(conn, EPERM);
-		return;
-	}
+	    perms[0].id != node->perms[0].id)
+		return EPERM;
 
 	domain_entry_dec(conn, node);
 	node->perms = perms;
 	node->num_perms = num;
 	domain_entry_inc(conn, node);
 
-	if (!write_node(conn, node)) {
-		send_error(conn, errno);
-		return;
-	}
+	if (!write_node(conn, node))
+		return errno;
 
 	add_change_node(conn->transaction, name, false);
 	fire_watches(conn, name, false);
-	send_ack(conn, XS_SET_PERMS);
+	return 0;
+}
+
+/*
+ * A sequence of modifying operations, each given as a struct xsd_sockmsg
+ * header (only type and len are used) followed by len bytes of payload.
+ * The operations are applied in order; outside of a transaction they are
+ * applied atomically, i.e. either all or none of them take effect.
+ */
+static int do_batch_ops(struct connection *conn, struct buffered_data *in)
+{
+	struct buffered_data op;
+	unsigned int offset = 0;
+	int ret;
+
+	if (!in->used)
+		return EINVAL;
+
+	while (offset < in->used) {
+		if (in->used - offset < sizeof(op.hdr.msg))
+			return EINVAL;
+		memcpy(&op.hdr.msg, in->buffer + offset, sizeof(op.hdr.msg));
+		offset += sizeof(op.hdr.msg);
+		if (op.hdr.msg.len > in->used - offset)
+			return EINVAL;
+		op.used = op.hdr.msg.len;
+
+		/* Handlers use the payload as talloc context: copy it. */
+		op.buffer = talloc_array(in, char, op.used);
+		if (!op.buffer)
+			return ENOMEM;
+		memcpy(op.buffer, in->buffer + offset, op.used);
+		offset += op.used;
+
+		switch (op.hdr.msg.type) {
+		case XS_WRITE:
+			ret = do_write(conn, &op);
+			break;
+
+		case XS_MKDIR:
+			ret = do_mkdir(conn, onearg(&op));
+			break;
+
+		case XS_RM:
+			ret = do_rm(conn, onearg(&op));
+			break;
+
+		case XS_SET_PERMS:
+			ret = do_set_perms(conn, &op);
+			break;
+
+		default:
+			ret = EINVAL;
+			break;
+		}
+
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int do_batch(struct connection *conn, struct buffered_data *in)
+{
+	struct transaction *trans;
+	int ret;
+
+	/* Within a transaction the caller decides whether to commit. */
+	if (conn->transaction)
+		return do_batch_ops(conn, in);
+
+	trans = transaction_start_internal(in);
+	if (!trans)
+		return ENOMEM;
+
+	conn->transaction = trans;
+	ret = do_batch_ops(conn, in);
+	conn->transaction = NULL;
+
+	if (!ret)
+		ret = transaction_commit(conn, trans);
+
+	talloc_free(trans);
+	return ret;
 }
 
 static void do_debug(struct connection *conn, struct buffered_data *in)
@@ -1228,15 +1261,15 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 		break;
 
 	case XS_WRITE:
-		do_write(conn, in);
+		send_result(conn, XS_WRITE, do_write(conn, in));
 		break;
 
 	case XS_MKDIR:
-		do_mkdir(conn, onearg(in));
+		send_result(conn, XS_MKDIR, do_mkdir(conn, onearg(in)));
 		break;
 
 	case XS_RM:
-		do_rm(conn, onearg(in));
+		send_result(conn, XS_RM, do_rm(conn, onearg(in)));
 		break;
 
 	case XS_GET_PERMS:
@@ -1244,7 +1277,7 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 		break;
 
 	case XS_SET_PERMS:
-		do_set_perms(conn, in);
+		send_result(conn, XS_SET_PERMS, do_set_perms(conn, in));
 		break;
 
 	case XS_DEBUG:
@@ -1295,6 +1328,10 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 		do_reset_watches(conn);
 		break;
 
+	case XS_BATCH:
+		send_result(conn, XS_BATCH, do_batch(conn, in));
+		break;
+
 	default:
 		eprintf("Client unknown operation %i", in->hdr.msg.type);
 		send_error(conn, ENOSYS);
@@ -1462,8 +1499,6 @@ static void accept_connection(int sock, bool canwrite)
 }
 #endif
 
-static int tdb_flags;
-
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
 {
@@ -1483,37 +1518,9 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
-static void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
-{
-	va_list ap;
-	char *s;
-
-	va_start(ap, fmt);
-	s = talloc_vasprintf(NULL, fmt, ap);
-	va_end(ap);
-
-	if (s) {
-		trace("TDB: %s\n", s);
-		syslog(LOG_ERR, "TDB: %s",  s);
-		if (verbose)
-			xprintf("TDB: %s", s);
-		talloc_free(s);
-	} else {
-		trace("talloc failure during logging\n");
-		syslog(LOG_ERR, "talloc failure during logging\n");
-	}
-}
-
 static void setup_structure(void)
 {
-	char *tdbname;
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-
-	if (!(tdb_flags & TDB_INTERNAL))
-		tdb_ctx = tdb_open_ex(tdbname, 0, tdb_flags, O_RDWR, 0,
-				      &tdb_logger, NULL);
-
-	if (tdb_ctx) {
+	if (store_open(store_type)) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1542,11 +1549,6 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open_ex(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				      0640, &tdb_logger, NULL);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
-
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
 		manual_node("/tool/xenstored", NULL);
@@ -1556,7 +1558,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1569,7 +1571,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1673,22 +1675,20 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static void clean_store_(const char *name, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
 
-	if (!hashtable_search(reachable, name)) {
+	/* Skip transaction private copies of nodes. */
+	if (name[0] != '/')
+		return;
+
+	if (!hashtable_search(reachable, (void *)name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			store_delete(name);
 		}
 	}
-
-	talloc_free(name);
-
-	return 0;
 }
 
 
@@ -1698,7 +1698,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	store_traverse(&clean_store_, reachable);
 }
 
 
@@ -1899,7 +1899,8 @@ static void usage(void)
 "  -t, --transaction <nb>  limit the number of transaction allowed per domain,\n"
 "  -R, --no-recovery       to request that no recovery should be attempted when\n"
 "                          the store is corrupted (debug only),\n"
-"  -I, --internal-db       store database in memory, not on disk\n"
+"  -U, --use-tdb           store database in a tdb file instead of in memory,\n"
+"  -I, --internal-db       with --use-tdb: keep the tdb in memory, not on disk\n"
 "  -L, --preserve-local    to request that /local is preserved on start-up,\n"
 "  -V, --verbose           to request verbose execution.\n");
 }
@@ -1921,6 +1922,7 @@ static struct option options[] = {
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "preserve-local", 0, NULL, 'L' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "use-tdb", 0, NULL, 'U' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
@@ -1937,13 +1939,14 @@ int main(int argc, char *argv[])
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
+	bool use_tdb = false, internal_db = false;
 	const char *pidfile = NULL;
 	int timeout;
 #if defined(XEN_SYSTEMD_ENABLED)
 	bool systemd;
 #endif
 
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
+	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLIUVW:", options,
 				  NULL)) != -1) {
 		switch (opt) {
 		case 'D':
@@ -1980,7 +1983,10 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			internal_db = true;
+			break;
+		case 'U':
+			use_tdb = true;
 			break;
 		case 'V':
 			verbose = true;
@@ -2002,6 +2008,9 @@ int main(int argc, char *argv[])
 	if (optind != argc)
 		barf("%s: No arguments desired", argv[0]);
 
+	if (use_tdb)
+		store_type = internal_db ? STORE_TDB_INTERNAL : STORE_TDB;
+
 #if defined(XEN_SYSTEMD_ENABLED)
 	systemd = systemd_checkin(&sock, &ro_sock);
 	if (systemd) {
@@ -2043,6 +2052,9 @@ int main(int argc, char *argv[])
 	/* Setup the database */
 	setup_structure();
 
+	/* Setup the watch index. */
+	watch_init();
+
 	/* Listen to hypervisor. */
 	if (!no_domain_init)
 		domain_init();
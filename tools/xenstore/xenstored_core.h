@@ -31,7 +31,6 @@
 
 #include "xenstore_lib.h"
 #include "list.h"
-#include "tdb.h"
 
 struct buffered_data
 {
@@ -100,11 +99,14 @@ struct connection
 };
 extern struct list_head connections;
 
+/* Generation count of a node which doesn't exist. */
+#define NO_GENERATION ~((uint64_t)0)
+
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Generation count of the node. */
+	uint64_t generation;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -149,21 +151,16 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
-
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
-
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
-
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
 
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
 
+/* Hash functions for string keys in struct hashtable. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
+
 /* Tracing infrastructure. */
 void trace_create(const void *data, const char *type);
 void trace_destroy(const void *data, const char *type);
@@ -175,6 +172,7 @@ extern int event_fd;
 extern int dom0_domid;
 extern int dom0_event;
 extern int priv_domid;
+extern bool verbose;
 
 /* Map the kernel's xenstore page. */
 void *xenbus_map(void);
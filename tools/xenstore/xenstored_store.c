@@ -0,0 +1,469 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include "talloc.h"
+#include "hashtable.h"
+#include "xenstored_core.h"
+#include "tdb.h"
+#include "xenstored_store.h"
+#include "xenstore_lib.h"
+#include "utils.h"
+
+/*
+ * The node store maps keys (node names, or transaction private names of
+ * nodes) to node records.  Two backends are available: an in-memory one
+ * keeping the parsed nodes in a hash table, and the traditional tdb one
+ * storing packed records.
+ */
+struct store_ops {
+	int (*fetch)(const char *key, struct node *node);
+	int (*write)(const char *key, const struct node *node);
+	int (*delete)(const char *key);
+	void (*traverse)(void (*fn)(const char *key, void *private),
+			 void *private);
+};
+
+static const struct store_ops *store;
+
+/*
+ * In-memory backend.
+ *
+ * Each record is a single block holding the node contents.  Fetched nodes
+ * point directly into the record and hold a reference to it, so the record
+ * stays valid for them even if it is replaced or deleted meanwhile.
+ */
+struct mem_record {
+	/* References: one from the hash table, one per fetched node. */
+	unsigned int refcnt;
+
+	uint64_t generation;
+	unsigned int num_perms;
+	unsigned int datalen;
+	unsigned int childlen;
+	struct xs_permissions *perms;
+	void *data;
+	char *children;
+};
+
+static struct hashtable *mem_hash;
+
+static void mem_put(struct mem_record *rec)
+{
+	if (--rec->refcnt == 0)
+		free(rec);
+}
+
+static int mem_put_ref(void *_ref)
+{
+	struct mem_record **ref = _ref;
+
+	mem_put(*ref);
+	return 0;
+}
+
+static int mem_fetch(const char *key, struct node *node)
+{
+	struct mem_record *rec, **ref;
+
+	rec = hashtable_search(mem_hash, (void *)key);
+	if (!rec) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Reference is dropped when the node is freed. */
+	ref = talloc(node, struct mem_record *);
+	if (!ref) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*ref = rec;
+	rec->refcnt++;
+	talloc_set_destructor(ref, mem_put_ref);
+
+	node->generation = rec->generation;
+	node->num_perms = rec->num_perms;
+	node->perms = rec->perms;
+	node->datalen = rec->datalen;
+	node->data = rec->data;
+	node->childlen = rec->childlen;
+	node->children = rec->children;
+
+	return 0;
+}
+
+static void mem_unlink(const char *key)
+{
+	struct mem_record *rec;
+
+	rec = hashtable_remove(mem_hash, (void *)key);
+	if (rec)
+		mem_put(rec);
+}
+
+static int mem_write(const char *key, const struct node *node)
+{
+	struct mem_record *rec, *old;
+	size_t permlen = node->num_perms * sizeof(node->perms[0]);
+	char *p, *hkey;
+
+	rec = malloc(sizeof(*rec) + permlen + node->datalen + node->childlen);
+	if (!rec)
+		goto nomem;
+
+	rec->refcnt = 1;
+	rec->generation = node->generation;
+	rec->num_perms = node->num_perms;
+	rec->datalen = node->datalen;
+	rec->childlen = node->childlen;
+
+	p = (char *)(rec + 1);
+	rec->perms = (void *)p;
+	memcpy(p, node->perms, permlen);
+	p += permlen;
+	rec->data = p;
+	memcpy(p, node->data, node->datalen);
+	p += node->datalen;
+	rec->children = p;
+	memcpy(p, node->children, node->childlen);
+
+	/* Only drop the old record once the new one is in place. */
+	old = hashtable_replace(mem_hash, (void *)key, rec);
+	if (old) {
+		mem_put(old);
+		return 0;
+	}
+
+	hkey = strdup(key);
+	if (!hkey)
+		goto nomem;
+	if (!hashtable_insert(mem_hash, hkey, rec)) {
+		free(hkey);
+		goto nomem;
+	}
+
+	return 0;
+
+ nomem:
+	free(rec);
+	errno = ENOMEM;
+	return -1;
+}
+
+static int mem_delete(const char *key)
+{
+	if (!hashtable_search(mem_hash, (void *)key)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	mem_unlink(key);
+	return 0;
+}
+
+struct mem_keys {
+	char **keys;
+	unsigned int num;
+};
+
+static int mem_collect_key(void *k, void *v, void *private)
+{
+	struct mem_keys *keys = private;
+
+	keys->keys[keys->num] = talloc_strdup(keys->keys, k);
+	if (!keys->keys[keys->num])
+		return -1;
+	keys->num++;
+	return 0;
+}
+
+static void mem_traverse(void (*fn)(const char *key, void *private),
+			 void *private)
+{
+	struct mem_keys keys;
+	unsigned int i;
+
+	/* Collect the keys first, fn is allowed to delete records. */
+	keys.num = 0;
+	keys.keys = talloc_array(NULL, char *, hashtable_count(mem_hash));
+	if (!keys.keys)
+		return;
+
+	if (hashtable_iterate(mem_hash, mem_collect_key, &keys) == 0)
+		for (i = 0; i < keys.num; i++)
+			fn(keys.keys[i], private);
+
+	talloc_free(keys.keys);
+}
+
+static const struct store_ops mem_ops = {
+	.fetch = mem_fetch,
+	.write = mem_write,
+	.delete = mem_delete,
+	.traverse = mem_traverse,
+};
+
+static bool mem_open(void)
+{
+	mem_hash = create_hashtable(7919, hash_from_key_fn, keys_equal_fn);
+	if (!mem_hash)
+		barf_perror("Could not create memory store");
+
+	store = &mem_ops;
+
+	/* Nothing survives a restart. */
+	return false;
+}
+
+/* tdb backend. */
+
+/* Header of the node record in tdb. */
+struct xs_tdb_record_hdr {
+	uint64_t generation;
+	uint32_t num_perms;
+	uint32_t datalen;
+	uint32_t childlen;
+	struct xs_permissions perms[0];
+};
+
+static TDB_CONTEXT *tdb_ctx;
+
+static void set_tdb_key(const char *name, TDB_DATA *key)
+{
+	key->dptr = (char *)name;
+	key->dsize = strlen(name);
+}
+
+static int tdb_node_fetch(const char *name, struct node *node)
+{
+	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
+
+	set_tdb_key(name, &key);
+	data = tdb_fetch(tdb_ctx, key);
+
+	if (data.dptr == NULL) {
+		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST)
+			errno = ENOENT;
+		else {
+			syslog(LOG_ERR, "TDB error on read: %s",
+			       tdb_errorstr(tdb_ctx));
+			errno = EIO;
+		}
+		return -1;
+	}
+
+	talloc_steal(node, data.dptr);
+
+	/* Generation, datalen, childlen, number of permissions */
+	hdr = (void *)data.dptr;
+	node->generation = hdr->generation;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
+
+	/* Permissions are struct xs_permissions. */
+	node->perms = hdr->perms;
+	/* Data is binary blob (usually ascii, no nul). */
+	node->data = node->perms + node->num_perms;
+	/* Children is strings, nul separated. */
+	node->children = node->data + node->datalen;
+
+	return 0;
+}
+
+static int tdb_node_write(const char *name, const struct node *node)
+{
+	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
+	void *p;
+	int ret;
+
+	set_tdb_key(name, &key);
+
+	data.dsize = sizeof(*hdr)
+		+ node->num_perms*sizeof(node->perms[0])
+		+ node->datalen + node->childlen;
+
+	data.dptr = talloc_size(node, data.dsize);
+	if (!data.dptr) {
+		errno = ENOMEM;
+		return -1;
+	}
+	hdr = (void *)data.dptr;
+	hdr->generation = node->generation;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
+
+	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
+	p += node->num_perms*sizeof(node->perms[0]);
+	memcpy(p, node->data, node->datalen);
+	p += node->datalen;
+	memcpy(p, node->children, node->childlen);
+
+	/* TDB should set errno, but doesn't even set ecode AFAICT. */
+	ret = tdb_store(tdb_ctx, key, data, TDB_REPLACE);
+	talloc_free(data.dptr);
+	if (ret != 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tdb_node_delete(const char *name)
+{
+	TDB_DATA key;
+
+	set_tdb_key(name, &key);
+	if (tdb_delete(tdb_ctx, key) != 0) {
+		errno = (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) ? ENOENT : EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct tdb_traverse_data {
+	void (*fn)(const char *key, void *private);
+	void *private;
+};
+
+static int tdb_traverse_fn(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+			   void *private)
+{
+	struct tdb_traverse_data *data = private;
+	char *name = talloc_strndup(NULL, key.dptr, key.dsize);
+
+	if (name)
+		data->fn(name, data->private);
+	talloc_free(name);
+
+	return 0;
+}
+
+static void tdb_node_traverse(void (*fn)(const char *key, void *private),
+			      void *private)
+{
+	struct tdb_traverse_data data = { .fn = fn, .private = private };
+
+	tdb_traverse(tdb_ctx, tdb_traverse_fn, &data);
+}
+
+static const struct store_ops tdb_ops = {
+	.fetch = tdb_node_fetch,
+	.write = tdb_node_write,
+	.delete = tdb_node_delete,
+	.traverse = tdb_node_traverse,
+};
+
+static void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
+{
+	va_list ap;
+	char *s;
+
+	va_start(ap, fmt);
+	s = talloc_vasprintf(NULL, fmt, ap);
+	va_end(ap);
+
+	if (s) {
+		trace("TDB: %s\n", s);
+		syslog(LOG_ERR, "TDB: %s",  s);
+		if (verbose)
+			xprintf("TDB: %s", s);
+		talloc_free(s);
+	} else {
+		trace("talloc failure during logging\n");
+		syslog(LOG_ERR, "talloc failure during logging\n");
+	}
+}
+
+static bool tdb_open_store(int tdb_flags)
+{
+	char *tdbname;
+
+	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
+
+	store = &tdb_ops;
+
+	if (!(tdb_flags & TDB_INTERNAL)) {
+		tdb_ctx = tdb_open_ex(tdbname, 0, tdb_flags, O_RDWR, 0,
+				      &tdb_logger, NULL);
+		if (tdb_ctx)
+			return true;
+	}
+
+	tdb_ctx = tdb_open_ex(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
+			      0640, &tdb_logger, NULL);
+	if (!tdb_ctx)
+		barf_perror("Could not create tdb file %s", tdbname);
+
+	return false;
+}
+
+bool store_open(enum store_type type)
+{
+	switch (type) {
+	case STORE_TDB:
+		return tdb_open_store(0);
+	case STORE_TDB_INTERNAL:
+		return tdb_open_store(TDB_INTERNAL|TDB_NOLOCK);
+	case STORE_MEMORY:
+	default:
+		return mem_open();
+	}
+}
+
+int store_fetch(const char *key, struct node *node)
+{
+	return store->fetch(key, node);
+}
+
+int store_write(const char *key, const struct node *node)
+{
+	return store->write(key, node);
+}
+
+int store_delete(const char *key)
+{
+	return store->delete(key);
+}
+
+void store_traverse(void (*fn)(const char *key, void *private),
+		    void *private)
+{
+	store->traverse(fn, private);
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
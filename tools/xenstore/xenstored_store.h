@@ -0,0 +1,65 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+
+#include <stdbool.h>
+
+struct node;
+
+enum store_type {
+	/* Parsed nodes kept in a hash table in memory (default). */
+	STORE_MEMORY,
+	/* Packed node records in a tdb file. */
+	STORE_TDB,
+	/* Packed node records in an internal (memory only) tdb. */
+	STORE_TDB_INTERNAL,
+};
+
+/* Open the store: returns true if an existing database was found. */
+bool store_open(enum store_type type);
+
+/*
+ * Fill in generation, permissions, data and children of node from the
+ * record stored under key.  The contents may be shared with the store
+ * and must not be modified in place.  Returns 0 or -1 with errno set
+ * (ENOENT if there is no such record).
+ */
+int store_fetch(const char *key, struct node *node);
+
+/* Store node under key.  Returns 0 or -1 with errno set. */
+int store_write(const char *key, const struct node *node);
+
+/* Delete record key.  Returns 0 or -1 with errno set (ENOENT if absent). */
+int store_delete(const char *key);
+
+/* Call fn for all keys in the store; fn may delete the key it is given. */
+void store_traverse(void (*fn)(const char *key, void *private),
+		    void *private);
+
+#endif /* _XENSTORED_STORE_H */
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
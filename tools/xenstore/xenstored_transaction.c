@@ -27,14 +27,71 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
+/*
+ * Some notes regarding detection and handling of transaction conflicts:
+ *
+ * Basic source of reference is the 'generation' count. Each writing access
+ * (either normal write or in a transaction) to the data base will set
+ * the node specific generation count to the global generation count.
+ * For being able to identify a transaction the transaction specific generation
+ * count is initialized with the global generation count when starting the
+ * transaction.
+ * Each time the global generation count is copied to either a node or a
+ * transaction it is incremented. This ensures all nodes and/or transactions
+ * are having a unique generation count.
+ *
+ * Instead of copying the complete tdb at transaction start, each node
+ * accessed in the transaction is recorded in the transaction's list of
+ * accessed nodes together with the generation count it had when it was
+ * first seen (NO_GENERATION if it didn't exist at that time).  Nodes
+ * modified in the transaction are written to the main store under a
+ * transaction specific key ("<transaction generation>/<path>"), so they
+ * are visible only inside the transaction.  Reads of such a node inside
+ * the transaction are redirected to the private copy; a node deleted in
+ * the transaction simply has no private copy.
+ *
+ * Transaction conflicts are detected by checking the generation count of
+ * all nodes accessed in the transaction to match with the generation count
+ * in the global data base at the end of the transaction.  Only those nodes
+ * are checked, so transactions working on disjunct parts of the store no
+ * longer fail with EAGAIN just because some other node has been modified
+ * in the meantime.
+ *
+ * On commit the private copies of all modified nodes are moved to their
+ * global keys (getting a new generation count), and nodes deleted in the
+ * transaction are deleted globally.  On abort (or when the connection goes
+ * away) the private copies are just removed.
+ */
+
+struct accessed_node
+{
+	/* List of all accessed nodes in the context of this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Key of the transaction private copy of the node. */
+	char *trans_name;
+
+	/* Generation count of the node when first accessed. */
+	uint64_t generation;
+
+	/* Was the node modified (written or deleted) in the transaction? */
+	bool modified;
+};
+
 struct changed_node
 {
 	/* List of all changed nodes in the context of this transaction. */
@@ -68,26 +125,118 @@ struct transaction
 	uint32_t id;
 
 	/* Generation when transaction started. */
-	unsigned int generation;
+	uint64_t generation;
 
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* List of accessed nodes. */
+	struct list_head accessed;
+
+	/* Accessed nodes indexed by node name. */
+	struct hashtable *accessed_hash;
 
 	/* List of changed nodes. */
 	struct list_head changes;
 
+	/* Changed nodes indexed by node name. */
+	struct hashtable *changes_hash;
+
 	/* List of changed domains - to record the changed domain entry number */
 	struct list_head changed_domains;
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
+uint64_t generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+static struct accessed_node *find_accessed_node(struct transaction *trans,
+						const char *name)
 {
-	return trans->tdb;
+	return hashtable_search(trans->accessed_hash, (void *)name);
+}
+
+/*
+ * Return the store key to be used for reading node name: the key of the
+ * transaction private copy if the node has been modified in the current
+ * transaction, the plain node name otherwise.
+ */
+const char *transaction_prepend(struct connection *conn, const char *name)
+{
+	struct accessed_node *i;
+
+	if (!conn || !conn->transaction)
+		return name;
+
+	i = find_accessed_node(conn->transaction, name);
+	if (i && i->modified)
+		return i->trans_name;
+
+	return name;
+}
+
+/*
+ * A node is being accessed. Record it in the transaction (if any), and set
+ * the store key to use for writing or deleting it.
+ * For writes outside of a transaction the node gets a new generation count.
+ * Returns 0 or -1 with errno set.
+ */
+int access_node(struct connection *conn, struct node *node,
+		enum node_access_type type, const char **key)
+{
+	struct accessed_node *i;
+	struct transaction *trans;
+	char *hkey;
+
+	if (!conn || !conn->transaction) {
+		/* They're changing the global database. */
+		if (type == NODE_ACCESS_WRITE)
+			node->generation = generation++;
+		if (key)
+			*key = node->name;
+		return 0;
+	}
+
+	trans = conn->transaction;
+
+	i = find_accessed_node(trans, node->name);
+	if (!i) {
+		i = talloc_zero(trans, struct accessed_node);
+		if (!i)
+			goto nomem;
+		i->node = talloc_strdup(i, node->name);
+		if (!i->node)
+			goto nomem;
+		i->generation = node->generation;
+		hkey = strdup(node->name);
+		if (!hkey)
+			goto nomem;
+		if (!hashtable_insert(trans->accessed_hash, hkey, i)) {
+			free(hkey);
+			goto nomem;
+		}
+		list_add_tail(&i->list, &trans->accessed);
+	}
+
+	if (type != NODE_ACCESS_READ) {
+		if (!i->trans_name) {
+			i->trans_name = talloc_asprintf(i, "%"PRIu64"%s",
+							trans->generation,
+							node->name);
+			if (!i->trans_name) {
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+		i->modified = true;
+		node->generation = trans->generation;
+	}
+
+	if (key)
+		*key = i->modified ? i->trans_name : node->name;
+
+	return 0;
+
+ nomem:
+	talloc_free(i);
+	errno = ENOMEM;
+	return -1;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -95,31 +244,103 @@ TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
 void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
+	char *hkey;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	if (!trans)
 		return;
-	}
 
-	list_for_each_entry(i, &trans->changes, list)
-		if (streq(i->node, node))
-			return;
+	if (hashtable_search(trans->changes_hash, (void *)node))
+		return;
 
 	i = talloc(trans, struct changed_node);
 	i->node = talloc_strdup(i, node);
 	i->recurse = recurse;
 	list_add_tail(&i->list, &trans->changes);
+
+	hkey = strdup(node);
+	if (hkey && !hashtable_insert(trans->changes_hash, hkey, i))
+		free(hkey);
+}
+
+/* Check all accessed nodes for modifications done outside the transaction. */
+static int check_transaction(struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct node *node;
+	uint64_t gen;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		node = talloc_zero(trans, struct node);
+		if (!node)
+			return ENOMEM;
+		if (!store_fetch(i->node, node))
+			gen = node->generation;
+		else if (errno == ENOENT)
+			gen = NO_GENERATION;
+		else {
+			talloc_free(node);
+			return EIO;
+		}
+		talloc_free(node);
+
+		if (gen != i->generation)
+			return EAGAIN;
+	}
+
+	return 0;
+}
+
+/* Make all modifications of the transaction globally visible. */
+static int finalize_transaction(struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct node *node;
+	int ret = 0;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+
+		node = talloc_zero(trans, struct node);
+		if (!node)
+			return ENOMEM;
+		if (!store_fetch(i->trans_name, node)) {
+			node->generation = generation++;
+			if (store_write(i->node, node))
+				ret = EIO;
+			else
+				store_delete(i->trans_name);
+		} else if (errno == ENOENT) {
+			/* Node was deleted in the transaction. */
+			if (store_delete(i->node) && errno != ENOENT)
+				ret = EIO;
+		} else
+			ret = EIO;
+		talloc_free(node);
+
+		if (ret)
+			return ret;
+
+		/* Private copy is gone, don't let the destructor look for it. */
+		i->modified = false;
+	}
+
+	return 0;
 }
 
 static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
+	struct accessed_node *i;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	list_for_each_entry(i, &trans->accessed, list)
+		if (i->modified)
+			store_delete(i->trans_name);
+	if (trans->accessed_hash)
+		hashtable_destroy(trans->accessed_hash, 0);
+	if (trans->changes_hash)
+		hashtable_destroy(trans->changes_hash, 0);
 	return 0;
 }
 
@@ -137,6 +358,59 @@ struct transaction *transaction_lookup(struct connection *conn, uint32_t id)
 	return ERR_PTR(-ENOENT);
 }
 
+static struct transaction *new_transaction(const void *ctx)
+{
+	struct transaction *trans;
+
+	trans = talloc_zero(ctx, struct transaction);
+	if (!trans)
+		return NULL;
+	INIT_LIST_HEAD(&trans->accessed);
+	INIT_LIST_HEAD(&trans->changes);
+	INIT_LIST_HEAD(&trans->changed_domains);
+	talloc_set_destructor(trans, destroy_transaction);
+	trans->accessed_hash = create_hashtable(16, hash_from_key_fn,
+						keys_equal_fn);
+	trans->changes_hash = create_hashtable(16, hash_from_key_fn,
+					       keys_equal_fn);
+	if (!trans->accessed_hash || !trans->changes_hash) {
+		talloc_free(trans);
+		return NULL;
+	}
+	trans->generation = generation++;
+
+	return trans;
+}
+
+struct transaction *transaction_start_internal(const void *ctx)
+{
+	return new_transaction(ctx);
+}
+
+int transaction_commit(struct connection *conn, struct transaction *trans)
+{
+	struct changed_node *i;
+	struct changed_domain *d;
+	int ret;
+
+	ret = check_transaction(trans);
+	if (ret)
+		return ret;
+	ret = finalize_transaction(trans);
+	if (ret)
+		return ret;
+
+	/* fix domain entry for each changed domain */
+	list_for_each_entry(d, &trans->changed_domains, list)
+		domain_entry_fix(d->domid, d->nbentry);
+
+	/* Fire off the watches for everything that changed. */
+	list_for_each_entry(i, &trans->changes, list)
+		fire_watches(conn, i->node, i->recurse);
+
+	return 0;
+}
+
 void do_transaction_start(struct connection *conn, struct buffered_data *in)
 {
 	struct transaction *trans, *exists;
@@ -154,19 +428,11 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	}
 
 	/* Attach transaction to input for autofree until it's complete */
-	trans = talloc(in, struct transaction);
-	INIT_LIST_HEAD(&trans->changes);
-	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans = new_transaction(in);
+	if (!trans) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -177,7 +443,6 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
 	talloc_steal(conn, trans);
-	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
@@ -186,9 +451,8 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 void do_transaction_end(struct connection *conn, const char *arg)
 {
-	struct changed_node *i;
-	struct changed_domain *d;
 	struct transaction *trans;
+	int ret;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F"))) {
 		send_error(conn, EINVAL);
@@ -208,26 +472,11 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
-			send_error(conn, EAGAIN);
-			return;
-		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
-			send_error(conn, errno);
+		ret = transaction_commit(conn, trans);
+		if (ret) {
+			send_error(conn, ret);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
-
-		/* fix domain entry for each changed domain */
-		list_for_each_entry(d, &trans->changed_domains, list)
-			domain_entry_fix(d->domid, d->nbentry);
-
-		/* Fire off the watches for everything that changed. */
-		list_for_each_entry(i, &trans->changes, list)
-			fire_watches(conn, i->node, i->recurse);
-		generation++;
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 }
@@ -19,13 +19,27 @@
 #define _XENSTORED_TRANSACTION_H
 #include "xenstored_core.h"
 
+enum node_access_type {
+    NODE_ACCESS_READ,
+    NODE_ACCESS_WRITE,
+    NODE_ACCESS_DELETE
+};
+
 struct transaction;
 
+extern uint64_t generation;
+
 void do_transaction_start(struct connection *conn, struct buffered_data *node);
 void do_transaction_end(struct connection *conn, const char *arg);
 
 struct transaction *transaction_lookup(struct connection *conn, uint32_t id);
 
+/* Start a transaction not visible to the client, freed with ctx. */
+struct transaction *transaction_start_internal(const void *ctx);
+
+/* Check trans for conflicts and make it globally visible: returns errno. */
+int transaction_commit(struct connection *conn, struct transaction *trans);
+
 /* inc/dec entry number local to trans while changing a node */
 void transaction_entry_inc(struct transaction *trans, unsigned int domid);
 void transaction_entry_dec(struct transaction *trans, unsigned int domid);
@@ -34,8 +48,12 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Return store key of the node to read, taking the transaction into account. */
+const char *transaction_prepend(struct connection *conn, const char *name);
+
+/* Record node access in the transaction, return store key to write/delete. */
+int access_node(struct connection *conn, struct node *node,
+                enum node_access_type type, const char **key);
 
 void conn_delete_all_transactions(struct connection *conn);
 
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -32,11 +33,48 @@
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * All watches are indexed by their path, one level of the index per path
+ * component.  A write to a node then only has to look at the watches on
+ * the node itself and on its ancestors (and on its descendants for
+ * recursive removal), instead of comparing the path against every watch
+ * of every connection.
+ */
+struct watch_node
+{
+	/* Parent in the index, NULL for the roots. */
+	struct watch_node *parent;
+
+	/* Path component (the complete name for special "@" watches). */
+	char *name;
+
+	/* Sibling list of the parent and list of the children. */
+	struct list_head list;
+	struct list_head children;
+
+	/* Children indexed by path component, allocated on first child. */
+	struct hashtable *child_hash;
+
+	/* Watches registered for exactly this path. */
+	struct list_head watches;
+};
+
+/* Root of the index for "/" paths and for "@" special watches. */
+static struct watch_node *watch_root;
+static struct watch_node *watch_special;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches in the same index node. */
+	struct list_head node_list;
+
+	/* Index node and connection of this watch. */
+	struct watch_node *wnode;
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -85,29 +123,175 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+static struct watch_node *new_watch_node(struct watch_node *parent,
+					 const char *name)
+{
+	struct watch_node *wnode;
+	char *key;
+
+	wnode = talloc_zero(parent, struct watch_node);
+	if (!wnode)
+		return NULL;
+	wnode->name = talloc_strdup(wnode, name);
+	if (!wnode->name)
+		goto nomem;
+	wnode->parent = parent;
+	INIT_LIST_HEAD(&wnode->children);
+	INIT_LIST_HEAD(&wnode->watches);
+	INIT_LIST_HEAD(&wnode->list);
+
+	if (!parent)
+		return wnode;
+
+	if (!parent->child_hash) {
+		parent->child_hash = create_hashtable(16, hash_from_key_fn,
+						      keys_equal_fn);
+		if (!parent->child_hash)
+			goto nomem;
+	}
+	key = strdup(name);
+	if (!key)
+		goto nomem;
+	if (!hashtable_insert(parent->child_hash, key, wnode)) {
+		free(key);
+		goto nomem;
+	}
+	list_add_tail(&wnode->list, &parent->children);
+	return wnode;
+
+ nomem:
+	talloc_free(wnode);
+	errno = ENOMEM;
+	return NULL;
+}
+
+static struct watch_node *watch_node_child(struct watch_node *parent,
+					   const char *name, bool create)
+{
+	struct watch_node *wnode = NULL;
+
+	if (parent->child_hash)
+		wnode = hashtable_search(parent->child_hash, (void *)name);
+	if (!wnode && create)
+		wnode = new_watch_node(parent, name);
+
+	return wnode;
+}
+
+/* Free index nodes which have neither watches nor children any longer. */
+static void prune_watch_node(struct watch_node *wnode)
+{
+	struct watch_node *parent;
+
+	while ((parent = wnode->parent) && list_empty(&wnode->watches) &&
+	       list_empty(&wnode->children)) {
+		hashtable_remove(parent->child_hash, wnode->name);
+		list_del(&wnode->list);
+		if (parent->child_hash && !hashtable_count(parent->child_hash)) {
+			hashtable_destroy(parent->child_hash, 0);
+			parent->child_hash = NULL;
+		}
+		talloc_free(wnode);
+		wnode = parent;
+	}
+}
+
+/* Find the index node of a (valid) watch path, optionally creating it. */
+static struct watch_node *watch_node_lookup(const char *path, bool create)
+{
+	struct watch_node *wnode;
+	char buf[XENSTORE_ABS_PATH_MAX + 1];
+	char *comp, *slash;
+
+	if (path[0] == '@')
+		return watch_node_child(watch_special, path, create);
+
+	if (strlen(path) >= sizeof(buf))
+		return NULL;
+	strcpy(buf, path);
+
+	wnode = watch_root;
+	for (comp = buf + 1; wnode && *comp; comp = slash + 1) {
+		slash = strchr(comp, '/');
+		if (slash)
+			*slash = '\0';
+		wnode = watch_node_child(wnode, comp, create);
+		if (!slash)
+			break;
+	}
+
+	return wnode;
+}
+
+/* Fire all watches on this index node and below it with their own path. */
+static void fire_watch_subtree(struct watch_node *wnode)
+{
+	struct watch_node *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &wnode->children, list) {
+		list_for_each_entry(watch, &child->watches, node_list)
+			add_event(watch->conn, watch, watch->node);
+		fire_watch_subtree(child);
+	}
+}
+
 void fire_watches(struct connection *conn, const char *name, bool recurse)
 {
-	struct connection *i;
+	struct watch_node *wnode;
 	struct watch *watch;
+	char buf[XENSTORE_ABS_PATH_MAX + 1];
+	char *comp, *slash;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	/* Watches on "/" see everything, including special events. */
+	list_for_each_entry(watch, &watch_root->watches, node_list)
+		add_event(watch->conn, watch, name);
+
+	if (name[0] == '@') {
+		wnode = watch_node_child(watch_special, name, false);
+		if (wnode)
+			list_for_each_entry(watch, &wnode->watches, node_list)
+				add_event(watch->conn, watch, name);
+		return;
+	}
+
+	if (strlen(name) >= sizeof(buf))
+		return;
+	strcpy(buf, name);
+
+	/* Create an event for each watch on the node or its ancestors. */
+	wnode = watch_root;
+	for (comp = buf + 1; *comp; comp = slash + 1) {
+		slash = strchr(comp, '/');
+		if (slash)
+			*slash = '\0';
+		wnode = watch_node_child(wnode, comp, false);
+		if (!wnode)
+			return;
+		list_for_each_entry(watch, &wnode->watches, node_list)
+			add_event(watch->conn, watch, name);
+		if (!slash)
+			break;
 	}
+
+	/* And for the watches on the children, if they went away, too. */
+	if (recurse)
+		fire_watch_subtree(wnode);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
 	trace_destroy(_watch, "watch");
+	if (watch->wnode) {
+		list_del(&watch->node_list);
+		prune_watch_node(watch->wnode);
+	}
 	return 0;
 }
 
@@ -152,7 +336,11 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 		return;
 	}
 
-	watch = talloc(conn, struct watch);
+	watch = talloc_zero(conn, struct watch);
+	if (!watch) {
+		send_error(conn, ENOMEM);
+		return;
+	}
 	watch->node = talloc_strdup(watch, vec[0]);
 	watch->token = talloc_strdup(watch, vec[1]);
 	if (relative)
@@ -162,10 +350,19 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 
 	INIT_LIST_HEAD(&watch->events);
 
+	watch->conn = conn;
+	talloc_set_destructor(watch, destroy_watch);
+	watch->wnode = watch_node_lookup(watch->node, true);
+	if (!watch->wnode) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+	list_add_tail(&watch->node_list, &watch->wnode->watches);
+
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
 	trace_create(watch, "watch");
-	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
 
 	/* We fire once up front: simplifies clients and restart. */
@@ -195,6 +392,14 @@ void do_unwatch(struct connection *conn, struct buffered_data *in)
 	send_error(conn, ENOENT);
 }
 
+void watch_init(void)
+{
+	watch_root = new_watch_node(NULL, "/");
+	watch_special = new_watch_node(NULL, "@");
+	if (!watch_root || !watch_special)
+		barf_perror("Failed to allocate watch index");
+}
+
 void conn_delete_all_watches(struct connection *conn)
 {
 	struct watch *watch;
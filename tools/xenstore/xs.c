@@ -68,6 +68,8 @@ struct xs_handle {
 	int watch_pipe[2];
 	/* Filtering watch event in unwatch function? */
 	bool unwatch_filter;
+	/* Daemon doesn't know XS_BATCH: send batched operations singly. */
+	bool batch_unsupported;
 
 	/*
          * A list of replies. Currently only one will ever be outstanding
@@ -128,6 +130,8 @@ struct xs_handle {
 	int watch_pipe[2];
 	/* Filtering watch event in unwatch function? */
 	bool unwatch_filter;
+	/* Daemon doesn't know XS_BATCH: send batched operations singly. */
+	bool batch_unsupported;
 };
 
 #define mutex_lock(m)		((void)0)
@@ -940,6 +944,221 @@ bool xs_unwatch(struct xs_handle *h, const char *path, const char *token)
 	return res;
 }
 
+/* Operations queued for a single XS_BATCH request. */
+struct xs_batch {
+	/* Each operation is a struct xsd_sockmsg followed by its payload. */
+	char *buf;
+	unsigned int len, size;
+	/* Error from queueing an operation, reported by xs_batch_commit. */
+	int error;
+};
+
+struct xs_batch *xs_batch_start(void)
+{
+	return calloc(1, sizeof(struct xs_batch));
+}
+
+void xs_batch_free(struct xs_batch *b)
+{
+	if (!b)
+		return;
+	free(b->buf);
+	free(b);
+}
+
+static bool batch_add(struct xs_batch *b, enum xsd_sockmsg_type type,
+		      const struct iovec *iovec, unsigned int num_vecs)
+{
+	struct xsd_sockmsg msg;
+	unsigned int i, size;
+	char *p;
+
+	if (b->error)
+		return false;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	for (i = 0; i < num_vecs; i++)
+		msg.len += iovec[i].iov_len;
+
+	/* Each operation must fit into a batch on its own. */
+	if (msg.len > XENSTORE_PAYLOAD_MAX - sizeof(msg)) {
+		b->error = E2BIG;
+		return false;
+	}
+
+	if (b->len + sizeof(msg) + msg.len > b->size) {
+		size = b->size ? b->size * 2 : 1024;
+		while (size < b->len + sizeof(msg) + msg.len)
+			size *= 2;
+		p = realloc(b->buf, size);
+		if (!p) {
+			b->error = ENOMEM;
+			return false;
+		}
+		b->buf = p;
+		b->size = size;
+	}
+
+	p = b->buf + b->len;
+	memcpy(p, &msg, sizeof(msg));
+	p += sizeof(msg);
+	for (i = 0; i < num_vecs; i++) {
+		memcpy(p, iovec[i].iov_base, iovec[i].iov_len);
+		p += iovec[i].iov_len;
+	}
+	b->len = p - b->buf;
+
+	return true;
+}
+
+bool xs_batch_write(struct xs_batch *b, const char *path,
+		    const void *data, unsigned int len)
+{
+	struct iovec iovec[2];
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+	iovec[1].iov_base = (void *)data;
+	iovec[1].iov_len = len;
+
+	return batch_add(b, XS_WRITE, iovec, ARRAY_SIZE(iovec));
+}
+
+bool xs_batch_mkdir(struct xs_batch *b, const char *path)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)path;
+	iovec.iov_len = strlen(path) + 1;
+
+	return batch_add(b, XS_MKDIR, &iovec, 1);
+}
+
+bool xs_batch_rm(struct xs_batch *b, const char *path)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)path;
+	iovec.iov_len = strlen(path) + 1;
+
+	return batch_add(b, XS_RM, &iovec, 1);
+}
+
+bool xs_batch_set_permissions(struct xs_batch *b, const char *path,
+			      struct xs_permissions *perms,
+			      unsigned int num_perms)
+{
+	unsigned int i;
+	struct iovec iov[1+num_perms];
+	char buffer[num_perms][MAX_STRLEN(unsigned int)+1];
+
+	if (b->error)
+		return false;
+
+	iov[0].iov_base = (void *)path;
+	iov[0].iov_len = strlen(path) + 1;
+
+	for (i = 0; i < num_perms; i++) {
+		if (!xs_perm_to_string(&perms[i], buffer[i],
+				       sizeof(buffer[i]))) {
+			b->error = errno;
+			return false;
+		}
+		iov[i+1].iov_base = buffer[i];
+		iov[i+1].iov_len = strlen(buffer[i]) + 1;
+	}
+
+	return batch_add(b, XS_SET_PERMS, iov, 1+num_perms);
+}
+
+/* Send the operations in buf one request at a time. */
+static bool batch_send_single(struct xs_handle *h, xs_transaction_t t,
+			      const char *buf, unsigned int len)
+{
+	struct xsd_sockmsg msg;
+	struct iovec iovec;
+	unsigned int off;
+
+	for (off = 0; off < len; off += msg.len) {
+		memcpy(&msg, buf + off, sizeof(msg));
+		off += sizeof(msg);
+		iovec.iov_base = (void *)(buf + off);
+		iovec.iov_len = msg.len;
+		if (!xs_bool(xs_talkv(h, t, msg.type, &iovec, 1, NULL)))
+			return false;
+	}
+
+	return true;
+}
+
+/* Send the operations in buf as XS_BATCH requests of maximum size. */
+static bool batch_send(struct xs_handle *h, xs_transaction_t t,
+		       const char *buf, unsigned int len)
+{
+	struct xsd_sockmsg msg;
+	struct iovec iovec;
+	unsigned int off, end;
+
+	for (off = 0; off < len; off = end) {
+		if (h->batch_unsupported)
+			return batch_send_single(h, t, buf + off, len - off);
+
+		for (end = off; end < len; end += sizeof(msg) + msg.len) {
+			memcpy(&msg, buf + end, sizeof(msg));
+			if (end + sizeof(msg) + msg.len - off >
+			    XENSTORE_PAYLOAD_MAX)
+				break;
+		}
+
+		iovec.iov_base = (void *)(buf + off);
+		iovec.iov_len = end - off;
+		if (xs_bool(xs_talkv(h, t, XS_BATCH, &iovec, 1, NULL)))
+			continue;
+
+		/* Older daemons reject the request type as a whole. */
+		if (errno != ENOSYS)
+			return false;
+		h->batch_unsupported = true;
+		end = off;
+	}
+
+	return true;
+}
+
+bool xs_batch_commit(struct xs_handle *h, xs_transaction_t t,
+		     struct xs_batch *b)
+{
+	xs_transaction_t bt;
+	int saved_errno;
+
+	if (b->error) {
+		errno = b->error;
+		return false;
+	}
+
+	/* Fits into one request, or the caller provides the transaction. */
+	if (b->len <= XENSTORE_PAYLOAD_MAX || t != XBT_NULL)
+		return batch_send(h, t, b->buf, b->len);
+
+	/* Use a transaction of our own to keep the batch atomic. */
+	for (;;) {
+		bt = xs_transaction_start(h);
+		if (bt == XBT_NULL)
+			return false;
+		if (!batch_send(h, bt, b->buf, b->len)) {
+			saved_errno = errno;
+			xs_transaction_end(h, bt, true);
+			errno = saved_errno;
+			return false;
+		}
+		if (xs_transaction_end(h, bt, false))
+			return true;
+		if (errno != EAGAIN)
+			return false;
+	}
+}
+
 /* Start a transaction: changes by others will not be seen during this
  * transaction, and changes will not be visible to others until end.
  * Returns XBT_NULL on failure.
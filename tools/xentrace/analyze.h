@@ -101,7 +101,9 @@ struct record_info {
     uint32_t *d;
     char dump_header[DUMP_HEADER_MAX];
     struct time_struct t;
-    struct trace_record rec;
+    /* Points into the trace file mapping, or at buf if it isn't mapped */
+    const struct trace_record *rec;
+    struct trace_record buf;
 };
 
 #endif
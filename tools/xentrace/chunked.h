@@ -0,0 +1,85 @@
+/*
+ * Compressed, indexed trace files, as written by xentrace --compress.
+ *
+ * The uncompressed contents are exactly the plain xentrace output: a
+ * sequence of windows, each a cpu_change record followed by that many
+ * bytes of the records of one cpu.  They are cut into chunks of whole
+ * windows, and each chunk is compressed on its own with zlib.
+ *
+ * The file is laid out as
+ *
+ *   struct chunked_header
+ *   chunks:  struct chunked_chunk_header, then the compressed data
+ *   struct chunked_chunk   table[nr_chunks]
+ *   struct chunked_index   index[nr_index]
+ *   struct chunked_footer
+ *
+ * The chunk table and the index are only written when tracing stops.  A
+ * file without them, e.g. because xentrace was killed, can still be read
+ * by walking the chunk headers.
+ *
+ * The index has an entry for each cpu with records in a chunk, with the
+ * range of tscs of the cpu's records in there.  Entries are in chunk
+ * order.  This allows finding where in the trace a point in time is,
+ * without reading the trace.
+ *
+ * All fields are in host byte order, like the trace records.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+#ifndef __CHUNKED_H
+#define __CHUNKED_H
+
+#include <stdint.h>
+
+#define CHUNKED_MAGIC "XENTRCZ"   /* Including the terminating nul */
+#define CHUNKED_VERSION 1
+
+#define CHUNKED_CODEC_ZLIB 1
+
+/* Chunks are cut at the first window boundary past this much data. */
+#define CHUNKED_CHUNK_SIZE (1UL << 20)
+
+struct chunked_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t codec;
+};
+
+struct chunked_chunk_header {
+    uint32_t size;      /* Of the compressed data following */
+    uint32_t raw_size;  /* Of the data once uncompressed */
+};
+
+struct chunked_chunk {
+    uint64_t offset;        /* Of the chunk header in the file */
+    uint64_t raw_offset;    /* Of the data in the uncompressed trace */
+    uint32_t size, raw_size;
+};
+
+struct chunked_index {
+    uint32_t cpu;
+    uint32_t chunk;
+    uint64_t first_tsc, last_tsc;
+};
+
+struct chunked_footer {
+    uint64_t table_offset;  /* Of the chunk table; the index follows it */
+    uint32_t nr_chunks;
+    uint32_t nr_index;
+    char magic[8];
+};
+
+#endif /* __CHUNKED_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,427 @@
+/******************************************************************************
+ * tools/xentrace/libxentrace.c
+ *
+ * Live access to the Xen trace buffers, see libxentrace.h.  This is what
+ * used to be the core of xentrace.
+ *
+ * Copyright (C) 2004 by Intel Research Cambridge
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+
+#include <xen/xen.h>
+#include <xen/trace.h>
+
+#define XC_WANT_COMPAT_MAP_FOREIGN_API
+#include <xenevtchn.h>
+#include <xenctrl.h>
+
+#include "libxentrace.h"
+
+#define PERROR(_m, _a...)                                       \
+do {                                                            \
+    int __saved_errno = errno;                                  \
+    fprintf(stderr, "ERROR: " _m " (%d = %s)\n" , ## _a ,       \
+            __saved_errno, strerror(__saved_errno));            \
+    errno = __saved_errno;                                      \
+} while (0)
+
+struct xentrace_handle {
+    xc_interface *xch;
+    xenevtchn_handle *xce;
+    int virq_port;
+    unsigned int nr_cpus;
+    unsigned int keep_enabled:1;
+
+    const struct t_info *t_info;    /* Information about the buffers */
+    unsigned long t_info_size;
+    struct t_buf **meta;            /* Per-cpu buffer metadata */
+    unsigned char **data;           /* Per-cpu buffer data areas */
+    unsigned long data_size;
+};
+
+static int map_tbufs(xentrace_handle *h, unsigned long tbufs_mfn)
+{
+    unsigned int i, j;
+
+    /* Map t_info metadata structure */
+    h->t_info = xc_map_foreign_range(h->xch, DOMID_XEN, h->t_info_size,
+                                     PROT_READ, tbufs_mfn);
+    if ( h->t_info == NULL )
+    {
+        PERROR("Failed to mmap trace buffers");
+        return -1;
+    }
+
+    if ( h->t_info->tbuf_size == 0 )
+    {
+        fprintf(stderr, "%s: tbuf_size 0!\n", __func__);
+        errno = EINVAL;
+        return -1;
+    }
+
+    h->data_size = h->t_info->tbuf_size * XC_PAGE_SIZE - sizeof(struct t_buf);
+
+    /* Map per-cpu buffers */
+    h->meta = calloc(h->nr_cpus, sizeof(*h->meta));
+    h->data = calloc(h->nr_cpus, sizeof(*h->data));
+    if ( h->meta == NULL || h->data == NULL )
+    {
+        PERROR("Failed to allocate memory for buffer pointers");
+        return -1;
+    }
+
+    for ( i = 0; i < h->nr_cpus; i++ )
+    {
+        const uint32_t *mfn_list = (const uint32_t *)h->t_info
+                                   + h->t_info->mfn_offset[i];
+        xen_pfn_t pfn_list[h->t_info->tbuf_size];
+
+        for ( j = 0; j < h->t_info->tbuf_size; j++ )
+            pfn_list[j] = (xen_pfn_t)mfn_list[j];
+
+        h->meta[i] = xc_map_foreign_pages(h->xch, DOMID_XEN,
+                                          PROT_READ | PROT_WRITE,
+                                          pfn_list,
+                                          h->t_info->tbuf_size);
+        if ( h->meta[i] == NULL )
+        {
+            PERROR("Failed to map cpu buffer!");
+            return -1;
+        }
+        h->data[i] = (unsigned char *)(h->meta[i] + 1);
+    }
+
+    return 0;
+}
+
+xentrace_handle *xentrace_open(unsigned long tbuf_pages, unsigned int flags)
+{
+    xentrace_handle *h;
+    xc_physinfo_t physinfo = { 0 };
+    unsigned long tbufs_mfn;
+    unsigned int i;
+
+    h = calloc(1, sizeof(*h));
+    if ( !h )
+        return NULL;
+    h->virq_port = -1;
+
+    h->xch = xc_interface_open(0, 0, 0);
+    if ( !h->xch )
+    {
+        PERROR("xenctrl interface open");
+        goto err;
+    }
+
+    /* prepare to listen for VIRQ_TBUF */
+    h->xce = xenevtchn_open(NULL, 0);
+    if ( h->xce == NULL )
+    {
+        PERROR("event channel open");
+        goto err;
+    }
+
+    h->virq_port = xenevtchn_bind_virq(h->xce, VIRQ_TBUF);
+    if ( h->virq_port == -1 )
+    {
+        PERROR("failed to bind to VIRQ port");
+        goto err;
+    }
+
+    /* get number of logical CPUs (and therefore number of trace buffers) */
+    if ( xc_physinfo(h->xch, &physinfo) != 0 )
+    {
+        PERROR("Failure to get logical CPU count from Xen");
+        goto err;
+    }
+    h->nr_cpus = physinfo.nr_cpus;
+
+    if ( xc_tbuf_enable(h->xch, tbuf_pages ? : XENTRACE_DEFAULT_TBUF_PAGES,
+                        &tbufs_mfn, &h->t_info_size) != 0 )
+    {
+        PERROR("Couldn't enable trace buffers");
+        goto err;
+    }
+
+    if ( (flags & XENTRACE_OPEN_START_DISABLED) && xentrace_disable(h) )
+        goto err;
+
+    if ( map_tbufs(h, tbufs_mfn) )
+        goto err;
+
+    if ( flags & XENTRACE_OPEN_DISCARD )
+        for ( i = 0; i < h->nr_cpus; i++ )
+            h->meta[i]->cons = h->meta[i]->prod;
+
+    return h;
+
+ err:
+    h->keep_enabled = 1;
+    xentrace_close(h);
+    return NULL;
+}
+
+void xentrace_close_keep_enabled(xentrace_handle *h)
+{
+    h->keep_enabled = 1;
+}
+
+void xentrace_close(xentrace_handle *h)
+{
+    unsigned int i;
+    int saved_errno = errno;
+
+    if ( !h )
+        return;
+
+    if ( !h->keep_enabled )
+        xentrace_disable(h);
+
+    if ( h->meta )
+        for ( i = 0; i < h->nr_cpus; i++ )
+            if ( h->meta[i] )
+                munmap(h->meta[i], h->t_info->tbuf_size * XC_PAGE_SIZE);
+    free(h->meta);
+    free(h->data);
+
+    if ( h->t_info )
+        munmap((void *)h->t_info, h->t_info_size);
+
+    if ( h->xce )
+        xenevtchn_close(h->xce);
+    if ( h->xch )
+        xc_interface_close(h->xch);
+
+    free(h);
+    errno = saved_errno;
+}
+
+int xentrace_enable(xentrace_handle *h)
+{
+    unsigned long mfn, size;
+
+    if ( xc_tbuf_enable(h->xch, 0, &mfn, &size) != 0 )
+    {
+        PERROR("Couldn't enable trace buffers");
+        return -1;
+    }
+
+    return 0;
+}
+
+int xentrace_disable(xentrace_handle *h)
+{
+    if ( xc_tbuf_disable(h->xch) != 0 )
+    {
+        PERROR("Couldn't disable trace buffers");
+        return -1;
+    }
+
+    return 0;
+}
+
+int xentrace_set_evt_mask(xentrace_handle *h, uint32_t mask)
+{
+    if ( xc_tbuf_set_evt_mask(h->xch, mask) != 0 )
+    {
+        PERROR("Failure to set the trace event mask");
+        return -1;
+    }
+
+    return 0;
+}
+
+unsigned int xentrace_nr_cpus(xentrace_handle *h)
+{
+    return h->nr_cpus;
+}
+
+int xentrace_fd(xentrace_handle *h)
+{
+    return xenevtchn_fd(h->xce);
+}
+
+int xentrace_wait(xentrace_handle *h, unsigned long timeout_ms)
+{
+    struct pollfd fd = { .fd = xenevtchn_fd(h->xce),
+                         .events = POLLIN | POLLERR };
+    int rc, port;
+
+    rc = poll(&fd, 1, timeout_ms);
+    if ( rc == -1 )
+    {
+        if ( errno == EINTR )
+            return 0;
+        PERROR("poll exitted with an error");
+        return -1;
+    }
+
+    if ( rc == 0 )
+        return 0;
+
+    port = xenevtchn_pending(h->xce);
+    if ( port == -1 )
+    {
+        PERROR("failed to read port from evtchn");
+        return -1;
+    }
+    if ( port != h->virq_port )
+    {
+        fprintf(stderr,
+                "unexpected port returned from evtchn (got %d vs expected %d)\n",
+                port, h->virq_port);
+        errno = EINVAL;
+        return -1;
+    }
+    if ( xenevtchn_unmask(h->xce, port) == -1 )
+    {
+        PERROR("failed to write port to evtchn");
+        return -1;
+    }
+
+    return 1;
+}
+
+long xentrace_read_windows(xentrace_handle *h, xentrace_window_fn *fn,
+                           void *arg)
+{
+    unsigned long data_size = h->data_size;
+    long total = 0;
+    unsigned int i;
+
+    for ( i = 0; i < h->nr_cpus; i++ )
+    {
+        struct t_buf *meta = h->meta[i];
+        unsigned char *data = h->data[i];
+        unsigned long start_offset, end_offset, window_size, cons, prod;
+
+        /* Read window information only once. */
+        cons = meta->cons;
+        prod = meta->prod;
+        xen_rmb(); /* read prod, then read item. */
+
+        if ( cons == prod )
+            continue;
+
+        assert(cons < 2*data_size);
+        assert(prod < 2*data_size);
+
+        // NB: if (prod<cons), then (prod-cons)%data_size will not yield
+        // the correct answer because data_size is not a power of 2.
+        if ( prod < cons )
+            window_size = (prod + 2*data_size) - cons;
+        else
+            window_size = prod - cons;
+        assert(window_size > 0);
+        assert(window_size <= data_size);
+
+        start_offset = cons % data_size;
+        end_offset = prod % data_size;
+
+        if ( end_offset > start_offset )
+        {
+            /* If window does not wrap, hand it over in one big chunk */
+            if ( fn(i, data + start_offset, window_size, window_size, arg) )
+                return -1;
+        }
+        else
+        {
+            /* If wrapped, in two chunks:
+             * - first, start to the end of the buffer
+             * - second, start of buffer to end of window
+             */
+            if ( fn(i, data + start_offset, data_size - start_offset,
+                    window_size, arg) ||
+                 fn(i, data, end_offset, 0, arg) )
+                return -1;
+        }
+
+        xen_mb(); /* read buffer, then update cons. */
+        meta->cons = prod;
+
+        total += window_size;
+    }
+
+    return total;
+}
+
+struct decode_state {
+    xentrace_record_fn *fn;
+    void *arg;
+};
+
+/* Records never wrap around the end of the buffer, so neither the
+ * parts of a window. */
+static int decode_window(unsigned int cpu, const void *data, size_t size,
+                         size_t total_size, void *arg)
+{
+    struct decode_state *s = arg;
+    const uint32_t *p = data, *end = p + size / sizeof(uint32_t);
+    struct xentrace_record rec = { .cpu = cpu };
+
+    while ( p < end )
+    {
+        const struct t_rec *t = (const struct t_rec *)p;
+        const uint32_t *extra;
+
+        rec.event = t->event;
+        rec.extra_u32 = t->extra_u32;
+        rec.cycles_included = t->cycles_included;
+        if ( t->cycles_included )
+        {
+            rec.tsc = ((uint64_t)t->u.cycles.cycles_hi << 32) |
+                t->u.cycles.cycles_lo;
+            extra = t->u.cycles.extra_u32;
+        }
+        else
+            extra = t->u.nocycles.extra_u32;
+        rec.extra = extra;
+
+        p = extra + t->extra_u32;
+        if ( p > end )
+        {
+            fprintf(stderr, "%s: cpu %u: record %x runs past the window\n",
+                    __func__, cpu, t->event);
+            break;
+        }
+
+        /* Padding up to the end of the buffer */
+        if ( rec.event == TRC_TRACE_WRAP_BUFFER )
+            continue;
+
+        if ( s->fn(&rec, s->arg) )
+            return 1;
+    }
+
+    return 0;
+}
+
+long xentrace_read_records(xentrace_handle *h, xentrace_record_fn *fn,
+                           void *arg)
+{
+    struct decode_state s = { .fn = fn, .arg = arg };
+
+    return xentrace_read_windows(h, decode_window, &s);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
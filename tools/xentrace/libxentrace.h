@@ -0,0 +1,109 @@
+/******************************************************************************
+ * tools/xentrace/libxentrace.h
+ *
+ * Live access to the Xen trace buffers: set them up, and hand what Xen
+ * writes into them to a callback, either as the raw per-cpu windows (as
+ * xentrace stores them) or as decoded records.
+ *
+ * Shared by xentrace and xenalyze --live; it is not installed, so the
+ * interface can change with them.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ */
+
+#ifndef __LIBXENTRACE_H
+#define __LIBXENTRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct xentrace_handle xentrace_handle;
+
+/* Flags for xentrace_open() */
+/* Throw away what is in the buffers already. */
+#define XENTRACE_OPEN_DISCARD       (1U << 0)
+/* Set up the buffers, but leave tracing off until xentrace_enable(). */
+#define XENTRACE_OPEN_START_DISABLED (1U << 1)
+
+#define XENTRACE_DEFAULT_TBUF_PAGES 32
+
+/*
+ * Allocate trace buffers of tbuf_pages pages per cpu (0 for the default
+ * size; buffers which are already allocated keep their size), turn
+ * tracing on and map the buffers.  Returns NULL with errno set, and a
+ * message on stderr, on failure.
+ */
+xentrace_handle *xentrace_open(unsigned long tbuf_pages, unsigned int flags);
+
+/* Turns tracing off, unless xentrace_close_keep_enabled() was called. */
+void xentrace_close(xentrace_handle *h);
+void xentrace_close_keep_enabled(xentrace_handle *h);
+
+int xentrace_enable(xentrace_handle *h);
+int xentrace_disable(xentrace_handle *h);
+
+/* Only trace events matching mask (TRC_* classes, see xen/trace.h). */
+int xentrace_set_evt_mask(xentrace_handle *h, uint32_t mask);
+
+/* Number of cpus, and so of trace buffers */
+unsigned int xentrace_nr_cpus(xentrace_handle *h);
+
+/* Becomes readable when Xen signals that a buffer is filling up. */
+int xentrace_fd(xentrace_handle *h);
+
+/*
+ * Wait until Xen signals that a buffer is filling up, or at most
+ * timeout_ms milliseconds.  Returns 1 if signalled, 0 on timeout or
+ * signal, -1 on error.
+ */
+int xentrace_wait(xentrace_handle *h, unsigned long timeout_ms);
+
+/*
+ * The new data of one cpu's buffer: size bytes at data, of a window of
+ * total_size bytes of trace records.  A window which wraps around the end
+ * of the buffer is handed over in two parts, the second one with a
+ * total_size of 0.  Return non-zero to stop reading.
+ */
+typedef int xentrace_window_fn(unsigned int cpu, const void *data,
+                               size_t size, size_t total_size, void *arg);
+
+/*
+ * Hand all new data in the buffers to fn, and release it to Xen.  Returns
+ * the number of bytes read, or -1 if fn asked to stop (the data it was
+ * given is not released then).
+ */
+long xentrace_read_windows(xentrace_handle *h, xentrace_window_fn *fn,
+                           void *arg);
+
+struct xentrace_record {
+    unsigned int cpu;
+    uint32_t event;             /* TRC_* */
+    unsigned int cycles_included;
+    uint64_t tsc;               /* If cycles_included */
+    unsigned int extra_u32;     /* Number of words in extra[] */
+    const uint32_t *extra;
+};
+
+/*
+ * A decoded record; rec and the data it points to are only valid during
+ * the call.  Return non-zero to stop reading.
+ */
+typedef int xentrace_record_fn(const struct xentrace_record *rec, void *arg);
+
+/* Like xentrace_read_windows(), for decoded records. */
+long xentrace_read_records(xentrace_handle *h, xentrace_record_fn *fn,
+                           void *arg);
+
+#endif /* __LIBXENTRACE_H */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,328 @@
+/*
+ * xenalyze --live: rolling per-domain statistics, straight from the trace
+ * buffers of the running system.
+ *
+ * Only the runstate changes and the HVM vmexits are traced.  Runstate
+ * changes give the time each vcpu spends running, waiting to run
+ * (runnable) and blocked, and how long it had to wait each time it was
+ * woken; they also tell which vcpu runs on which pcpu, which is what
+ * vmexits are counted against.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <xen/xen.h>
+#include <xen/trace.h>
+#include <xen/vcpu.h>
+#include "libxentrace.h"
+#include "live.h"
+
+#define NR_RUNSTATES 4
+
+struct live_domain;
+
+struct live_vcpu {
+    struct live_domain *d;
+    int state;                  /* RUNSTATE_*, -1 until seen */
+    uint64_t state_tsc;         /* Accounted up to here */
+    uint64_t wait_tsc;          /* Runnable since */
+};
+
+struct live_domain {
+    struct live_domain *next;
+    unsigned int did;
+    struct live_vcpu **vcpu;
+    int nr_vcpus;
+
+    /* For this interval */
+    uint64_t time[NR_RUNSTATES];
+    unsigned long vmexits;
+    unsigned long waits;
+    uint64_t wait_cycles, max_wait;
+};
+
+static struct {
+    struct live_domain *domains;
+    struct live_vcpu **running;  /* On each pcpu, if known */
+    unsigned int nr_pcpus;
+    uint64_t now, interval_tsc; /* Latest tsc seen, at start of interval */
+    unsigned long records, lost;
+    long long cpu_hz;
+} L;
+
+static volatile sig_atomic_t live_interrupted;
+
+static void live_handler(int signal)
+{
+    live_interrupted = 1;
+}
+
+static void *live_calloc(size_t nmemb, size_t size)
+{
+    void *p = calloc(nmemb, size);
+
+    if ( !p )
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    return p;
+}
+
+static struct live_vcpu *vcpu_find(unsigned int did, unsigned int vid)
+{
+    struct live_domain *d, **pd;
+    struct live_vcpu *v;
+
+    /* Sorted by domain id */
+    for ( pd = &L.domains; (d = *pd) && d->did < did; pd = &d->next )
+        ;
+
+    if ( !d || d->did != did )
+    {
+        d = live_calloc(1, sizeof(*d));
+        d->did = did;
+        d->next = *pd;
+        *pd = d;
+    }
+
+    if ( vid >= d->nr_vcpus )
+    {
+        int nr = vid + 1;
+
+        d->vcpu = realloc(d->vcpu, nr * sizeof(*d->vcpu));
+        if ( !d->vcpu )
+        {
+            perror("realloc");
+            exit(1);
+        }
+        memset(d->vcpu + d->nr_vcpus, 0,
+               (nr - d->nr_vcpus) * sizeof(*d->vcpu));
+        d->nr_vcpus = nr;
+    }
+
+    if ( !(v = d->vcpu[vid]) )
+    {
+        v = d->vcpu[vid] = live_calloc(1, sizeof(*v));
+        v->d = d;
+        v->state = -1;
+    }
+
+    return v;
+}
+
+/* Account the time in the current state of v up to tsc. */
+static void vcpu_account(struct live_vcpu *v, uint64_t tsc)
+{
+    if ( v->state >= 0 && tsc > v->state_tsc )
+        v->d->time[v->state] += tsc - v->state_tsc;
+    if ( tsc > v->state_tsc )
+        v->state_tsc = tsc;
+}
+
+static void runstate_change(const struct xentrace_record *rec)
+{
+    unsigned int old = (rec->event >> 8) & 0x3, new = (rec->event >> 4) & 0x3;
+    struct live_vcpu *v;
+
+    if ( !rec->cycles_included || rec->extra_u32 < 1 )
+        return;
+
+    v = vcpu_find(rec->extra[0] >> 16, rec->extra[0] & 0xffff);
+
+    if ( v->state < 0 )
+        v->state_tsc = rec->tsc;
+    else
+        vcpu_account(v, rec->tsc);
+
+    if ( old == RUNSTATE_runnable && new == RUNSTATE_running &&
+         v->state == RUNSTATE_runnable && rec->tsc > v->wait_tsc )
+    {
+        uint64_t wait = rec->tsc - v->wait_tsc;
+
+        v->d->waits++;
+        v->d->wait_cycles += wait;
+        if ( wait > v->d->max_wait )
+            v->d->max_wait = wait;
+    }
+
+    if ( new == RUNSTATE_runnable )
+        v->wait_tsc = rec->tsc;
+    v->state = new;
+
+    if ( rec->cpu < L.nr_pcpus )
+    {
+        if ( new == RUNSTATE_running )
+            L.running[rec->cpu] = v;
+        else if ( L.running[rec->cpu] == v )
+            L.running[rec->cpu] = NULL;
+    }
+}
+
+static int live_record(const struct xentrace_record *rec, void *arg)
+{
+    L.records++;
+
+    if ( rec->cycles_included && rec->tsc > L.now )
+    {
+        L.now = rec->tsc;
+        if ( !L.interval_tsc )
+            L.interval_tsc = rec->tsc;
+    }
+
+    if ( (rec->event & ~0xff0) == TRC_SCHED_RUNSTATE_CHANGE )
+        runstate_change(rec);
+    else if ( rec->event == TRC_HVM_VMEXIT || rec->event == TRC_HVM_VMEXIT64 )
+    {
+        if ( rec->cpu < L.nr_pcpus && L.running[rec->cpu] )
+            L.running[rec->cpu]->d->vmexits++;
+    }
+    else if ( rec->event == TRC_LOST_RECORDS && rec->extra_u32 >= 1 )
+        L.lost += rec->extra[0];
+
+    return 0;
+}
+
+#define PCT(_c) (cycles ? (_c) * 100.0 / cycles : 0.0)
+#define USEC(_c) ((_c) * 1000000.0 / L.cpu_hz)
+
+static void live_print(unsigned int interval, double seconds)
+{
+    struct live_domain *d;
+    int i;
+
+    printf("--- Interval %u: %.2lfs, %lu records, %lu lost ---\n",
+           interval, seconds, L.records, L.lost);
+    printf("%8s %5s %8s %8s %8s %10s %8s %12s %12s\n",
+           "dom", "vcpus", "running", "runnable", "blocked",
+           "vmexits/s", "waits", "avg wait us", "max wait us");
+
+    for ( d = L.domains; d; d = d->next )
+    {
+        uint64_t cycles = 0;
+        int nr_vcpus = 0;
+
+        for ( i = 0; i < d->nr_vcpus; i++ )
+            if ( d->vcpu[i] )
+            {
+                vcpu_account(d->vcpu[i], L.now);
+                nr_vcpus++;
+            }
+
+        /* Of all the vcpus together */
+        if ( L.now > L.interval_tsc )
+            cycles = (L.now - L.interval_tsc) * nr_vcpus;
+
+        if ( d->did == DOMID_IDLE )
+            printf("%8s", "idle");
+        else
+            printf("%8u", d->did);
+
+        printf(" %5d %7.1lf%% %7.1lf%% %7.1lf%% %10.0lf %8lu %12.1lf %12.1lf\n",
+               nr_vcpus,
+               PCT(d->time[RUNSTATE_running]),
+               PCT(d->time[RUNSTATE_runnable]),
+               PCT(d->time[RUNSTATE_blocked]),
+               seconds > 0 ? d->vmexits / seconds : 0.0,
+               d->waits,
+               d->waits ? USEC(d->wait_cycles) / d->waits : 0.0,
+               USEC(d->max_wait));
+
+        memset(d->time, 0, sizeof(d->time));
+        d->vmexits = d->waits = 0;
+        d->wait_cycles = d->max_wait = 0;
+    }
+
+    fflush(stdout);
+
+    L.records = L.lost = 0;
+    L.interval_tsc = L.now;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int live_run(long long cpu_hz, unsigned int interval_ms)
+{
+    xentrace_handle *h;
+    struct sigaction act;
+    uint64_t start, last, next, t;
+    unsigned int interval = 0;
+    int rc = 0;
+
+    L.cpu_hz = cpu_hz;
+
+    h = xentrace_open(0, XENTRACE_OPEN_DISCARD);
+    if ( !h )
+        return 1;
+
+    /* Nothing but what is needed, to keep the cost of tracing down. */
+    if ( xentrace_set_evt_mask(h, TRC_SCHED_MIN | TRC_HVM_ENTRYEXIT) )
+    {
+        xentrace_close(h);
+        return 1;
+    }
+
+    L.nr_pcpus = xentrace_nr_cpus(h);
+    L.running = live_calloc(L.nr_pcpus, sizeof(*L.running));
+
+    act.sa_handler = live_handler;
+    act.sa_flags = 0;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGHUP,  &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT,  &act, NULL);
+
+    start = last = now_ms();
+    next = start + interval_ms;
+
+    while ( !live_interrupted )
+    {
+        xentrace_read_records(h, live_record, NULL);
+
+        t = now_ms();
+        if ( t >= next )
+        {
+            live_print(++interval, (t - last) / 1000.0);
+            last = t;
+            next += interval_ms;
+            if ( next <= t )
+                next = t + interval_ms;
+        }
+
+        if ( xentrace_wait(h, next - t) < 0 )
+        {
+            rc = 1;
+            break;
+        }
+    }
+
+    /* Leave the default mask for whoever traces next. */
+    xentrace_set_evt_mask(h, TRC_ALL);
+    xentrace_close(h);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
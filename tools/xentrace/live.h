@@ -0,0 +1,11 @@
+#ifndef __LIVE_H
+#define __LIVE_H
+
+/*
+ * Consume the trace buffers of the running system, printing per-domain
+ * statistics every interval_ms, until interrupted.  cpu_hz converts tsc
+ * to time.
+ */
+int live_run(long long cpu_hz, unsigned int interval_ms);
+
+#endif
@@ -1,11 +1,315 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <zlib.h>
 #include "mread.h"
+#include "chunked.h"
+
+/* Uncompressed chunks kept around; each pcpu's stream may be in another. */
+#define MREAD_CHUNK_CACHE 32
+
+struct mread_chunked {
+    struct chunked_chunk *chunks;
+    int nr_chunks;
+    /* NULL if the trace has no footer */
+    struct chunked_index *index;
+    int nr_index;
+    char *zbuf;
+    size_t zbuf_size;
+    struct {
+        char *buffer;
+        int chunk;
+        int accessed;
+    } cache[MREAD_CHUNK_CACHE];
+    int clock, last;
+};
+
+static void *mread_malloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
+    return p;
+}
+
+static int pread_exact(int fd, void *buf, size_t len, off_t offset)
+{
+    ssize_t r;
+
+    while ( len )
+    {
+        r = pread(fd, buf, len, offset);
+        if ( r < 0 && errno == EINTR )
+            continue;
+        if ( r <= 0 )
+            return -1;
+        buf = (char *)buf + r;
+        len -= r;
+        offset += r;
+    }
+
+    return 0;
+}
+
+static void chunked_load_table(mread_handle_t h, struct chunked_footer *f)
+{
+    struct mread_chunked *c = h->chunked;
+    size_t tsize = f->nr_chunks * sizeof(*c->chunks);
+    size_t isize = f->nr_index * sizeof(*c->index);
+
+    c->nr_chunks = f->nr_chunks;
+    c->chunks = mread_malloc(tsize);
+    c->nr_index = f->nr_index;
+    c->index = mread_malloc(isize);
+
+    if ( pread_exact(h->fd, c->chunks, tsize, f->table_offset)
+         || pread_exact(h->fd, c->index, isize, f->table_offset + tsize) )
+    {
+        perror("reading chunk table");
+        exit(1);
+    }
+}
+
+/* Without the footer, find the chunks by walking through the file. */
+static void chunked_scan_table(mread_handle_t h, off_t size)
+{
+    struct mread_chunked *c = h->chunked;
+    struct chunked_chunk_header hdr;
+    off_t offset = sizeof(struct chunked_header);
+    uint64_t raw_offset = 0;
+    int max = 0;
+
+    fprintf(stderr, "%s: compressed trace has no index, was it "
+            "cut short?  Reading it without\n", __func__);
+
+    while ( offset + sizeof(hdr) <= size
+            && !pread_exact(h->fd, &hdr, sizeof(hdr), offset)
+            && offset + sizeof(hdr) + hdr.size <= size )
+    {
+        struct chunked_chunk *chunk;
+
+        if ( c->nr_chunks == max )
+        {
+            max = max ? max * 2 : 256;
+            c->chunks = realloc(c->chunks, max * sizeof(*c->chunks));
+            if ( !c->chunks )
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        chunk = &c->chunks[c->nr_chunks++];
+        chunk->offset = offset;
+        chunk->raw_offset = raw_offset;
+        chunk->size = hdr.size;
+        chunk->raw_size = hdr.raw_size;
+
+        offset += sizeof(hdr) + hdr.size;
+        raw_offset += hdr.raw_size;
+    }
+}
+
+/* Set up reading a compressed trace; returns 0 if fd isn't one. */
+static int chunked_init(mread_handle_t h, off_t size)
+{
+    struct chunked_header hdr;
+    struct chunked_footer f;
+    struct mread_chunked *c;
+    int i;
+
+    if ( size < sizeof(hdr)
+         || pread_exact(h->fd, &hdr, sizeof(hdr), 0)
+         || memcmp(hdr.magic, CHUNKED_MAGIC, sizeof(hdr.magic)) )
+        return 0;
+
+    if ( hdr.version != CHUNKED_VERSION || hdr.codec != CHUNKED_CODEC_ZLIB )
+    {
+        fprintf(stderr, "%s: unknown compressed trace version %u codec %u\n",
+                __func__, hdr.version, hdr.codec);
+        exit(1);
+    }
+
+    c = mread_malloc(sizeof(*c));
+    bzero(c, sizeof(*c));
+    for ( i = 0; i < MREAD_CHUNK_CACHE; i++ )
+        c->cache[i].chunk = -1;
+    h->chunked = c;
+
+    if ( size >= sizeof(hdr) + sizeof(f)
+         && !pread_exact(h->fd, &f, sizeof(f), size - sizeof(f))
+         && !memcmp(f.magic, CHUNKED_MAGIC, sizeof(f.magic))
+         && f.table_offset + f.nr_chunks * sizeof(struct chunked_chunk)
+            + f.nr_index * sizeof(struct chunked_index) + sizeof(f) == size )
+        chunked_load_table(h, &f);
+    else
+        chunked_scan_table(h, size);
+
+    h->file_size = 0;
+    if ( c->nr_chunks )
+        h->file_size = c->chunks[c->nr_chunks - 1].raw_offset
+            + c->chunks[c->nr_chunks - 1].raw_size;
+
+    return 1;
+}
+
+/* Find the chunk holding offset (which must be in the trace). */
+static int chunked_find(struct mread_chunked *c, off_t offset)
+{
+    int lo = 0, hi = c->nr_chunks - 1;
+
+    while ( lo < hi )
+    {
+        int mid = (lo + hi + 1) / 2;
+
+        if ( c->chunks[mid].raw_offset <= offset )
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+/* Get chunk uncompressed, from the cache if possible. */
+static char *chunked_get(mread_handle_t h, int chunk)
+{
+    struct mread_chunked *c = h->chunked;
+    struct chunked_chunk *ch = &c->chunks[chunk];
+    uLongf len = ch->raw_size;
+    int i;
+
+    if ( c->cache[c->last].chunk == chunk )
+    {
+        i = c->last;
+        goto found;
+    }
+
+    for ( i = 0; i < MREAD_CHUNK_CACHE; i++ )
+        if ( c->cache[i].chunk == chunk )
+            goto found;
+
+    /* Not there: evict a chunk by the clock algorithm, as for map[] */
+    while ( 1 )
+    {
+        c->clock++;
+        if ( c->clock >= MREAD_CHUNK_CACHE )
+            c->clock = 0;
+        if ( c->cache[c->clock].buffer == NULL
+             || !c->cache[c->clock].accessed )
+            break;
+        c->cache[c->clock].accessed = 0;
+    }
+    i = c->clock;
+
+    free(c->cache[i].buffer);
+    c->cache[i].chunk = -1;
+    c->cache[i].buffer = mread_malloc(ch->raw_size);
+
+    if ( ch->size > c->zbuf_size )
+    {
+        free(c->zbuf);
+        c->zbuf_size = ch->size;
+        c->zbuf = mread_malloc(c->zbuf_size);
+    }
+
+    if ( pread_exact(h->fd, c->zbuf, ch->size,
+                     ch->offset + sizeof(struct chunked_chunk_header)) )
+    {
+        perror("reading chunk");
+        exit(1);
+    }
+
+    if ( uncompress((Bytef *)c->cache[i].buffer, &len,
+                    (Bytef *)c->zbuf, ch->size) != Z_OK
+         || len != ch->raw_size )
+    {
+        fprintf(stderr, "%s: chunk %d at offset %llx is corrupt\n",
+                __func__, chunk, (unsigned long long)ch->offset);
+        exit(1);
+    }
+
+    c->cache[i].chunk = chunk;
+
+found:
+    c->last = i;
+    c->cache[i].accessed = 1;
+    return c->cache[i].buffer;
+}
+
+static ssize_t chunked_read(mread_handle_t h, char *rec, ssize_t len,
+                            off_t offset)
+{
+    struct mread_chunked *c = h->chunked;
+    ssize_t done = 0;
+
+    while ( done < len )
+    {
+        int chunk = chunked_find(c, offset);
+        struct chunked_chunk *ch = &c->chunks[chunk];
+        off_t coffset = offset - ch->raw_offset;
+        ssize_t csize = ch->raw_size - coffset;
+
+        if ( csize > len - done )
+            csize = len - done;
+
+        memcpy(rec + done, chunked_get(h, chunk) + coffset, csize);
+        done += csize;
+        offset += csize;
+    }
+
+    return done;
+}
+
+int mread_first_tsc(mread_handle_t h, uint64_t *tsc)
+{
+    struct mread_chunked *c = h->chunked;
+    int i;
+
+    if ( !c || !c->nr_index )
+        return -1;
+
+    *tsc = c->index[0].first_tsc;
+    for ( i = 1; i < c->nr_index; i++ )
+        if ( c->index[i].first_tsc < *tsc )
+            *tsc = c->index[i].first_tsc;
+
+    return 0;
+}
+
+int mread_seek_tsc(mread_handle_t h, uint64_t tsc, off_t *offset)
+{
+    struct mread_chunked *c = h->chunked;
+    int i;
+
+    if ( !c || !c->nr_index )
+        return -1;
+
+    /* Every cpu's records before the first chunk with a record at or
+     * after tsc are all before tsc. */
+    for ( i = 0; i < c->nr_index; i++ )
+        if ( c->index[i].last_tsc >= tsc )
+            break;
+
+    if ( i == c->nr_index )
+        *offset = h->file_size;
+    else
+        *offset = c->chunks[c->index[i].chunk].raw_offset;
+
+    return 0;
+}
 
 mread_handle_t mread_init(int fd)
 {
@@ -27,9 +331,51 @@ mread_handle_t mread_init(int fd)
     fstat(fd, &s);
     h->file_size = s.st_size;
 
+    if ( chunked_init(h, s.st_size) )
+        return h;
+
+    /* Map the whole file if the address space allows; otherwise fall back
+     * to the cache of MREAD_BUF_SIZE windows. */
+    if ( h->file_size > 0 && (size_t)h->file_size == h->file_size )
+    {
+        h->file_map = mmap(NULL, h->file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if ( h->file_map == MAP_FAILED )
+            h->file_map = NULL;
+    }
+
     return h;
 }
 
+ssize_t mread_ptr(mread_handle_t h, const void **ptr, void *buf,
+                  ssize_t len, off_t offset)
+{
+    if ( !h->file_map )
+    {
+        *ptr = buf;
+        return mread64(h, buf, len, offset);
+    }
+
+    if ( offset >= h->file_size )
+        return 0;
+    if ( offset + len > h->file_size )
+        len = h->file_size - offset;
+
+    *ptr = h->file_map + offset;
+    return len;
+}
+
+void mread_willneed(mread_handle_t h, off_t offset, ssize_t len)
+{
+    off_t start = offset & ~((1ULL << PAGE_SHIFT) - 1);
+
+    if ( !h->file_map || offset >= h->file_size )
+        return;
+    if ( offset + len > h->file_size )
+        len = h->file_size - offset;
+
+    madvise(h->file_map + start, len + (offset - start), MADV_WILLNEED);
+}
+
 ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
 {
     /* Idea: have a "cache" of N mmaped regions.  If the offset is
@@ -66,6 +412,15 @@ ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
         len = h->file_size - offset;
     }
 
+    if ( h->file_map )
+    {
+        bcopy(h->file_map + offset, rec, len);
+        return len;
+    }
+
+    if ( h->chunked )
+        return chunked_read(h, rec, len, offset);
+
     /* Try to find the offset in our range */
     dprintf(warn, " Trying last, %d\n", last);
     if ( h->map[h->last].buffer
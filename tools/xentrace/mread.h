@@ -3,9 +3,16 @@
 #define PAGE_SHIFT 12
 #define MREAD_BUF_SIZE (1ULL<<(PAGE_SHIFT+MREAD_BUF_SHIFT))
 #define MREAD_BUF_MASK (~(MREAD_BUF_SIZE-1))
+struct mread_chunked;
 typedef struct mread_ctrl {
     int fd;
+    /* For compressed traces, the size of the trace once uncompressed. */
     off_t file_size;
+    /* The whole file, if it could be mapped; map[] is only used if not. */
+    char * file_map;
+    /* Set for compressed traces (see chunked.h); offsets into the trace
+     * are offsets into the uncompressed data. */
+    struct mread_chunked * chunked;
     struct mread_buffer {
         char * buffer;
         off_t start_offset;
@@ -16,3 +23,20 @@ typedef struct mread_ctrl {
 
 mread_handle_t mread_init(int fd);
 ssize_t mread64(mread_handle_t h, void *dst, ssize_t len, off_t offset);
+/*
+ * Set *ptr to the len bytes at offset and return how many of them there
+ * are (fewer than len at the end of the file).  *ptr points straight into
+ * the file mapping; only if the file couldn't be mapped as a whole is the
+ * data copied, into buf.
+ */
+ssize_t mread_ptr(mread_handle_t h, const void **ptr, void *buf,
+                  ssize_t len, off_t offset);
+/* Start reading len bytes at offset in, to have them ready when needed. */
+void mread_willneed(mread_handle_t h, off_t offset, ssize_t len);
+/*
+ * Using the index of a compressed trace: get the tsc of its first record,
+ * or the offset of a cpu_change record from which on all records with a
+ * tsc of at least tsc are.  Both return -1 if there is no index.
+ */
+int mread_first_tsc(mread_handle_t h, uint64_t *tsc);
+int mread_seek_tsc(mread_handle_t h, uint64_t tsc, off_t *offset);
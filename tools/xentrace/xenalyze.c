@@ -28,9 +28,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <xen/trace.h>
 #include "analyze.h"
 #include "mread.h"
+#include "live.h"
 #include "pv.h"
 #include <errno.h>
 #include <strings.h>
@@ -75,7 +77,12 @@ struct {
         int pipe[2];
         FILE* out;
         int pid;
+        unsigned long long records, last_records;
+        struct timespec start, last;
     } progress;
+    struct {
+        tsc_t base_tsc, start_tsc, end_tsc;
+    } time_window;
 } G = {
     .fd=-1,
     .symbols = NULL,
@@ -179,6 +186,8 @@ struct {
         summary:1,
         report_pcpu:1,
         tsc_loop_fatal:1,
+        time_window:1,
+        live:1,
         summary_info;
     long long cpu_qhz, cpu_hz;
     int scatterplot_interrupt_vector;
@@ -189,6 +198,7 @@ struct {
     int interrupt_eip_enumeration_vector;
     int default_guest_paging_levels;
     int sample_size;
+    double time_window_start, time_window_end; /* In seconds */
     enum error_level tolerance; /* Tolerate up to this level of error */
     struct {
         tsc_t cycles;
@@ -1616,10 +1626,17 @@ struct cr3_value_struct {
     } destroy;
 };
 
+/*
+ * State for pcpus and vcpus is allocated as they show up in the trace;
+ * MAX_CPUS only bounds the ids accepted, to catch corrupt records.
+ */
 #ifndef MAX_CPUS
-#define MAX_CPUS 256
+#define MAX_CPUS 4096
 #endif
-typedef uint32_t cpu_mask_t;
+typedef struct {
+    unsigned long *bits;
+    int nr;
+} cpu_mask_t;
 
 #define IDLE_DOMAIN 32767
 #define DEFAULT_DOMAIN 32768
@@ -1674,7 +1691,8 @@ struct vcpu_data {
     struct cycle_summary runnable_states[RUNNABLE_STATE_MAX];
     struct weighted_cpi_summary cpi;
     struct cycle_summary cpu_affinity_all,
-        cpu_affinity_pcpu[MAX_CPUS];
+        *cpu_affinity_pcpu; /* Indexed by pcpu, see vcpu_cpu_affinity() */
+    int nr_cpu_affinity_pcpu;
     enum {
         VCPU_DATA_NONE=0,
         VCPU_DATA_HVM,
@@ -1725,7 +1743,8 @@ char * pod_reclaim_context_name[] = {
 struct domain_data {
     struct domain_data *next;
     int did;
-    struct vcpu_data *vcpu[MAX_CPUS];
+    struct vcpu_data **vcpu;
+    int nr_vcpus;
 
     int max_vid;
 
@@ -1834,6 +1853,7 @@ struct pcpu_info {
     tsc_t first_tsc, last_tsc, order_tsc;
     off_t file_offset;
     off_t next_cpu_change_offset;
+    off_t readahead_offset;
     struct record_info ri;
     int last_cpu_change_pid;
     int power_state;
@@ -1883,7 +1903,9 @@ struct {
     tsc_t now;
     struct cycle_framework f;
     tsc_t buffer_trace_virq_tsc;
-    struct pcpu_info pcpu[MAX_CPUS];
+    /* Allocated up to the highest cpu seen, see pcpu_find() */
+    struct pcpu_info **pcpu;
+    int nr_pcpus;
 
     struct {
         int id;
@@ -1916,34 +1938,67 @@ char * pcpu_string(int pcpu);
 void pcpu_string_draw(struct pcpu_info *p);
 void process_generic(struct record_info *ri);
 void dump_generic(FILE *f, struct record_info *ri);
-ssize_t __read_record(struct trace_record *rec, off_t offset);
+ssize_t __read_record(const struct trace_record **rec,
+                      struct trace_record *buf, off_t offset);
 void error(enum error_level l, struct record_info *ri);
 void update_io_address(struct io_address ** list, unsigned int pa, int dir,
                        tsc_t arc_cycles, unsigned int va);
 int check_extra_words(struct record_info *ri, int expected_size, const char *record);
 int vcpu_set_data_type(struct vcpu_data *v, int type);
 
+/*
+ * Grow the array at *ptr, of *nr elements of size size, to hold at least
+ * n elements.  New elements are zeroed.
+ */
+void grow_array(void *ptr, int *nr, int n, size_t size) {
+    void **array = ptr;
+    int new_nr;
+
+    if ( n <= *nr )
+        return;
+
+    new_nr = *nr * 2 > n ? *nr * 2 : n;
+
+    if ( (*array = realloc(*array, new_nr * size)) == NULL )
+    {
+        fprintf(stderr, "%s: realloc %zd failed!\n", __func__,
+                new_nr * size);
+        error(ERR_SYSTEM, NULL);
+    }
+
+    bzero((char *)*array + *nr * size, (new_nr - *nr) * size);
+    *nr = new_nr;
+}
+
 void cpumask_init(cpu_mask_t *c) {
-    *c = 0UL;
+    if ( c->bits )
+        bzero(c->bits, c->nr * sizeof(*c->bits));
 }
 
 void cpumask_clear(cpu_mask_t *c, int cpu) {
-    *c &= ~(1UL << cpu);
+    if ( cpu / BITS_PER_LONG < c->nr )
+        c->bits[cpu / BITS_PER_LONG] &= ~(1UL << (cpu % BITS_PER_LONG));
 }
 
 void cpumask_set(cpu_mask_t *c, int cpu) {
-    *c |= (1UL << cpu);
+    grow_array(&c->bits, &c->nr, cpu / BITS_PER_LONG + 1, sizeof(*c->bits));
+    c->bits[cpu / BITS_PER_LONG] |= 1UL << (cpu % BITS_PER_LONG);
 }
 
 int cpumask_isset(const cpu_mask_t *c, int cpu) {
-    if(*c & (1UL<<cpu))
+    if(cpu / BITS_PER_LONG < c->nr
+       && (c->bits[cpu / BITS_PER_LONG] & (1UL << (cpu % BITS_PER_LONG))))
         return 1;
     else
         return 0;
 }
 
 void cpumask_union(cpu_mask_t *d, const cpu_mask_t *s) {
-    *d |= *s;
+    int i;
+
+    grow_array(&d->bits, &d->nr, s->nr, sizeof(*d->bits));
+    for ( i = 0; i < s->nr; i++ )
+        d->bits[i] |= s->bits[i];
 }
 
 /* -- Time code -- */
@@ -3610,7 +3665,7 @@ void hvm_vlapic_icr_handler(struct hvm_data *h)
             struct domain_data *d = v->d;
             int i;
 
-            for(i=0; i<MAX_CPUS; i++)
+            for(i=0; i<d->nr_vcpus; i++)
             {
                 ov = d->vcpu[i];
                 if(!ov || ov == v)
@@ -5083,8 +5138,8 @@ static inline void runstate_update(struct vcpu_data *v, int new_runstate,
         /* How much did dom0 run this buffer? */
         if(v->d->did == 0) {
             int i;
-            for(i=0; i<MAX_CPUS; i++) {
-                struct pcpu_info * p = P.pcpu + i;
+            for(i=0; i<=P.max_active_pcpu; i++) {
+                struct pcpu_info * p = P.pcpu[i];
                 tsc_t start_tsc;
                 if(!p->active)
                     continue;
@@ -6753,6 +6808,8 @@ struct vcpu_data * vcpu_create(struct domain_data *d, int vid)
 {
     struct vcpu_data *v;
 
+    grow_array(&d->vcpu, &d->nr_vcpus, vid + 1, sizeof(*d->vcpu));
+
     assert(d->vcpu[vid] == NULL);
 
     fprintf(warn, "Creating vcpu %d for dom %d\n", vid, d->did);
@@ -6841,7 +6898,7 @@ struct vcpu_data * vcpu_find(int did, int vid)
 
     d = domain_find(did);
 
-    v = d->vcpu[vid];
+    v = vid < d->nr_vcpus ? d->vcpu[vid] : NULL;
 
     if(!v)
         v = vcpu_create(d, vid);
@@ -6849,6 +6906,14 @@ struct vcpu_data * vcpu_find(int did, int vid)
     return v;
 }
 
+struct cycle_summary * vcpu_cpu_affinity(struct vcpu_data *v, int pid)
+{
+    grow_array(&v->cpu_affinity_pcpu, &v->nr_cpu_affinity_pcpu, pid + 1,
+               sizeof(*v->cpu_affinity_pcpu));
+
+    return v->cpu_affinity_pcpu + pid;
+}
+
 void pcpu_runstate_update(struct pcpu_info *p, tsc_t tsc)
 {
     if ( p->time.tsc )
@@ -6949,7 +7014,7 @@ void vcpu_next_update(struct pcpu_info *p, struct vcpu_data *next, tsc_t tsc)
             if(next->pcpu_tsc)
             {
                 update_cycles(&next->cpu_affinity_all, tsc - next->pcpu_tsc);
-                update_cycles(&next->cpu_affinity_pcpu[p->pid], tsc - next->pcpu_tsc);
+                update_cycles(vcpu_cpu_affinity(next, p->pid), tsc - next->pcpu_tsc);
             }
             next->pcpu_tsc = tsc;
         }
@@ -7110,7 +7175,7 @@ void sched_runstate_process(struct pcpu_info *p)
         }
     }
 
-    if(r->vcpu > MAX_CPUS)
+    if(r->vcpu >= MAX_CPUS)
     {
         fprintf(warn, "%s: vcpu %u > MAX_VCPUS %d!\n",
                 __func__, r->vcpu, MAX_CPUS);
@@ -7227,7 +7292,7 @@ void sched_runstate_process(struct pcpu_info *p)
                 goto no_update;
             }
 
-            p2 = P.pcpu + last_oldstate.pid;
+            p2 = P.pcpu[last_oldstate.pid];
 
             lag = ri->tsc
                 - last_oldstate.tsc;
@@ -7249,7 +7314,7 @@ void sched_runstate_process(struct pcpu_info *p)
                     fprintf(warn, "Tsc skew dependency loop detected!  Resetting...\n");
                     for ( i=0; i<=P.max_active_pcpu; i++)
                     {
-                        struct pcpu_info *p = P.pcpu + i;
+                        struct pcpu_info *p = P.pcpu[i];
 
                         p->tsc_skew.offset = 0;
                         cpumask_init(&p->tsc_skew.downstream);
@@ -7427,14 +7492,14 @@ void sched_switch_process(struct pcpu_info *p)
     if(opt.dump_all)
         dump_sched_switch(ri);
 
-    if(r->prev_vcpu > MAX_CPUS)
+    if(r->prev_vcpu >= MAX_CPUS)
     {
         fprintf(warn, "%s: prev_vcpu %u > MAX_VCPUS %d!\n",
                 __func__, r->prev_vcpu, MAX_CPUS);
         return;
     }
 
-    if(r->next_vcpu > MAX_CPUS)
+    if(r->next_vcpu >= MAX_CPUS)
     {
         fprintf(warn, "%s: next_vcpu %u > MAX_VCPUS %d!\n",
                 __func__, r->next_vcpu, MAX_CPUS);
@@ -7451,7 +7516,10 @@ void sched_switch_process(struct pcpu_info *p)
 
 void sched_default_vcpu_activate(struct pcpu_info *p)
 {
-    struct vcpu_data *v = default_domain.vcpu[p->pid];
+    struct vcpu_data *v = NULL;
+
+    if(p->pid < default_domain.nr_vcpus)
+        v = default_domain.vcpu[p->pid];
 
     if(!v)
         v = vcpu_create(&default_domain, p->pid);
@@ -7502,7 +7570,7 @@ void sched_summary_vcpu(struct vcpu_data *v)
     if ( v->pcpu_tsc )
     {
         update_cycles(&v->cpu_affinity_all, P.f.last_tsc - v->pcpu_tsc);
-        update_cycles(&v->cpu_affinity_pcpu[v->p->pid], P.f.last_tsc - v->pcpu_tsc);
+        update_cycles(vcpu_cpu_affinity(v, v->p->pid), P.f.last_tsc - v->pcpu_tsc);
     }
 
     printf(" Runstates:\n");
@@ -7522,7 +7590,7 @@ void sched_summary_vcpu(struct vcpu_data *v)
     }
     print_cpi_summary(&v->cpi);
     print_cpu_affinity(&v->cpu_affinity_all, " cpu affinity");
-    for ( i = 0; i < MAX_CPUS ; i++)
+    for ( i = 0; i < v->nr_cpu_affinity_pcpu ; i++)
     {
         snprintf(desc,30, "   [%d]", i);
         print_cpu_affinity(v->cpu_affinity_pcpu+i, desc);
@@ -8488,7 +8556,7 @@ void dump_raw(char * s, struct record_info *ri)
 {
     int i;
 
-    if(ri->rec.cycle_flag)
+    if(ri->rec->cycle_flag)
         printf("%s %7x %d %14lld [",
                s, ri->event, ri->extra_words, ri->tsc);
     else
@@ -8505,7 +8573,10 @@ void dump_raw(char * s, struct record_info *ri)
     printf(" ] | ");
 
     for (i=0; i<8; i++) {
-        printf(" %08x", ri->rec.raw[i]);
+        if ( i * sizeof(uint32_t) < ri->size )
+            printf(" %08x", ri->rec->raw[i]);
+        else
+            printf("         ");
     }
 
     printf(" |\n");
@@ -8696,7 +8767,7 @@ void process_lost_records(struct pcpu_info *p)
         for(d=domain_list ; d; d=d->next)
         {
             if(d->did != DEFAULT_DOMAIN) {
-                for(i=0; i<MAX_CPUS; i++)
+                for(i=0; i<d->nr_vcpus; i++)
                     if(d->vcpu[i] &&
                        d->vcpu[i]->runstate.state != RUNSTATE_RUNNING) {
                         if(opt.dump_all)
@@ -8818,7 +8889,7 @@ void activate_early_eof(void) {
     P.early_eof = 1;
 
     for(i=0; i<=P.max_active_pcpu; i++) {
-        p = P.pcpu + i;
+        p = P.pcpu[i];
         if(p->active && p->file_offset > P.last_epoch_offset) {
             fprintf(warn, " deactivating pid %d\n",
                     p->pid);
@@ -8827,27 +8898,61 @@ void activate_early_eof(void) {
     }
 }
 
+/* Find the state of pcpu cpu, allocating it (and any below it) if needed. */
+struct pcpu_info * pcpu_find(int cpu)
+{
+    int i = P.nr_pcpus;
+
+    if ( cpu < P.nr_pcpus )
+        return P.pcpu[cpu];
+
+    grow_array(&P.pcpu, &P.nr_pcpus, cpu + 1, sizeof(*P.pcpu));
+
+    for ( ; i < P.nr_pcpus; i++ )
+    {
+        struct pcpu_info *p;
+
+        if((p=malloc(sizeof(*p)))==NULL)
+        {
+            fprintf(stderr, "%s: malloc %zd failed!\n", __func__, sizeof(*p));
+            error(ERR_SYSTEM, NULL);
+        }
+
+        bzero(p, sizeof(*p));
+
+        p->pid=i;
+        p->lost_record.seen_valid_schedule=1;
+        p->power_state=CSTATE_INVALID;
+
+        P.pcpu[i] = p;
+    }
+
+    return P.pcpu[cpu];
+}
+
 off_t scan_for_new_pcpu(off_t offset) {
     ssize_t r;
-    struct trace_record rec;
-    struct cpu_change_data *cd;
+    struct trace_record buf;
+    const struct trace_record *rec;
+    const struct cpu_change_data *cd;
+    struct pcpu_info *p;
 
-    r=__read_record(&rec, offset);
+    r=__read_record(&rec, &buf, offset);
 
     if(r==0)
         return 0;
 
-    if(rec.event != TRC_TRACE_CPU_CHANGE
-       || rec.cycle_flag)
+    if(rec->event != TRC_TRACE_CPU_CHANGE
+       || rec->cycle_flag)
     {
         fprintf(stderr, "%s: Unexpected record event %x!\n",
-                __func__, rec.event);
+                __func__, rec->event);
         error(ERR_ASSERT, NULL); /* Actually file, but can't recover */
     }
 
-    cd = (typeof(cd))rec.u.notsc.data;
+    cd = (typeof(cd))rec->u.notsc.data;
 
-    if ( cd->cpu > MAX_CPUS )
+    if ( cd->cpu < 0 || cd->cpu >= MAX_CPUS )
     {
         fprintf(stderr, "%s: cpu %d exceeds MAX_CPU %d!\n",
                 __func__, cd->cpu, MAX_CPUS);
@@ -8855,15 +8960,16 @@ off_t scan_for_new_pcpu(off_t offset) {
         error(ERR_ASSERT, NULL);
     }
 
-    if(cd->cpu > P.max_active_pcpu || !P.pcpu[cd->cpu].active) {
-        struct pcpu_info *p = P.pcpu + cd->cpu;
+    p = pcpu_find(cd->cpu);
 
+    if(cd->cpu > P.max_active_pcpu || !p->active) {
         fprintf(warn, "%s: Activating pcpu %d at offset %lld\n",
                 __func__, cd->cpu, (unsigned long long)offset);
 
         p->active = 1;
         /* Process this cpu_change record first */
-        p->ri.rec = rec;
+        p->ri.buf = buf;
+        p->ri.rec = rec == &buf ? &p->ri.buf : rec;
         p->ri.size = r;
         __fill_in_record_info(p);
 
@@ -8931,7 +9037,7 @@ void deactivate_pcpu(struct pcpu_info *p)
         int i, max_active_pcpu = -1;
         for(i=0; i<=P.max_active_pcpu; i++)
         {
-            if(!P.pcpu[i].active)
+            if(!P.pcpu[i]->active)
                 continue;
 
             max_active_pcpu = i;
@@ -9053,6 +9159,7 @@ int find_toplevel_event(struct record_info *ri)
 void process_cpu_change(struct pcpu_info *p) {
     struct record_info *ri = &p->ri;
     struct cpu_change_data *r = (typeof(r))ri->d;
+    struct pcpu_info *p2;
 
     if(opt.dump_all && verbosity >= 6) {
         printf("]%s cpu_change this-cpu %u record-cpu %u window_size %u(0x%08x)\n",
@@ -9067,9 +9174,9 @@ void process_cpu_change(struct pcpu_info *p) {
                 (unsigned long long)p->file_offset);
     }
 
-    if(r->cpu > MAX_CPUS)
+    if(r->cpu < 0 || r->cpu >= MAX_CPUS)
     {
-        fprintf(stderr, "FATAL: cpu %d > MAX_CPUS %d.\n",
+        fprintf(stderr, "FATAL: cpu %d >= MAX_CPUS %d.\n",
                 r->cpu, MAX_CPUS);
         /* Actually file, but takes some work to skip */
         error(ERR_ASSERT, NULL);
@@ -9082,10 +9189,9 @@ void process_cpu_change(struct pcpu_info *p) {
     }
 
     /* If that pcpu has never been activated, activate it. */
-    if(!P.pcpu[r->cpu].active && P.pcpu[r->cpu].file_offset == 0)
+    p2 = pcpu_find(r->cpu);
+    if(!p2->active && p2->file_offset == 0)
     {
-        struct pcpu_info * p2 = P.pcpu + r->cpu;
-
         p2->active = 1;
         if(r->cpu > P.max_active_pcpu)
             P.max_active_pcpu = r->cpu;
@@ -9093,8 +9199,10 @@ void process_cpu_change(struct pcpu_info *p) {
         /* Taking this record as the first record should make everything
          * run swimmingly. */
         p2->ri = *ri;
+        if(ri->rec == &ri->buf)
+            p2->ri.rec = &p2->ri.buf;
         p2->ri.cpu = r->cpu;
-        p2->ri.d = p2->ri.rec.u.notsc.data;
+        p2->ri.d = (uint32_t *)p2->ri.rec->u.notsc.data;
         p2->file_offset = p->file_offset;
         p2->next_cpu_change_offset = p->file_offset;
 
@@ -9318,7 +9426,7 @@ void process_record(struct pcpu_info *p) {
         p->file_offset += ri->size;
 }
 
-static inline ssize_t get_rec_size(struct trace_record *rec) {
+static inline ssize_t get_rec_size(const struct trace_record *rec) {
     ssize_t s;
 
     s = sizeof(uint32_t);
@@ -9366,29 +9474,56 @@ void progress_init(void) {
         opt.progress = 0;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &G.progress.start);
+    G.progress.last = G.progress.start;
+}
+
+static double progress_seconds(const struct timespec *from,
+                               const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
 }
 
 void progress_update(off_t offset) {
     long long p;
+    struct timespec now;
+    double secs, rate = 0;
 
     p = ( offset * 100 ) / G.file_size;
 
+    /* Records/s since the last update, to show up slow stretches */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = progress_seconds(&G.progress.last, &now);
+    if ( secs > 0 )
+        rate = (G.progress.records - G.progress.last_records) / secs;
+    G.progress.last = now;
+    G.progress.last_records = G.progress.records;
+
+    /* zenity shows lines starting with '#' as the text of the dialog */
+    fprintf(G.progress.out, "# %s: %llu records, %.0f records/s\n",
+            G.trace_file, G.progress.records, rate);
     fprintf(G.progress.out, "%lld\n", p);
     fflush(G.progress.out);
 
+    fprintf(stderr, "Progress: %lld %%, %llu records, %.0f records/s\n",
+            p, G.progress.records, rate);
+
     p += 1;
 
     G.progress.update_offset = ( G.file_size * p ) / 100;
-
-#if 0
-    fprintf(stderr, "Progress: %lld %% Next update_offset: %lld\n",
-            p-1,
-            G.progress.update_offset);
-#endif
 }
 
 void progress_finish(void) {
     int pid;
+    struct timespec now;
+    double secs, rate = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = progress_seconds(&G.progress.start, &now);
+    if ( secs > 0 )
+        rate = G.progress.records / secs;
+
+    fprintf(warn, "Processed %llu records in %.2lfs, %.0f records/s\n",
+            G.progress.records, secs, rate);
 
     fprintf(G.progress.out, "100\n");
     fflush(G.progress.out);
@@ -9400,17 +9535,18 @@ void progress_finish(void) {
         /* Child */
         char text[128];
 
-        snprintf(text, 128, "Finished analyzing %s",
-                 G.trace_file);
+        snprintf(text, 128, "Finished analyzing %s: %llu records, %.0f records/s",
+                 G.trace_file, G.progress.records, rate);
         execlp("zenity", "zenity", "--info", "--text", text, NULL);
     }
 }
 
-ssize_t __read_record(struct trace_record *rec, off_t offset)
+ssize_t __read_record(const struct trace_record **rec,
+                      struct trace_record *buf, off_t offset)
 {
     ssize_t r, rsize;
 
-    r=mread64(G.mh, rec, sizeof(*rec), offset);
+    r=mread_ptr(G.mh, (const void **)rec, buf, sizeof(*buf), offset);
 
     if(r < 0) {
         /* Read error */
@@ -9427,7 +9563,7 @@ ssize_t __read_record(struct trace_record *rec, off_t offset)
         error(ERR_SYSTEM, NULL);
     }
 
-    rsize=get_rec_size(rec);
+    rsize=get_rec_size(*rec);
 
     if(r < rsize) {
         /* Full record not read */
@@ -9446,17 +9582,17 @@ void __fill_in_record_info(struct pcpu_info *p)
 
     ri = &p->ri;
 
-    ri->event = ri->rec.event;
-    ri->extra_words = ri->rec.extra_words;
+    ri->event = ri->rec->event;
+    ri->extra_words = ri->rec->extra_words;
 
-    if(ri->rec.cycle_flag) {
-        tsc = (((tsc_t)ri->rec.u.tsc.tsc_hi) << 32)
-                | ri->rec.u.tsc.tsc_lo;
+    if(ri->rec->cycle_flag) {
+        tsc = (((tsc_t)ri->rec->u.tsc.tsc_hi) << 32)
+                | ri->rec->u.tsc.tsc_lo;
 
         tsc += p->tsc_skew.offset;
 
         ri->tsc = tsc;
-        ri->d = ri->rec.u.tsc.data;
+        ri->d = (uint32_t *)ri->rec->u.tsc.data;
 
         if(p->first_tsc == 0)
             p->first_tsc = tsc;
@@ -9472,7 +9608,7 @@ void __fill_in_record_info(struct pcpu_info *p)
         p->last_tsc = tsc;
     } else {
         ri->tsc = p->last_tsc;
-        ri->d = ri->rec.u.notsc.data;
+        ri->d = (uint32_t *)ri->rec->u.notsc.data;
     }
 
     if ( opt.dump_raw_reads ) {
@@ -9495,7 +9631,14 @@ ssize_t read_record(struct pcpu_info * p) {
     offset = &p->file_offset;
     ri = &p->ri;
 
-    ri->size = __read_record(&ri->rec, *offset);
+    /* Each pcpu reads its own stream through the file: get its next
+     * window coming while this one is processed. */
+    if(*offset >= p->readahead_offset) {
+        p->readahead_offset = (*offset & MREAD_BUF_MASK) + MREAD_BUF_SIZE;
+        mread_willneed(G.mh, p->readahead_offset, MREAD_BUF_SIZE);
+    }
+
+    ri->size = __read_record(&ri->rec, &ri->buf, *offset);
     if(ri->size)
     {
         __fill_in_record_info(p);
@@ -9523,12 +9666,17 @@ ssize_t read_record(struct pcpu_info * p) {
  * WARNING not thread-safe
  */
 
-char __pcpu_string[MAX_CPUS+1] = { 0 };
+char *__pcpu_string = NULL;
+int __pcpu_string_size = 0;
 void pcpu_string_draw(struct pcpu_info *p)
 {
-    char *s = __pcpu_string;
+    char *s;
     int i=p->pid;
 
+    /* Leave room for the terminating null */
+    grow_array(&__pcpu_string, &__pcpu_string_size, i + 2, 1);
+    s = __pcpu_string;
+
     if(p->lost_record.active)
         s[i]='l';
     else if (!p->current)
@@ -9548,31 +9696,55 @@ void pcpu_string_draw(struct pcpu_info *p)
 
 char * pcpu_string(int pcpu)
 {
-    char *s = __pcpu_string;
+    char *s;
     static int max_active_pcpu=-1, last_pcpu=-1;
 
-    assert(P.max_active_pcpu < MAX_CPUS);
+    assert(P.max_active_pcpu < P.nr_pcpus);
     assert(pcpu <= P.max_active_pcpu);
 
     if(last_pcpu >= 0)
-        pcpu_string_draw(P.pcpu+last_pcpu);
+        pcpu_string_draw(P.pcpu[last_pcpu]);
 
     if(P.max_active_pcpu > max_active_pcpu)
     {
         int i;
         for(i=max_active_pcpu + 1; i<= P.max_active_pcpu; i++)
-            pcpu_string_draw(P.pcpu+i);
+            pcpu_string_draw(P.pcpu[i]);
         max_active_pcpu=P.max_active_pcpu;
     }
 
+    s = __pcpu_string;
+
     s[pcpu]='x';
     last_pcpu = pcpu;
 
     return s;
 }
 
-/* Null terminated */
-struct pcpu_info *record_order[MAX_CPUS+1] = { 0 };
+/*
+ * The order in which to process the active pcpus is kept in a tournament
+ * tree ("loser tree"), with a leaf for each pcpu, keyed on the tsc of its
+ * next record.  Each internal node holds the pcpu which lost the match
+ * there, and node 0 the overall winner: the one to process next.  Once it
+ * has been processed, only the matches on the way from its leaf up to the
+ * root need replaying, which takes log2(pcpus) comparisons, and always
+ * the same number, whatever the order the records come in.
+ *
+ * Replaying only works for the winner; activating or deactivating a
+ * pcpu (which is rare) rebuilds the tree.
+ */
+struct record_order_leaf {
+    tsc_t tsc;
+    unsigned long long tie;
+    struct pcpu_info *p;    /* NULL if the pcpu isn't in the tree */
+};
+static struct {
+    struct record_order_leaf *leaf;
+    int *node;              /* The losers; node[0] is the winner */
+    int *scratch;           /* For rebuilding */
+    int size;               /* Number of leaves, a power of 2 */
+    int count;              /* Number of pcpus in the tree */
+} record_order;
 
 /* In the case of identical tsc values, the old algorithm would favor the
  * pcpu with the lowest number.  By default the new algorithm favors the
@@ -9580,90 +9752,157 @@ struct pcpu_info *record_order[MAX_CPUS+1] = { 0 };
  *
  * I think the second way is better; but it's good to be able to use the
  * old ordering, at very lest to verify that there are no (other) ordering
- * differences.  Enabling the below flag will cause the insertion / bubble
- * routines to order by pcpu id as well as tsc, preserving the old order. */
+ * differences.  Enabling the below flag will cause the tree to order by
+ * pcpu id as well as tsc, preserving the old order. */
 //#define PRESERVE_PCPU_ORDERING
 
-/* Steady state:
- * + Entire list is in order, except (potentially) for the first entry
- * + last is pointing to the first entry.
- */
-void record_order_bubble(struct pcpu_info *last)
+/* Counts down each time a pcpu is (re)placed, to break ties the new way */
+static unsigned long long record_order_seq = ~0ULL - 1;
+
+static inline int record_order_before(int a, int b)
 {
-    int i;
+    const struct record_order_leaf *la = &record_order.leaf[a],
+        *lb = &record_order.leaf[b];
 
-    /* Find the pcpu to "bubble".  This is usually the
-     * first one, but if other pcpus have been activated, it may
-     * not be. */
-    for(i=0; record_order[i] && record_order[i]!=last; i++);
+    return la->tsc < lb->tsc || (la->tsc == lb->tsc && la->tie < lb->tie);
+}
 
-    assert(record_order[i]);
+static void record_order_key(struct pcpu_info *p)
+{
+    struct record_order_leaf *l = &record_order.leaf[p->pid];
 
-    /* Now bubble it down */
-    for( ;
-        record_order[i+1]
-             && ( record_order[i+1]->order_tsc < last->order_tsc
+    l->tsc = p->order_tsc;
 #ifdef PRESERVE_PCPU_ORDERING
-                  || ( record_order[i+1]->order_tsc == last->order_tsc
-                       && record_order[i+1]->pid < last->pid )
+    l->tie = p->pid;
+#else
+    l->tie = record_order_seq--;
 #endif
-                 ) ;
-        i++)
-        record_order[i]=record_order[i+1];
-    record_order[i]=last;
 }
 
-void record_order_insert(struct pcpu_info *new)
+/* Replay all the matches. */
+static void record_order_rebuild(void)
 {
-    int i;
-    struct pcpu_info *p=NULL, *t=NULL;
+    int *winner = record_order.scratch, n = record_order.size, i;
 
-    /* Sanity check: Make sure it's not already in there */
-    for(i=0; record_order[i]; i++)
-        assert(record_order[i]!=new);
+    for ( i = 0; i < n; i++ )
+        winner[n + i] = i;
 
-    /* Find where to insert it */
-    for(i=0;
-        record_order[i]
-             && ( record_order[i]->order_tsc < new->order_tsc
-#ifdef PRESERVE_PCPU_ORDERING
-                  || ( record_order[i]->order_tsc == new->order_tsc
-                       && record_order[i]->pid < new->pid )
-#endif
-                 ) ;
-        i++)
-        ;
+    for ( i = n - 1; i > 0; i-- )
+    {
+        int a = winner[2 * i], b = winner[2 * i + 1];
+
+        if ( record_order_before(b, a) )
+        {
+            winner[i] = b;
+            record_order.node[i] = a;
+        }
+        else
+        {
+            winner[i] = a;
+            record_order.node[i] = b;
+        }
+    }
+
+    record_order.node[0] = winner[1];
+}
+
+static void record_order_grow(int pid)
+{
+    int n = record_order.size ? record_order.size : 1, i;
+
+    /* Need at least two leaves, so that there is a root match */
+    while ( n <= pid || n < 2 )
+        n *= 2;
+
+    if ( n == record_order.size )
+        return;
+
+    if ( (record_order.leaf = realloc(record_order.leaf,
+                                      n * sizeof(*record_order.leaf))) == NULL
+         || (record_order.node = realloc(record_order.node,
+                                         n * sizeof(*record_order.node))) == NULL
+         || (record_order.scratch = realloc(record_order.scratch,
+                                            2 * n * sizeof(*record_order.scratch))) == NULL )
+    {
+        fprintf(stderr, "%s: realloc failed!\n", __func__);
+        error(ERR_SYSTEM, NULL);
+    }
 
-    /* And insert it */
-    for( p=new; p ; i++)
+    /* Empty leaves never win */
+    for ( i = record_order.size; i < n; i++ )
     {
-        t=record_order[i];
-        record_order[i]=p;
-        p=t;
+        record_order.leaf[i].tsc = ~0ULL;
+        record_order.leaf[i].tie = ~0ULL;
+        record_order.leaf[i].p = NULL;
     }
+
+    record_order.size = n;
 }
 
-void record_order_remove(struct pcpu_info *rem)
+/* Replay the matches of last, the winner, after its tsc has changed. */
+void record_order_bubble(struct pcpu_info *last)
 {
-    int i;
+    int winner = last->pid, i;
+
+    assert(winner < record_order.size && record_order.leaf[winner].p == last);
+
+    record_order_key(last);
+
+    /* Someone else was activated while last was being processed */
+    if ( record_order.node[0] != winner )
+    {
+        record_order_rebuild();
+        return;
+    }
+
+    /* Written so as to compile without branches */
+    for ( i = (record_order.size + winner) / 2; i > 0; i /= 2 )
+    {
+        int loser = record_order.node[i];
+        int swap = record_order_before(loser, winner);
+
+        record_order.node[i] = swap ? winner : loser;
+        winner = swap ? loser : winner;
+    }
+
+    record_order.node[0] = winner;
+}
+
+void record_order_insert(struct pcpu_info *new)
+{
+    record_order_grow(new->pid);
 
-    /* Find where the record is */
-    for(i=0; record_order[i] && record_order[i]!=rem; i++)
-        ;
+    /* Sanity check: Make sure it's not already in there */
+    assert(!record_order.leaf[new->pid].p);
+
+    record_order.leaf[new->pid].p = new;
+    record_order_key(new);
+    record_order.count++;
+
+    record_order_rebuild();
+}
+
+void record_order_remove(struct pcpu_info *rem)
+{
+    struct record_order_leaf *l = &record_order.leaf[rem->pid];
 
     /* Sanity check: Make sure it's actually there! */
-    assert(record_order[i]);
+    assert(rem->pid < record_order.size && l->p == rem);
+
+    l->tsc = ~0ULL;
+    l->tie = ~0ULL;
+    l->p = NULL;
+    record_order.count--;
 
-    /* And move everyone forward */
-    for(; (record_order[i]=record_order[i+1]); i++)
-        ;
+    record_order_rebuild();
 }
 
 struct pcpu_info * choose_next_record(void)
 {
     struct pcpu_info *min_p=NULL;
 
-    min_p=record_order[0];
+    if(record_order.count)
+        min_p=record_order.leaf[record_order.node[0]].p;
 
     if(opt.progress && min_p && min_p->file_offset >= G.progress.update_offset)
         progress_update(min_p->file_offset);
@@ -9674,6 +9913,59 @@ struct pcpu_info * choose_next_record(void)
     return min_p;
 }
 
+/*
+ * --time-window: the window is relative to the first tsc of the trace,
+ * which comes from the index of compressed traces, or else is the first
+ * one seen.
+ */
+void time_window_set_base(tsc_t base) {
+    G.time_window.base_tsc = base;
+    G.time_window.start_tsc = base + opt.time_window_start * opt.cpu_hz;
+    if(opt.time_window_end)
+        G.time_window.end_tsc = base + opt.time_window_end * opt.cpu_hz;
+}
+
+/* Returns the offset from which to read the trace. */
+off_t time_window_init(void) {
+    uint64_t base;
+    off_t offset = 0;
+
+    if(mread_first_tsc(G.mh, &base) < 0) {
+        fprintf(warn, "%s: trace has no index, reading it up to the window\n",
+                __func__);
+        return 0;
+    }
+
+    time_window_set_base(base);
+
+    if(mread_seek_tsc(G.mh, G.time_window.start_tsc, &offset) == 0)
+        fprintf(warn, "%s: starting at offset %lld\n",
+                __func__, (unsigned long long)offset);
+
+    return offset;
+}
+
+/* Returns 1 to skip the next record of p, -1 if it is past the window. */
+int time_window_check(struct pcpu_info *p) {
+    if(!G.time_window.base_tsc) {
+        if(!p->order_tsc)
+            return 0;
+        time_window_set_base(p->order_tsc);
+    }
+
+    /* These are needed to follow the stream of p */
+    if(p->ri.event == TRC_TRACE_CPU_CHANGE)
+        return 0;
+
+    if(p->order_tsc < G.time_window.start_tsc)
+        return 1;
+
+    if(G.time_window.end_tsc && p->order_tsc > G.time_window.end_tsc)
+        return -1;
+
+    return 0;
+}
+
 void process_records(void) {
     while(1) {
         struct pcpu_info *p = NULL;
@@ -9681,7 +9973,25 @@ void process_records(void) {
         if(!(p=choose_next_record()))
             return;
 
+        if(opt.time_window) {
+            int skip = time_window_check(p);
+
+            if(skip < 0)
+                return;
+
+            if(skip) {
+                /* As if the trace started with the window */
+                p->first_tsc = 0;
+                p->file_offset += p->ri.size;
+                read_record(p);
+                if ( p->active )
+                    record_order_bubble(p);
+                continue;
+            }
+        }
+
         process_record(p);
+        G.progress.records++;
 
         /* Lost records gets processed twice. */
         if(p->ri.event == TRC_LOST_RECORDS) {
@@ -9728,7 +10038,7 @@ void domain_summary(void)
         d = &default_domain;
         printf("|-- Default domain --|\n");
 
-        for( i = 0; i < MAX_CPUS ; i++ )
+        for( i = 0; i < d->nr_vcpus ; i++ )
         {
             if(d->vcpu[i])
                 vcpu_summary(d->vcpu[i]);
@@ -9744,7 +10054,7 @@ void domain_summary(void)
 
         mem_summary_domain(d);
 
-        for( i = 0; i < MAX_CPUS ; i++ )
+        for( i = 0; i < d->nr_vcpus ; i++ )
         {
             if(d->vcpu[i])
                 vcpu_summary(d->vcpu[i]);
@@ -9772,9 +10082,9 @@ void summary(void) {
            ((double)(P.f.total_cycles))/opt.cpu_hz,
            stringify_cpu_hz(opt.cpu_hz));
     printf("--- Log volume summary ---\n");
-    for(i=0; i<MAX_CPUS; i++)
+    for(i=0; i<P.nr_pcpus; i++)
     {
-        struct pcpu_info *p = P.pcpu+i;
+        struct pcpu_info *p = P.pcpu[i];
         if(!p->summary)
             continue;
         printf(" - cpu %d -\n", i);
@@ -9786,9 +10096,9 @@ void summary(void) {
 void report_pcpu(void) {
     int i, active=0;
 
-    for(i=0; i<MAX_CPUS; i++)
+    for(i=0; i<P.nr_pcpus; i++)
     {
-        struct pcpu_info *p = P.pcpu+i;
+        struct pcpu_info *p = P.pcpu[i];
         if(!p->summary)
             continue;
         printf("pcpu %d\n", i);
@@ -9804,17 +10114,7 @@ void report_pcpu(void) {
 
 }
 
-void init_pcpus(void) {
-    int i=0;
-    off_t offset = 0;
-
-    for(i=0; i<MAX_CPUS; i++)
-    {
-        P.pcpu[i].pid=i;
-        P.pcpu[i].lost_record.seen_valid_schedule=1;
-        P.pcpu[i].power_state=CSTATE_INVALID;
-    }
-
+void init_pcpus(off_t offset) {
     P.max_active_pcpu = -1;
 
     sched_default_domain_init();
@@ -9884,6 +10184,8 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_TIME_WINDOW,
+    OPT_LIVE,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10360,6 +10662,34 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_TIME_WINDOW:
+    {
+        char * inval;
+
+        opt.time_window = 1;
+        opt.time_window_start = strtod(arg, &inval);
+
+        if( inval == arg || opt.time_window_start < 0 )
+            argp_usage(state);
+
+        if( *inval == ':' ) {
+            arg = inval + 1;
+            opt.time_window_end = strtod(arg, &inval);
+
+            if( inval == arg
+                || opt.time_window_end <= opt.time_window_start )
+                argp_usage(state);
+        }
+
+        if( *inval )
+            argp_usage(state);
+    }
+    break;
+
+    case OPT_LIVE:
+        opt.live = 1;
+        break;
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
@@ -10376,7 +10706,7 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
             interval_header();
         }
 
-        if(!G.output_defined)
+        if(!G.output_defined && !opt.live)
         {
             fprintf(stderr, "No output defined, using summary.\n");
             opt.summary = 1;
@@ -10652,6 +10982,20 @@ const struct argp_option cmd_opts[] =  {
       .arg = "errlevel",
       .doc = "Sets tolerance for errors found in the file.  Default is 3; max is 6.", },
 
+    { .name = "time-window",
+      .key = OPT_TIME_WINDOW,
+      .arg = "START[:END]",
+      .doc = "Only analyze the records from START to END seconds into the "
+      "trace, or to its end.  Compressed traces (xentrace -z) are only "
+      "read from about START on.", },
+
+    { .name = "live",
+      .key = OPT_LIVE,
+      .doc = "Instead of reading a trace file, trace the running system and "
+      "show per-domain runstate times, waits and vmexits every interval "
+      "(see --interval).  Sets the trace event mask, and resets it to all "
+      "events when done.", },
+
 
     { 0 },
 };
@@ -10672,6 +11016,9 @@ int main(int argc, char *argv[]) {
 
     argp_parse(&parser_def, argc, argv, 0, NULL, NULL);
 
+    if (opt.live)
+        return live_run(opt.cpu_hz, opt.interval.msec);
+
     if (G.trace_file == NULL)
         exit(1);
 
@@ -10686,6 +11033,8 @@ int main(int argc, char *argv[]) {
 
     if ( (G.mh = mread_init(G.fd)) == NULL )
         perror("mread");
+    else
+        G.file_size = G.mh->file_size;
 
     if (G.symbol_file != NULL)
         parse_symbol_file(G.symbol_file);
@@ -10693,7 +11042,7 @@ int main(int argc, char *argv[]) {
     if(opt.dump_all)
         warn = stdout;
 
-    init_pcpus();
+    init_pcpus(opt.time_window ? time_window_init() : 0);
 
     if(opt.progress)
         progress_init();
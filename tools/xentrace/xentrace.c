@@ -24,16 +24,17 @@
 #include <getopt.h>
 #include <assert.h>
 #include <ctype.h>
-#include <sys/poll.h>
 #include <sys/statvfs.h>
+#include <zlib.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
 
-#define XC_WANT_COMPAT_MAP_FOREIGN_API
-#include <xenevtchn.h>
 #include <xenctrl.h>
 
+#include "chunked.h"
+#include "libxentrace.h"
+
 #define PERROR(_m, _a...)                                       \
 do {                                                            \
     int __saved_errno = errno;                                  \
@@ -48,7 +49,6 @@ do {                                                            \
 /* sleep for this long (milliseconds) between checking the trace buffers */
 #define POLL_SLEEP_MILLIS 100
 
-#define DEFAULT_TBUF_SIZE 32
 /***** The code **************************************************************/
 
 typedef struct settings_st {
@@ -60,24 +60,18 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned long bench;
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        compress:1;
 } settings_t;
 
-struct t_struct {
-    const struct t_info *t_info; /* Structure with information about individual buffers */
-    struct t_buf **meta;    /* Pointers to trace buffer metadata */
-    unsigned char **data;   /* Pointers to trace buffer data areas */
-};
-
 settings_t opts;
 
 int interrupted = 0; /* gets set if we get a SIGHUP */
 
 static xc_interface *xc_handle;
-static xenevtchn_handle *xce_handle = NULL;
-static int virq_port = -1;
 static int outfd = 1;
 
 static void close_handler(int signal)
@@ -278,6 +272,276 @@ void membuf_write(void *start, unsigned long size) {
     }
 }
 
+/*
+ * Compressed output, see chunked.h.  The plain output is collected until
+ * there is a chunk's worth, then the whole windows in it are compressed
+ * and written out.
+ */
+static struct {
+    unsigned char *buf, *zbuf;
+    unsigned long len, size, zsize;
+    uint64_t offset, raw_offset;
+    struct chunked_chunk *chunks;
+    struct chunked_index *index;
+    unsigned long nr_chunks, max_chunks, nr_index, max_index;
+} chunked;
+
+static int write_exact(const void *buf, size_t size)
+{
+    const char *p = buf;
+    ssize_t written;
+
+    while ( size )
+    {
+        written = write(outfd, p, size);
+        if ( written < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            return -1;
+        }
+        p += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+static void *chunked_grow(void *array, unsigned long *max, size_t size)
+{
+    *max = *max ? *max * 2 : 256;
+    array = realloc(array, *max * size);
+    if ( !array )
+    {
+        fprintf(stderr, "%s: Couldn't realloc %lu bytes!\n",
+                __func__, *max * size);
+        exit(EXIT_FAILURE);
+    }
+
+    return array;
+}
+
+static void chunked_init(void)
+{
+    struct chunked_header hdr = {
+        .magic = CHUNKED_MAGIC,
+        .version = CHUNKED_VERSION,
+        .codec = CHUNKED_CODEC_ZLIB,
+    };
+
+    if ( write_exact(&hdr, sizeof(hdr)) )
+    {
+        PERROR("Failed to write trace header");
+        exit(EXIT_FAILURE);
+    }
+
+    chunked.offset = sizeof(hdr);
+}
+
+/* Add the tsc range of the records in a window of cpu to the index. */
+static void chunked_index_window(unsigned int cpu, const unsigned char *data,
+                                 unsigned long size)
+{
+    const unsigned char *p, *end = data + size;
+    uint64_t first_tsc = 0, last_tsc = 0;
+    struct chunked_index *e;
+    unsigned long i;
+
+    for ( p = data; p + sizeof(uint32_t) <= end; )
+    {
+        const struct t_rec *rec = (const struct t_rec *)p;
+        unsigned long rec_size = sizeof(uint32_t);
+
+        if ( rec->cycles_included )
+        {
+            uint64_t tsc;
+
+            rec_size += 2 * sizeof(uint32_t);
+            if ( p + rec_size > end )
+                break;
+
+            tsc = ((uint64_t)rec->u.cycles.cycles_hi << 32) |
+                rec->u.cycles.cycles_lo;
+            if ( !first_tsc || tsc < first_tsc )
+                first_tsc = tsc;
+            if ( tsc > last_tsc )
+                last_tsc = tsc;
+        }
+        p += rec_size + rec->extra_u32 * sizeof(uint32_t);
+    }
+
+    if ( !first_tsc )
+        return;
+
+    /* Extend the entry of cpu for this chunk, if there is one. */
+    for ( i = chunked.nr_index; i-- > 0; )
+    {
+        e = &chunked.index[i];
+        if ( e->chunk != chunked.nr_chunks )
+            break;
+        if ( e->cpu != cpu )
+            continue;
+
+        if ( first_tsc < e->first_tsc )
+            e->first_tsc = first_tsc;
+        if ( last_tsc > e->last_tsc )
+            e->last_tsc = last_tsc;
+        return;
+    }
+
+    if ( chunked.nr_index == chunked.max_index )
+        chunked.index = chunked_grow(chunked.index, &chunked.max_index,
+                                     sizeof(*chunked.index));
+
+    e = &chunked.index[chunked.nr_index++];
+    e->cpu = cpu;
+    e->chunk = chunked.nr_chunks;
+    e->first_tsc = first_tsc;
+    e->last_tsc = last_tsc;
+}
+
+/*
+ * Compress and write out the complete windows collected so far.  With
+ * final, write out everything.
+ */
+static int chunked_flush(int final)
+{
+    struct chunked_chunk_header hdr;
+    struct chunked_chunk *chunk;
+    unsigned long len = 0;
+    uLongf zlen;
+
+    while ( len + sizeof(struct cpu_change_record) <= chunked.len )
+    {
+        struct cpu_change_record *rec =
+            (struct cpu_change_record *)(chunked.buf + len);
+        unsigned long end = len + sizeof(*rec) + rec->data.window_size;
+
+        if ( rec->header != CPU_CHANGE_HEADER )
+        {
+            fprintf(stderr, "%s: INTERNAL ERROR: no cpu_change record at %lu!\n",
+                    __func__, len);
+            exit(EXIT_FAILURE);
+        }
+
+        if ( end > chunked.len )
+            break;
+
+        chunked_index_window(rec->data.cpu, chunked.buf + len + sizeof(*rec),
+                             rec->data.window_size);
+        len = end;
+    }
+
+    if ( final )
+        len = chunked.len;
+
+    if ( len == 0 )
+        return 0;
+
+    zlen = compressBound(len);
+    if ( zlen > chunked.zsize )
+    {
+        free(chunked.zbuf);
+        chunked.zsize = zlen;
+        chunked.zbuf = malloc(zlen);
+        if ( !chunked.zbuf )
+        {
+            fprintf(stderr, "%s: Couldn't malloc %lu bytes!\n",
+                    __func__, (unsigned long)zlen);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if ( compress2(chunked.zbuf, &zlen, chunked.buf, len,
+                   Z_BEST_SPEED) != Z_OK )
+    {
+        fprintf(stderr, "%s: compression failed!\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    hdr.size = zlen;
+    hdr.raw_size = len;
+    if ( write_exact(&hdr, sizeof(hdr)) || write_exact(chunked.zbuf, zlen) )
+        return -1;
+
+    if ( chunked.nr_chunks == chunked.max_chunks )
+        chunked.chunks = chunked_grow(chunked.chunks, &chunked.max_chunks,
+                                      sizeof(*chunked.chunks));
+
+    chunk = &chunked.chunks[chunked.nr_chunks++];
+    chunk->offset = chunked.offset;
+    chunk->raw_offset = chunked.raw_offset;
+    chunk->size = zlen;
+    chunk->raw_size = len;
+
+    chunked.offset += sizeof(hdr) + zlen;
+    chunked.raw_offset += len;
+
+    chunked.len -= len;
+    memmove(chunked.buf, chunked.buf + len, chunked.len);
+
+    return 0;
+}
+
+static void chunked_finish(void)
+{
+    struct chunked_footer footer = {
+        .magic = CHUNKED_MAGIC,
+    };
+
+    if ( chunked_flush(1) )
+        goto fail;
+
+    footer.table_offset = chunked.offset;
+    footer.nr_chunks = chunked.nr_chunks;
+    footer.nr_index = chunked.nr_index;
+
+    if ( write_exact(chunked.chunks,
+                     chunked.nr_chunks * sizeof(*chunked.chunks)) ||
+         write_exact(chunked.index,
+                     chunked.nr_index * sizeof(*chunked.index)) ||
+         write_exact(&footer, sizeof(footer)) )
+        goto fail;
+
+    return;
+
+fail:
+    PERROR("Failed to write trace data");
+    exit(EXIT_FAILURE);
+}
+
+/* Write out trace data; returns size like write(), or -1 on error. */
+static ssize_t output_write(const void *buf, size_t size)
+{
+    if ( !opts.compress )
+        return write(outfd, buf, size);
+
+    if ( chunked.len + size > chunked.size )
+    {
+        unsigned long new_size = chunked.size ? chunked.size : 2 * CHUNKED_CHUNK_SIZE;
+
+        while ( new_size < chunked.len + size )
+            new_size *= 2;
+
+        chunked.buf = realloc(chunked.buf, new_size);
+        if ( !chunked.buf )
+        {
+            fprintf(stderr, "%s: Couldn't realloc %lu bytes!\n",
+                    __func__, new_size);
+            exit(EXIT_FAILURE);
+        }
+        chunked.size = new_size;
+    }
+
+    memcpy(chunked.buf + chunked.len, buf, size);
+    chunked.len += size;
+
+    if ( chunked.len >= CHUNKED_CHUNK_SIZE && chunked_flush(0) )
+        return -1;
+
+    return size;
+}
+
 void membuf_dump(void) {
     /* Dump circular memory buffer */
     int cons, prod, wsize, written;
@@ -294,7 +558,7 @@ void membuf_dump(void) {
         wstart = membuf.buf + cons;
         wsize = prod - cons;
 
-        written = write(outfd, wstart, wsize);
+        written = output_write(wstart, wsize);
         if ( written != wsize )
             goto fail;
     }
@@ -304,7 +568,7 @@ void membuf_dump(void) {
         wstart = membuf.buf + cons;
         wsize = membuf.size - cons;
 
-        written = write(outfd, wstart, wsize);
+        written = output_write(wstart, wsize);
         if ( written != wsize )
         {
             fprintf(stderr, "Write failed! (size %d, returned %d)\n",
@@ -315,7 +579,7 @@ void membuf_dump(void) {
         wstart = membuf.buf;
         wsize = prod;
 
-        written = write(outfd, wstart, wsize);
+        written = output_write(wstart, wsize);
         if ( written != wsize )
         {
             fprintf(stderr, "Write failed! (size %d, returned %d)\n",
@@ -393,7 +657,7 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
             rec.data.cpu = cpu;
             rec.data.window_size = total_size;
 
-            written = write(outfd, &rec, sizeof(rec));
+            written = output_write(&rec, sizeof(rec));
             if ( written != sizeof(rec) )
             {
                 fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
@@ -409,7 +673,7 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
     }
     else
     {
-        written = write(outfd, start, size);
+        written = output_write(start, size);
         if ( written != size )
         {
             fprintf(stderr, "Write failed! (size %d, returned %zd)\n",
@@ -425,105 +689,6 @@ fail:
     exit(EXIT_FAILURE);
 }
 
-static void disable_tbufs(void)
-{
-    xc_interface *xc_handle = xc_interface_open(0,0,0);
-
-    if ( !xc_handle ) 
-    {
-        perror("Couldn't open xc handle to disable tbufs.");
-        return;
-    }
-
-    if ( xc_tbuf_disable(xc_handle) != 0 )
-    {
-        perror("Couldn't disable trace buffers");
-    }
-
-    xc_interface_close(xc_handle);
-}
-
-static void get_tbufs(unsigned long *mfn, unsigned long *size)
-{
-    int ret;
-
-    if(!opts.tbuf_size)
-      opts.tbuf_size = DEFAULT_TBUF_SIZE;
-
-    ret = xc_tbuf_enable(xc_handle, opts.tbuf_size, mfn, size);
-
-    if ( ret != 0 )
-    {
-        perror("Couldn't enable trace buffers");
-        exit(1);
-    }
-}
-
-/**
- * map_tbufs - memory map Xen trace buffers into user space
- * @tbufs_mfn: mfn of the trace buffers
- * @num:       number of trace buffers to map
- * @size:      size of each trace buffer
- *
- * Maps the Xen trace buffers them into process address space.
- */
-static struct t_struct *map_tbufs(unsigned long tbufs_mfn, unsigned int num,
-                                  unsigned long tinfo_size)
-{
-    static struct t_struct tbufs = { 0 };
-    int i;
-
-    /* Map t_info metadata structure */
-    tbufs.t_info = xc_map_foreign_range(xc_handle, DOMID_XEN, tinfo_size,
-                                        PROT_READ, tbufs_mfn);
-
-    if ( tbufs.t_info == 0 ) 
-    {
-        PERROR("Failed to mmap trace buffers");
-        exit(EXIT_FAILURE);
-    }
-
-    if ( tbufs.t_info->tbuf_size == 0 )
-    {
-        fprintf(stderr, "%s: tbuf_size 0!\n", __func__);
-        exit(EXIT_FAILURE);
-    }
-
-    /* Map per-cpu buffers */
-    tbufs.meta = (struct t_buf **)calloc(num, sizeof(struct t_buf *));
-    tbufs.data = (unsigned char **)calloc(num, sizeof(unsigned char *));
-    if ( tbufs.meta == NULL || tbufs.data == NULL )
-    {
-        PERROR( "Failed to allocate memory for buffer pointers\n");
-        exit(EXIT_FAILURE);
-    }
-
-    for(i=0; i<num; i++)
-    {
-        
-        const uint32_t *mfn_list = (const uint32_t *)tbufs.t_info
-                                   + tbufs.t_info->mfn_offset[i];
-        int j;
-        xen_pfn_t pfn_list[tbufs.t_info->tbuf_size];
-
-        for ( j=0; j<tbufs.t_info->tbuf_size; j++)
-            pfn_list[j] = (xen_pfn_t)mfn_list[j];
-
-        tbufs.meta[i] = xc_map_foreign_pages(xc_handle, DOMID_XEN,
-                                             PROT_READ | PROT_WRITE,
-                                             pfn_list,
-                                             tbufs.t_info->tbuf_size);
-        if ( tbufs.meta[i] == NULL )
-        {
-            PERROR("Failed to map cpu buffer!");
-            exit(EXIT_FAILURE);
-        }
-        tbufs.data[i] = (unsigned char *)(tbufs.meta[i]+1);
-    }
-
-    return &tbufs;
-}
-
 void print_cpu_mask(xc_cpumap_t map)
 {
     unsigned int v, had_printed = 0;
@@ -578,187 +743,35 @@ static void set_evt_mask(uint32_t mask)
     }
 }
 
-/**
- * get_num_cpus - get the number of logical CPUs
- */
-static unsigned int get_num_cpus(void)
+static int write_window(unsigned int cpu, const void *data, size_t size,
+                        size_t total_size, void *arg)
 {
-    xc_physinfo_t physinfo = { 0 };
-    int ret;
-    
-    ret = xc_physinfo(xc_handle, &physinfo);
-    
-    if ( ret != 0 )
-    {
-        PERROR("Failure to get logical CPU count from Xen");
-        exit(EXIT_FAILURE);
-    }
-
-    return physinfo.nr_cpus;
-}
-
-/**
- * event_init - setup to receive the VIRQ_TBUF event
- */
-static void event_init(void)
-{
-    int rc;
-
-    xce_handle = xenevtchn_open(NULL, 0);
-    if (xce_handle == NULL) {
-        perror("event channel open");
-        exit(EXIT_FAILURE);
-    }
-
-    rc = xenevtchn_bind_virq(xce_handle, VIRQ_TBUF);
-    if (rc == -1) {
-        PERROR("failed to bind to VIRQ port");
-        exit(EXIT_FAILURE);
-    }
-    virq_port = rc;
-}
-
-/**
- * wait_for_event_or_timeout - sleep for the specified number of milliseconds,
- *                             or until an VIRQ_TBUF event occurs
- */
-static void wait_for_event_or_timeout(unsigned long milliseconds)
-{
-    int rc;
-    struct pollfd fd = { .fd = xenevtchn_fd(xce_handle),
-                         .events = POLLIN | POLLERR };
-    int port;
-
-    rc = poll(&fd, 1, milliseconds);
-    if (rc == -1) {
-        if (errno == EINTR)
-            return;
-        PERROR("poll exitted with an error");
-        exit(EXIT_FAILURE);
-    }
-
-    if (rc == 1) {
-        port = xenevtchn_pending(xce_handle);
-        if (port == -1) {
-            PERROR("failed to read port from evtchn");
-            exit(EXIT_FAILURE);
-        }
-        if (port != virq_port) {
-            fprintf(stderr,
-                    "unexpected port returned from evtchn (got %d vs expected %d)\n",
-                    port, virq_port);
-            exit(EXIT_FAILURE);
-        }
-        rc = xenevtchn_unmask(xce_handle, port);
-        if (rc == -1) {
-            PERROR("failed to write port to evtchn");
-            exit(EXIT_FAILURE);
-        }
-    }
+    write_buffer(cpu, (unsigned char *)data, size, total_size);
+    return 0;
 }
 
-
 /**
  * monitor_tbufs - monitor the contents of tbufs and output to a file
  * @logfile:       the FILE * representing the file to log to
  */
 static int monitor_tbufs(void)
 {
-    int i;
-
-    struct t_struct *tbufs;      /* Pointer to hypervisor maps */
-    struct t_buf **meta;         /* pointers to the trace buffer metadata    */
-    unsigned char **data;        /* pointers to the trace buffer data areas
-                                  * where they are mapped into user space.   */
-    unsigned long tbufs_mfn;     /* mfn of the tbufs                         */
-    unsigned int  num;           /* number of trace buffers / logical CPUS   */
-    unsigned long tinfo_size;    /* size of t_info metadata map */
-    unsigned long size;          /* size of a single trace buffer            */
-
-    unsigned long data_size;
-
+    xentrace_handle *h;
     int last_read = 1;
 
-    /* prepare to listen for VIRQ_TBUF */
-    event_init();
-
-    /* get number of logical CPUs (and therefore number of trace buffers) */
-    num = get_num_cpus();
-
-    /* setup access to trace buffers */
-    get_tbufs(&tbufs_mfn, &tinfo_size);
-
-    if ( opts.start_disabled )
-        disable_tbufs();
-    
-    tbufs = map_tbufs(tbufs_mfn, num, tinfo_size);
-
-    size = tbufs->t_info->tbuf_size * XC_PAGE_SIZE;
-
-    data_size = size - sizeof(struct t_buf);
-
-    meta = tbufs->meta;
-    data = tbufs->data;
+    h = xentrace_open(opts.tbuf_size,
+                      (opts.discard ? XENTRACE_OPEN_DISCARD : 0) |
+                      (opts.start_disabled ? XENTRACE_OPEN_START_DISABLED : 0));
+    if ( !h )
+        exit(EXIT_FAILURE);
 
-    if ( opts.discard )
-        for ( i = 0; i < num; i++ )
-            meta[i]->cons = meta[i]->prod;
+    /* Whether to leave tracing on is up to opts.disable_tracing */
+    xentrace_close_keep_enabled(h);
 
     /* now, scan buffers for events */
     while ( 1 )
     {
-        for ( i = 0; i < num; i++ )
-        {
-            unsigned long start_offset, end_offset, window_size, cons, prod;
-                
-            /* Read window information only once. */
-            cons = meta[i]->cons;
-            prod = meta[i]->prod;
-            xen_rmb(); /* read prod, then read item. */
-
-            if ( cons == prod )
-                continue;
-           
-            assert(cons < 2*data_size);
-            assert(prod < 2*data_size);
-
-            // NB: if (prod<cons), then (prod-cons)%data_size will not yield
-            // the correct answer because data_size is not a power of 2.
-            if ( prod < cons )
-                window_size = (prod + 2*data_size) - cons;
-            else
-                window_size = prod - cons;
-            assert(window_size > 0);
-            assert(window_size <= data_size);
-
-            start_offset = cons % data_size;
-            end_offset = prod % data_size;
-
-            if ( end_offset > start_offset )
-            {
-                /* If window does not wrap, write in one big chunk */
-                write_buffer(i, data[i]+start_offset,
-                             window_size,
-                             window_size);
-            }
-            else
-            {
-                /* If wrapped, write in two chunks:
-                 * - first, start to the end of the buffer
-                 * - second, start of buffer to end of window
-                 */
-                write_buffer(i, data[i] + start_offset,
-                             data_size - start_offset,
-                             window_size);
-                write_buffer(i, data[i],
-                             end_offset,
-                             0);
-            }
-
-            xen_mb(); /* read buffer, then update cons. */
-            meta[i]->cons = prod;
-
-        }
+        xentrace_read_windows(h, write_window, NULL);
 
         if ( interrupted )
         {
@@ -766,7 +779,7 @@ static int monitor_tbufs(void)
             {
                 /* Disable tracing, then read through all the buffers one last time */
                 if ( opts.disable_tracing )
-                    disable_tbufs();
+                    xentrace_disable(h);
                 last_read = 0;
                 continue;
             }
@@ -774,16 +787,18 @@ static int monitor_tbufs(void)
                 break;
         }
 
-        wait_for_event_or_timeout(opts.poll_sleep);
+        if ( xentrace_wait(h, opts.poll_sleep) < 0 )
+            exit(EXIT_FAILURE);
     }
 
     if ( opts.memory_buffer )
         membuf_dump();
 
+    if ( opts.compress )
+        chunked_finish();
+
     /* cleanup */
-    free(meta);
-    free(data);
-    /* don't need to munmap - cleanup is automatic */
+    xentrace_close(h);
     close(outfd);
 
     return 0;
@@ -813,7 +828,7 @@ static void usage(void)
 "                          polling the trace buffer for new data\n" \
 "                          (default " xstr(POLL_SLEEP_MILLIS) ").\n" \
 "  -S, --trace-buf-size=N  Set trace buffer size in pages (default " \
-                           xstr(DEFAULT_TBUF_SIZE) ").\n" \
+                           xstr(XENTRACE_DEFAULT_TBUF_PAGES) ").\n" \
 "                          N.B. that the trace buffer cannot be resized.\n" \
 "                          if it has already been set this boot cycle,\n" \
 "                          this argument will be ignored.\n" \
@@ -835,6 +850,10 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -z  --compress          Write a compressed trace, with an index by cpu\n" \
+"                          and time.  Only xenalyze can read these.\n" \
+"  -B  --bench=n           Don't capture anything: time Xen writing n trace\n" \
+"                          records, and print the cycles per record.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -1083,12 +1102,14 @@ static void parse_args(int argc, char **argv)
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
+        { "compress",       no_argument,       0, 'z' },
+        { "bench",          required_argument, 0, 'B' },
         { "help",           no_argument,       0, '?' },
         { "version",        no_argument,       0, 'V' },
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:B:DxXz?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -1133,15 +1154,27 @@ static void parse_args(int argc, char **argv)
             opts.timeout = argtol(optarg, 0);
             break;
 
+        case 'z': /* Compressed, indexed output */
+            opts.compress = 1;
+            break;
+
         case 'M':
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'B':
+            opts.bench = argtol(optarg, 0);
+            break;
+
         default:
             usage();
         }
     }
 
+    /* No output when benchmarking */
+    if ( opts.bench && optind == argc )
+        return;
+
     /* get outfile (required last argument) */
     if (optind != (argc-1))
         usage();
@@ -1149,6 +1182,62 @@ static void parse_args(int argc, char **argv)
     opts.outfile = argv[optind];
 }
 
+static int discard_window(unsigned int cpu, const void *data, size_t size,
+                          size_t total_size, void *arg)
+{
+    return 0;
+}
+
+/* Size of the records Xen writes for XEN_SYSCTL_TBUFOP_bench */
+#define BENCH_REC_SIZE (4 + 8 + 12)
+
+/**
+ * run_bench - time Xen writing opts.bench trace records
+ *
+ * In batches of half a buffer, emptying the buffers in between, so that
+ * what is timed is records being written rather than lost.
+ */
+static int run_bench(void)
+{
+    xentrace_handle *h;
+    unsigned long pages, batch, done, n;
+    uint64_t cycles, total = 0;
+
+    h = xentrace_open(opts.tbuf_size, XENTRACE_OPEN_DISCARD);
+    if ( !h )
+        return EXIT_FAILURE;
+
+    if ( xc_tbuf_get_size(xc_handle, &pages) != 0 )
+    {
+        PERROR("Failure to get the trace buffer size");
+        xentrace_close(h);
+        return EXIT_FAILURE;
+    }
+    batch = pages * XC_PAGE_SIZE / 2 / BENCH_REC_SIZE;
+
+    for ( done = 0; done < opts.bench; done += n )
+    {
+        n = opts.bench - done;
+        if ( n > batch )
+            n = batch;
+        if ( xc_tbuf_bench(xc_handle, n, &cycles) != 0 )
+        {
+            PERROR("Failure to run the trace benchmark");
+            xentrace_close(h);
+            return EXIT_FAILURE;
+        }
+        total += cycles;
+        xentrace_read_windows(h, discard_window, NULL);
+    }
+
+    printf("%lu records in %"PRIu64" cycles: %.1f cycles/record\n",
+           opts.bench, total, (double)total / opts.bench);
+
+    xentrace_close(h);
+
+    return EXIT_SUCCESS;
+}
+
 /* *BSD has no O_LARGEFILE */
 #ifndef O_LARGEFILE
 #define O_LARGEFILE	0
@@ -1186,6 +1275,9 @@ int main(int argc, char **argv)
             exit(EXIT_FAILURE);
     }
 
+    if ( opts.bench )
+        return run_bench();
+
     if ( opts.timeout != 0 ) 
         alarm(opts.timeout);
 
@@ -1209,6 +1301,9 @@ int main(int argc, char **argv)
     if ( opts.memory_buffer > 0 )
         membuf_alloc(opts.memory_buffer);
 
+    if ( opts.compress )
+        chunked_init();
+
     /* ensure that if we get a signal, we'll do cleanup, then exit */
     act.sa_handler = close_handler;
     act.sa_flags = 0;
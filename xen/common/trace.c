@@ -54,9 +54,25 @@ static struct t_info *t_info;
 static unsigned int t_info_pages;
 
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
+/*
+ * Each cpu's buffer has a single producer, the cpu itself, but a writer
+ * may be interrupted by another one (in an interrupt or NMI handler).
+ * Rather than disabling interrupts around each record, writers reserve
+ * their space by advancing t_reserve with cmpxchg (which retries if a
+ * nested writer got in between), write their records, and the outermost
+ * writer then publishes everything reserved so far by moving prod up to
+ * t_reserve.  Nested writers always finish before the one they
+ * interrupted carries on, so all the reserved space has been written by
+ * then.  t_nesting counts the writers in progress on the cpu; t_published
+ * is what prod was last set to (prod itself is in a page dom0 can write).
+ */
+static DEFINE_PER_CPU(u32, t_reserve);
+static DEFINE_PER_CPU(u32, t_published);
+static DEFINE_PER_CPU(unsigned int, t_nesting);
+static DEFINE_PER_CPU(bool_t, t_notify);
+
 /* High water mark for trace buffers; */
 /* Send virtual interrupt when buffer level reaches this point */
 static u32 t_buf_highwater;
@@ -79,21 +95,6 @@ static u32 tb_event_mask = TRC_ALL;
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
 
-static int cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     int offset_in_bytes = offsetof(struct t_info, mfn_offset[NR_CPUS]);
@@ -226,13 +227,12 @@ static int alloc_trace_bufs(unsigned int pages)
         struct t_buf *buf;
         struct page_info *pg;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
         offset = t_info->mfn_offset[cpu];
 
         /* Initialize the buffer metadata */
         per_cpu(t_bufs, cpu) = buf = mfn_to_virt(t_info_mfn_list[offset]);
         buf->cons = buf->prod = 0;
+        per_cpu(t_reserve, cpu) = per_cpu(t_published, cpu) = 0;
 
         printk(XENLOG_INFO "xentrace: p%d mfn %x offset %u\n",
                    cpu, t_info_mfn_list[offset], offset);
@@ -342,7 +342,6 @@ int trace_will_trace_event(u32 event)
 void __init init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -362,6 +361,32 @@ void __init init_trace_bufs(void)
     }
 }
 
+/* Keep the time spent in the hypercall down. */
+#define TB_BENCH_MAX_RECORDS (1U << 20)
+
+/**
+ * tb_bench - time the writing of records, for the BENCH sysctl.
+ */
+static int tb_bench(xen_sysctl_tbuf_op_t *tbc)
+{
+    uint32_t d[3] = { 0, tbc->size, smp_processor_id() };
+    unsigned int i;
+    u64 start;
+
+    if ( !tb_init_done || tbc->size == 0 || tbc->size > TB_BENCH_MAX_RECORDS )
+        return -EINVAL;
+
+    start = get_cycles();
+    for ( i = 0; i < tbc->size; i++ )
+    {
+        d[0] = i;
+        __trace_var(TRC_TRACE_BENCH, 1, sizeof(d), d);
+    }
+    tbc->cycles = get_cycles() - start;
+
+    return 0;
+}
+
 /**
  * tb_control - sysctl operations on trace buffers.
  * @tbc: a pointer to a xen_sysctl_tbuf_op_t to be filled out
@@ -405,6 +430,9 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
         else
             tb_init_done = 1;
         break;
+    case XEN_SYSCTL_TBUFOP_bench:
+        rc = tb_bench(tbc);
+        break;
     case XEN_SYSCTL_TBUFOP_disable:
     {
         /*
@@ -414,16 +442,17 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
         int i;
 
         tb_init_done = 0;
-        smp_wmb();
+        /* Pairs with the check of tb_init_done after bumping t_nesting. */
+        smp_mb();
         /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
-         * hypercall returns, no more records should be placed into the buffers. */
+         * start tracing.  Wait for the writers in progress to make sure we're not racing
+         * anyone.  After this hypercall returns, no more records should be placed into
+         * the buffers. */
         for_each_online_cpu(i)
         {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
-            per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
+            while ( read_atomic(&per_cpu(t_nesting, i)) )
+                cpu_relax();
+            per_cpu(lost_records, i) = 0;
         }
     }
         break;
@@ -460,15 +489,10 @@ static inline bool_t bogus(u32 prod, u32 cons)
     return 0;
 }
 
-static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
+static inline u32 calc_unconsumed_bytes(u32 prod, u32 cons)
 {
-    u32 prod = buf->prod, cons = buf->cons;
     s32 x;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return data_size;
-
     x = prod - cons;
     if ( x < 0 )
         x += 2*data_size;
@@ -479,15 +503,10 @@ static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
+static inline u32 calc_bytes_to_wrap(u32 prod)
 {
-    u32 prod = buf->prod, cons = buf->cons;
     s32 x;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return 0;
-
     x = data_size - prod;
     if ( x <= 0 )
         x += data_size;
@@ -498,27 +517,25 @@ static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_avail(const struct t_buf *buf)
+static inline u32 advance(u32 x, unsigned int size)
 {
-    return data_size - calc_unconsumed_bytes(buf);
+    x += size;
+    if ( x >= 2*data_size )
+        x -= 2*data_size;
+    ASSERT(x < 2*data_size);
+
+    return x;
 }
 
-static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
-                                 unsigned char **next_page,
-                                 uint32_t *offset_in_page)
+static unsigned char *next_record(u32 x, unsigned char **next_page,
+                                  uint32_t *offset_in_page)
 {
-    u32 x = buf->prod, cons = buf->cons;
     uint16_t per_cpu_mfn_offset;
     uint32_t per_cpu_mfn_nr;
     uint32_t *mfn_list;
     uint32_t mfn;
     unsigned char *this_page;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    *next = x;
-    if ( !tb_init_done || bogus(x, cons) )
-        return NULL;
-
     if ( x >= data_size )
         x -= data_size;
 
@@ -547,28 +564,26 @@ static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
     return this_page;
 }
 
-static inline void __insert_record(struct t_buf *buf,
-                                   unsigned long event,
-                                   unsigned int extra,
-                                   bool_t cycles,
-                                   unsigned int rec_size,
-                                   const void *extra_data)
+/* Write a record at x, in space reserved for it; returns where it ends. */
+static inline u32 __insert_record(u32 x,
+                                  unsigned long event,
+                                  unsigned int extra,
+                                  bool_t cycles,
+                                  unsigned int rec_size,
+                                  const void *extra_data)
 {
     struct t_rec split_rec, *rec;
     uint32_t *dst;
     unsigned char *this_page, *next_page;
     unsigned int extra_word = extra / sizeof(u32);
     unsigned int local_rec_size = calc_rec_size(cycles, extra);
-    uint32_t next;
     uint32_t offset;
     uint32_t remaining;
 
     BUG_ON(local_rec_size != rec_size);
     BUG_ON(extra & 3);
 
-    this_page = next_record(buf, &next, &next_page, &offset);
-    if ( !this_page )
-        return;
+    this_page = next_record(x, &next_page, &offset);
 
     remaining = PAGE_SIZE - offset;
 
@@ -578,9 +593,9 @@ static inline void __insert_record(struct t_buf *buf,
         {
             /* access beyond end of buffer */
             printk(XENLOG_WARNING
-                   "%s: size=%08x prod=%08x cons=%08x rec=%u remaining=%u\n",
-                   __func__, data_size, next, buf->cons, rec_size, remaining);
-            return;
+                   "%s: size=%08x prod=%08x rec=%u remaining=%u\n",
+                   __func__, data_size, x, rec_size, remaining);
+            return advance(x, rec_size);
         }
         rec = &split_rec;
     } else {
@@ -607,19 +622,12 @@ static inline void __insert_record(struct t_buf *buf,
         memcpy(next_page, (char *)rec + remaining, rec_size - remaining);
     }
 
-    smp_wmb();
-
-    next += rec_size;
-    if ( next >= 2*data_size )
-        next -= 2*data_size;
-    ASSERT(next < 2*data_size);
-    buf->prod = next;
+    return advance(x, rec_size);
 }
 
-static inline void insert_wrap_record(struct t_buf *buf,
-                                      unsigned int size)
+static inline u32 insert_wrap_record(u32 x, unsigned int size)
 {
-    u32 space_left = calc_bytes_to_wrap(buf);
+    u32 space_left = calc_bytes_to_wrap(x);
     unsigned int extra_space = space_left - sizeof(u32);
     bool_t cycles = 0;
 
@@ -633,13 +641,13 @@ static inline void insert_wrap_record(struct t_buf *buf,
         ASSERT((extra_space/sizeof(u32)) <= TRACE_EXTRA_MAX);
     }
 
-    __insert_record(buf, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
-                    space_left, NULL);
+    return __insert_record(x, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
+                           space_left, NULL);
 }
 
 #define LOST_REC_SIZE (4 + 8 + 16) /* header + tsc + sizeof(struct ed) */
 
-static inline void insert_lost_records(struct t_buf *buf)
+static inline u32 insert_lost_records(u32 x)
 {
     struct __packed {
         u32 lost_records;
@@ -649,13 +657,29 @@ static inline void insert_lost_records(struct t_buf *buf)
 
     ed.vid = current->vcpu_id;
     ed.did = current->domain->domain_id;
-    ed.lost_records = this_cpu(lost_records);
     ed.first_tsc = this_cpu(lost_records_first_tsc);
+    /* Including any lost by writers which interrupted us since. */
+    ed.lost_records = xchg(&this_cpu(lost_records), 0);
 
-    this_cpu(lost_records) = 0;
+    return __insert_record(x, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
+                           LOST_REC_SIZE, &ed);
+}
 
-    __insert_record(buf, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
-                    LOST_REC_SIZE, &ed);
+/*
+ * Make everything reserved on this cpu so far visible to the consumer.
+ * Only ever called by the outermost writer, so that prod never goes
+ * backwards: writers which interrupt us don't publish.
+ */
+static void publish_records(struct t_buf *buf)
+{
+    u32 x;
+
+    do {
+        x = read_atomic(&this_cpu(t_reserve));
+        smp_wmb(); /* the records before prod */
+        buf->prod = this_cpu(t_published) = x;
+        barrier();
+    } while ( unlikely(x != read_atomic(&this_cpu(t_reserve))) );
 }
 
 /*
@@ -676,17 +700,20 @@ static DECLARE_SOFTIRQ_TASKLET(trace_notify_dom0_tasklet,
  * @extra: size of additional trace data in bytes
  * @extra_data: pointer to additional trace data
  *
- * Logs a trace record into the appropriate buffer.
+ * Logs a trace record into the appropriate buffer.  Safe to call from
+ * interrupt context, including from one which interrupted another call on
+ * the same CPU.  Not from NMI or #MC context though: the outermost writer
+ * may end up scheduling the consumer notification, which takes a lock.
  */
 void __trace_var(u32 event, bool_t cycles, unsigned int extra,
                  const void *extra_data)
 {
     struct t_buf *buf;
-    unsigned long flags;
-    u32 bytes_to_tail, bytes_to_wrap;
+    unsigned int *nesting;
+    u32 x, next, cons, bytes_to_wrap;
     unsigned int rec_size, total_size;
     unsigned int extra_word;
-    bool_t started_below_highwater;
+    bool_t lost_rec, crossed_highwater = 0;
 
     if( !tb_init_done )
         return;
@@ -720,79 +747,99 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
-
     buf = this_cpu(t_bufs);
 
     if ( unlikely(!buf) )
-    {
-        /* Make gcc happy */
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        return;
 
-    started_below_highwater = (calc_unconsumed_bytes(buf) < t_buf_highwater);
+    /*
+     * Not atomic, but it doesn't need to be: anyone interrupting the
+     * increment or decrement leaves the count as they found it.
+     */
+    nesting = &this_cpu(t_nesting);
+    ++*nesting;
+
+    /*
+     * Pairs with the disable path, which clears tb_init_done before
+     * waiting for t_nesting to drop: either it sees us here, or we see
+     * tracing is off.
+     */
+    smp_mb();
+    if ( !tb_init_done )
+        goto out;
 
     /* Calculate the record size */
     rec_size = calc_rec_size(cycles, extra);
- 
-    /* How many bytes are available in the buffer? */
-    bytes_to_tail = calc_bytes_avail(buf);
-    
-    /* How many bytes until the next wrap-around? */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
-    
-    /* 
-     * Calculate expected total size to commit this record by
-     * doing a dry-run.
-     */
-    total_size = 0;
 
-    /* First, check to see if we need to include a lost_record.
-     */
-    if ( this_cpu(lost_records) )
-    {
-        if ( LOST_REC_SIZE > bytes_to_wrap )
+    /* Only the outermost writer reports lost records (see below). */
+    lost_rec = (*nesting == 1) && this_cpu(lost_records);
+
+    do {
+        x = read_atomic(&this_cpu(t_reserve));
+        cons = read_atomic(&buf->cons);
+        if ( bogus(x, cons) )
+            goto out;
+
+        /* How many bytes until the next wrap-around? */
+        bytes_to_wrap = calc_bytes_to_wrap(x);
+
+        /*
+         * Calculate expected total size to commit this record by
+         * doing a dry-run.
+         */
+        total_size = 0;
+
+        /* First, check to see if we need to include a lost_record.
+         */
+        if ( lost_rec )
+        {
+            if ( LOST_REC_SIZE > bytes_to_wrap )
+            {
+                total_size += bytes_to_wrap;
+                bytes_to_wrap = data_size;
+            } 
+            total_size += LOST_REC_SIZE;
+            bytes_to_wrap -= LOST_REC_SIZE;
+
+            /* LOST_REC might line up perfectly with the buffer wrap */
+            if ( bytes_to_wrap == 0 )
+                bytes_to_wrap = data_size;
+        }
+
+        if ( rec_size > bytes_to_wrap )
         {
             total_size += bytes_to_wrap;
-            bytes_to_wrap = data_size;
         } 
-        total_size += LOST_REC_SIZE;
-        bytes_to_wrap -= LOST_REC_SIZE;
+        total_size += rec_size;
 
-        /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
-    }
+        /* Do we have enough space for everything? */
+        if ( total_size > data_size - calc_unconsumed_bytes(x, cons) )
+        {
+            if ( arch_fetch_and_add(&this_cpu(lost_records), 1) == 0 )
+                this_cpu(lost_records_first_tsc)=(u64)get_cycles();
+            goto out;
+        }
 
-    if ( rec_size > bytes_to_wrap )
-    {
-        total_size += bytes_to_wrap;
-    } 
-    total_size += rec_size;
+        next = advance(x, total_size);
+    } while ( cmpxchg(&this_cpu(t_reserve), x, next) != x );
 
-    /* Do we have enough space for everything? */
-    if ( total_size > bytes_to_tail )
-    {
-        if ( ++this_cpu(lost_records) == 1 )
-            this_cpu(lost_records_first_tsc)=(u64)get_cycles();
-        started_below_highwater = 0;
-        goto unlock;
-    }
+    crossed_highwater =
+        (calc_unconsumed_bytes(x, cons) < t_buf_highwater) &&
+        (calc_unconsumed_bytes(next, cons) >= t_buf_highwater);
 
     /*
      * Now, actually write information 
      */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
+    bytes_to_wrap = calc_bytes_to_wrap(x);
 
-    if ( this_cpu(lost_records) )
+    if ( lost_rec )
     {
         if ( LOST_REC_SIZE > bytes_to_wrap )
         {
-            insert_wrap_record(buf, LOST_REC_SIZE);
+            x = insert_wrap_record(x, LOST_REC_SIZE);
             bytes_to_wrap = data_size;
         } 
-        insert_lost_records(buf);
+        x = insert_lost_records(x);
         bytes_to_wrap -= LOST_REC_SIZE;
 
         /* LOST_REC might line up perfectly with the buffer wrap */
@@ -801,18 +848,56 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     }
 
     if ( rec_size > bytes_to_wrap )
-        insert_wrap_record(buf, rec_size);
+        x = insert_wrap_record(x, rec_size);
 
     /* Write the original record */
-    __insert_record(buf, event, extra, cycles, rec_size, extra_data);
+    x = __insert_record(x, event, extra, cycles, rec_size, extra_data);
+    ASSERT(x == next);
+
+out:
+    /*
+     * Nested writers leave publishing, and notifying the consumer (which
+     * takes locks), to the writer they interrupted.
+     */
+    if ( *nesting > 1 )
+    {
+        if ( crossed_highwater )
+            this_cpu(t_notify) = 1;
+        barrier();
+        --*nesting;
+        return;
+    }
 
-unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+    publish_records(buf);
+    barrier();
+    --*nesting;
+    barrier();
+
+    /*
+     * Anything reserved by writers which got in between publishing and
+     * dropping the count is only published by the next writer, but that
+     * may be a while: do it now.  Writers getting in after the count was
+     * dropped publish themselves.
+     */
+    while ( unlikely(read_atomic(&this_cpu(t_reserve)) !=
+                     this_cpu(t_published)) )
+    {
+        ++*nesting;
+        barrier();
+        publish_records(buf);
+        barrier();
+        --*nesting;
+        barrier();
+    }
+
+    if ( this_cpu(t_notify) )
+    {
+        this_cpu(t_notify) = 0;
+        crossed_highwater = 1;
+    }
 
     /* Notify trace buffer consumer that we've crossed the high water mark. */
-    if ( likely(buf!=NULL)
-         && started_below_highwater
-         && (calc_unconsumed_bytes(buf) >= t_buf_highwater) )
+    if ( crossed_highwater )
         tasklet_schedule(&trace_notify_dom0_tasklet);
 }
 